@@ -18,10 +18,13 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "lwan.h"
+#include "lwan-mod-serve-files.h"
+#include "lwan-template.h"
 
 LWAN_HANDLER(quit_lwan)
 {
@@ -254,14 +257,518 @@ LWAN_HANDLER(custom_header)
     return HTTP_OK;
 }
 
+LWAN_HANDLER(path_params)
+{
+    static const char *names[] = {"id", "rest"};
+
+    response->mime_type = "text/plain";
+
+    for (size_t i = 0; i < N_ELEMENTS(names); i++) {
+        size_t len;
+        const char *value = lwan_request_get_path_param(request, names[i], &len);
+
+        if (value) {
+            lwan_strbuf_append_printf(response->buffer, "%s=%.*s\n", names[i],
+                                      (int)len, value);
+        }
+    }
+
+    lwan_strbuf_append_printf(response->buffer, "url=%.*s\n",
+                              (int)request->url.len, request->url.value);
+
+    return HTTP_OK;
+}
+
+struct hash_check {
+    struct hash *hash;
+    char **keys; /* NULL for integer keys */
+    unsigned char *seen;
+    long n_keys;
+    unsigned long checks;
+};
+
+static const void *hash_check_key(const struct hash_check *hc, long i)
+{
+    return hc->keys ? (const void *)hc->keys[i] : (const void *)(intptr_t)i;
+}
+
+/* Keys in [first, last) must be in the table, with their index plus one
+ * as the value, and be seen exactly once when iterating; no other key
+ * can be there. */
+static const char *hash_check(struct hash_check *hc, long first, long last)
+{
+    struct hash_iter iter;
+    const void *key, *value;
+    unsigned int n = 0;
+
+    hc->checks++;
+
+    if (hash_get_count(hc->hash) != (unsigned int)(last - first))
+        return "wrong count";
+
+    for (long i = 0; i < hc->n_keys; i++) {
+        const void *found = hash_find(hc->hash, hash_check_key(hc, i));
+
+        if (i >= first && i < last) {
+            if (found != (const void *)(intptr_t)(i + 1))
+                return "key not found";
+        } else if (found) {
+            return "key found after removal or before insertion";
+        }
+    }
+
+    memset(hc->seen, 0, (size_t)hc->n_keys);
+    hash_iter_init(hc->hash, &iter);
+    while (hash_iter_next(&iter, &key, &value)) {
+        long i = (long)(intptr_t)value - 1;
+
+        if (i < first || i >= last)
+            return "iterated over a key that isn't in the table";
+        if (hc->keys ? strcmp(key, hc->keys[i]) : key != hash_check_key(hc, i))
+            return "iterated over a key with the wrong value";
+        if (hc->seen[i]++)
+            return "iterated over a key twice";
+        n++;
+    }
+    if (n != (unsigned int)(last - first))
+        return "iteration missed keys";
+
+    return NULL;
+}
+
+static const char *hash_check_migration(struct hash_check *hc)
+{
+    const char *failure;
+
+    /* Grow the table one key at a time; every now and then, remove a key
+     * and add it back, so that removals happen while growing too. */
+    for (long i = 0; i < hc->n_keys; i++) {
+        const void *value = (const void *)(intptr_t)(i + 1);
+
+        if (hash_add_unique(hc->hash, hash_check_key(hc, i), value) < 0)
+            return "could not add key";
+        if (i % 7 == 6) {
+            if (hash_del(hc->hash, hash_check_key(hc, i)) < 0)
+                return "could not remove key while growing";
+            if ((failure = hash_check(hc, 0, i)))
+                return failure;
+            if (hash_add_unique(hc->hash, hash_check_key(hc, i), value) < 0)
+                return "could not add key back";
+        }
+        if ((failure = hash_check(hc, 0, i + 1)))
+            return failure;
+    }
+
+    /* Then shrink it, one key at a time. */
+    for (long i = 0; i < hc->n_keys; i++) {
+        if (hash_del(hc->hash, hash_check_key(hc, i)) < 0)
+            return "could not remove key while shrinking";
+        if (hash_del(hc->hash, hash_check_key(hc, i)) != -ENOENT)
+            return "removed key twice";
+        if ((failure = hash_check(hc, i + 1, hc->n_keys)))
+            return failure;
+    }
+
+    return NULL;
+}
+
+/* Tables are resized incrementally, so most of the checks done here happen
+ * while the entries are split between the old and the new table. */
+LWAN_HANDLER(hash_migration)
+{
+    struct hash_check hc = {
+        .n_keys = parse_long(lwan_request_get_query_param(request, "keys"), 0),
+    };
+    bool str_keys = !!lwan_request_get_query_param(request, "str");
+    const char *failure = "out of memory";
+
+    if (hc.n_keys <= 0 || hc.n_keys > 100000)
+        return HTTP_BAD_REQUEST;
+
+    hc.seen = malloc((size_t)hc.n_keys);
+    if (!hc.seen)
+        goto out;
+
+    if (str_keys) {
+        hc.keys = calloc((size_t)hc.n_keys, sizeof(*hc.keys));
+        if (!hc.keys)
+            goto out;
+        for (long i = 0; i < hc.n_keys; i++) {
+            if (asprintf(&hc.keys[i], "key-%ld", i) < 0) {
+                hc.keys[i] = NULL;
+                goto out;
+            }
+        }
+        hc.hash = hash_str_new(NULL, NULL);
+    } else {
+        hc.hash = hash_int_new(NULL, NULL);
+    }
+    if (!hc.hash)
+        goto out;
+
+    failure = hash_check_migration(&hc);
+
+out:
+    if (hc.hash)
+        hash_free(hc.hash);
+    if (hc.keys) {
+        for (long i = 0; i < hc.n_keys; i++)
+            free(hc.keys[i]);
+        free(hc.keys);
+    }
+    free(hc.seen);
+
+    response->mime_type = "text/plain";
+    if (failure) {
+        lwan_strbuf_printf(response->buffer, "failure=%s\nchecks=%lu\n",
+                           failure, hc.checks);
+        return HTTP_INTERNAL_ERROR;
+    }
+
+    lwan_strbuf_printf(response->buffer, "checks=%lu\n", hc.checks);
+    return HTTP_OK;
+}
+
+/* Optional features lwan was built with, so that tests for them can be
+ * skipped. */
+LWAN_HANDLER(build_features)
+{
+    static const char features[] =
+#if defined(HAVE_BROTLI)
+        "brotli=1\n"
+#else
+        "brotli=0\n"
+#endif
+#if defined(HAVE_ZSTD)
+        "zstd=1\n"
+#else
+        "zstd=0\n"
+#endif
+        ;
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_set_static(response->buffer, features, sizeof(features) - 1);
+
+    return HTTP_OK;
+}
+
+/* Pieces of many sizes, every tenth of them a reference to static data,
+ * so that the response buffer is split over several chunks and appends
+ * cross from one chunk to the next. */
+static char static_piece[512];
+
+__attribute__((constructor)) static void init_static_piece(void)
+{
+    memset(static_piece, 'S', sizeof(static_piece));
+}
+
+static bool append_pieces(struct lwan_strbuf *buf, long n)
+{
+    char piece[1000];
+
+    for (long i = 0; i < n; i++) {
+        if (i % 10 == 9) {
+            if (!lwan_strbuf_append_static(buf, static_piece,
+                                           sizeof(static_piece)))
+                return false;
+        } else {
+            size_t len = (size_t)(i * 37 % 1000) + 1;
+
+            memset(piece, 'a' + (int)(i % 26), len);
+            if (!lwan_strbuf_append_str(buf, piece, len))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+LWAN_HANDLER(strbuf_segments)
+{
+    long n = parse_long(lwan_request_get_query_param(request, "n"), 0);
+    struct lwan_key_value *headers;
+    const struct iovec *segments;
+
+    /* Fill the buffer, then reset it (keeping a chunk) and fill it again. */
+    if (lwan_request_get_query_param(request, "reset")) {
+        if (!append_pieces(response->buffer, n))
+            return HTTP_INTERNAL_ERROR;
+        lwan_strbuf_reset(response->buffer);
+    }
+
+    if (!append_pieces(response->buffer, n))
+        return HTTP_INTERNAL_ERROR;
+
+    headers = coro_malloc(request->conn->coro, 2 * sizeof(*headers));
+    if (!headers)
+        return HTTP_INTERNAL_ERROR;
+    headers[0] = (struct lwan_key_value){
+        .key = "X-Segments",
+        .value = coro_printf(request->conn->coro, "%zu",
+                             lwan_strbuf_get_segments(response->buffer,
+                                                      &segments)),
+    };
+    headers[1] = (struct lwan_key_value){};
+    response->headers = headers;
+
+    if (lwan_request_get_query_param(request, "flatten")) {
+        if (!lwan_strbuf_get_buffer(response->buffer) ||
+            lwan_strbuf_get_segments(response->buffer, &segments))
+            return HTTP_INTERNAL_ERROR;
+    }
+
+    response->mime_type = "text/plain";
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(sendfile_stats)
+{
+    struct lwan_sendfile_stats stats;
+
+    lwan_get_sendfile_stats(request->conn->thread->lwan, &stats);
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer,
+                       "resident=%llu\noffloaded=%llu\nblocked=%llu\n",
+                       stats.resident, stats.offloaded, stats.blocked);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(readahead_stats)
+{
+    struct lwan_readahead_stats stats;
+
+    lwan_get_readahead_stats(&stats);
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer,
+                       "prefetched_pages=%llu\nresident_hints=%llu\n"
+                       "dropped_hints=%llu\nlocked=%zu\nlock_budget=%zu\n",
+                       stats.prefetched_pages, stats.resident_hints,
+                       stats.dropped_hints, stats.locked, stats.lock_budget);
+
+    return HTTP_OK;
+}
+
+LWAN_HANDLER(preload_status)
+{
+    const char *prefix = lwan_request_get_query_param(request, "prefix");
+    struct lwan_serve_files_preload_status status;
+    const struct lwan_url_map *url_map;
+    struct lwan_trie_match match = {};
+
+    if (!prefix)
+        return HTTP_BAD_REQUEST;
+
+    url_map = lwan_trie_lookup(&request->conn->thread->lwan->url_map_trie,
+                               prefix, REQUEST_METHOD_GET, &match);
+    if (!url_map || url_map->module != LWAN_MODULE_REF(serve_files) ||
+        !lwan_serve_files_get_preload_status(url_map->data, &status))
+        return HTTP_NOT_FOUND;
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer,
+                       "files=%zu\nloaded=%zu\nfailed=%zu\nskipped=%zu\n"
+                       "bytes=%zu\ndone=%d\n",
+                       status.files, status.loaded, status.failed,
+                       status.skipped, status.bytes, status.done);
+
+    return HTTP_OK;
+}
+
+struct fragment_cache {
+    const char *name;
+    int requests;
+};
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct fragment_cache
+static const struct lwan_var_descriptor fragment_cache_desc[] = {
+    TPL_VAR_STR(name),
+    TPL_VAR_INT(requests),
+    TPL_VAR_SENTINEL,
+};
+
+static struct lwan_tpl *fragment_cache_tpl;
+
+LWAN_HANDLER(fragment_cache)
+{
+    static int requests;
+    struct fragment_cache vars = {
+        .name = lwan_request_get_query_param(request, "name"),
+        .requests = __atomic_add_fetch(&requests, 1, __ATOMIC_SEQ_CST),
+    };
+
+    response->mime_type = "text/plain";
+
+    if (!lwan_tpl_apply_with_coro(fragment_cache_tpl, response->buffer, &vars,
+                                  request->conn->coro))
+        return HTTP_INTERNAL_ERROR;
+
+    return HTTP_OK;
+}
+
+struct cursor_sequence {
+    int n_items;
+    bool fail_init;
+
+    int inits, nexts, finis;
+    int nested_inits, nested_finis;
+
+    struct {
+        int id;
+        struct {
+            int unused;
+        } nested;
+    } item;
+};
+
+static bool cursor_sequence_init(void *data)
+{
+    struct cursor_sequence *seq = data;
+
+    seq->inits++;
+    seq->item.id = 0;
+    return !seq->fail_init;
+}
+
+static bool cursor_sequence_next(void *data)
+{
+    struct cursor_sequence *seq = data;
+
+    seq->nexts++;
+    if (seq->item.id == seq->n_items)
+        return false;
+    seq->item.id++;
+    return true;
+}
+
+static void cursor_sequence_fini(void *data)
+{
+    struct cursor_sequence *seq = data;
+
+    seq->finis++;
+}
+
+/* Nested cursor that can't be started, making the outer iteration stop
+ * halfway through its first item. */
+static bool cursor_sequence_nested_init(void *data)
+{
+    struct cursor_sequence *seq = data;
+
+    seq->nested_inits++;
+    return false;
+}
+
+static void cursor_sequence_nested_fini(void *data)
+{
+    struct cursor_sequence *seq = data;
+
+    seq->nested_finis++;
+}
+
+#undef TPL_STRUCT
+#define TPL_STRUCT struct cursor_sequence
+static const struct lwan_var_descriptor cursor_sequence_nested_desc[] = {
+    TPL_VAR_SENTINEL,
+};
+static const struct lwan_var_descriptor cursor_sequence_item_desc[] = {
+    TPL_VAR_INT(item.id),
+    TPL_VAR_SEQUENCE_CURSOR(item.nested, cursor_sequence_nested_init,
+                            cursor_sequence_next, cursor_sequence_nested_fini,
+                            cursor_sequence_nested_desc),
+    TPL_VAR_SENTINEL,
+};
+static const struct lwan_var_descriptor cursor_sequence_desc[] = {
+    TPL_VAR_SEQUENCE_CURSOR(item, cursor_sequence_init, cursor_sequence_next,
+                            cursor_sequence_fini, cursor_sequence_item_desc),
+    TPL_VAR_SENTINEL,
+};
+
+static struct {
+    const char *name;
+    const char *string;
+    struct lwan_tpl *tpl;
+} cursor_sequence_tpls[] = {
+    {.name = "all", .string = "{{#item}}[{{item.id}}]{{/item}}"},
+    {.name = "negated", .string = "{{^#item}}empty{{/item}}"},
+    {.name = "nested",
+     .string = "{{#item}}[{{item.id}}]{{#item.nested}}{{/item.nested}}{{/item}}"},
+};
+
+/* Renders one of the templates above and reports how the cursor was
+ * driven, so that early termination can be checked to call fini. */
+LWAN_HANDLER(cursor_sequence)
+{
+    const char *name = lwan_request_get_query_param(request, "tpl");
+    struct cursor_sequence seq = {
+        .n_items = (int)parse_long(lwan_request_get_query_param(request, "items"), 0),
+        .fail_init = !!lwan_request_get_query_param(request, "fail_init"),
+    };
+    struct lwan_strbuf output;
+    bool rendered;
+    size_t i;
+
+    if (!name)
+        return HTTP_BAD_REQUEST;
+    for (i = 0; i < N_ELEMENTS(cursor_sequence_tpls); i++) {
+        if (streq(cursor_sequence_tpls[i].name, name))
+            break;
+    }
+    if (i == N_ELEMENTS(cursor_sequence_tpls))
+        return HTTP_NOT_FOUND;
+
+    lwan_strbuf_init(&output);
+    rendered = lwan_tpl_apply_with_buffer(cursor_sequence_tpls[i].tpl,
+                                          &output, &seq);
+
+    response->mime_type = "text/plain";
+    lwan_strbuf_printf(response->buffer,
+                       "rendered=%d\ninits=%d\nnexts=%d\nfinis=%d\n"
+                       "nested_inits=%d\nnested_finis=%d\noutput=%.*s\n",
+                       rendered, seq.inits, seq.nexts, seq.finis,
+                       seq.nested_inits, seq.nested_finis,
+                       rendered ? (int)lwan_strbuf_get_length(&output) : 0,
+                       lwan_strbuf_get_buffer(&output));
+    lwan_strbuf_free(&output);
+
+    return HTTP_OK;
+}
+
 int
 main()
 {
     struct lwan l;
 
     lwan_init(&l);
+
+    /* The first block only depends on the name, so the request counter
+     * in there is only rendered when the name changes. */
+    fragment_cache_tpl = lwan_tpl_compile_string(
+        "{{%cache 1h name}}name={{name}} rendered={{requests}}{{/%cache}}\n"
+        "{{%cache 1h}}{{name?}}hello, {{name}}{{/name?}}{{/%cache}}\n"
+        "{{name?}}{{%cache 1h name}}welcome, {{name}} "
+        "({{requests}}){{/%cache}}{{/name?}}\n"
+        "requests={{requests}}\n",
+        fragment_cache_desc);
+    if (!fragment_cache_tpl)
+        lwan_status_critical("Could not compile fragment cache template");
+
+    for (size_t i = 0; i < N_ELEMENTS(cursor_sequence_tpls); i++) {
+        cursor_sequence_tpls[i].tpl = lwan_tpl_compile_string(
+            cursor_sequence_tpls[i].string, cursor_sequence_desc);
+        if (!cursor_sequence_tpls[i].tpl)
+            lwan_status_critical("Could not compile cursor template %s",
+                                 cursor_sequence_tpls[i].name);
+    }
+
     lwan_main_loop(&l);
     lwan_shutdown(&l);
 
+    lwan_tpl_free(fragment_cache_tpl);
+    for (size_t i = 0; i < N_ELEMENTS(cursor_sequence_tpls); i++)
+        lwan_tpl_free(cursor_sequence_tpls[i].tpl);
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,172 @@
+/*
+ * hashbench - benchmark for the hash table used throughout Lwan
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+/* String keys look like the paths used by the file cache. */
+#define KEY_FORMAT "static/assets/%zu/file-%zu.css"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void die(const char *msg, size_t i)
+{
+    fprintf(stderr, "hashbench: %s (key #%zu)\n", msg, i);
+    exit(1);
+}
+
+static void report(const char *what, uint64_t elapsed, size_t n)
+{
+    printf("  %-14s %8.1f ns/op\n", what, (double)elapsed / (double)n);
+}
+
+/* The first n keys are added to the table; the other n are used for
+ * lookups that should miss.  Whole phases are timed at once, so that
+ * clock_gettime() doesn't dominate the results; only the slowest insertion,
+ * to show how long rehashing stalls a single caller, is timed on its own. */
+static void bench(const char *name,
+                  struct hash *(*hash_new)(void (*)(void *), void (*)(void *)),
+                  const void **keys,
+                  size_t n)
+{
+    struct hash *hash = hash_new(NULL, NULL);
+    uint64_t start, slowest = 0;
+
+    if (!hash)
+        die("could not allocate table", 0);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        if (hash_add(hash, keys[i], keys[i]) < 0)
+            die("could not add", i);
+    }
+    printf("%s, %zu entries:\n", name, n);
+    report("insert", now_ns() - start, n);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+        size_t k = (i * 7919) % n;
+
+        if (hash_find(hash, keys[k]) != keys[k])
+            die("lookup didn't find added key", k);
+    }
+    report("lookup hit", now_ns() - start, n);
+
+    start = now_ns();
+    for (size_t i = n; i < n * 2; i++) {
+        if (hash_find(hash, keys[i]))
+            die("lookup found key that wasn't added", i);
+    }
+    report("lookup miss", now_ns() - start, n);
+
+    start = now_ns();
+    for (size_t i = 0; i < n; i += 2) {
+        if (hash_del(hash, keys[i]) < 0)
+            die("could not remove", i);
+    }
+    report("remove", now_ns() - start, (n + 1) / 2);
+
+    for (size_t i = 0; i < n; i++) {
+        if (!hash_find(hash, keys[i]) != !(i & 1))
+            die("wrong lookup result after removing keys", i);
+    }
+    if (hash_get_count(hash) != n / 2)
+        die("wrong count after removing keys", n);
+
+    hash_free(hash);
+
+    hash = hash_new(NULL, NULL);
+    if (!hash)
+        die("could not allocate table", 0);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t elapsed;
+
+        start = now_ns();
+        if (hash_add(hash, keys[i], keys[i]) < 0)
+            die("could not add", i);
+        elapsed = now_ns() - start;
+
+        if (elapsed > slowest)
+            slowest = elapsed;
+    }
+    printf("  %-14s %8.1f us\n", "slowest insert", (double)slowest / 1000.0);
+    hash_free(hash);
+}
+
+static void bench_sizes(size_t n)
+{
+    const void **keys = calloc(n * 2, sizeof(*keys));
+
+    if (!keys)
+        die("could not allocate keys", 0);
+
+    for (size_t i = 0; i < n * 2; i++) {
+        char *key;
+
+        if (asprintf(&key, KEY_FORMAT, i % 97, i) < 0)
+            die("could not allocate key", i);
+        keys[i] = key;
+    }
+    bench("string keys", hash_str_new, keys, n);
+    for (size_t i = 0; i < n * 2; i++)
+        free((void *)keys[i]);
+
+    for (size_t i = 0; i < n * 2; i++)
+        keys[i] = (const void *)(uintptr_t)(i + 1);
+    bench("integer keys", hash_int_new, keys, n);
+
+    free(keys);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t default_sizes[] = {100, 10000, 1000000};
+
+    if (argc == 1) {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]);
+             i++)
+            bench_sizes(default_sizes[i]);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        size_t n = (size_t)strtoull(argv[i], NULL, 10);
+
+        if (!n) {
+            fprintf(stderr, "Usage: %s [number of entries...]\n", argv[0]);
+            return 1;
+        }
+
+        bench_sizes(n);
+    }
+
+    return 0;
+}
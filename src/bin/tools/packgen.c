@@ -0,0 +1,503 @@
+/*
+ * packgen - pack a directory into a single file served by serve_files
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "../../lib/lwan-pack.h"
+
+struct mime_type {
+    char *ext;
+    char *type;
+};
+
+static struct {
+    struct mime_type *types;
+    size_t n_types;
+
+    struct lwan_pack_entry *entries;
+    size_t n_entries;
+    size_t entries_capacity;
+
+    const char *root;
+    size_t root_len;
+
+    FILE *out;
+    uint64_t off;
+
+    size_t n_skipped;
+} packgen;
+
+static int compare_mime_type(const void *a, const void *b)
+{
+    const struct mime_type *ma = a;
+    const struct mime_type *mb = b;
+
+    return strcasecmp(ma->ext, mb->ext);
+}
+
+static int read_mime_types(const char *path)
+{
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_len = 0;
+    FILE *fp;
+
+    fp = fopen(path, "re");
+    if (!fp)
+        return -errno;
+
+    while (getline(&line, &line_len, fp) > 0) {
+        char *saveptr, *type, *ext;
+
+        if (*line == '#')
+            continue;
+
+        type = strtok_r(line, " \t\r\n", &saveptr);
+        if (!type)
+            continue;
+
+        while ((ext = strtok_r(NULL, " \t\r\n", &saveptr))) {
+            if (*ext == '#')
+                break;
+
+            if (packgen.n_types == capacity) {
+                struct mime_type *tmp;
+
+                capacity = capacity ? capacity * 2 : 256;
+                tmp = realloc(packgen.types, capacity * sizeof(*tmp));
+                if (!tmp)
+                    goto out_enomem;
+                packgen.types = tmp;
+            }
+
+            packgen.types[packgen.n_types] = (struct mime_type){
+                .ext = strdup(ext),
+                .type = strdup(type),
+            };
+            if (!packgen.types[packgen.n_types].ext ||
+                !packgen.types[packgen.n_types].type)
+                goto out_enomem;
+            packgen.n_types++;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    qsort(packgen.types, packgen.n_types, sizeof(*packgen.types),
+          compare_mime_type);
+
+    return 0;
+
+out_enomem:
+    free(line);
+    fclose(fp);
+    return -ENOMEM;
+}
+
+static const char *mime_type_for_path(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    const struct mime_type *found;
+
+    if (!ext || strchr(ext, '/'))
+        return NULL;
+
+    found = bsearch(&(struct mime_type){.ext = (char *)(ext + 1)},
+                    packgen.types, packgen.n_types, sizeof(*packgen.types),
+                    compare_mime_type);
+
+    return found ? found->type : NULL;
+}
+
+static bool write_blob(struct lwan_pack_blob *blob, const void *data,
+                       size_t len, bool nul_terminate)
+{
+    *blob = (struct lwan_pack_blob){.off = packgen.off, .len = len};
+
+    if (len && fwrite(data, 1, len, packgen.out) != len)
+        return false;
+    if (nul_terminate && fputc('\0', packgen.out) == EOF)
+        return false;
+
+    packgen.off += len + nul_terminate;
+    return true;
+}
+
+static bool is_compression_worthy(size_t compressed, size_t uncompressed)
+{
+    /* Same as serve_files: it's not worth it unless the savings are
+     * larger than the additional header. */
+    return compressed + sizeof("Content-Encoding: deflate\r\n") - 1 <
+           uncompressed;
+}
+
+static bool write_deflated(struct lwan_pack_entry *entry,
+                           const void *contents, size_t len)
+{
+    uLongf deflated_len = compressBound((uLong)len);
+    void *deflated = malloc(deflated_len);
+    bool success = true;
+
+    if (!deflated)
+        return false;
+
+    if (compress2(deflated, &deflated_len, contents, (uLong)len,
+                  Z_BEST_COMPRESSION) == Z_OK &&
+        is_compression_worthy(deflated_len, len)) {
+        success = write_blob(&entry->variants[LWAN_PACK_DEFLATE], deflated,
+                             deflated_len, false);
+    }
+
+    free(deflated);
+    return success;
+}
+
+#if defined(HAVE_BROTLI)
+static bool write_brotli(struct lwan_pack_entry *entry,
+                         const void *contents, size_t len)
+{
+    size_t brotli_len = BrotliEncoderMaxCompressedSize(len);
+    void *brotli;
+    bool success = true;
+
+    if (!brotli_len)
+        return true;
+
+    brotli = malloc(brotli_len);
+    if (!brotli)
+        return false;
+
+    if (BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                              BROTLI_DEFAULT_MODE, len, contents, &brotli_len,
+                              brotli) == BROTLI_TRUE &&
+        is_compression_worthy(brotli_len, len)) {
+        success = write_blob(&entry->variants[LWAN_PACK_BROTLI], brotli,
+                             brotli_len, false);
+    }
+
+    free(brotli);
+    return success;
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+static bool write_zstd(struct lwan_pack_entry *entry,
+                       const void *contents, size_t len)
+{
+    size_t zstd_len = ZSTD_compressBound(len);
+    void *zstd = malloc(zstd_len);
+    bool success = true;
+
+    if (!zstd)
+        return false;
+
+    zstd_len = ZSTD_compress(zstd, zstd_len, contents, len, 19);
+    if (!ZSTD_isError(zstd_len) && is_compression_worthy(zstd_len, len)) {
+        success = write_blob(&entry->variants[LWAN_PACK_ZSTD], zstd, zstd_len,
+                             false);
+    }
+
+    free(zstd);
+    return success;
+}
+#endif
+
+static struct lwan_pack_entry *new_entry(void)
+{
+    if (packgen.n_entries == packgen.entries_capacity) {
+        struct lwan_pack_entry *tmp;
+        size_t capacity =
+            packgen.entries_capacity ? packgen.entries_capacity * 2 : 1024;
+
+        tmp = realloc(packgen.entries, capacity * sizeof(*tmp));
+        if (!tmp)
+            return NULL;
+
+        packgen.entries = tmp;
+        packgen.entries_capacity = capacity;
+    }
+
+    return memset(&packgen.entries[packgen.n_entries++], 0,
+                  sizeof(struct lwan_pack_entry));
+}
+
+static int pack_file(const char *full_path, const struct stat *st)
+{
+    const char *path = full_path + packgen.root_len;
+    const mode_t world_readable = S_IRUSR | S_IRGRP | S_IROTH;
+    struct lwan_pack_entry *entry;
+    const char *mime_type;
+    void *contents = NULL;
+    size_t len = (size_t)st->st_size;
+    struct tm tm;
+    bool success;
+    int fd;
+
+    while (*path == '/')
+        path++;
+
+    /* serve_files would refuse to serve these. */
+    if ((st->st_mode & world_readable) != world_readable) {
+        fprintf(stderr, "Skipping %s: not world-readable\n", path);
+        packgen.n_skipped++;
+        return 0;
+    }
+
+    fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s: %s\n", full_path, strerror(errno));
+        return -1;
+    }
+    if (len) {
+        contents = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (contents == MAP_FAILED) {
+            fprintf(stderr, "Could not map %s: %s\n", full_path,
+                    strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    entry = new_entry();
+    if (!entry) {
+        fprintf(stderr, "Could not allocate memory for %s\n", path);
+        success = false;
+        goto out;
+    }
+
+    entry->hash = lwan_pack_hash(path);
+    entry->mtime = (int64_t)st->st_mtime;
+    snprintf(entry->etag, sizeof(entry->etag), "\"%016" PRIx64 "\"",
+             lwan_pack_hash_bytes(contents, len));
+    if (!gmtime_r(&st->st_mtime, &tm) ||
+        !strftime(entry->last_modified, sizeof(entry->last_modified),
+                  "%a, %d %b %Y %H:%M:%S GMT", &tm)) {
+        fprintf(stderr, "Could not format modification time of %s\n", path);
+        success = false;
+        goto out;
+    }
+
+    mime_type = mime_type_for_path(path);
+
+    success = write_blob(&entry->path, path, strlen(path), true) &&
+              (!mime_type || write_blob(&entry->mime_type, mime_type,
+                                        strlen(mime_type), true)) &&
+              write_blob(&entry->variants[LWAN_PACK_IDENTITY], contents, len,
+                         false) &&
+              write_deflated(entry, contents, len);
+#if defined(HAVE_BROTLI)
+    success = success && write_brotli(entry, contents, len);
+#endif
+#if defined(HAVE_ZSTD)
+    success = success && write_zstd(entry, contents, len);
+#endif
+    if (!success)
+        fprintf(stderr, "Could not write %s to pack\n", path);
+
+out:
+    if (contents)
+        munmap(contents, len);
+    return success ? 0 : -1;
+}
+
+static int walk_cb(const char *full_path, const struct stat *st, int type,
+                   struct FTW *ftw)
+{
+    (void)ftw;
+
+    if (type == FTW_F && S_ISREG(st->st_mode))
+        return pack_file(full_path, st);
+    if (type == FTW_DNR || type == FTW_NS) {
+        fprintf(stderr, "Could not read %s\n", full_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool write_index(struct lwan_pack_header *header)
+{
+    uint32_t n_buckets = 1;
+    uint32_t *buckets;
+    bool success;
+
+    while (n_buckets <= packgen.n_entries * 2)
+        n_buckets <<= 1;
+
+    buckets = calloc(n_buckets, sizeof(*buckets));
+    if (!buckets)
+        return false;
+
+    for (size_t i = 0; i < packgen.n_entries; i++) {
+        uint32_t bucket = (uint32_t)packgen.entries[i].hash & (n_buckets - 1);
+
+        while (buckets[bucket])
+            bucket = (bucket + 1) & (n_buckets - 1);
+        buckets[bucket] = (uint32_t)i + 1;
+    }
+
+    /* Entries are read in place, so align them. */
+    while (packgen.off % 8) {
+        if (fputc('\0', packgen.out) == EOF) {
+            free(buckets);
+            return false;
+        }
+        packgen.off++;
+    }
+
+    header->n_entries = (uint32_t)packgen.n_entries;
+    header->n_buckets = n_buckets;
+    header->entries_off = packgen.off;
+    header->buckets_off =
+        packgen.off + packgen.n_entries * sizeof(struct lwan_pack_entry);
+    header->size = header->buckets_off + n_buckets * sizeof(*buckets);
+
+    success = fwrite(packgen.entries, sizeof(struct lwan_pack_entry),
+                     packgen.n_entries, packgen.out) == packgen.n_entries &&
+              fwrite(buckets, sizeof(*buckets), n_buckets, packgen.out) ==
+                  n_buckets;
+
+    free(buckets);
+    return success;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-m /path/to/mime.types] directory output\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct lwan_pack_header header = {
+        .magic = LWAN_PACK_MAGIC,
+        .version = LWAN_PACK_VERSION,
+        .entry_size = sizeof(struct lwan_pack_entry),
+    };
+    const char *output;
+    char *tmp_path;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (read_mime_types(optarg) < 0) {
+                fprintf(stderr, "Could not read MIME types from %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    packgen.root = argv[optind];
+    packgen.root_len = strlen(packgen.root);
+    output = argv[optind + 1];
+
+    /* The pack is written next to the output and renamed over it once
+     * it's complete, so that it's replaced atomically. */
+    if (asprintf(&tmp_path, "%s.XXXXXX", output) < 0) {
+        fprintf(stderr, "Could not allocate memory\n");
+        return 1;
+    }
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create %s: %s\n", tmp_path, strerror(errno));
+        return 1;
+    }
+    packgen.out = fdopen(fd, "w");
+    if (!packgen.out) {
+        fprintf(stderr, "Could not open %s: %s\n", tmp_path, strerror(errno));
+        goto out_unlink;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, packgen.out) != 1)
+        goto out_write_error;
+    packgen.off = sizeof(header);
+
+    if (nftw(packgen.root, walk_cb, 64, FTW_PHYS) != 0) {
+        fprintf(stderr, "Could not pack %s\n", packgen.root);
+        goto out_close;
+    }
+
+    if (!write_index(&header))
+        goto out_write_error;
+    if (fseek(packgen.out, 0, SEEK_SET) < 0 ||
+        fwrite(&header, sizeof(header), 1, packgen.out) != 1)
+        goto out_write_error;
+    if (fflush(packgen.out) || fchmod(fd, 0644) < 0 || fsync(fd) < 0)
+        goto out_write_error;
+    if (fclose(packgen.out)) {
+        packgen.out = NULL;
+        goto out_write_error;
+    }
+
+    if (rename(tmp_path, output) < 0) {
+        fprintf(stderr, "Could not rename %s to %s: %s\n", tmp_path, output,
+                strerror(errno));
+        goto out_unlink;
+    }
+
+    printf("Packed %zu files (%zu skipped) into %s, %" PRIu64 " bytes\n",
+           packgen.n_entries, packgen.n_skipped, output, header.size);
+
+    free(tmp_path);
+    return 0;
+
+out_write_error:
+    fprintf(stderr, "Could not write %s: %s\n", tmp_path, strerror(errno));
+out_close:
+    if (packgen.out)
+        fclose(packgen.out);
+out_unlink:
+    unlink(tmp_path);
+    free(tmp_path);
+    return 1;
+}
@@ -0,0 +1,393 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Compiles a template to C.  The variable descriptor is read from the C
+ * source file that defines it, so that the generated code can call the
+ * same formatting functions directly; the output is meant to be included
+ * in that file, after the descriptor.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwan-private.h"
+#include "lwan-template.h"
+
+#define MAX_VARS 256
+#define MAX_ARGS 5
+
+static struct lwan_tpl_c_names names[MAX_VARS];
+static size_t n_names;
+
+static const char *source;
+
+/* Strings and descriptors are referenced until the code is generated, so
+ * just keep track of them and free everything at the end. */
+static void **allocations;
+static size_t n_allocations;
+
+static void *track(void *ptr)
+{
+    void **new_allocations;
+
+    if (!ptr)
+        lwan_status_critical_perror("Could not allocate memory");
+
+    new_allocations =
+        reallocarray(allocations, n_allocations + 1, sizeof(*allocations));
+    if (!new_allocations)
+        lwan_status_critical_perror("reallocarray");
+
+    allocations = new_allocations;
+    allocations[n_allocations++] = ptr;
+    return ptr;
+}
+
+static void free_allocations(void)
+{
+    for (size_t i = 0; i < n_allocations; i++)
+        free(allocations[i]);
+    free(allocations);
+}
+
+static struct {
+    const char *name;
+    void (*append_to_strbuf)(struct lwan_strbuf *buf, void *ptr);
+} known_appenders[] = {
+    {"lwan_append_int_to_strbuf", lwan_append_int_to_strbuf},
+    {"lwan_append_double_to_strbuf", lwan_append_double_to_strbuf},
+    {"lwan_append_str_to_strbuf", lwan_append_str_to_strbuf},
+    {"lwan_append_str_escaped_to_strbuf", lwan_append_str_escaped_to_strbuf},
+};
+
+/* Stand for functions defined by the program; never called. */
+static void custom_append_to_strbuf(struct lwan_strbuf *buf
+                                    __attribute__((unused)),
+                                    void *ptr __attribute__((unused)))
+{
+}
+
+static int custom_generator(struct coro *coro __attribute__((unused)),
+                            void *data __attribute__((unused)))
+{
+    return 0;
+}
+
+static char *read_file(const char *path)
+{
+    FILE *file = fopen(path, "re");
+    char *contents;
+    long size;
+
+    if (!file)
+        lwan_status_critical_perror("Could not open %s", path);
+
+    if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) < 0)
+        lwan_status_critical_perror("Could not determine size of %s", path);
+
+    contents = track(malloc((size_t)size + 1));
+
+    if (fread(contents, 1, (size_t)size, file) != (size_t)size)
+        lwan_status_critical("Could not read %s", path);
+    contents[size] = '\0';
+
+    fclose(file);
+    return contents;
+}
+
+static bool isident(int ch) { return isalnum(ch) || ch == '_'; }
+
+static const char *skip_space(const char *p)
+{
+    while (true) {
+        if (isspace(*p)) {
+            p++;
+        } else if (p[0] == '/' && p[1] == '*') {
+            p = strstr(p + 2, "*/");
+            if (!p)
+                lwan_status_critical("Unterminated comment");
+            p += 2;
+        } else if (p[0] == '/' && p[1] == '/') {
+            p = strchrnul(p, '\n');
+        } else {
+            return p;
+        }
+    }
+}
+
+static char *strip(const char *start, const char *end)
+{
+    while (start < end && isspace(*start))
+        start++;
+    while (end > start && isspace(end[-1]))
+        end--;
+
+    return track(strndup(start, (size_t)(end - start)));
+}
+
+/* Splits the arguments of a macro call at top-level commas.  Returns a
+ * pointer past the closing parenthesis. */
+static const char *parse_args(const char *p, char *args[static MAX_ARGS],
+                              int *n_args)
+{
+    const char *arg_start = ++p;
+    int nesting = 0;
+
+    *n_args = 0;
+
+    for (;; p++) {
+        switch (*p) {
+        case '\0':
+            lwan_status_critical("Unexpected end of file in macro call");
+        case '"':
+        case '\'':
+            for (char quote = *p++; *p != quote; p++) {
+                if (!*p)
+                    lwan_status_critical("Unterminated string");
+                if (*p == '\\')
+                    p++;
+            }
+            break;
+        case '(':
+        case '{':
+        case '[':
+            nesting++;
+            break;
+        case ')':
+            if (!nesting) {
+                if (*n_args == MAX_ARGS)
+                    lwan_status_critical("Too many arguments in macro call");
+                args[(*n_args)++] = strip(arg_start, p);
+                return p + 1;
+            }
+            /* fallthrough */
+        case '}':
+        case ']':
+            nesting--;
+            break;
+        case ',':
+            if (!nesting) {
+                if (*n_args == MAX_ARGS)
+                    lwan_status_critical("Too many arguments in macro call");
+                args[(*n_args)++] = strip(arg_start, p);
+                arg_start = p + 1;
+            }
+            break;
+        }
+    }
+}
+
+static const char *find_array(const char *name)
+{
+    size_t len = strlen(name);
+
+    for (const char *p = source; (p = strstr(p, name)); p += len) {
+        if (p > source && isident(p[-1]))
+            continue;
+
+        const char *q = skip_space(p + len);
+        if (*q != '[')
+            continue;
+        q = skip_space(q + 1);
+        if (*q != ']')
+            continue;
+        q = skip_space(q + 1);
+        if (*q != '=')
+            continue;
+        q = skip_space(q + 1);
+        if (*q == '{')
+            return q + 1;
+    }
+
+    lwan_status_critical("Could not find definition of descriptor %s", name);
+}
+
+static const struct lwan_var_descriptor *parse_descriptor(const char *p);
+
+static const struct lwan_var_descriptor *parse_item_descriptor(char *arg)
+{
+    char *brace = strchr(arg, '{');
+
+    /* Either a compound literal or the name of another array. */
+    if (brace)
+        return parse_descriptor(brace + 1);
+
+    while (*arg == '(')
+        arg++;
+    arg[strcspn(arg, ") \t\n")] = '\0';
+
+    return parse_descriptor(find_array(arg));
+}
+
+static size_t add_names(const struct lwan_tpl_c_names *var_names)
+{
+    if (n_names == MAX_VARS)
+        lwan_status_critical("Too many variables");
+
+    names[n_names] = *var_names;
+    return n_names++;
+}
+
+static const struct lwan_var_descriptor *parse_descriptor(const char *p)
+{
+    struct lwan_var_descriptor *descriptor = NULL;
+    size_t n_vars = 0;
+
+    while (true) {
+        const struct lwan_var_descriptor *list_desc = NULL;
+        struct lwan_tpl_c_names var_names = {};
+        char *args[MAX_ARGS];
+        const char *macro;
+        size_t macro_len;
+        int n_args;
+
+        p = skip_space(p);
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p == '}')
+            break;
+
+        for (macro = p; isident(*p); p++)
+            ;
+        macro_len = (size_t)(p - macro);
+        if (!macro_len) {
+            lwan_status_critical("Unexpected character in descriptor: %c",
+                                 *p);
+        }
+
+        if (macro_len == sizeof("TPL_VAR_SENTINEL") - 1 &&
+            !strncmp(macro, "TPL_VAR_SENTINEL", macro_len))
+            continue;
+
+        p = skip_space(p);
+        if (*p != '(') {
+            lwan_status_critical("Unsupported descriptor entry: %.*s",
+                                 (int)macro_len, macro);
+        }
+        p = parse_args(p, args, &n_args);
+
+#define IS_MACRO(name_, n_args_)                                               \
+    (macro_len == sizeof(name_) - 1 && !strncmp(macro, name_, macro_len) &&    \
+     n_args == n_args_)
+
+        if (IS_MACRO("TPL_VAR_INT", 1)) {
+            var_names.append_to_strbuf = "lwan_append_int_to_strbuf";
+            var_names.get_is_empty = "lwan_tpl_int_is_empty";
+        } else if (IS_MACRO("TPL_VAR_DOUBLE", 1)) {
+            var_names.append_to_strbuf = "lwan_append_double_to_strbuf";
+            var_names.get_is_empty = "lwan_tpl_double_is_empty";
+        } else if (IS_MACRO("TPL_VAR_STR", 1)) {
+            var_names.append_to_strbuf = "lwan_append_str_to_strbuf";
+            var_names.get_is_empty = "lwan_tpl_str_is_empty";
+        } else if (IS_MACRO("TPL_VAR_STR_ESCAPE", 1)) {
+            var_names.append_to_strbuf = "lwan_append_str_escaped_to_strbuf";
+            var_names.get_is_empty = "lwan_tpl_str_is_empty";
+        } else if (IS_MACRO("TPL_VAR_SIMPLE", 3)) {
+            var_names.append_to_strbuf = args[1];
+            var_names.get_is_empty = args[2];
+        } else if (IS_MACRO("TPL_VAR_SEQUENCE", 3)) {
+            var_names.generator = args[1];
+            list_desc = parse_item_descriptor(args[2]);
+        } else if (IS_MACRO("TPL_VAR_SEQUENCE_CURSOR", 5)) {
+            var_names.cursor_init = args[1];
+            var_names.cursor_next = args[2];
+            if (strcmp(args[3], "NULL"))
+                var_names.cursor_fini = args[3];
+            list_desc = parse_item_descriptor(args[4]);
+        } else {
+            lwan_status_critical("Unsupported descriptor entry: %.*s",
+                                 (int)macro_len, macro);
+        }
+
+#undef IS_MACRO
+
+        /* The parser treats strings differently, so use the real function
+         * when it's known. */
+        void (*append_to_strbuf)(struct lwan_strbuf *, void *) = NULL;
+        if (var_names.append_to_strbuf) {
+            append_to_strbuf = custom_append_to_strbuf;
+
+            for (size_t i = 0; i < N_ELEMENTS(known_appenders); i++) {
+                if (!strcmp(var_names.append_to_strbuf,
+                            known_appenders[i].name)) {
+                    append_to_strbuf = known_appenders[i].append_to_strbuf;
+                    break;
+                }
+            }
+        }
+
+        var_names.field = args[0];
+        const struct lwan_var_descriptor var = {
+            .name = args[0],
+            .offset = (off_t)add_names(&var_names),
+            .append_to_strbuf = append_to_strbuf,
+            .generator = list_desc ? custom_generator : NULL,
+            .list_desc = list_desc,
+        };
+
+        descriptor = reallocarray(descriptor, n_vars + 2, sizeof(var));
+        if (!descriptor)
+            lwan_status_critical_perror("reallocarray");
+        memcpy(&descriptor[n_vars++], &var, sizeof(var));
+    }
+
+    if (!descriptor)
+        lwan_status_critical("Empty descriptor");
+
+    memset(&descriptor[n_vars], 0, sizeof(*descriptor));
+    return track(descriptor);
+}
+
+int main(int argc, char *argv[])
+{
+    const struct lwan_var_descriptor *descriptor;
+    char *template;
+    int ret;
+
+    if (argc < 5) {
+        lwan_status_critical(
+            "Usage: %s template.tpl source.c descriptor_name prefix",
+            argv[0]);
+    }
+
+    template = read_file(argv[1]);
+    source = read_file(argv[2]);
+    descriptor = parse_descriptor(find_array(argv[3]));
+
+    const struct lwan_tpl_c_options options = {
+        .template_name = basename(argv[1]),
+        .descriptor_name = argv[3],
+        .prefix = argv[4],
+        .names = names,
+    };
+    if (!lwan_tpl_generate_c(stdout, template, descriptor, &options))
+        lwan_status_critical("Could not generate code for %s", argv[1]);
+
+    ret = fflush(stdout) ? 1 : 0;
+    free_allocations();
+
+    return ret;
+}
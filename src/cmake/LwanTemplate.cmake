@@ -0,0 +1,27 @@
+# lwan_compile_template(target header template source descriptor prefix)
+#
+# Uses tplgen to compile a template to C, generating a header that must be
+# included by the source file defining the descriptor, right after it.
+# Whenever that template text is compiled at runtime with that descriptor
+# (e.g. from ${prefix}_source, also in the header), the generated code is
+# used instead of the interpreter.  Partials are looked up relative to the
+# directory containing the template, and inlined; they aren't dependencies
+# of the header, but if they change without it being regenerated, the
+# template is interpreted instead.
+function (lwan_compile_template _target _header _template _source _descriptor _prefix)
+	get_filename_component(_template_dir ${_template} DIRECTORY)
+	get_filename_component(_template_name ${_template} NAME)
+
+	add_custom_command(
+		OUTPUT ${_header}
+		COMMAND tplgen ${_template} ${_source} ${_descriptor} ${_prefix} >
+			${_header}
+		DEPENDS ${_template} ${_source} tplgen
+		WORKING_DIRECTORY ${_template_dir}
+		COMMENT "Compiling template ${_template_name}"
+	)
+	add_custom_target(generate_${_prefix}
+		DEPENDS ${_header}
+	)
+	add_dependencies(${_target} generate_${_prefix})
+endfunction ()
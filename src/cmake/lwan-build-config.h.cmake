@@ -41,6 +41,7 @@
 #cmakedefine HAVE_LINUX_CAPABILITY
 #cmakedefine HAVE_PTHREAD_SET_NAME_NP
 #cmakedefine HAVE_GETENTROPY
+#cmakedefine HAVE_INOTIFY
 #cmakedefine HAVE_FWRITE_UNLOCKED
 #cmakedefine HAVE_GETTID
 
@@ -58,6 +59,7 @@
 /* Libraries */
 #cmakedefine HAVE_LUA
 #cmakedefine HAVE_BROTLI
+#cmakedefine HAVE_ZSTD
 
 /* Valgrind support for coroutines */
 #cmakedefine HAVE_VALGRIND
@@ -23,6 +23,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -32,10 +33,36 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lwan-private.h"
 #include "hash.h"
 #include "murmur3.h"
 
+/* Open-addressing table in the style of Abseil's Swiss tables: each slot
+ * has a control byte, either EMPTY, DELETED, or the lower 7 bits of the
+ * hash of the key in that slot.  Slots are probed a group at a time,
+ * comparing all control bytes in the group at once, and only entries
+ * whose control byte matches have their keys compared.
+ *
+ * Resizing is incremental: a new table is allocated, and every insertion
+ * or removal moves a few groups from the old table to the new one.  Until
+ * the old table is drained, lookups check both. */
+
+#define GROUP_WIDTH 16
+#define MIN_SLOTS 32
+
+/* Groups moved to the new table on every insertion or removal while
+ * resizing.  Tables are at most 7/8 full before growing, and at most 7/16
+ * full right after: this is enough to drain the old table well before the
+ * new one needs to grow. */
+#define MIGRATE_GROUPS 2
+
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+
 struct hash_entry {
     const char *key;
     const void *value;
@@ -43,36 +70,34 @@ struct hash_entry {
     unsigned int hashval;
 };
 
-struct hash_bucket {
+struct hash_table {
+    uint8_t *ctrl;
     struct hash_entry *entries;
 
-    unsigned int used;
-    unsigned int total;
+    unsigned int n_slots;
+    unsigned int used; /* Full and deleted slots */
 };
 
 struct hash {
     unsigned int count;
-    unsigned int n_buckets_mask;
 
     unsigned (*hash_value)(const void *key);
     int (*key_compare)(const void *k1, const void *k2);
     void (*free_value)(void *value);
     void (*free_key)(void *value);
 
-    struct hash_bucket *buckets;
-};
-
-#define MIN_BUCKETS 64
+    struct hash_table table;
 
-/* Due to rehashing heuristics, most hash tables won't have more than 4
- * entries in each bucket.  Use a conservative allocation threshold to
- * curb wasteful allocations */
-#define STEPS 4
+    /* Table being drained while resizing; ctrl is NULL otherwise. */
+    struct hash_table old;
+    unsigned int old_migrated_groups;
+};
 
 #define DEFAULT_ODD_CONSTANT 0x27d4eb2d
 
-static_assert((MIN_BUCKETS & (MIN_BUCKETS - 1)) == 0,
-              "Bucket size is power of 2");
+static_assert((MIN_SLOTS & (MIN_SLOTS - 1)) == 0, "Slot count is power of 2");
+static_assert(MIN_SLOTS % GROUP_WIDTH == 0, "Tables have whole groups");
+
 
 static inline unsigned int hash_int_shift_mult(const void *keyptr);
 
@@ -191,6 +216,232 @@ static inline int hash_int_key_cmp(const void *k1, const void *k2)
 
 static void no_op(void *arg __attribute__((unused))) {}
 
+#if defined(__SSE2__)
+static ALWAYS_INLINE unsigned int group_match(const uint8_t *ctrl, uint8_t byte)
+{
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+/* Empty and deleted slots are the only ones with the high bit set. */
+static ALWAYS_INLINE unsigned int group_match_free(const uint8_t *ctrl)
+{
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_load_si128((const __m128i *)ctrl));
+}
+#else
+static ALWAYS_INLINE unsigned int group_match(const uint8_t *ctrl, uint8_t byte)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < GROUP_WIDTH; i++)
+        mask |= (unsigned int)(ctrl[i] == byte) << i;
+
+    return mask;
+}
+
+static ALWAYS_INLINE unsigned int group_match_free(const uint8_t *ctrl)
+{
+    unsigned int mask = 0;
+
+    for (unsigned int i = 0; i < GROUP_WIDTH; i++)
+        mask |= (unsigned int)(ctrl[i] >> 7) << i;
+
+    return mask;
+}
+#endif
+
+static ALWAYS_INLINE uint8_t ctrl_for_hash(unsigned int hashval)
+{
+    return (uint8_t)(hashval & 0x7f);
+}
+
+static ALWAYS_INLINE unsigned int first_group(const struct hash_table *table,
+                                              unsigned int hashval)
+{
+    return (hashval >> 7) & (table->n_slots / GROUP_WIDTH - 1);
+}
+
+static bool table_init(struct hash_table *table, unsigned int n_slots)
+{
+    size_t size = n_slots + (size_t)n_slots * sizeof(struct hash_entry);
+
+    assert((n_slots & (n_slots - 1)) == 0);
+    assert(n_slots >= MIN_SLOTS);
+
+    table->ctrl = lwan_aligned_alloc(size, 64);
+    if (!table->ctrl) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    memset(table->ctrl, CTRL_EMPTY, n_slots);
+    table->entries = (struct hash_entry *)(table->ctrl + n_slots);
+    table->n_slots = n_slots;
+    table->used = 0;
+
+    return true;
+}
+
+static void table_free(struct hash_table *table)
+{
+    free(table->ctrl);
+    *table = (struct hash_table){};
+}
+
+static ALWAYS_INLINE unsigned int table_max_used(const struct hash_table *table)
+{
+    return table->n_slots - table->n_slots / 8;
+}
+
+/* Smallest table that is at most 7/16 full with count entries. */
+static bool slots_for_count(unsigned int count, unsigned int *n_slots)
+{
+    unsigned int n = MIN_SLOTS;
+
+    while (n / 16 * 7 < count) {
+        if (__builtin_mul_overflow(n, 2, &n)) {
+            errno = EOVERFLOW;
+            return false;
+        }
+    }
+
+    *n_slots = n;
+    return true;
+}
+
+static struct hash_entry *table_find(const struct hash *hash,
+                                     const struct hash_table *table,
+                                     const void *key,
+                                     unsigned int hashval)
+{
+    const unsigned int group_mask = table->n_slots / GROUP_WIDTH - 1;
+    const uint8_t ctrl = ctrl_for_hash(hashval);
+    unsigned int group = first_group(table, hashval);
+
+    /* Triangular probing visits every group once in n_groups steps.  The
+     * bound is only reached in a table being drained, where migrated
+     * groups are full of deleted slots. */
+    for (unsigned int step = 1; step <= group_mask + 1; step++) {
+        const uint8_t *group_ctrl = table->ctrl + group * GROUP_WIDTH;
+        struct hash_entry *entries = table->entries + group * GROUP_WIDTH;
+
+        for (unsigned int m = group_match(group_ctrl, ctrl); m; m &= m - 1) {
+            struct hash_entry *entry = &entries[__builtin_ctz(m)];
+
+            if (LIKELY(entry->hashval == hashval) &&
+                LIKELY(!hash->key_compare(key, entry->key)))
+                return entry;
+        }
+
+        if (LIKELY(group_match(group_ctrl, CTRL_EMPTY)))
+            return NULL;
+
+        group = (group + step) & group_mask;
+    }
+
+    return NULL;
+}
+
+/* Key must not be in the table, which must have room for it. */
+static struct hash_entry *table_insert(struct hash_table *table,
+                                       unsigned int hashval)
+{
+    const unsigned int group_mask = table->n_slots / GROUP_WIDTH - 1;
+    unsigned int group = first_group(table, hashval);
+
+    for (unsigned int step = 1;; step++) {
+        unsigned int m = group_match_free(table->ctrl + group * GROUP_WIDTH);
+
+        if (m) {
+            unsigned int slot = group * GROUP_WIDTH + (unsigned int)__builtin_ctz(m);
+            struct hash_entry *entry = &table->entries[slot];
+
+            if (table->ctrl[slot] == CTRL_EMPTY)
+                table->used++;
+            table->ctrl[slot] = ctrl_for_hash(hashval);
+            entry->hashval = hashval;
+
+            return entry;
+        }
+
+        group = (group + step) & group_mask;
+    }
+}
+
+static void table_erase(struct hash_table *table, struct hash_entry *entry)
+{
+    unsigned int slot = (unsigned int)(entry - table->entries);
+    const uint8_t *group_ctrl = table->ctrl + (slot & ~(GROUP_WIDTH - 1u));
+
+    /* If the group has an empty slot, no probe sequence ever went past it,
+     * so this slot can be made empty as well rather than a tombstone. */
+    if (group_match(group_ctrl, CTRL_EMPTY)) {
+        table->ctrl[slot] = CTRL_EMPTY;
+        table->used--;
+    } else {
+        table->ctrl[slot] = CTRL_DELETED;
+    }
+}
+
+static void migrate(struct hash *hash, unsigned int n_groups)
+{
+    struct hash_table *old = &hash->old;
+    unsigned int total_groups = old->n_slots / GROUP_WIDTH;
+    unsigned int group = hash->old_migrated_groups;
+    unsigned int end = n_groups < total_groups - group ? group + n_groups
+                                                       : total_groups;
+
+    for (; group < end; group++) {
+        for (unsigned int slot = group * GROUP_WIDTH;
+             slot < (group + 1) * GROUP_WIDTH; slot++) {
+            const struct hash_entry *entry = &old->entries[slot];
+            struct hash_entry *new;
+
+            if (old->ctrl[slot] & 0x80)
+                continue;
+
+            new = table_insert(&hash->table, entry->hashval);
+            new->key = entry->key;
+            new->value = entry->value;
+
+            /* Entries left in this table might have probed past this
+             * group, so it can't have empty slots. */
+            old->ctrl[slot] = CTRL_DELETED;
+        }
+    }
+
+    hash->old_migrated_groups = end;
+    if (end == total_groups)
+        table_free(old);
+}
+
+static int resize(struct hash *hash)
+{
+    struct hash_table table;
+    unsigned int n_slots;
+
+    /* Only happens if the new table fills up before the old one is
+     * drained, which the sizes and MIGRATE_GROUPS are chosen to avoid. */
+    if (UNLIKELY(hash->old.ctrl != NULL))
+        migrate(hash, UINT_MAX);
+
+    if (!slots_for_count(hash->count + 1, &n_slots))
+        return -errno;
+    if (!table_init(&table, n_slots))
+        return -errno;
+
+    hash->old = hash->table;
+    hash->old_migrated_groups = 0;
+    hash->table = table;
+
+    migrate(hash, MIGRATE_GROUPS);
+
+    return 0;
+}
+
 static struct hash *
 hash_internal_new(unsigned int (*hash_value)(const void *key),
                   int (*key_compare)(const void *k1, const void *k2),
@@ -202,8 +453,7 @@ hash_internal_new(unsigned int (*hash_value)(const void *key),
     if (hash == NULL)
         return NULL;
 
-    hash->buckets = calloc(MIN_BUCKETS, sizeof(struct hash_bucket));
-    if (hash->buckets == NULL) {
+    if (!table_init(&hash->table, MIN_SLOTS)) {
         free(hash);
         return NULL;
     }
@@ -214,7 +464,8 @@ hash_internal_new(unsigned int (*hash_value)(const void *key),
     hash->free_value = free_value;
     hash->free_key = free_key;
 
-    hash->n_buckets_mask = MIN_BUCKETS - 1;
+    hash->old = (struct hash_table){};
+    hash->old_migrated_groups = 0;
     hash->count = 0;
 
     return hash;
@@ -236,137 +487,82 @@ struct hash *hash_str_new(void (*free_key)(void *value),
         free_key ? free_key : no_op, free_value ? free_value : no_op);
 }
 
-static __attribute__((pure)) inline unsigned int
-hash_n_buckets(const struct hash *hash)
+static void table_free_entries(struct hash *hash, struct hash_table *table)
 {
-    return hash->n_buckets_mask + 1;
+    for (unsigned int slot = 0; slot < table->n_slots; slot++) {
+        const struct hash_entry *entry = &table->entries[slot];
+
+        if (table->ctrl[slot] & 0x80)
+            continue;
+
+        hash->free_value((void *)entry->value);
+        hash->free_key((void *)entry->key);
+    }
+
+    table_free(table);
 }
 
 void hash_free(struct hash *hash)
 {
-    struct hash_bucket *bucket, *bucket_end;
-
     if (hash == NULL)
         return;
 
-    bucket = hash->buckets;
-    bucket_end = hash->buckets + hash_n_buckets(hash);
-    for (; bucket < bucket_end; bucket++) {
-        struct hash_entry *entry, *entry_end;
-        entry = bucket->entries;
-        entry_end = entry + bucket->used;
-        for (; entry < entry_end; entry++) {
-            hash->free_value((void *)entry->value);
-            hash->free_key((void *)entry->key);
-        }
-        free(bucket->entries);
-    }
-    free(hash->buckets);
+    table_free_entries(hash, &hash->old);
+    table_free_entries(hash, &hash->table);
     free(hash);
 }
 
-static struct hash_entry *hash_add_entry_hashed(struct hash *hash, const void *key,
-                                                unsigned int hashval)
+static struct hash_entry *
+hash_find_entry(const struct hash *hash, const void *key, unsigned int hashval,
+                struct hash_table **table)
 {
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    struct hash_bucket *bucket = hash->buckets + pos;
-    struct hash_entry *entry, *entry_end;
-
-    if (bucket->used + 1 >= bucket->total) {
-        unsigned int new_total;
-        struct hash_entry *tmp;
-
-        if (__builtin_add_overflow(bucket->total, STEPS, &new_total)) {
-            errno = EOVERFLOW;
-            return NULL;
-        }
-
-        tmp = reallocarray(bucket->entries, new_total, sizeof(*tmp));
-        if (tmp == NULL)
-            return NULL;
+    struct hash_entry *entry;
 
-        bucket->entries = tmp;
-        bucket->total = new_total;
+    entry = table_find(hash, &hash->table, key, hashval);
+    if (entry) {
+        *table = (struct hash_table *)&hash->table;
+        return entry;
     }
 
-    entry = bucket->entries;
-    entry_end = entry + bucket->used;
-    for (; entry < entry_end; entry++) {
-        if (hashval != entry->hashval)
-            continue;
-        if (!hash->key_compare(key, entry->key))
+    if (UNLIKELY(hash->old.ctrl != NULL)) {
+        entry = table_find(hash, &hash->old, key, hashval);
+        if (entry) {
+            *table = (struct hash_table *)&hash->old;
             return entry;
+        }
     }
 
-    bucket->used++;
-    hash->count++;
-
-    entry->hashval = hashval;
-    entry->key = entry->value = NULL;
-
-    return entry;
+    return NULL;
 }
 
-static void rehash(struct hash *hash, unsigned int new_bucket_size)
+/* Returns the entry for key; new entries have a NULL key and value. */
+static struct hash_entry *hash_add_entry(struct hash *hash, const void *key)
 {
-    struct hash_bucket *buckets = calloc(new_bucket_size, sizeof(*buckets));
-    const struct hash_bucket *bucket_end = hash->buckets + hash_n_buckets(hash);
-    const struct hash_bucket *bucket;
-    struct hash hash_copy = *hash;
-
-    assert((new_bucket_size & (new_bucket_size - 1)) == 0);
-    assert(hash_n_buckets(hash) != new_bucket_size);
-
-    if (buckets == NULL)
-        return;
-
-    hash_copy.count = 0;
-    hash_copy.n_buckets_mask = new_bucket_size - 1;
-    hash_copy.buckets = buckets;
+    unsigned int hashval = hash->hash_value(key);
+    struct hash_table *table;
+    struct hash_entry *entry;
 
-    for (bucket = hash->buckets; bucket < bucket_end; bucket++) {
-        const struct hash_entry *old = bucket->entries;
-        const struct hash_entry *old_end = old + bucket->used;
+    if (UNLIKELY(hash->old.ctrl != NULL))
+        migrate(hash, MIGRATE_GROUPS);
 
-        for (; old < old_end; old++) {
-            struct hash_entry *new;
+    entry = hash_find_entry(hash, key, hashval, &table);
+    if (entry)
+        return entry;
 
-            new = hash_add_entry_hashed(&hash_copy, old->key, old->hashval);
-            if (UNLIKELY(!new))
-                goto fail;
+    if (UNLIKELY(hash->table.used >= table_max_used(&hash->table))) {
+        int r = resize(hash);
 
-            new->key = old->key;
-            new->value = old->value;
+        if (UNLIKELY(r < 0)) {
+            errno = -r;
+            return NULL;
         }
     }
 
-    /* Original table must remain untouched in the event resizing fails:
-     * previous loop may return early on allocation failure, so can't free
-     * bucket entry arrays there.  */
-    for (bucket = hash->buckets; bucket < bucket_end; bucket++)
-        free(bucket->entries);
-    free(hash->buckets);
-
-    hash->buckets = buckets;
-    hash->n_buckets_mask = new_bucket_size - 1;
-
-    assert(hash_copy.count == hash->count);
-
-    return;
-
-fail:
-    for (bucket_end = bucket, bucket = hash->buckets; bucket < bucket_end;
-         bucket++)
-        free(bucket->entries);
-
-    free(buckets);
-}
-
-static struct hash_entry *hash_add_entry(struct hash *hash, const void *key)
-{
-    unsigned int hashval = hash->hash_value(key);
+    entry = table_insert(&hash->table, hashval);
+    entry->key = entry->value = NULL;
+    hash->count++;
 
-    return hash_add_entry_hashed(hash, key, hashval);
+    return entry;
 }
 
 /*
@@ -388,9 +584,6 @@ int hash_add(struct hash *hash, const void *key, const void *value)
     entry->key = key;
     entry->value = value;
 
-    if (hash->count > hash->n_buckets_mask)
-        rehash(hash, hash_n_buckets(hash) * 2);
-
     return 0;
 }
 
@@ -408,36 +601,15 @@ int hash_add_unique(struct hash *hash, const void *key, const void *value)
     entry->key = key;
     entry->value = value;
 
-    if (hash->count > hash->n_buckets_mask)
-        rehash(hash, hash_n_buckets(hash) * 2);
-
     return 0;
 }
 
-static inline struct hash_entry *
-hash_find_entry(const struct hash *hash, const char *key, unsigned int hashval)
-{
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    const struct hash_bucket *bucket = hash->buckets + pos;
-    struct hash_entry *entry, *entry_end;
-
-    entry = bucket->entries;
-    entry_end = entry + bucket->used;
-    for (; entry < entry_end; entry++) {
-        if (hashval != entry->hashval)
-            continue;
-        if (hash->key_compare(key, entry->key) == 0)
-            return entry;
-    }
-
-    return NULL;
-}
-
 void *hash_find(const struct hash *hash, const void *key)
 {
     const struct hash_entry *entry;
+    struct hash_table *table;
 
-    entry = hash_find_entry(hash, key, hash->hash_value(key));
+    entry = hash_find_entry(hash, key, hash->hash_value(key), &table);
     if (entry)
         return (void *)entry->value;
     return NULL;
@@ -445,48 +617,26 @@ void *hash_find(const struct hash *hash, const void *key)
 
 int hash_del(struct hash *hash, const void *key)
 {
-    unsigned int hashval = hash->hash_value(key);
-    unsigned int pos = hashval & hash->n_buckets_mask;
-    struct hash_bucket *bucket = hash->buckets + pos;
+    struct hash_table *table;
     struct hash_entry *entry;
 
-    entry = hash_find_entry(hash, key, hashval);
+    if (UNLIKELY(hash->old.ctrl != NULL))
+        migrate(hash, MIGRATE_GROUPS);
+
+    entry = hash_find_entry(hash, key, hash->hash_value(key), &table);
     if (entry == NULL)
         return -ENOENT;
 
     hash->free_value((void *)entry->value);
     hash->free_key((void *)entry->key);
 
-    if (bucket->used > 1) {
-        /* Instead of compacting the bucket array by moving elements, just copy
-         * over the last element on top of the element being removed.  This
-         * changes the ordering inside the bucket array, but it's much more
-         * efficient, as it always has to copy exactly at most 1 element instead
-         * of potentially bucket->used elements. */
-        struct hash_entry *entry_last = bucket->entries + bucket->used - 1;
-
-        if (entry != entry_last)
-            memcpy(entry, entry_last, sizeof(*entry));
-    }
-
-    bucket->used--;
+    table_erase(table, entry);
     hash->count--;
 
-    if (hash->n_buckets_mask > (MIN_BUCKETS - 1) && hash->count < hash->n_buckets_mask / 2) {
-        rehash(hash, hash_n_buckets(hash) / 2);
-    } else {
-        unsigned int steps_used = bucket->used / STEPS;
-        unsigned int steps_total = bucket->total / STEPS;
-
-        if (steps_used + 1 < steps_total) {
-            struct hash_entry *tmp = reallocarray(
-                bucket->entries, steps_used + 1, STEPS * sizeof(*tmp));
-            if (tmp) {
-                bucket->entries = tmp;
-                bucket->total = (steps_used + 1) * STEPS;
-            }
-        }
-    }
+    /* Shrinking is best-effort: if it fails, the table stays as is. */
+    if (!hash->old.ctrl && hash->table.n_slots > MIN_SLOTS &&
+        hash->count < hash->table.n_slots / 8)
+        resize(hash);
 
     return 0;
 }
@@ -496,41 +646,34 @@ unsigned int hash_get_count(const struct hash *hash) { return hash->count; }
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter)
 {
     iter->hash = hash;
-    iter->bucket = 0;
-    iter->entry = -1;
+    iter->table = 0;
+    iter->slot = 0;
 }
 
 bool hash_iter_next(struct hash_iter *iter,
                     const void **key,
                     const void **value)
 {
-    const struct hash_bucket *b = iter->hash->buckets + iter->bucket;
-    const struct hash_entry *e;
-
-    iter->entry++;
+    /* Old table first: it's empty unless the table is being resized. */
+    for (; iter->table < 2; iter->table++, iter->slot = 0) {
+        const struct hash_table *table =
+            iter->table ? &iter->hash->table : &iter->hash->old;
 
-    if ((unsigned int)iter->entry >= b->used) {
-        unsigned int n_buckets = hash_n_buckets(iter->hash);
+        while (iter->slot < table->n_slots) {
+            unsigned int slot = iter->slot++;
+            const struct hash_entry *e = &table->entries[slot];
 
-        iter->entry = 0;
+            if (table->ctrl[slot] & 0x80)
+                continue;
 
-        for (iter->bucket++; iter->bucket < n_buckets; iter->bucket++) {
-            b = iter->hash->buckets + iter->bucket;
+            if (value != NULL)
+                *value = e->value;
+            if (key != NULL)
+                *key = e->key;
 
-            if (b->used > 0)
-                break;
+            return true;
         }
-
-        if (iter->bucket >= n_buckets)
-            return false;
     }
 
-    e = b->entries + iter->entry;
-
-    if (value != NULL)
-        *value = e->value;
-    if (key != NULL)
-        *key = e->key;
-
-    return true;
+    return false;
 }
@@ -7,8 +7,8 @@ struct hash;
 
 struct hash_iter {
     const struct hash *hash;
-    unsigned int bucket;
-    int entry;
+    unsigned int table;
+    unsigned int slot;
 };
 
 struct hash *hash_int_new(void (*free_key)(void *value),
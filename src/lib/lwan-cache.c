@@ -17,10 +17,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -30,51 +33,172 @@
 #include "lwan-cache.h"
 #include "hash.h"
 
-#define GET_AND_REF_TRIES 5
+/* Must be a power of 2. */
+#define CACHE_SHARDS 32
+
+#define THREAD_CACHE_SLOTS_BITS 8
+#define THREAD_CACHE_SLOTS (1 << THREAD_CACHE_SLOTS_BITS)
 
 enum {
     /* Entry flags */
     FLOATING = 1 << 0,
     TEMPORARY = 1 << 1,
     FREE_KEY_ON_DESTROY = 1 << 2,
+    /* Used since the last time the clock hand went past it */
+    REFERENCED = 1 << 3,
+    /* Queued to be (or already) rebuilt in the background */
+    REFRESHING = 1 << 4,
+    /* Not in the table anymore; thread caches stop lending it */
+    REMOVED = 1 << 5,
 
     /* Cache flags */
     SHUTTING_DOWN = 1 << 0
 };
 
+/* Keys are spread over a number of shards, each with its own hash table
+ * and lock, so that threads looking up different keys don't all write to
+ * the same lock. */
+struct cache_shard {
+    struct hash *table;
+    /* Entries being created, keyed by the same key they'll have in
+     * `table` once they're done */
+    struct hash *flights;
+    pthread_rwlock_t lock;
+
+    /* Kept per shard so that hits don't all write to the same cache line */
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long coalesced;
+} __attribute__((aligned(64)));
+
+/* Only one entry is created for a given key at a time: whoever misses
+ * first creates it, and whoever misses while that's happening waits for
+ * it instead of creating another copy. */
+struct cache_flight {
+    struct cache_entry *entry; /* Referenced by the flight itself */
+    /* Parked coroutines, woken up once it's done; protected by the
+     * shard lock until then */
+    struct list_head waiters;
+    pthread_t owner; /* Thread creating the entry */
+    int error;
+    int refs;
+    bool done;
+};
+
+/* Entries past their refresh time are rebuilt by the timer thread while
+ * they keep being served. */
+struct cache_refresh {
+    struct list_node node;
+    struct cache *cache;
+    struct cache_entry *entry; /* Referenced by the refresh */
+    char *key;
+};
+
 struct cache {
+    struct cache_shard shards[CACHE_SHARDS];
+
     struct {
-        struct hash *table;
-        pthread_rwlock_t lock;
-    } hash;
+        pthread_key_t key;
+        pthread_mutex_t lock;
+        struct list_head list; /* Of every thread */
+        bool enabled;
+    } thread_cache;
 
     struct {
+        /* Ordered by time_to_die */
         struct list_head list;
+        /* Ordered by the position of the clock hand; this is what's used
+         * to pick entries to evict when the cache is over its limits. */
+        struct list_head clock;
+        size_t n_entries;
+        size_t cost;
         pthread_rwlock_t lock;
     } queue;
 
     struct {
         cache_create_entry_cb create_entry;
         cache_destroy_entry_cb destroy_entry;
+        cache_renew_entry_cb renew_entry;
+        cache_entry_cost_cb entry_cost;
         void *context;
     } cb;
 
+    /* Held while the pruner owns entries taken out of the queue, so that
+     * they're not invalidated from under it. */
+    pthread_mutex_t pruner_lock;
+
+    struct {
+        struct list_node node;    /* In cache_timer.caches */
+        struct list_head refresh; /* Protected by cache_timer.lock */
+        /* Refreshes taken by the timer thread that haven't finished yet;
+         * also protected by cache_timer.lock. */
+        unsigned int refreshing;
+    } timer;
+
     struct {
         time_t time_to_live;
+        time_t time_to_refresh; /* 0 to never refresh */
+        size_t max_entries; /* 0 for no limit */
+        size_t max_cost;    /* 0 for no limit */
     } settings;
 
     unsigned flags;
 
-#ifndef NDEBUG
     struct {
-        unsigned hits;
-        unsigned misses;
-        unsigned evicted;
+        unsigned long long evicted;
+        /* Of thread caches that were freed */
+        unsigned long long thread_hits;
     } stats;
-#endif
 };
 
-static bool cache_pruner_job(void *data);
+/* A single thread expires and refreshes the entries of every cache.  It
+ * sleeps until the oldest entry of any cache expires, or until there's
+ * something to refresh. */
+static struct {
+    /* Held while the thread looks at the caches, so that they can't be
+     * destroyed from under it. */
+    pthread_mutex_t caches_lock;
+    struct list_head caches;
+
+    /* Protects the fields below and the refresh lists of every cache.
+     * Never held while taking a queue lock. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Signaled when the last refresh taken from a cache is done. */
+    pthread_cond_t refreshed;
+    bool kicked;
+    bool running;
+
+    /* Serializes starting and stopping the thread */
+    pthread_mutex_t users_lock;
+    size_t users;
+    pthread_t self;
+} cache_timer = {
+    .caches_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .refreshed = PTHREAD_COND_INITIALIZER,
+    .users_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void cache_prune(struct cache *cache);
+static bool cache_timer_start(void);
+static void cache_timer_stop(void);
+static void thread_cache_destroy_all(struct cache *cache);
+
+static struct cache_shard *cache_shard_for_key(struct cache *cache,
+                                               const char *key)
+{
+    /* FNV-1a.  The hash tables use a different function, so keys within
+     * a shard are still spread over all buckets. */
+    uint32_t hash = 2166136261u;
+
+    for (; *key; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619u;
+    }
+
+    return &cache->shards[hash & (CACHE_SHARDS - 1)];
+}
 
 struct cache *cache_create(cache_create_entry_cb create_entry_cb,
                              cache_destroy_entry_cb destroy_entry_cb,
@@ -82,23 +206,41 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
                              time_t time_to_live)
 {
     struct cache *cache;
+    size_t n_shards;
 
     assert(create_entry_cb);
     assert(destroy_entry_cb);
     assert(time_to_live > 0);
 
-    cache = calloc(1, sizeof(*cache));
+    cache = aligned_alloc(__alignof__(*cache), sizeof(*cache));
     if (!cache)
         return NULL;
+    memset(cache, 0, sizeof(*cache));
 
-    cache->hash.table = hash_str_new(free, NULL);
-    if (!cache->hash.table)
-        goto error_no_hash;
+    for (n_shards = 0; n_shards < CACHE_SHARDS; n_shards++) {
+        struct cache_shard *shard = &cache->shards[n_shards];
+
+        shard->table = hash_str_new(free, NULL);
+        if (!shard->table)
+            goto error_no_shards;
+
+        shard->flights = hash_str_new(NULL, NULL);
+        if (!shard->flights) {
+            hash_free(shard->table);
+            goto error_no_shards;
+        }
+
+        if (pthread_rwlock_init(&shard->lock, NULL)) {
+            hash_free(shard->flights);
+            hash_free(shard->table);
+            goto error_no_shards;
+        }
+    }
 
-    if (pthread_rwlock_init(&cache->hash.lock, NULL))
-        goto error_no_hash_lock;
     if (pthread_rwlock_init(&cache->queue.lock, NULL))
         goto error_no_queue_lock;
+    if (pthread_mutex_init(&cache->pruner_lock, NULL))
+        goto error_no_pruner_lock;
 
     cache->cb.create_entry = create_entry_cb;
     cache->cb.destroy_entry = destroy_entry_cb;
@@ -107,16 +249,28 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
     cache->settings.time_to_live = time_to_live;
 
     list_head_init(&cache->queue.list);
+    list_head_init(&cache->queue.clock);
+    list_head_init(&cache->timer.refresh);
 
-    lwan_job_add(cache_pruner_job, cache);
+    if (!cache_timer_start())
+        goto error_no_timer;
+    pthread_mutex_lock(&cache_timer.caches_lock);
+    list_add_tail(&cache_timer.caches, &cache->timer.node);
+    pthread_mutex_unlock(&cache_timer.caches_lock);
 
     return cache;
 
+error_no_timer:
+    pthread_mutex_destroy(&cache->pruner_lock);
+error_no_pruner_lock:
+    pthread_rwlock_destroy(&cache->queue.lock);
 error_no_queue_lock:
-    pthread_rwlock_destroy(&cache->hash.lock);
-error_no_hash_lock:
-    hash_free(cache->hash.table);
-error_no_hash:
+error_no_shards:
+    while (n_shards--) {
+        pthread_rwlock_destroy(&cache->shards[n_shards].lock);
+        hash_free(cache->shards[n_shards].flights);
+        hash_free(cache->shards[n_shards].table);
+    }
     free(cache);
 
     return NULL;
@@ -124,58 +278,405 @@ error_no_hash:
 
 void cache_destroy(struct cache *cache)
 {
+    struct cache_refresh *refresh;
+    struct cache_stats stats;
+
     assert(cache);
 
-#ifndef NDEBUG
-    lwan_status_debug("Cache stats: %d hits, %d misses, %d evictions",
-                      cache->stats.hits, cache->stats.misses,
-                      cache->stats.evicted);
-#endif
+    cache_get_stats(cache, &stats);
+    lwan_status_debug("Cache stats: %llu hits, %llu misses (%llu coalesced), "
+                      "%llu evictions",
+                      stats.hits, stats.misses, stats.coalesced,
+                      stats.evictions);
+
+    /* Once it's out of the list, the timer won't look at it anymore, but
+     * it might still be running refreshes it took from it before. */
+    pthread_mutex_lock(&cache_timer.caches_lock);
+    list_del(&cache->timer.node);
+    pthread_mutex_unlock(&cache_timer.caches_lock);
+
+    pthread_mutex_lock(&cache_timer.lock);
+    while (cache->timer.refreshing)
+        pthread_cond_wait(&cache_timer.refreshed, &cache_timer.lock);
+    pthread_mutex_unlock(&cache_timer.lock);
+
+    cache_timer_stop();
+
+    while ((refresh = list_pop(&cache->timer.refresh, struct cache_refresh,
+                               node))) {
+        cache_entry_unref(cache, refresh->entry);
+        free(refresh->key);
+        free(refresh);
+    }
+
+    if (cache->thread_cache.enabled)
+        thread_cache_destroy_all(cache);
 
-    lwan_job_del(cache_pruner_job, cache);
     cache->flags |= SHUTTING_DOWN;
-    cache_pruner_job(cache);
-    pthread_rwlock_destroy(&cache->hash.lock);
+    cache_prune(cache);
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_destroy(&cache->shards[i].lock);
+        hash_free(cache->shards[i].flights);
+        hash_free(cache->shards[i].table);
+    }
     pthread_rwlock_destroy(&cache->queue.lock);
-    hash_free(cache->hash.table);
+    pthread_mutex_destroy(&cache->pruner_lock);
     free(cache);
 }
 
-struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
-                                              const char *key, int *error)
+void cache_set_renew_entry_cb(struct cache *cache,
+                              cache_renew_entry_cb renew_entry_cb)
+{
+    cache->cb.renew_entry = renew_entry_cb;
+}
+
+void cache_set_entry_cost_cb(struct cache *cache,
+                             cache_entry_cost_cb entry_cost_cb)
+{
+    cache->cb.entry_cost = entry_cost_cb;
+}
+
+void cache_set_time_to_refresh(struct cache *cache, time_t time_to_refresh)
+{
+    cache->settings.time_to_refresh = time_to_refresh;
+}
+
+void cache_set_limits(struct cache *cache, size_t max_entries, size_t max_cost)
+{
+    cache->settings.max_entries = max_entries;
+    cache->settings.max_cost = max_cost;
+}
+
+static unsigned long long thread_cache_hits(struct cache *cache);
+
+void cache_get_stats(struct cache *cache, struct cache_stats *stats)
+{
+    *stats = (struct cache_stats){
+        .hits = thread_cache_hits(cache),
+        .evictions = ATOMIC_READ(cache->stats.evicted),
+        .entries = ATOMIC_READ(cache->queue.n_entries),
+        .cost = ATOMIC_READ(cache->queue.cost),
+    };
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        stats->hits += ATOMIC_READ(cache->shards[i].hits);
+        stats->misses += ATOMIC_READ(cache->shards[i].misses);
+        stats->coalesced += ATOMIC_READ(cache->shards[i].coalesced);
+    }
+}
+
+static void cache_timer_kick(void)
+{
+    pthread_mutex_lock(&cache_timer.lock);
+    cache_timer.kicked = true;
+    pthread_cond_signal(&cache_timer.cond);
+    pthread_mutex_unlock(&cache_timer.lock);
+}
+
+/* Must be called with the queue lock held. */
+static void cache_queue_add(struct cache *cache, struct cache_entry *entry)
+{
+    /* The timer sleeps indefinitely while there's nothing to expire;
+     * entries are added in the order they expire, so it only needs to
+     * be woken up for the first one. */
+    if (list_empty(&cache->queue.list))
+        cache_timer_kick();
+
+    list_add_tail(&cache->queue.list, &entry->entries);
+    list_add_tail(&cache->queue.clock, &entry->clock);
+    cache->queue.n_entries++;
+    cache->queue.cost += entry->cost;
+}
+
+/* Must be called with the queue lock held.  Entries being looked at by
+ * the pruner have already been taken out of the TTL queue. */
+static void cache_queue_del(struct cache *cache,
+                            struct cache_entry *entry,
+                            bool in_ttl_queue)
+{
+    if (in_ttl_queue)
+        list_del(&entry->entries);
+    list_del(&entry->clock);
+    cache->queue.n_entries--;
+    cache->queue.cost -= entry->cost;
+}
+
+static bool cache_over_limits(const struct cache *cache)
+{
+    if (cache->settings.max_entries &&
+        ATOMIC_READ(cache->queue.n_entries) > cache->settings.max_entries)
+        return true;
+
+    if (cache->settings.max_cost &&
+        ATOMIC_READ(cache->queue.cost) > cache->settings.max_cost)
+        return true;
+
+    return false;
+}
+
+/* Must be called with the shard lock held, right after removing the entry
+ * from its table. */
+static void cache_entry_removed(struct cache_entry *entry)
+{
+    ATOMIC_BITWISE(&entry->flags, or, REMOVED);
+}
+
+static void cache_entry_unref_floating(struct cache *cache,
+                                       struct cache_entry *entry)
+{
+    if (ATOMIC_INC(entry->refs) == 1) {
+        cache->cb.destroy_entry(entry, cache->cb.context);
+    } else {
+        ATOMIC_BITWISE(&entry->flags, or, FLOATING);
+        /* Decrement the reference and see if we were genuinely the last one
+         * holding it.  If so, destroy the entry.  */
+        if (!ATOMIC_DEC(entry->refs))
+            cache->cb.destroy_entry(entry, cache->cb.context);
+    }
+}
+
+static void cache_evict_over_limits(struct cache *cache)
 {
+    struct cache_entry *entry;
+    struct list_head victims;
+    unsigned evicted = 0;
+
+    if (LIKELY(!cache_over_limits(cache)))
+        return;
+
+    /* Don't wait if the pruner (or another evictor) is running: whoever
+     * holds the lock will look at the limits before releasing it. */
+    if (pthread_mutex_trylock(&cache->pruner_lock))
+        return;
+    if (UNLIKELY(pthread_rwlock_wrlock(&cache->queue.lock)))
+        goto unlock_pruner;
+
+    list_head_init(&victims);
+
+    /* CLOCK: entries used since the hand last went past them get a second
+     * chance, so a scan through many entries used only once won't push
+     * the frequently used ones out.  Each entry is looked at, at most,
+     * twice. */
+    for (size_t budget = 2 * cache->queue.n_entries;
+         budget && cache_over_limits(cache); budget--) {
+        entry = list_top(&cache->queue.clock, struct cache_entry, clock);
+        if (!entry)
+            break;
+
+        if (ATOMIC_READ(entry->flags) & REFERENCED) {
+            ATOMIC_BITWISE(&entry->flags, and, ~REFERENCED);
+            list_del(&entry->clock);
+            list_add_tail(&cache->queue.clock, &entry->clock);
+            continue;
+        }
+
+        cache_queue_del(cache, entry, true);
+        list_add_tail(&victims, &entry->clock);
+    }
+
+    pthread_rwlock_unlock(&cache->queue.lock);
+
+    /* Victims can still be found (and referenced) until they're removed
+     * from their shards; the lock order is shard first, then queue, so
+     * this can't be done while picking them. */
+    list_for_each (&victims, entry, clock) {
+        struct cache_shard *shard = cache_shard_for_key(cache, entry->key);
+
+        if (LIKELY(!pthread_rwlock_wrlock(&shard->lock))) {
+            cache_entry_removed(entry);
+            hash_del(shard->table, entry->key);
+            pthread_rwlock_unlock(&shard->lock);
+        } else {
+            lwan_status_perror("pthread_rwlock_wrlock");
+        }
+    }
+
+    pthread_mutex_unlock(&cache->pruner_lock);
+
+    while ((entry = list_pop(&victims, struct cache_entry, clock))) {
+        cache_entry_unref_floating(cache, entry);
+        evicted++;
+    }
+    ATOMIC_AAF(&cache->stats.evicted, evicted);
+    return;
+
+unlock_pruner:
+    pthread_mutex_unlock(&cache->pruner_lock);
+}
+
+static void cache_entry_ref(struct cache_entry *entry)
+{
+    ATOMIC_INC(entry->refs);
+    /* Avoid dirtying the cache line if the bit is set already. */
+    if (!(ATOMIC_READ(entry->flags) & REFERENCED))
+        ATOMIC_BITWISE(&entry->flags, or, REFERENCED);
+}
+
+static void cache_flight_unref(struct cache *cache, struct cache_flight *flight)
+{
+    if (ATOMIC_DEC(flight->refs))
+        return;
+
+    if (flight->entry)
+        cache_entry_unref(cache, flight->entry);
+    free(flight);
+}
+
+static void cache_flight_unref_defer(void *data1, void *data2)
+{
+    cache_flight_unref((struct cache *)data1, (struct cache_flight *)data2);
+}
+
+static struct cache_entry *cache_flight_wait(struct cache *cache,
+                                             struct cache_flight *flight,
+                                             struct coro *coro,
+                                             struct lwan_waiter *waiter,
+                                             int *error)
+{
+    struct cache_entry *entry;
+    size_t generation = 0;
+
+    if (coro) {
+        /* The coroutine might be killed while it's waiting. */
+        generation = coro_deferred_get_generation(coro);
+        coro_defer2(coro, cache_flight_unref_defer, cache, flight);
+    }
+
+    if (waiter) {
+        lwan_waiter_wait(waiter, coro);
+    } else {
+        /* Only threads without connections (or when the waiter couldn't
+         * be allocated) get here, and get_and_ref_entry() made sure the
+         * flight belongs to another thread, which will finish it. */
+        while (!__atomic_load_n(&flight->done, __ATOMIC_ACQUIRE))
+            sched_yield();
+    }
+
+    entry = flight->entry;
+    if (entry)
+        cache_entry_ref(entry);
+    *error = flight->error;
+
+    if (coro)
+        coro_deferred_run(coro, generation);
+    else
+        cache_flight_unref(cache, flight);
+
+    return entry;
+}
+
+/* Must be called after the flight has been removed from its shard, as no
+ * waiters can be added after that. */
+static void cache_flight_done(struct cache_flight *flight)
+{
+    struct lwan_waiter *waiter, *next;
+
+    __atomic_store_n(&flight->done, true, __ATOMIC_RELEASE);
+
+    /* Waiters can't be freed before they're woken up. */
+    list_for_each_safe (&flight->waiters, waiter, next, node)
+        lwan_waiter_wake(waiter);
+}
+
+/* Must be called with the shard lock held, so that the key isn't freed
+ * by another thread while it's copied. */
+static struct cache_refresh *cache_refresh_if_stale(struct cache *cache,
+                                                    struct cache_entry *entry)
+{
+    struct cache_refresh *refresh;
+    struct timespec now;
+
+    if (ATOMIC_READ(entry->flags) & REFRESHING)
+        return NULL;
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return NULL;
+    if (now.tv_sec < entry->time_to_die - cache->settings.time_to_live +
+                         cache->settings.time_to_refresh)
+        return NULL;
+
+    /* Only one of the readers noticing that it's stale gets to refresh it */
+    if (__sync_fetch_and_or(&entry->flags, REFRESHING) & REFRESHING)
+        return NULL;
+
+    refresh = malloc(sizeof(*refresh));
+    if (UNLIKELY(!refresh))
+        goto no_refresh;
+
+    refresh->key = strdup(entry->key);
+    if (UNLIKELY(!refresh->key)) {
+        free(refresh);
+        goto no_refresh;
+    }
+
+    ATOMIC_INC(entry->refs);
+    refresh->cache = cache;
+    refresh->entry = entry;
+
+    return refresh;
+
+no_refresh:
+    /* Let another reader try again. */
+    ATOMIC_BITWISE(&entry->flags, and, ~REFRESHING);
+    return NULL;
+}
+
+static void cache_refresh_queue(struct cache *cache,
+                                struct cache_refresh *refresh)
+{
+    pthread_mutex_lock(&cache_timer.lock);
+    list_add_tail(&cache->timer.refresh, &refresh->node);
+    cache_timer.kicked = true;
+    pthread_cond_signal(&cache_timer.cond);
+    pthread_mutex_unlock(&cache_timer.lock);
+}
+
+static struct cache_entry *get_and_ref_entry(struct cache *cache,
+                                             struct coro *coro,
+                                             const char *key,
+                                             int *error,
+                                             void *create_ctx)
+{
+    struct cache_shard *shard;
+    struct cache_flight *flight;
     struct cache_entry *entry;
     char *key_copy;
+    int r;
 
     assert(cache);
     assert(error);
     assert(key);
 
+    shard = cache_shard_for_key(cache, key);
+
+retry:
     *error = 0;
 
-    /* If the lock can't be obtained, return an error to allow, for instance,
-     * yielding from the coroutine and trying to obtain the lock at a later
-     * time. */
-    if (UNLIKELY(pthread_rwlock_tryrdlock(&cache->hash.lock) == EBUSY)) {
-        *error = EWOULDBLOCK;
+    /* Readers only contend with writers on the same shard, and those hold
+     * the lock just long enough to update its tables, so there's no point
+     * in yielding and retrying if it can't be obtained right away. */
+    r = pthread_rwlock_rdlock(&shard->lock);
+    if (UNLIKELY(r)) {
+        *error = r;
         return NULL;
     }
-    entry = hash_find(cache->hash.table, key);
+    entry = hash_find(shard->table, key);
     if (LIKELY(entry)) {
-        ATOMIC_INC(entry->refs);
-        pthread_rwlock_unlock(&cache->hash.lock);
-#ifndef NDEBUG
-        ATOMIC_INC(cache->stats.hits);
-#endif
+        struct cache_refresh *refresh = NULL;
+
+        cache_entry_ref(entry);
+        if (UNLIKELY(cache->settings.time_to_refresh))
+            refresh = cache_refresh_if_stale(cache, entry);
+        pthread_rwlock_unlock(&shard->lock);
+
+        if (refresh)
+            cache_refresh_queue(cache, refresh);
+        ATOMIC_INC(shard->hits);
         return entry;
     }
+    pthread_rwlock_unlock(&shard->lock);
 
-    /* No need to keep the hash table lock locked while the item is being created. */
-    pthread_rwlock_unlock(&cache->hash.lock);
-
-#ifndef NDEBUG
-    ATOMIC_INC(cache->stats.misses);
-#endif
+    ATOMIC_INC(shard->misses);
 
     key_copy = strdup(key);
     if (UNLIKELY(!key_copy)) {
@@ -183,25 +684,98 @@ struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
         return NULL;
     }
 
-    entry = cache->cb.create_entry(key, cache->cb.context);
-    if (UNLIKELY(!entry)) {
+    r = pthread_rwlock_wrlock(&shard->lock);
+    if (UNLIKELY(r)) {
         free(key_copy);
+        *error = r;
         return NULL;
     }
 
-    *entry = (struct cache_entry) { .key =  key_copy, .refs = 1 };
+    /* The entry might have been created, or started being created, while
+     * the shard wasn't locked. */
+    entry = hash_find(shard->table, key);
+    if (entry) {
+        cache_entry_ref(entry);
+        pthread_rwlock_unlock(&shard->lock);
+        free(key_copy);
+        return entry;
+    }
+    flight = hash_find(shard->flights, key);
+    if (flight) {
+        struct lwan_waiter *waiter = coro ? lwan_waiter_new(coro) : NULL;
+
+        /* Creating an entry can yield, if it looks up another entry that's
+         * being created (as nested cached blocks in templates do), so the
+         * flight might belong to a coroutine parked on this very thread.
+         * Spinning would keep it from ever finishing. */
+        if (UNLIKELY(!waiter && pthread_equal(flight->owner, pthread_self()))) {
+            pthread_rwlock_unlock(&shard->lock);
+            free(key_copy);
+            *error = EDEADLK;
+            return NULL;
+        }
 
-    if (pthread_rwlock_trywrlock(&cache->hash.lock) == EBUSY) {
-        /* Couldn't obtain hash write lock: instead of waiting, just return
-         * the recently-created item as a temporary item.  Might result in
-         * items not being added to the cache, though, so this might be
-         * changed back to pthread_rwlock_wrlock() again someday if this
-         * proves to be a problem.  */
-        entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
+        ATOMIC_INC(flight->refs);
+        if (waiter)
+            list_add_tail(&flight->waiters, &waiter->node);
+        pthread_rwlock_unlock(&shard->lock);
+        free(key_copy);
+
+        ATOMIC_INC(shard->coalesced);
+
+        entry = cache_flight_wait(cache, flight, coro, waiter, error);
+        if (UNLIKELY(*error == EAGAIN))
+            goto retry;
+        return entry;
+    }
+
+    flight = malloc(sizeof(*flight));
+    if (LIKELY(flight)) {
+        *flight = (struct cache_flight){.refs = 1, .owner = pthread_self()};
+        list_head_init(&flight->waiters);
+        if (UNLIKELY(hash_add_unique(shard->flights, key_copy, flight))) {
+            free(flight);
+            flight = NULL;
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    entry = cache->cb.create_entry(key, create_ctx ? create_ctx
+                                                   : cache->cb.context);
+    if (LIKELY(entry)) {
+        *entry = (struct cache_entry){.key = key_copy, .refs = 1};
+        if (cache->cb.entry_cost)
+            entry->cost = cache->cb.entry_cost(entry, cache->cb.context);
+    }
+
+    r = pthread_rwlock_wrlock(&shard->lock);
+    if (UNLIKELY(r)) {
+        lwan_status_perror("pthread_rwlock_wrlock");
+
+        if (flight) {
+            /* The flight can't be removed from the shard without its
+             * lock, so it's leaked, along with its key and the reference
+             * held here, rather than freed from under the table.  Whoever
+             * finds it gets the error instead of waiting forever. */
+            flight->error = r;
+            cache_flight_done(flight);
+            if (entry)
+                entry->flags = TEMPORARY;
+        } else if (entry) {
+            entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
+        } else {
+            free(key_copy);
+        }
         return entry;
     }
 
-    if (!hash_add_unique(cache->hash.table, entry->key, entry)) {
+    if (flight)
+        hash_del(shard->flights, key_copy);
+
+    if (UNLIKELY(!entry)) {
+        free(key_copy);
+    } else if (!hash_add_unique(shard->table, entry->key, entry)) {
         struct timespec time_to_die;
 
         if (UNLIKELY(clock_gettime(monotonic_clock_id, &time_to_die) < 0))
@@ -210,7 +784,7 @@ struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
         entry->time_to_die = time_to_die.tv_sec + cache->settings.time_to_live;
 
         if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
-            list_add_tail(&cache->queue.list, &entry->entries);
+            cache_queue_add(cache, entry);
             pthread_rwlock_unlock(&cache->queue.lock);
         } else {
             /* Key is freed when this entry is removed from the hash
@@ -220,22 +794,82 @@ struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
             /* Ensure item is removed from the hash table; otherwise,
              * another thread could potentially get another reference
              * to this entry and cause an invalid memory access. */
-            hash_del(cache->hash.table, entry->key);
+            hash_del(shard->table, entry->key);
         }
     } else {
-        /* Either there's another item with the same key (-EEXIST), or
-         * there was an error inside the hash table. In either case,
-         * just return a TEMPORARY entry so that it is destroyed the first
-         * time someone unrefs this entry. TEMPORARY entries are pretty much
-         * like FLOATING entries, but unreffing them do not use atomic
+        /* There was an error inside the hash table; just return a
+         * TEMPORARY entry so that it is destroyed the first time someone
+         * unrefs this entry. TEMPORARY entries are pretty much like
+         * FLOATING entries, but unreffing them do not use atomic
          * operations. */
         entry->flags = TEMPORARY | FREE_KEY_ON_DESTROY;
     }
 
-    pthread_rwlock_unlock(&cache->hash.lock);
+    if (flight) {
+        if (!entry) {
+            /* Whatever made the creation fail will most likely make it
+             * fail for the waiters as well. */
+            flight->error = *error;
+        } else if (entry->flags & TEMPORARY) {
+            /* TEMPORARY entries can't be shared; have the waiters try
+             * again on their own. */
+            flight->error = EAGAIN;
+        } else {
+            ATOMIC_INC(entry->refs);
+            flight->entry = entry;
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (flight) {
+        cache_flight_done(flight);
+        cache_flight_unref(cache, flight);
+    }
+
+    if (entry && !(entry->flags & TEMPORARY))
+        cache_evict_over_limits(cache);
+
     return entry;
 }
 
+struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
+                                              const char *key, int *error)
+{
+    return get_and_ref_entry(cache, NULL, key, error, NULL);
+}
+
+struct cache_entry *cache_get_and_ref_entry_with_ctx(struct cache *cache,
+                                                     const char *key,
+                                                     int *error,
+                                                     void *create_ctx)
+{
+    return get_and_ref_entry(cache, NULL, key, error, create_ctx);
+}
+
+bool cache_contains(struct cache *cache, const char *key)
+{
+    struct cache_shard *shard;
+    bool found;
+
+    assert(cache);
+    assert(key);
+
+    shard = cache_shard_for_key(cache, key);
+
+    if (UNLIKELY(pthread_rwlock_rdlock(&shard->lock)))
+        return false;
+    found = hash_find(shard->table, key) != NULL;
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (found)
+        ATOMIC_INC(shard->hits);
+    else
+        ATOMIC_INC(shard->misses);
+
+    return found;
+}
+
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry)
 {
     assert(entry);
@@ -263,28 +897,159 @@ destroy_entry:
     }
 }
 
-static bool cache_pruner_job(void *data)
+bool cache_invalidate(struct cache *cache, const char *key)
+{
+    struct cache_shard *shard;
+    struct cache_entry *entry;
+
+    assert(cache);
+    assert(key);
+
+    shard = cache_shard_for_key(cache, key);
+
+    if (UNLIKELY(pthread_mutex_lock(&cache->pruner_lock)))
+        return false;
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&shard->lock))) {
+        pthread_mutex_unlock(&cache->pruner_lock);
+        return false;
+    }
+
+    entry = hash_find(shard->table, key);
+    if (entry) {
+        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
+            cache_queue_del(cache, entry, true);
+            pthread_rwlock_unlock(&cache->queue.lock);
+        } else {
+            lwan_status_perror("pthread_rwlock_wrlock");
+            entry = NULL;
+        }
+    }
+    if (entry) {
+        cache_entry_removed(entry);
+        hash_del(shard->table, key);
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+    pthread_mutex_unlock(&cache->pruner_lock);
+
+    if (!entry)
+        return false;
+
+    cache_entry_unref_floating(cache, entry);
+    ATOMIC_INC(cache->stats.evicted);
+    return true;
+}
+
+size_t cache_invalidate_prefix(struct cache *cache, const char *prefix)
+{
+    const size_t prefix_len = strlen(prefix);
+    struct cache_entry *entry;
+    struct list_head victims;
+    size_t invalidated = 0;
+
+    assert(cache);
+    assert(prefix);
+
+    if (UNLIKELY(pthread_mutex_lock(&cache->pruner_lock)))
+        return 0;
+
+    list_head_init(&victims);
+
+    for (size_t i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct list_head shard_victims;
+        struct hash_iter iter;
+        const void *key;
+        const void *value;
+
+        if (UNLIKELY(pthread_rwlock_wrlock(&shard->lock))) {
+            lwan_status_perror("pthread_rwlock_wrlock");
+            continue;
+        }
+        if (UNLIKELY(pthread_rwlock_wrlock(&cache->queue.lock))) {
+            lwan_status_perror("pthread_rwlock_wrlock");
+            pthread_rwlock_unlock(&shard->lock);
+            continue;
+        }
+
+        /* Entries can't be removed from the table while iterating over
+         * it, so collect them first. */
+        list_head_init(&shard_victims);
+        hash_iter_init(shard->table, &iter);
+        while (hash_iter_next(&iter, &key, &value)) {
+            if (strncmp(key, prefix, prefix_len))
+                continue;
+
+            entry = (struct cache_entry *)value;
+            cache_queue_del(cache, entry, true);
+            list_add_tail(&shard_victims, &entry->clock);
+        }
+        pthread_rwlock_unlock(&cache->queue.lock);
+
+        list_for_each (&shard_victims, entry, clock) {
+            cache_entry_removed(entry);
+            hash_del(shard->table, entry->key);
+        }
+        list_append_list(&victims, &shard_victims);
+
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    pthread_mutex_unlock(&cache->pruner_lock);
+
+    while ((entry = list_pop(&victims, struct cache_entry, clock))) {
+        cache_entry_unref_floating(cache, entry);
+        invalidated++;
+    }
+    ATOMIC_AAF(&cache->stats.evicted, invalidated);
+
+    return invalidated;
+}
+
+bool cache_entry_try_ref(struct cache_entry *entry)
+{
+    assert(entry);
+
+    /* Only entries that are already referenced by the caller can be passed
+     * here.  TEMPORARY entries are destroyed on their first unref, so they
+     * can't be shared (e.g. with another thread). */
+    if (entry->flags & TEMPORARY)
+        return false;
+
+    ATOMIC_INC(entry->refs);
+    return true;
+}
+
+static void cache_prune(struct cache *cache)
 {
-    struct cache *cache = data;
     struct cache_entry *node, *next;
     struct timespec now;
     bool shutting_down = cache->flags & SHUTTING_DOWN;
     unsigned evicted = 0;
     struct list_head queue;
+    struct list_head renewed;
 
-    if (UNLIKELY(pthread_rwlock_trywrlock(&cache->queue.lock) == EBUSY))
-        return false;
+    if (UNLIKELY(pthread_mutex_lock(&cache->pruner_lock)))
+        return;
+
+    if (UNLIKELY(pthread_rwlock_wrlock(&cache->queue.lock))) {
+        pthread_mutex_unlock(&cache->pruner_lock);
+        return;
+    }
 
     /* If the queue is empty, there's nothing to do; unlock/return*/
     if (list_empty(&cache->queue.list)) {
         if (UNLIKELY(pthread_rwlock_unlock(&cache->queue.lock)))
             lwan_status_perror("pthread_rwlock_unlock");
-        return false;
+        pthread_mutex_unlock(&cache->pruner_lock);
+        return;
     }
 
     /* There are things to do; work on a local queue so the lock doesn't
      * need to be held while items are being pruned. */
     list_head_init(&queue);
+    list_head_init(&renewed);
     list_append_list(&queue, &cache->queue.list);
     list_head_init(&cache->queue.list);
 
@@ -293,97 +1058,632 @@ static bool cache_pruner_job(void *data)
         goto end;
     }
 
-    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0)) {
+    /* Not monotonic_clock_id: the timer sleeps on CLOCK_MONOTONIC, which
+     * might be ahead of the coarse clock by a few milliseconds. */
+    if (UNLIKELY(clock_gettime(CLOCK_MONOTONIC, &now) < 0)) {
         lwan_status_perror("clock_gettime");
         goto end;
     }
 
     list_for_each_safe(&queue, node, next, entries) {
-        char *key = node->key;
+        struct cache_shard *shard;
 
         if (now.tv_sec < node->time_to_die && LIKELY(!shutting_down))
             break;
 
         list_del(&node->entries);
 
-        if (UNLIKELY(pthread_rwlock_wrlock(&cache->hash.lock))) {
-            lwan_status_perror("pthread_rwlock_wrlock");
+        /* The owner of the cache might know that this entry is still
+         * fresh (e.g. because it's watching the underlying file); if so,
+         * give it another lease instead of evicting it. */
+        if (cache->cb.renew_entry && LIKELY(!shutting_down) &&
+            cache->cb.renew_entry(node, cache->cb.context)) {
+            node->time_to_die = now.tv_sec + cache->settings.time_to_live;
+            list_add_tail(&renewed, &node->entries);
             continue;
         }
 
-        hash_del(cache->hash.table, key);
+        shard = cache_shard_for_key(cache, node->key);
+        if (UNLIKELY(pthread_rwlock_wrlock(&shard->lock))) {
+            lwan_status_perror("pthread_rwlock_wrlock");
+            continue;
+        }
 
-        if (UNLIKELY(pthread_rwlock_unlock(&cache->hash.lock)))
-            lwan_status_perror("pthread_rwlock_unlock");
+        cache_entry_removed(node);
+        hash_del(shard->table, node->key);
 
-        if (ATOMIC_INC(node->refs) == 1) {
-            cache->cb.destroy_entry(node, cache->cb.context);
+        if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
+            cache_queue_del(cache, node, false);
+            pthread_rwlock_unlock(&cache->queue.lock);
         } else {
-            ATOMIC_BITWISE(&node->flags, or, FLOATING);
-            /* Decrement the reference and see if we were genuinely the last one
-             * holding it.  If so, destroy the entry.  */
-            if (!ATOMIC_DEC(node->refs))
-                cache->cb.destroy_entry(node, cache->cb.context);
+            lwan_status_perror("pthread_rwlock_wrlock");
         }
 
+        if (UNLIKELY(pthread_rwlock_unlock(&shard->lock)))
+            lwan_status_perror("pthread_rwlock_unlock");
+
+        cache_entry_unref_floating(cache, node);
+
         evicted++;
     }
 
     /* If local queue has been entirely processed, there's no need to
      * append items in the cache queue to it; just update statistics and
      * return */
-    if (list_empty(&queue))
+    if (list_empty(&queue) && list_empty(&renewed))
         goto end;
 
     /* Prepend local, unprocessed queue, to the cache queue. Since the cache
-     * item TTL is constant, items created later will be destroyed later. */
+     * item TTL is constant, items created later will be destroyed later.
+     * Renewed items got a lease starting now, so they go to the end. */
     if (LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
         list_prepend_list(&cache->queue.list, &queue);
+        list_append_list(&cache->queue.list, &renewed);
         pthread_rwlock_unlock(&cache->queue.lock);
     } else {
         lwan_status_perror("pthread_rwlock_wrlock");
     }
 
 end:
-#ifndef NDEBUG
     ATOMIC_AAF(&cache->stats.evicted, evicted);
-#endif
-    return evicted;
+    pthread_mutex_unlock(&cache->pruner_lock);
+
+    /* Entries might have been added while the pruner was running, with
+     * their evictions skipped because it held the lock. */
+    if (LIKELY(!shutting_down))
+        cache_evict_over_limits(cache);
 }
 
-static void cache_entry_unref_defer(void *data1, void *data2)
+static void cache_refresh(struct cache *cache, struct cache_refresh *refresh)
 {
-    cache_entry_unref((struct cache *)data1, (struct cache_entry *)data2);
+    struct cache_entry *stale = refresh->entry;
+    struct cache_shard *shard = cache_shard_for_key(cache, refresh->key);
+    struct cache_entry *entry;
+    struct timespec now;
+    bool replaced = false;
+
+    entry = cache->cb.create_entry(refresh->key, cache->cb.context);
+    if (!entry) {
+        free(refresh->key);
+        goto out;
+    }
+
+    /* Unlike the entries created by readers, there's nobody holding a
+     * reference to this one yet. */
+    *entry = (struct cache_entry){.key = refresh->key};
+    if (cache->cb.entry_cost)
+        entry->cost = cache->cb.entry_cost(entry, cache->cb.context);
+
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        lwan_status_critical("clock_gettime");
+    entry->time_to_die = now.tv_sec + cache->settings.time_to_live;
+
+    pthread_mutex_lock(&cache->pruner_lock);
+    if (LIKELY(!pthread_rwlock_wrlock(&shard->lock))) {
+        /* The stale entry might have been evicted or invalidated in the
+         * meantime; if so, the new entry isn't wanted either. */
+        if (hash_find(shard->table, entry->key) == stale &&
+            LIKELY(!pthread_rwlock_wrlock(&cache->queue.lock))) {
+            cache_queue_del(cache, stale, true);
+            cache_queue_add(cache, entry);
+            pthread_rwlock_unlock(&cache->queue.lock);
+
+            /* Frees the key of the stale entry. */
+            cache_entry_removed(stale);
+            hash_add(shard->table, entry->key, entry);
+            replaced = true;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&cache->pruner_lock);
+
+    if (replaced) {
+        cache_entry_unref_floating(cache, stale);
+        cache_evict_over_limits(cache);
+    } else {
+        free(entry->key);
+        cache->cb.destroy_entry(entry, cache->cb.context);
+    }
+
+out:
+    /* The stale entry is still served until it expires; if it couldn't be
+     * replaced, the next reader to notice gets to try again. */
+    if (!replaced)
+        ATOMIC_BITWISE(&stale->flags, and, ~REFRESHING);
+    cache_entry_unref(cache, stale);
+    free(refresh);
 }
 
-struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
-                                                 struct coro *coro,
-                                                 const char *key)
+static bool cache_next_expiration(struct cache *cache, struct timespec *when)
+{
+    struct cache_entry *oldest;
+    bool earlier = false;
+
+    if (UNLIKELY(pthread_rwlock_rdlock(&cache->queue.lock)))
+        return false;
+
+    oldest = list_top(&cache->queue.list, struct cache_entry, entries);
+    if (oldest && (!when->tv_sec || oldest->time_to_die < when->tv_sec)) {
+        *when = (struct timespec){.tv_sec = oldest->time_to_die};
+        earlier = true;
+    }
+
+    pthread_rwlock_unlock(&cache->queue.lock);
+
+    return earlier;
+}
+
+/* Moves the pending refreshes of every cache to refreshes, so that they
+ * can run without holding any lock.  Must be called with caches_lock
+ * held; caches can't be destroyed until their refreshes are done. */
+static void cache_refresh_take_all(struct list_head *refreshes)
 {
-    for (int tries = GET_AND_REF_TRIES; tries; tries--) {
-        int error;
-        struct cache_entry *ce = cache_get_and_ref_entry(cache, key, &error);
-
-        if (LIKELY(ce)) {
-            /*
-             * This is deferred here so that, if the coroutine is killed
-             * after it has been yielded, this cache entry is properly
-             * freed.
-             */
-            coro_defer2(coro, cache_entry_unref_defer, cache, ce);
-            return ce;
+    struct cache_refresh *refresh;
+    struct cache *cache;
+
+    pthread_mutex_lock(&cache_timer.lock);
+    list_for_each (&cache_timer.caches, cache, timer.node) {
+        while ((refresh = list_pop(&cache->timer.refresh, struct cache_refresh,
+                                   node))) {
+            list_add_tail(refreshes, &refresh->node);
+            cache->timer.refreshing++;
         }
+    }
+    pthread_mutex_unlock(&cache_timer.lock);
+}
 
-        /*
-         * If the cache would block while reading its hash table, yield and
-         * try again. On any other error, just return NULL.
-         */
-        if (error == EWOULDBLOCK) {
-            coro_yield(coro, CONN_CORO_YIELD);
-        } else {
+static void cache_refresh_done(struct cache *cache)
+{
+    pthread_mutex_lock(&cache_timer.lock);
+    if (!--cache->timer.refreshing)
+        pthread_cond_broadcast(&cache_timer.refreshed);
+    pthread_mutex_unlock(&cache_timer.lock);
+}
+
+static void *cache_timer_thread(void *data __attribute__((unused)))
+{
+    lwan_set_thread_name("cache");
+
+    while (true) {
+        struct cache_refresh *refresh;
+        struct list_head refreshes;
+        struct timespec when = {};
+        struct cache *cache;
+        bool expires = false;
+
+        list_head_init(&refreshes);
+
+        /* The queue locks can't be taken while holding the timer lock, as
+         * the timer is kicked with a queue locked.  If an entry is added
+         * between these two points, the timer won't sleep. */
+        pthread_mutex_lock(&cache_timer.caches_lock);
+        list_for_each (&cache_timer.caches, cache, timer.node)
+            expires |= cache_next_expiration(cache, &when);
+        pthread_mutex_unlock(&cache_timer.caches_lock);
+
+        pthread_mutex_lock(&cache_timer.lock);
+        if (cache_timer.running && !cache_timer.kicked) {
+            if (expires)
+                pthread_cond_timedwait(&cache_timer.cond, &cache_timer.lock,
+                                       &when);
+            else
+                pthread_cond_wait(&cache_timer.cond, &cache_timer.lock);
+        }
+        cache_timer.kicked = false;
+        if (!cache_timer.running) {
+            pthread_mutex_unlock(&cache_timer.lock);
             break;
         }
+        pthread_mutex_unlock(&cache_timer.lock);
+
+        pthread_mutex_lock(&cache_timer.caches_lock);
+        cache_refresh_take_all(&refreshes);
+        list_for_each (&cache_timer.caches, cache, timer.node)
+            cache_prune(cache);
+        pthread_mutex_unlock(&cache_timer.caches_lock);
+
+        /* Rebuilding entries can take a while, and shouldn't keep caches
+         * from being created or destroyed meanwhile. */
+        while ((refresh = list_pop(&refreshes, struct cache_refresh, node))) {
+            cache = refresh->cache;
+            cache_refresh(cache, refresh);
+            cache_refresh_done(cache);
+        }
     }
 
     return NULL;
 }
+
+/* The thread is started with the first cache and stopped with the last
+ * one, so that programs without caches don't get it. */
+static bool cache_timer_start(void)
+{
+    pthread_condattr_t condattr;
+    bool started = false;
+
+    pthread_mutex_lock(&cache_timer.users_lock);
+
+    if (cache_timer.users) {
+        started = true;
+        goto out;
+    }
+
+    if (pthread_condattr_init(&condattr))
+        goto out;
+    /* Expiration times are taken from the monotonic clock */
+    if (pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&cache_timer.cond, &condattr)) {
+        pthread_condattr_destroy(&condattr);
+        goto out;
+    }
+    pthread_condattr_destroy(&condattr);
+
+    /* Every cache left the list before the previous thread stopped. */
+    list_head_init(&cache_timer.caches);
+    cache_timer.kicked = false;
+    cache_timer.running = true;
+    if (pthread_create(&cache_timer.self, NULL, cache_timer_thread, NULL)) {
+        pthread_cond_destroy(&cache_timer.cond);
+        goto out;
+    }
+
+    started = true;
+
+out:
+    if (started)
+        cache_timer.users++;
+    pthread_mutex_unlock(&cache_timer.users_lock);
+
+    return started;
+}
+
+static void cache_timer_stop(void)
+{
+    pthread_mutex_lock(&cache_timer.users_lock);
+
+    if (!--cache_timer.users) {
+        pthread_mutex_lock(&cache_timer.lock);
+        cache_timer.running = false;
+        pthread_cond_signal(&cache_timer.cond);
+        pthread_mutex_unlock(&cache_timer.lock);
+
+        pthread_join(cache_timer.self, NULL);
+        pthread_cond_destroy(&cache_timer.cond);
+    }
+
+    pthread_mutex_unlock(&cache_timer.users_lock);
+}
+
+static void cache_entry_unref_defer(void *data1, void *data2)
+{
+    cache_entry_unref((struct cache *)data1, (struct cache_entry *)data2);
+}
+
+/* Thread caches are small, direct-mapped tables, one per cache per worker
+ * thread, sitting in front of the shards.  Each slot keeps a reference to
+ * an entry, which is lent to requests on the same thread without touching
+ * anything shared.  Slots are only trusted while their entry is still in
+ * the shared table. */
+struct thread_cache_slot {
+    struct thread_cache *tc;
+    struct cache_entry *entry; /* Referenced by the slot */
+    time_t time_to_refresh;
+    unsigned int lent; /* To requests on this thread */
+    bool retired;      /* Not in the table anymore; free once not lent */
+    uint64_t hash;
+    size_t len;
+    char key[];
+};
+
+struct thread_cache {
+    struct list_node thread_node; /* In thread_caches */
+    struct list_node cache_node;  /* In cache->thread_cache.list */
+    struct cache *cache;
+    unsigned long long hits; /* Only written by its thread */
+    struct thread_cache_slot *slots[THREAD_CACHE_SLOTS];
+};
+
+static __thread struct list_head thread_caches;
+
+static void thread_cache_destroy(void *data);
+
+bool cache_set_thread_cache(struct cache *cache, bool enabled)
+{
+    if (enabled == cache->thread_cache.enabled)
+        return true;
+
+    if (!enabled) {
+        thread_cache_destroy_all(cache);
+        cache->thread_cache.enabled = false;
+        return true;
+    }
+
+    if (pthread_mutex_init(&cache->thread_cache.lock, NULL))
+        return false;
+    if (pthread_key_create(&cache->thread_cache.key, thread_cache_destroy)) {
+        pthread_mutex_destroy(&cache->thread_cache.lock);
+        return false;
+    }
+
+    list_head_init(&cache->thread_cache.list);
+    cache->thread_cache.enabled = true;
+    return true;
+}
+
+static unsigned long long thread_cache_hits(struct cache *cache)
+{
+    unsigned long long hits = ATOMIC_READ(cache->stats.thread_hits);
+    struct thread_cache *tc;
+
+    if (!cache->thread_cache.enabled)
+        return hits;
+
+    pthread_mutex_lock(&cache->thread_cache.lock);
+    list_for_each (&cache->thread_cache.list, tc, cache_node)
+        hits += ATOMIC_READ(tc->hits);
+    pthread_mutex_unlock(&cache->thread_cache.lock);
+
+    return hits;
+}
+
+static void thread_cache_slot_free(struct thread_cache_slot *slot)
+{
+    cache_entry_unref(slot->tc->cache, slot->entry);
+    free(slot);
+}
+
+static void thread_cache_slot_retire(struct thread_cache_slot *slot)
+{
+    if (slot->lent)
+        slot->retired = true;
+    else
+        thread_cache_slot_free(slot);
+}
+
+static void thread_cache_slot_return(void *data)
+{
+    struct thread_cache_slot *slot = data;
+
+    if (!--slot->lent && slot->retired)
+        thread_cache_slot_free(slot);
+}
+
+static bool thread_cache_slot_is_removed(const struct thread_cache_slot *slot)
+{
+    return ATOMIC_READ(slot->entry->flags) & REMOVED;
+}
+
+static void thread_cache_flush(struct thread_cache *tc, bool only_removed)
+{
+    for (size_t i = 0; i < THREAD_CACHE_SLOTS; i++) {
+        struct thread_cache_slot *slot = tc->slots[i];
+
+        if (slot && (!only_removed || thread_cache_slot_is_removed(slot))) {
+            thread_cache_slot_retire(slot);
+            tc->slots[i] = NULL;
+        }
+    }
+}
+
+/* Called when a thread exits; caches outlive the threads using them. */
+static void thread_cache_destroy(void *data)
+{
+    struct thread_cache *tc = data;
+    struct cache *cache = tc->cache;
+
+    thread_cache_flush(tc, false);
+    list_del(&tc->thread_node);
+
+    pthread_mutex_lock(&cache->thread_cache.lock);
+    list_del(&tc->cache_node);
+    cache->stats.thread_hits += tc->hits;
+    pthread_mutex_unlock(&cache->thread_cache.lock);
+
+    free(tc);
+}
+
+/* Thread caches of threads that are still around when the cache is
+ * destroyed (e.g. the one destroying it) have to be freed here, as the
+ * destructor won't be called after the key is deleted. */
+static void thread_cache_destroy_all(struct cache *cache)
+{
+    struct thread_cache *tc, *next;
+
+    pthread_key_delete(cache->thread_cache.key);
+
+    pthread_mutex_lock(&cache->thread_cache.lock);
+    list_for_each_safe (&cache->thread_cache.list, tc, next, cache_node) {
+        thread_cache_flush(tc, false);
+        list_del(&tc->thread_node);
+        list_del(&tc->cache_node);
+        free(tc);
+    }
+    pthread_mutex_unlock(&cache->thread_cache.lock);
+
+    pthread_mutex_destroy(&cache->thread_cache.lock);
+}
+
+static struct thread_cache *thread_cache_get(struct cache *cache)
+{
+    struct thread_cache *tc = pthread_getspecific(cache->thread_cache.key);
+
+    if (LIKELY(tc))
+        return tc;
+
+    tc = calloc(1, sizeof(*tc));
+    if (UNLIKELY(!tc))
+        return NULL;
+    if (UNLIKELY(pthread_setspecific(cache->thread_cache.key, tc))) {
+        free(tc);
+        return NULL;
+    }
+
+    if (!thread_caches.n.next)
+        list_head_init(&thread_caches);
+    list_add_tail(&thread_caches, &tc->thread_node);
+
+    pthread_mutex_lock(&cache->thread_cache.lock);
+    list_add_tail(&cache->thread_cache.list, &tc->cache_node);
+    pthread_mutex_unlock(&cache->thread_cache.lock);
+
+    tc->cache = cache;
+    return tc;
+}
+
+static uint64_t thread_cache_hash(const char *key, size_t *len)
+{
+    /* FNV-1a, 64-bit */
+    uint64_t hash = UINT64_C(14695981039346656037);
+    const char *p;
+
+    for (p = key; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= UINT64_C(1099511628211);
+    }
+
+    *len = (size_t)(p - key);
+    return hash;
+}
+
+static struct thread_cache_slot **
+thread_cache_slot_for_hash(struct thread_cache *tc, uint64_t hash)
+{
+    return &tc->slots[hash >> (64 - THREAD_CACHE_SLOTS_BITS)];
+}
+
+static bool thread_cache_slot_is_fresh(const struct thread_cache_slot *slot)
+{
+    struct timespec now;
+
+    if (UNLIKELY(thread_cache_slot_is_removed(slot)))
+        return false;
+    if (!slot->time_to_refresh)
+        return true;
+
+    /* Let the shared cache see that it's time to refresh this entry. */
+    if (UNLIKELY(clock_gettime(monotonic_clock_id, &now) < 0))
+        return false;
+    return now.tv_sec < slot->time_to_refresh;
+}
+
+static struct cache_entry *thread_cache_lend(struct thread_cache_slot *slot,
+                                             struct coro *coro)
+{
+    struct cache_entry *entry = slot->entry;
+
+    slot->lent++;
+    coro_defer(coro, thread_cache_slot_return, slot);
+
+    return entry;
+}
+
+static struct cache_entry *
+thread_cache_get_entry(struct cache *cache,
+                       struct coro *coro,
+                       const char *key,
+                       void *create_ctx)
+{
+    struct thread_cache_slot **slot_ptr, *slot;
+    struct thread_cache *tc;
+    struct cache_entry *entry;
+    uint64_t hash;
+    size_t len;
+    int error;
+
+    tc = cache->thread_cache.enabled ? thread_cache_get(cache) : NULL;
+    if (!tc) {
+        entry = get_and_ref_entry(cache, coro, key, &error, create_ctx);
+        if (UNLIKELY(!entry))
+            return NULL;
+        goto no_slot;
+    }
+
+    hash = thread_cache_hash(key, &len);
+    slot_ptr = thread_cache_slot_for_hash(tc, hash);
+    slot = *slot_ptr;
+    if (LIKELY(slot && slot->hash == hash && slot->len == len &&
+               !memcmp(slot->key, key, len) &&
+               thread_cache_slot_is_fresh(slot))) {
+        /* Avoid dirtying the cache line if the bit is set already. */
+        if (!(ATOMIC_READ(slot->entry->flags) & REFERENCED))
+            ATOMIC_BITWISE(&slot->entry->flags, or, REFERENCED);
+
+        tc->hits++;
+        return thread_cache_lend(slot, coro);
+    }
+
+    entry = get_and_ref_entry(cache, coro, key, &error, create_ctx);
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    /* The entry might have been removed from the table while the lookup
+     * yielded.  TEMPORARY entries can't be shared, not even with the
+     * slot. */
+    if (UNLIKELY(ATOMIC_READ(entry->flags) & (TEMPORARY | REMOVED)))
+        goto no_slot;
+
+    slot = malloc(sizeof(*slot) + len + 1);
+    if (UNLIKELY(!slot))
+        goto no_slot;
+
+    /* The reference taken by the lookup is handed over to the slot. */
+    *slot = (struct thread_cache_slot){
+        .tc = tc,
+        .entry = entry,
+        .hash = hash,
+        .len = len,
+    };
+    if (cache->settings.time_to_refresh) {
+        slot->time_to_refresh = entry->time_to_die -
+                                cache->settings.time_to_live +
+                                cache->settings.time_to_refresh;
+    }
+    memcpy(slot->key, key, len + 1);
+
+    if (*slot_ptr)
+        thread_cache_slot_retire(*slot_ptr);
+    *slot_ptr = slot;
+
+    return thread_cache_lend(slot, coro);
+
+no_slot:
+    coro_defer2(coro, cache_entry_unref_defer, cache, entry);
+    return entry;
+}
+
+void cache_thread_sweep(void)
+{
+    struct thread_cache *tc;
+
+    if (!thread_caches.n.next)
+        return;
+
+    list_for_each (&thread_caches, tc, thread_node)
+        thread_cache_flush(tc, true);
+}
+
+void cache_thread_release(void)
+{
+    struct thread_cache *tc;
+
+    if (!thread_caches.n.next)
+        return;
+
+    list_for_each (&thread_caches, tc, thread_node)
+        thread_cache_flush(tc, false);
+}
+
+struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
+                                                 struct coro *coro,
+                                                 const char *key)
+{
+    return thread_cache_get_entry(cache, coro, key, NULL);
+}
+
+struct cache_entry *cache_coro_get_and_ref_entry_with_ctx(struct cache *cache,
+                                                          struct coro *coro,
+                                                          const char *key,
+                                                          void *create_ctx)
+{
+    return thread_cache_get_entry(cache, coro, key, create_ctx);
+}
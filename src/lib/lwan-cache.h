@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <time.h>
 
 #include "list.h"
@@ -26,16 +28,31 @@
 
 struct cache_entry {
   struct list_node entries;
+  struct list_node clock;
   char *key;
+  size_t cost;
   int refs;
   unsigned flags;
   time_t time_to_die;
 };
 
+struct cache_stats {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long coalesced; /* Misses that waited for another one */
+  unsigned long long evictions;
+  size_t entries;
+  size_t cost;
+};
+
 typedef struct cache_entry *(*cache_create_entry_cb)(
       const char *key, void *context);
 typedef void (*cache_destroy_entry_cb)(
       struct cache_entry *entry, void *context);
+typedef bool (*cache_renew_entry_cb)(
+      struct cache_entry *entry, void *context);
+typedef size_t (*cache_entry_cost_cb)(
+      struct cache_entry *entry, void *context);
 
 struct cache;
 
@@ -44,9 +61,43 @@ struct cache *cache_create(cache_create_entry_cb create_entry_cb,
       void *cb_context,
       time_t time_to_live);
 void cache_destroy(struct cache *cache);
+void cache_set_renew_entry_cb(struct cache *cache,
+      cache_renew_entry_cb renew_entry_cb);
+void cache_set_entry_cost_cb(struct cache *cache,
+      cache_entry_cost_cb entry_cost_cb);
+void cache_set_time_to_refresh(struct cache *cache, time_t time_to_refresh);
+void cache_set_limits(struct cache *cache, size_t max_entries,
+      size_t max_cost);
+void cache_get_stats(struct cache *cache, struct cache_stats *stats);
+
+/* If enabled, entries obtained with cache_coro_get_and_ref_entry() are also
+ * kept in a small per-thread table, so that subsequent lookups from that
+ * thread don't touch anything shared.  This costs a pthread key per cache
+ * and keeps entries alive until threads let go of them, so it's meant for
+ * hot caches, and must be set before the cache is used.  Threads using it
+ * must call cache_thread_sweep() every now and then, and
+ * cache_thread_release() before they go idle or exit; caches must outlive
+ * them. */
+bool cache_set_thread_cache(struct cache *cache, bool enabled);
+void cache_thread_sweep(void);
+void cache_thread_release(void);
 
 struct cache_entry *cache_get_and_ref_entry(struct cache *cache,
       const char *key, int *error);
+/* Whether an entry for key exists, without creating it if it doesn't. */
+bool cache_contains(struct cache *cache, const char *key);
 void cache_entry_unref(struct cache *cache, struct cache_entry *entry);
+bool cache_entry_try_ref(struct cache_entry *entry);
+bool cache_invalidate(struct cache *cache, const char *key);
+size_t cache_invalidate_prefix(struct cache *cache, const char *prefix);
 struct cache_entry *cache_coro_get_and_ref_entry(struct cache *cache,
       struct coro *coro, const char *key);
+
+/* Like the functions above, but if the entry has to be created, create_ctx
+ * is passed to create_entry_cb instead of the context given to
+ * cache_create().  Entries being refreshed are still created with the
+ * latter. */
+struct cache_entry *cache_get_and_ref_entry_with_ctx(struct cache *cache,
+      const char *key, int *error, void *create_ctx);
+struct cache_entry *cache_coro_get_and_ref_entry_with_ctx(struct cache *cache,
+      struct coro *coro, const char *key, void *create_ctx);
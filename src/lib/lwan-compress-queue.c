@@ -0,0 +1,219 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2019 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lwan-private.h"
+#include "list.h"
+
+/* Maximum number of pending jobs.  Jobs that don't fit are rejected; the
+ * caller keeps serving whatever it has until it tries again. */
+#define MAX_PENDING_JOBS 256
+
+struct compress_job {
+    struct list_node jobs;
+    void (*cb)(void *data, bool cancelled);
+    void *data;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head jobs;
+    unsigned int n_jobs;
+
+    pthread_t *threads;
+    unsigned int n_threads;
+
+    /* Percentage of a CPU each worker may use; 100 disables throttling. */
+    unsigned int cpu_budget;
+
+    /* Written with the lock held; read without it only as a hint. */
+    bool running;
+} queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static struct timespec thread_cpu_time(void)
+{
+    struct timespec ts;
+
+    if (UNLIKELY(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0))
+        return (struct timespec){};
+
+    return ts;
+}
+
+static void throttle(const struct timespec *before)
+{
+    const struct timespec after = thread_cpu_time();
+    long long used_ns, sleep_ns;
+
+    if (queue.cpu_budget >= 100)
+        return;
+
+    used_ns = (after.tv_sec - before->tv_sec) * 1000000000ll +
+              (after.tv_nsec - before->tv_nsec);
+    if (used_ns <= 0)
+        return;
+
+    /* Sleep long enough so that, over the lifetime of the job plus the
+     * sleep, this thread used at most cpu_budget% of a CPU. */
+    sleep_ns = used_ns * (100 - queue.cpu_budget) / queue.cpu_budget;
+
+    struct timespec ts = {
+        .tv_sec = sleep_ns / 1000000000ll,
+        .tv_nsec = sleep_ns % 1000000000ll,
+    };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+static void *compress_queue_loop(void *data __attribute__((unused)))
+{
+    lwan_set_thread_name("compress");
+
+    pthread_mutex_lock(&queue.lock);
+    while (true) {
+        struct compress_job *job;
+
+        while (queue.running && list_empty(&queue.jobs))
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        if (!queue.running)
+            break;
+
+        job = list_pop(&queue.jobs, struct compress_job, jobs);
+        queue.n_jobs--;
+        pthread_mutex_unlock(&queue.lock);
+
+        const struct timespec before = thread_cpu_time();
+        job->cb(job->data, false);
+        free(job);
+        throttle(&before);
+
+        pthread_mutex_lock(&queue.lock);
+    }
+    pthread_mutex_unlock(&queue.lock);
+
+    return NULL;
+}
+
+bool lwan_compress_queue_add(void (*cb)(void *data, bool cancelled),
+                             void *data)
+{
+    struct compress_job *job;
+
+    if (!lwan_compress_queue_enabled())
+        return false;
+
+    job = malloc(sizeof(*job));
+    if (UNLIKELY(!job))
+        return false;
+
+    job->cb = cb;
+    job->data = data;
+
+    pthread_mutex_lock(&queue.lock);
+    if (UNLIKELY(!queue.running || queue.n_jobs >= MAX_PENDING_JOBS)) {
+        pthread_mutex_unlock(&queue.lock);
+        free(job);
+        return false;
+    }
+    list_add_tail(&queue.jobs, &job->jobs);
+    queue.n_jobs++;
+    pthread_cond_signal(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    return true;
+}
+
+bool lwan_compress_queue_enabled(void)
+{
+    return __atomic_load_n(&queue.running, __ATOMIC_ACQUIRE);
+}
+
+void lwan_compress_queue_init(unsigned int n_threads, unsigned int cpu_budget)
+{
+    if (queue.threads || !n_threads)
+        return;
+
+    lwan_status_debug("Initializing %u background compression threads",
+                      n_threads);
+
+    queue.threads = calloc(n_threads, sizeof(*queue.threads));
+    if (!queue.threads)
+        lwan_status_critical_perror("calloc");
+
+    list_head_init(&queue.jobs);
+    queue.cpu_budget = (cpu_budget && cpu_budget < 100) ? cpu_budget : 100;
+
+    pthread_mutex_lock(&queue.lock);
+    __atomic_store_n(&queue.running, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (queue.n_threads = 0; queue.n_threads < n_threads; queue.n_threads++) {
+        pthread_t *self = &queue.threads[queue.n_threads];
+
+        if (pthread_create(self, NULL, compress_queue_loop, NULL))
+            lwan_status_critical_perror("pthread_create");
+
+#ifdef SCHED_BATCH
+        struct sched_param sched_param = {.sched_priority = 0};
+        if (pthread_setschedparam(*self, SCHED_BATCH, &sched_param) < 0)
+            lwan_status_perror("pthread_setschedparam");
+#endif /* SCHED_BATCH */
+    }
+}
+
+void lwan_compress_queue_shutdown(void)
+{
+    struct compress_job *job, *next;
+
+    if (!queue.threads)
+        return;
+
+    lwan_status_debug("Shutting down background compression threads");
+
+    pthread_mutex_lock(&queue.lock);
+    __atomic_store_n(&queue.running, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (unsigned int i = 0; i < queue.n_threads; i++)
+        pthread_join(queue.threads[i], NULL);
+
+    /* Give pending jobs a chance to release whatever they're holding. */
+    list_for_each_safe(&queue.jobs, job, next, jobs) {
+        list_del(&job->jobs);
+        job->cb(job->data, true);
+        free(job);
+    }
+    queue.n_jobs = 0;
+
+    free(queue.threads);
+    queue.threads = NULL;
+    queue.n_threads = 0;
+}
@@ -0,0 +1,649 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#include "lwan-private.h"
+
+#if defined(HAVE_BROTLI)
+#include <brotli/encode.h>
+#endif
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+/* Idle compressors kept around per thread.  Each zlib stream holds a few
+ * hundred kilobytes, so don't let a burst of streaming responses pin too
+ * much memory after it's gone. */
+#define MAX_IDLE_COMPRESSORS 8
+
+enum compressor_type {
+    COMPRESSOR_DEFLATE,
+    COMPRESSOR_GZIP,
+#if defined(HAVE_ZSTD)
+    COMPRESSOR_ZSTD,
+#endif
+};
+
+enum compress_mode {
+    COMPRESS_CONTINUE,
+    COMPRESS_FLUSH,
+    COMPRESS_FINISH,
+};
+
+struct lwan_compressor {
+    struct lwan_compressor *next;
+    struct lwan_thread *thread;
+
+    enum compressor_type type;
+    int level;
+
+    union {
+        z_stream zlib;
+#if defined(HAVE_ZSTD)
+        ZSTD_CCtx *zstd;
+#endif
+    };
+
+    /* Output for streaming responses; kept between chunks. */
+    char *out;
+    size_t out_size;
+};
+
+static const char *compressor_encoding[] = {
+    [COMPRESSOR_DEFLATE] = "deflate",
+    [COMPRESSOR_GZIP] = "gzip",
+#if defined(HAVE_ZSTD)
+    [COMPRESSOR_ZSTD] = "zstd",
+#endif
+};
+
+static void compressor_destroy(struct lwan_compressor *c)
+{
+#if defined(HAVE_ZSTD)
+    if (c->type == COMPRESSOR_ZSTD)
+        ZSTD_freeCCtx(c->zstd);
+    else
+#endif
+        deflateEnd(&c->zlib);
+
+    free(c->out);
+    free(c);
+}
+
+static bool compressor_reset(struct lwan_compressor *c)
+{
+#if defined(HAVE_ZSTD)
+    if (c->type == COMPRESSOR_ZSTD) {
+        /* Keeps the parameters, such as the compression level. */
+        return !ZSTD_isError(
+            ZSTD_CCtx_reset(c->zstd, ZSTD_reset_session_only));
+    }
+#endif
+
+    return deflateReset(&c->zlib) == Z_OK;
+}
+
+static bool compressor_init(struct lwan_compressor *c)
+{
+#if defined(HAVE_ZSTD)
+    if (c->type == COMPRESSOR_ZSTD) {
+        c->zstd = ZSTD_createCCtx();
+        if (UNLIKELY(!c->zstd))
+            return false;
+
+        if (UNLIKELY(ZSTD_isError(ZSTD_CCtx_setParameter(
+                c->zstd, ZSTD_c_compressionLevel, c->level)))) {
+            ZSTD_freeCCtx(c->zstd);
+            return false;
+        }
+
+        return true;
+    }
+#endif
+
+    /* 15 is the default window size; adding 16 to it makes zlib write
+     * a gzip header and trailer instead of a zlib one. */
+    return deflateInit2(&c->zlib, c->level, Z_DEFLATED,
+                        c->type == COMPRESSOR_GZIP ? 15 + 16 : 15, 8,
+                        Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+static struct lwan_compressor *compressor_acquire(struct lwan_thread *t,
+                                                  enum compressor_type type,
+                                                  int level)
+{
+    struct lwan_compressor **prev = &t->compressors;
+    struct lwan_compressor *c;
+
+    for (c = t->compressors; c; prev = &c->next, c = c->next) {
+        if (c->type == type && c->level == level) {
+            *prev = c->next;
+
+            if (UNLIKELY(!compressor_reset(c))) {
+                compressor_destroy(c);
+                return NULL;
+            }
+
+            return c;
+        }
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (UNLIKELY(!c))
+        return NULL;
+
+    c->thread = t;
+    c->type = type;
+    c->level = level;
+
+    if (UNLIKELY(!compressor_init(c))) {
+        free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+static void compressor_release(struct lwan_compressor *c)
+{
+    struct lwan_thread *t = c->thread;
+    struct lwan_compressor *iter;
+    int idle = 0;
+
+    for (iter = t->compressors; iter; iter = iter->next) {
+        if (++idle >= MAX_IDLE_COMPRESSORS) {
+            compressor_destroy(c);
+            return;
+        }
+    }
+
+    c->next = t->compressors;
+    t->compressors = c;
+}
+
+void lwan_compressor_pool_free(struct lwan_thread *t)
+{
+    struct lwan_compressor *c = t->compressors;
+
+    while (c) {
+        struct lwan_compressor *next = c->next;
+
+        compressor_destroy(c);
+        c = next;
+    }
+
+    t->compressors = NULL;
+}
+
+static size_t compressor_bound(struct lwan_compressor *c, size_t len)
+{
+#if defined(HAVE_ZSTD)
+    if (c->type == COMPRESSOR_ZSTD)
+        return ZSTD_compressBound(len);
+#endif
+
+    return deflateBound(&c->zlib, len);
+}
+
+static bool grow_output(char **out, size_t *out_size)
+{
+    const size_t new_size = *out_size ? *out_size * 2 : DEFAULT_BUFFER_SIZE;
+    char *new_out;
+
+    if (UNLIKELY(new_size > UINT_MAX))
+        return false;
+
+    new_out = realloc(*out, new_size);
+    if (UNLIKELY(!new_out))
+        return false;
+
+    *out = new_out;
+    *out_size = new_size;
+
+    return true;
+}
+
+static ssize_t deflate_iov(z_stream *stream,
+                           const struct iovec *iov,
+                           size_t n_iov,
+                           enum compress_mode mode,
+                           char **out,
+                           size_t *out_size,
+                           bool growable)
+{
+    static const int flush_modes[] = {
+        [COMPRESS_CONTINUE] = Z_NO_FLUSH,
+        [COMPRESS_FLUSH] = Z_SYNC_FLUSH,
+        [COMPRESS_FINISH] = Z_FINISH,
+    };
+
+    stream->next_out = (Bytef *)*out;
+    stream->avail_out = (uInt)*out_size;
+
+    for (size_t i = 0; i <= n_iov; i++) {
+        const int flush = flush_modes[i == n_iov ? mode : COMPRESS_CONTINUE];
+        int ret;
+
+        if (i < n_iov) {
+            if (!iov[i].iov_len)
+                continue;
+
+            stream->next_in = iov[i].iov_base;
+            stream->avail_in = (uInt)iov[i].iov_len;
+        } else {
+            stream->next_in = NULL;
+            stream->avail_in = 0;
+        }
+
+        while (true) {
+            if (!stream->avail_out) {
+                const size_t used = *out_size;
+
+                if (UNLIKELY(!growable || !grow_output(out, out_size)))
+                    return -1;
+
+                stream->next_out = (Bytef *)*out + used;
+                stream->avail_out = (uInt)(*out_size - used);
+            }
+
+            ret = deflate(stream, flush);
+            if (UNLIKELY(ret == Z_STREAM_ERROR))
+                return -1;
+
+            if (stream->avail_in)
+                continue;
+            if (flush == Z_FINISH && ret != Z_STREAM_END)
+                continue;
+            if (flush == Z_SYNC_FLUSH && !stream->avail_out)
+                continue;
+
+            break;
+        }
+    }
+
+    return (ssize_t)(*out_size - stream->avail_out);
+}
+
+#if defined(HAVE_ZSTD)
+static ssize_t zstd_iov(ZSTD_CCtx *cctx,
+                        const struct iovec *iov,
+                        size_t n_iov,
+                        enum compress_mode mode,
+                        char **out,
+                        size_t *out_size,
+                        bool growable)
+{
+    static const ZSTD_EndDirective end_directives[] = {
+        [COMPRESS_CONTINUE] = ZSTD_e_continue,
+        [COMPRESS_FLUSH] = ZSTD_e_flush,
+        [COMPRESS_FINISH] = ZSTD_e_end,
+    };
+    ZSTD_outBuffer output = {.dst = *out, .size = *out_size};
+
+    for (size_t i = 0; i <= n_iov; i++) {
+        const ZSTD_EndDirective end =
+            end_directives[i == n_iov ? mode : COMPRESS_CONTINUE];
+        ZSTD_inBuffer input = {};
+        size_t remaining;
+
+        if (i < n_iov) {
+            if (!iov[i].iov_len)
+                continue;
+
+            input.src = iov[i].iov_base;
+            input.size = iov[i].iov_len;
+        }
+
+        while (true) {
+            if (output.pos == output.size) {
+                if (UNLIKELY(!growable || !grow_output(out, out_size)))
+                    return -1;
+
+                output.dst = *out;
+                output.size = *out_size;
+            }
+
+            remaining = ZSTD_compressStream2(cctx, &output, &input, end);
+            if (UNLIKELY(ZSTD_isError(remaining)))
+                return -1;
+
+            if (input.pos < input.size)
+                continue;
+            if (end != ZSTD_e_continue && remaining)
+                continue;
+
+            break;
+        }
+    }
+
+    return (ssize_t)output.pos;
+}
+#endif
+
+/* Compresses all of `iov` into (*out, *out_size), growing it with realloc()
+ * if `growable`.  Returns the number of bytes written, or -1 on error.
+ * `mode` only applies after the last vector element. */
+static ssize_t compress_iov(struct lwan_compressor *c,
+                            const struct iovec *iov,
+                            size_t n_iov,
+                            enum compress_mode mode,
+                            char **out,
+                            size_t *out_size,
+                            bool growable)
+{
+#if defined(HAVE_ZSTD)
+    if (c->type == COMPRESSOR_ZSTD)
+        return zstd_iov(c->zstd, iov, n_iov, mode, out, out_size, growable);
+#endif
+
+    return deflate_iov(&c->zlib, iov, n_iov, mode, out, out_size, growable);
+}
+
+static bool mime_type_is_compressible(const char *mime_types,
+                                      const char *mime_type)
+{
+    const size_t mime_type_len = strcspn(mime_type, "; ");
+
+    while (*mime_types) {
+        const size_t len = strcspn(mime_types, ",");
+
+        if (len >= 2 && !strncmp(mime_types + len - 2, "/*", 2)) {
+            if (!strncasecmp(mime_type, mime_types, len - 1))
+                return true;
+        } else if (len == mime_type_len &&
+                   !strncasecmp(mime_type, mime_types, len)) {
+            return true;
+        }
+
+        mime_types += len;
+        if (*mime_types == ',')
+            mime_types++;
+    }
+
+    return false;
+}
+
+static bool has_content_encoding(const struct lwan_response *response)
+{
+    if (!response->headers)
+        return false;
+
+    for (const struct lwan_key_value *header = response->headers; header->key;
+         header++) {
+        if (!strcasecmp(header->key, "Content-Encoding"))
+            return true;
+    }
+
+    return false;
+}
+
+static bool should_compress(const struct lwan_request *request)
+{
+    const struct lwan_response *response = &request->response;
+    const struct lwan_compression_settings *settings =
+        response->compression.settings;
+
+    if (!settings)
+        return false;
+    if (!(request->flags & (REQUEST_ACCEPT_DEFLATE | REQUEST_ACCEPT_GZIP |
+                            REQUEST_ACCEPT_BROTLI | REQUEST_ACCEPT_ZSTD)))
+        return false;
+    if (!response->mime_type)
+        return false;
+
+    return mime_type_is_compressible(settings->mime_types,
+                                     response->mime_type);
+}
+
+static size_t get_buffer_iov(struct lwan_strbuf *buffer,
+                             const struct iovec **iov,
+                             struct iovec *contiguous)
+{
+    size_t n_iov = lwan_strbuf_get_segments(buffer, iov);
+
+    if (n_iov)
+        return n_iov;
+
+    *contiguous = (struct iovec){
+        .iov_base = lwan_strbuf_get_buffer(buffer),
+        .iov_len = lwan_strbuf_get_length(buffer),
+    };
+    *iov = contiguous;
+    return 1;
+}
+
+#if defined(HAVE_BROTLI)
+/* The Brotli encoder can't be reset, so there's no point in keeping
+ * instances around: use the one-shot API instead.  It's only used for
+ * responses that are compressed as a whole. */
+static bool compress_brotli(struct lwan_request *request, int level)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const size_t len = lwan_strbuf_get_length(buffer);
+    size_t out_len = BrotliEncoderMaxCompressedSize(len);
+    char *in, *out;
+
+    if (UNLIKELY(!out_len))
+        return false;
+
+    in = lwan_strbuf_get_buffer(buffer);
+    if (UNLIKELY(!in))
+        return false;
+
+    out = coro_malloc(request->conn->coro, out_len);
+    if (UNLIKELY(!out))
+        return false;
+
+    if (UNLIKELY(BrotliEncoderCompress(level, BROTLI_DEFAULT_WINDOW,
+                                       BROTLI_DEFAULT_MODE, len,
+                                       (const uint8_t *)in, &out_len,
+                                       (uint8_t *)out) != BROTLI_TRUE))
+        return false;
+    if (out_len >= len)
+        return false;
+
+    lwan_strbuf_set_static(buffer, out, out_len);
+    request->response.compression.encoding = "br";
+
+    return true;
+}
+#endif
+
+static bool pick_compressor(const struct lwan_request *request,
+                            enum compressor_type *type)
+{
+#if defined(HAVE_ZSTD)
+    if (request->flags & REQUEST_ACCEPT_ZSTD) {
+        *type = COMPRESSOR_ZSTD;
+        return true;
+    }
+#endif
+    if (request->flags & REQUEST_ACCEPT_GZIP) {
+        *type = COMPRESSOR_GZIP;
+        return true;
+    }
+    if (request->flags & REQUEST_ACCEPT_DEFLATE) {
+        *type = COMPRESSOR_DEFLATE;
+        return true;
+    }
+
+    return false;
+}
+
+void lwan_response_compress(struct lwan_request *request)
+{
+    struct lwan_response *response = &request->response;
+    const struct lwan_compression_settings *settings =
+        response->compression.settings;
+    const size_t len = lwan_strbuf_get_length(response->buffer);
+    const struct iovec *iov;
+    struct iovec contiguous;
+    struct lwan_compressor *c;
+    enum compressor_type type;
+    size_t n_iov, out_size;
+    ssize_t out_len;
+    char *out;
+
+    if (!should_compress(request))
+        return;
+    if (len < settings->min_size || !len)
+        return;
+    if (has_content_encoding(response))
+        return;
+
+#if defined(HAVE_BROTLI)
+    if (request->flags & REQUEST_ACCEPT_BROTLI) {
+        if (compress_brotli(request, settings->level))
+            return;
+    }
+#endif
+
+    if (!pick_compressor(request, &type))
+        return;
+
+    c = compressor_acquire(request->conn->thread, type, settings->level);
+    if (UNLIKELY(!c))
+        return;
+
+    /* The output is sized so that a single pass is enough, and is owned by
+     * the coroutine: the compressor goes back to the pool right away, but
+     * the response might still be waiting for the socket to be writable. */
+    out_size = compressor_bound(c, len);
+    out = coro_malloc(request->conn->coro, out_size);
+    if (UNLIKELY(!out))
+        goto out;
+
+    n_iov = get_buffer_iov(response->buffer, &iov, &contiguous);
+    out_len =
+        compress_iov(c, iov, n_iov, COMPRESS_FINISH, &out, &out_size, false);
+
+    if (out_len > 0 && (size_t)out_len < len) {
+        lwan_strbuf_set_static(response->buffer, out, (size_t)out_len);
+        response->compression.encoding = compressor_encoding[type];
+    }
+
+out:
+    compressor_release(c);
+}
+
+static void release_stream_defer(void *data)
+{
+    struct lwan_compressor **slot = data;
+
+    if (*slot)
+        compressor_release(*slot);
+}
+
+void lwan_response_compress_stream_begin(struct lwan_request *request)
+{
+    struct lwan_response *response = &request->response;
+    struct lwan_compressor **slot;
+    enum compressor_type type;
+
+    if (!should_compress(request))
+        return;
+    if (has_content_encoding(response))
+        return;
+
+    /* Brotli isn't used here: see compress_brotli(). */
+    if (!pick_compressor(request, &type))
+        return;
+
+    slot = coro_malloc(request->conn->coro, sizeof(*slot));
+    if (UNLIKELY(!slot))
+        return;
+
+    *slot = compressor_acquire(request->conn->thread, type,
+                               response->compression.settings->level);
+    if (UNLIKELY(!*slot))
+        return;
+
+    /* If the connection is dropped before the stream finishes, the
+     * compressor is returned to the pool when the coroutine goes away. */
+    coro_defer(request->conn->coro, release_stream_defer, slot);
+
+    response->compression.stream = slot;
+    response->compression.encoding = compressor_encoding[type];
+}
+
+bool lwan_response_compress_stream(struct lwan_request *request,
+                                   const struct iovec *iov,
+                                   size_t n_iov,
+                                   bool finish,
+                                   struct lwan_value *out)
+{
+    struct lwan_compressor **slot = request->response.compression.stream;
+    struct lwan_compressor *c = *slot;
+    ssize_t out_len;
+
+    if (UNLIKELY(!c))
+        return false;
+
+    /* A sync flush after each chunk or event lets the client decode what
+     * has been sent so far, at the expense of a few bytes per flush. */
+    out_len = compress_iov(c, iov, n_iov,
+                           finish ? COMPRESS_FINISH : COMPRESS_FLUSH, &c->out,
+                           &c->out_size, true);
+    if (UNLIKELY(out_len < 0))
+        return false;
+
+    *out = (struct lwan_value){.value = c->out, .len = (size_t)out_len};
+    return true;
+}
+
+void lwan_response_compress_stream_end(struct lwan_request *request)
+{
+    struct lwan_compressor **slot = request->response.compression.stream;
+
+    /* Only called after the output from the last call to
+     * lwan_response_compress_stream() has been sent, as it's owned by the
+     * compressor. */
+    if (*slot) {
+        compressor_release(*slot);
+        *slot = NULL;
+    }
+
+    request->response.compression.stream = NULL;
+}
+
+bool lwan_response_compress_chunk(struct lwan_request *request, bool finish)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    const struct iovec *iov = NULL;
+    struct iovec contiguous;
+    struct lwan_value out;
+    size_t n_iov = 0;
+
+    if (lwan_strbuf_get_length(buffer))
+        n_iov = get_buffer_iov(buffer, &iov, &contiguous);
+
+    if (UNLIKELY(!lwan_response_compress_stream(request, iov, n_iov, finish,
+                                                &out)))
+        return false;
+
+    return lwan_strbuf_set_static(buffer, out.value, out.len);
+}
@@ -72,10 +72,10 @@ DEFINE_ARRAY_TYPE_INLINEFIRST(coro_defer_array, struct coro_defer)
 struct coro {
     struct coro_switcher *switcher;
     coro_context context;
-    struct coro_defer_array defer;
-
     int yield_value;
 
+    struct coro_defer_array defer;
+
 #if !defined(NDEBUG) && defined(HAVE_VALGRIND)
     unsigned int vg_stack_id;
 #endif
@@ -83,6 +83,14 @@ struct coro {
     unsigned char stack[] __attribute__((aligned(64)));
 };
 
+#if defined(__x86_64__)
+/* coro_entry_point() below hardcodes these. */
+static_assert(offsetof(struct coro, yield_value) == 0x58,
+              "yield_value is where coro_entry_point() stores it");
+static_assert(offsetof(struct coro_switcher, callee) == 0x50,
+              "callee is where coro_entry_point() looks for it");
+#endif
+
 #if defined(__APPLE__)
 #define ASM_SYMBOL(name_) "_" #name_
 #else
@@ -180,7 +188,7 @@ asm(".text\n\t"
     "movq  %r15, %rsi\n\t" /* data = r15 */
     "call  *%rdx\n\t"      /* eax = func(coro, data) */
     "movq  (%rbx), %rsi\n\t"
-    "movl  %eax, 0x68(%rbx)\n\t" /* coro->yield_value eax */
+    "movl  %eax, 0x58(%rbx)\n\t" /* coro->yield_value eax */
     "popq  %rbx\n\t"
     "leaq  0x50(%rsi), %rdi\n\t" /* get coro context from coro */
     "jmp   " ASM_SYMBOL(coro_swapcontext) "\n\t");
@@ -135,8 +135,13 @@ bool lwan_http_authorize_init(void)
 {
     realm_password_cache =
         cache_create(create_realm_file, destroy_realm_file, NULL, 60);
+    if (!realm_password_cache)
+        return false;
+
+    if (!cache_set_thread_cache(realm_password_cache, true))
+        lwan_status_warning("Could not enable thread cache for realm files");
 
-    return !!realm_password_cache;
+    return true;
 }
 
 void lwan_http_authorize_shutdown(void) { cache_destroy(realm_password_cache); }
@@ -204,6 +204,47 @@ out:
 #if defined(__linux__)
 static inline size_t min_size(size_t a, size_t b) { return (a > b) ? b : a; }
 
+static void wait_until_resident(struct lwan_request *request,
+                                const struct lwan_mapped_range *range,
+                                int in_fd,
+                                off_t offset,
+                                size_t count)
+{
+    struct lwan_connection *conn = request->conn;
+    struct lwan_thread *t = conn->thread;
+    struct lwan_page_in *page_in;
+
+    if (LIKELY(lwan_readahead_range_is_resident(range, offset, count))) {
+        t->sendfile.resident++;
+        return;
+    }
+
+    /* Reading from disk would block every other connection handled by
+     * this thread; have an I/O thread do it and wake this one up. */
+    page_in = malloc(sizeof(*page_in));
+    if (UNLIKELY(!page_in))
+        goto blocked;
+    lwan_waiter_init(&page_in->waiter, conn);
+    page_in->off = offset;
+    page_in->size = count;
+    if (UNLIKELY(!lwan_readahead_page_in(page_in, in_fd))) {
+        free(page_in);
+        goto blocked;
+    }
+
+    t->sendfile.offloaded++;
+    lwan_waiter_wait(&page_in->waiter, conn->coro);
+    return;
+
+blocked:
+    t->sendfile.blocked++;
+}
+
+static void unmap_range(void *data)
+{
+    lwan_readahead_unmap_range(data);
+}
+
 void lwan_sendfile(struct lwan_request *request,
                    int in_fd,
                    off_t offset,
@@ -211,13 +252,43 @@ void lwan_sendfile(struct lwan_request *request,
                    const char *header,
                    size_t header_len)
 {
-    size_t chunk_size = min_size(count, 1 << 17);
+    struct lwan_mapped_range *range, unmapped = {};
+    size_t window = min_size(count, 1 << 17);
     size_t to_be_written = count;
+    off_t resident_until = offset;
+
+    /* The range is mapped once for the whole transfer, and each window is
+     * checked only once, no matter how many writes it takes to send it.
+     * The mapping is released with the coroutine, as it might be aborted
+     * while sending.  Without one, windows are assumed to be resident. */
+    range = coro_malloc_full(request->conn->coro, sizeof(*range), unmap_range);
+    if (LIKELY(range))
+        lwan_readahead_map_range(range, in_fd, offset, count);
+    else
+        range = &unmapped;
 
     lwan_send(request, header, header_len, MSG_MORE);
 
     while (true) {
-        ssize_t written = sendfile(request->fd, in_fd, &offset, chunk_size);
+        ssize_t written;
+
+        if (offset == resident_until) {
+            wait_until_resident(request, range, in_fd, offset, window);
+            resident_until = offset + (off_t)window;
+
+            if (to_be_written > window) {
+                /* Get the kernel started on the window after this one. */
+                lwan_readahead_queue(in_fd, resident_until,
+                                     min_size(to_be_written - window, 1 << 19));
+            } else {
+                /* Nothing else to check; don't keep the file mapped while
+                 * the rest is sent. */
+                lwan_readahead_unmap_range(range);
+            }
+        }
+
+        written = sendfile(request->fd, in_fd, &offset,
+                           (size_t)(resident_until - offset));
         if (written < 0) {
             switch (errno) {
             case EAGAIN:
@@ -233,8 +304,8 @@ void lwan_sendfile(struct lwan_request *request,
         if (!to_be_written)
             break;
 
-        chunk_size = min_size(to_be_written, 1 << 19);
-        lwan_readahead_queue(in_fd, offset, chunk_size);
+        if (offset == resident_until)
+            window = min_size(to_be_written, 1 << 19);
 
     try_again:
         coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
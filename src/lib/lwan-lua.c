@@ -112,6 +112,21 @@ LWAN_LUA_METHOD(cookie)
     return request_param_getter(L, lwan_request_get_cookie);
 }
 
+LWAN_LUA_METHOD(path_param)
+{
+    struct lwan_request *request = lwan_lua_get_request_from_userdata(L);
+    const char *name = lua_tostring(L, -1);
+    size_t len;
+
+    const char *value = lwan_request_get_path_param(request, name, &len);
+    if (!value)
+        lua_pushnil(L);
+    else
+        lua_pushlstring(L, value, len);
+
+    return 1;
+}
+
 LWAN_LUA_METHOD(ws_upgrade)
 {
     struct lwan_request *request = lwan_lua_get_request_from_userdata(L);
@@ -138,6 +153,8 @@ LWAN_LUA_METHOD(ws_read)
 {
     struct lwan_request *request = lwan_lua_get_request_from_userdata(L);
 
+    /* Reading a frame makes the buffer contiguous, so this can't fail
+     * to flatten it. */
     if (lwan_response_websocket_read(request)) {
         lua_pushlstring(L, lwan_strbuf_get_buffer(request->response.buffer),
                         lwan_strbuf_get_length(request->response.buffer));
@@ -23,10 +23,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
 
 #include "lwan-private.h"
@@ -37,6 +40,7 @@
 #include "lwan-config.h"
 #include "lwan-io-wrappers.h"
 #include "lwan-mod-serve-files.h"
+#include "lwan-pack.h"
 #include "lwan-template.h"
 #include "int-to-str.h"
 
@@ -46,6 +50,14 @@
 #include <brotli/encode.h>
 #endif
 
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_INOTIFY)
+#include <sys/inotify.h>
+#endif
+
 static const struct lwan_key_value deflate_compression_hdr = {
     .key = "Content-Encoding",
     .value = "deflate",
@@ -54,6 +66,10 @@ static const struct lwan_key_value gzip_compression_hdr = {
     .key = "Content-Encoding",
     .value = "gzip",
 };
+static const struct lwan_key_value zstd_compression_hdr = {
+    .key = "Content-Encoding",
+    .value = "zstd",
+};
 #if defined(HAVE_BROTLI)
 static const struct lwan_key_value br_compression_hdr = {
     .key = "Content-Encoding",
@@ -63,10 +79,25 @@ static const struct lwan_key_value br_compression_hdr = {
 
 static const int open_mode = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
 
+/* Files smaller than this are mmap()ed; larger ones are sent with
+ * sendfile(). */
+#define MMAP_SIZE_THRESHOLD 16384
+
+/* Chunks in the slab store are 256 bytes to 64KiB, in powers of two. */
+#define SLAB_MIN_CHUNK_SHIFT 8
+#define SLAB_CLASSES 9
+#define SLAB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 struct file_cache_entry;
+struct preload;
+struct slab;
+struct watcher;
+struct compressed_store;
+struct stored_variants;
 
 struct serve_files_priv {
     struct cache *cache;
+    struct cache *missing; /* Keys known not to be servable, if enabled */
 
     char *root_path;
     size_t root_path_len;
@@ -78,10 +109,25 @@ struct serve_files_priv {
     struct lwan_tpl *directory_list_tpl;
 
     size_t read_ahead;
+    size_t background_compression_max_size;
+    size_t max_ranges;
+    size_t auto_index_stream_threshold;
+
+    struct preload *preload;
+    struct watcher *watcher;
+    struct compressed_store *store;
+    struct packed_assets *packed;
+    struct slab *slab;
+    size_t slab_max_file_size;
+
+    char multipart_boundary[sizeof("lwan") + 16];
+    char multipart_mime_type[sizeof("multipart/byteranges; boundary=") +
+                             sizeof("lwan") + 16];
 
     bool serve_precompressed_files;
     bool auto_index;
     bool auto_index_readme;
+    bool compressed_only;
 };
 
 struct cache_funcs {
@@ -91,29 +137,89 @@ struct cache_funcs {
                  const char *full_path,
                  struct stat *st);
     void (*free)(struct file_cache_entry *ce);
+    size_t (*cost)(const struct file_cache_entry *ce);
 };
 
-struct mmap_cache_data {
-    struct lwan_value uncompressed;
+struct compressed_variants {
     struct lwan_value deflated;
 #if defined(HAVE_BROTLI)
     struct lwan_value brotli;
 #endif
+#if defined(HAVE_ZSTD)
+    struct lwan_value zstd;
+#endif
+};
+
+struct compressed_data {
+    /* Produced with fast settings while the entry is being created. */
+    struct compressed_variants fast;
+    /* Produced with the best settings by the background compression
+     * queue; attached atomically once ready, and never replaced. */
+    struct compressed_variants *best;
+    /* Cache holding the entry, so that background jobs can unref it. */
+    struct cache *cache;
+    int pending;
+};
+
+struct mmap_cache_data {
+    /* If only compressed variants are kept, value is NULL, and clients
+     * that don't accept them are served from fd with sendfile(). */
+    struct lwan_value uncompressed;
+    struct compressed_data compressed;
+    struct lwan_readahead_region *region;
+    int fd;
+};
+
+/* A complete response, headers included, as it'd be sent to an HTTP/1.1
+ * keep-alive connection; only the dates have to be filled in. */
+struct slab_response {
+    const char *blob;
+    size_t len;
+    size_t body_off;
+    size_t date_off;
+    size_t expires_off;
+};
+
+struct slab_responses {
+    char *chunk;
+    int chunk_class;
+    struct slab_response identity;
+    struct slab_response deflated;
+#if defined(HAVE_BROTLI)
+    struct slab_response brotli;
+#endif
+#if defined(HAVE_ZSTD)
+    struct slab_response zstd;
+#endif
+};
+
+struct slab_cache_data {
+    /* Identity and quickly compressed responses, built while the entry is
+     * being created. */
+    struct slab_responses fast;
+    /* Responses compressed with the best settings by the background
+     * compression queue, without the identity; attached atomically once
+     * ready, and never replaced. */
+    struct slab_responses *best;
+    int pending;
 };
 
 struct sendfile_cache_data {
     struct {
         int fd;
         size_t size;
-    } compressed, uncompressed;
+    } compressed, zstd, uncompressed;
+    /* Variants from the compressed store; attached atomically once all of
+     * them are known, and never replaced. */
+    struct stored_variants *stored;
+    int store_pending;
 };
 
 struct dir_list_cache_data {
     struct lwan_strbuf rendered;
-    struct lwan_value deflated;
-#if defined(HAVE_BROTLI)
-    struct lwan_value brotli;
-#endif
+    struct compressed_data compressed;
+    /* If set, the list is rendered, and streamed, on every request. */
+    char *full_path;
 };
 
 struct redir_cache_data {
@@ -129,10 +235,17 @@ struct file_cache_entry {
     } last_modified;
 
     const char *mime_type;
+    const char *etag;
     const struct cache_funcs *funcs;
+    const struct serve_files_priv *priv;
+
+    /* Directory holding this entry, if it's being watched for changes */
+    struct watched_dir *watch;
+    unsigned int watch_generation;
 
     union {
         struct mmap_cache_data mmap_cache_data;
+        struct slab_cache_data slab_cache_data;
         struct sendfile_cache_data sendfile_cache_data;
         struct dir_list_cache_data dir_list_cache_data;
         struct redir_cache_data redir_cache_data;
@@ -144,7 +257,8 @@ struct file_list {
     const char *rel_path;
     const char *readme;
     struct {
-        coro_function_t generator;
+        DIR *dir;
+        unsigned int n_entries;
 
         const char *icon;
         const char *icon_alt;
@@ -158,21 +272,34 @@ struct file_list {
     } file_list;
 };
 
-static int directory_list_generator(struct coro *coro, void *data);
+static bool directory_list_init(void *data);
+static bool directory_list_next(void *data);
+static void directory_list_fini(void *data);
 
 static bool mmap_init(struct file_cache_entry *ce,
                       struct serve_files_priv *priv,
                       const char *full_path,
                       struct stat *st);
 static void mmap_free(struct file_cache_entry *ce);
+static size_t mmap_cost(const struct file_cache_entry *ce);
 static enum lwan_http_status mmap_serve(struct lwan_request *request,
                                         void *data);
 
+static bool slab_init(struct file_cache_entry *ce,
+                      struct serve_files_priv *priv,
+                      const char *full_path,
+                      struct stat *st);
+static void slab_free(struct file_cache_entry *ce);
+static size_t slab_cost(const struct file_cache_entry *ce);
+static enum lwan_http_status slab_serve(struct lwan_request *request,
+                                        void *data);
+
 static bool sendfile_init(struct file_cache_entry *ce,
                           struct serve_files_priv *priv,
                           const char *full_path,
                           struct stat *st);
 static void sendfile_free(struct file_cache_entry *ce);
+static size_t sendfile_cost(const struct file_cache_entry *ce);
 static enum lwan_http_status sendfile_serve(struct lwan_request *request,
                                             void *data);
 
@@ -181,6 +308,7 @@ static bool dirlist_init(struct file_cache_entry *ce,
                          const char *full_path,
                          struct stat *st);
 static void dirlist_free(struct file_cache_entry *ce);
+static size_t dirlist_cost(const struct file_cache_entry *ce);
 static enum lwan_http_status dirlist_serve(struct lwan_request *request,
                                            void *data);
 
@@ -189,30 +317,42 @@ static bool redir_init(struct file_cache_entry *ce,
                        const char *full_path,
                        struct stat *st);
 static void redir_free(struct file_cache_entry *ce);
+static size_t redir_cost(const struct file_cache_entry *ce);
 static enum lwan_http_status redir_serve(struct lwan_request *request,
                                          void *data);
 
 static const struct cache_funcs mmap_funcs = {
     .init = mmap_init,
     .free = mmap_free,
+    .cost = mmap_cost,
     .serve = mmap_serve,
 };
 
+static const struct cache_funcs slab_funcs = {
+    .init = slab_init,
+    .free = slab_free,
+    .cost = slab_cost,
+    .serve = slab_serve,
+};
+
 static const struct cache_funcs sendfile_funcs = {
     .init = sendfile_init,
     .free = sendfile_free,
+    .cost = sendfile_cost,
     .serve = sendfile_serve,
 };
 
 static const struct cache_funcs dirlist_funcs = {
     .init = dirlist_init,
     .free = dirlist_free,
+    .cost = dirlist_cost,
     .serve = dirlist_serve,
 };
 
 static const struct cache_funcs redir_funcs = {
     .init = redir_init,
     .free = redir_free,
+    .cost = redir_cost,
     .serve = redir_serve,
 };
 
@@ -222,85 +362,52 @@ static const struct lwan_var_descriptor file_list_desc[] = {
     TPL_VAR_STR_ESCAPE(full_path),
     TPL_VAR_STR_ESCAPE(rel_path),
     TPL_VAR_STR_ESCAPE(readme),
-    TPL_VAR_SEQUENCE(file_list,
-                     directory_list_generator,
-                     ((const struct lwan_var_descriptor[]){
-                         TPL_VAR_STR(file_list.icon),
-                         TPL_VAR_STR(file_list.icon_alt),
-                         TPL_VAR_STR(file_list.name),
-                         TPL_VAR_STR(file_list.type),
-                         TPL_VAR_INT(file_list.size),
-                         TPL_VAR_STR(file_list.unit),
-                         TPL_VAR_STR(file_list.zebra_class),
-                         TPL_VAR_SENTINEL,
-                     })),
+    TPL_VAR_SEQUENCE_CURSOR(file_list,
+                            directory_list_init,
+                            directory_list_next,
+                            directory_list_fini,
+                            ((const struct lwan_var_descriptor[]){
+                                TPL_VAR_STR(file_list.icon),
+                                TPL_VAR_STR(file_list.icon_alt),
+                                TPL_VAR_STR(file_list.name),
+                                TPL_VAR_STR(file_list.type),
+                                TPL_VAR_INT(file_list.size),
+                                TPL_VAR_STR(file_list.unit),
+                                TPL_VAR_STR(file_list.zebra_class),
+                                TPL_VAR_SENTINEL,
+                            })),
     TPL_VAR_SENTINEL,
 };
 
+/* Defines directory_list_tpl_source and a compiled version of it. */
+#include "directory-list-tpl.h"
+
+static bool directory_list_init(void *data)
+{
+    struct file_list *fl = data;
+
+    /* Directories that can't be read are listed as empty. */
+    fl->file_list.dir = opendir(fl->full_path);
+    fl->file_list.n_entries = 0;
+
+    return true;
+}
 
-static const char *directory_list_tpl_str =
-    "<html>\n"
-    "<head>\n"
-    "{{rel_path?}}  <title>Index of {{rel_path}}</title>{{/rel_path?}}\n"
-    "{{^rel_path?}}  <title>Index of /</title>{{/rel_path?}}\n"
-    "<style>\n"
-    "  body { background: #fff }\n"
-    "  tr.odd>td { background: #fff }\n"
-    "  tr.even>td { background: #eee }\n"
-    "</style>\n"
-    "</head>\n"
-    "<body>\n"
-    "{{rel_path?}}  <h1>Index of {{rel_path}}</h1>\n{{/rel_path?}}"
-    "{{^rel_path?}}  <h1>Index of /</h1>\n{{/rel_path?}}"
-    "{{readme?}}<pre>{{readme}}</pre>\n{{/readme?}}"
-    "  <table>\n"
-    "    <tr>\n"
-    "      <td><img src=\"?icon=back\"></td>\n"
-    "      <td colspan=\"3\"><a href=\"..\">Parent directory</a></td>\n"
-    "    </tr>\n"
-    "    <tr>\n"
-    "      <td>&nbsp;</td>\n"
-    "      <th>File name</th>\n"
-    "      <th>Type</th>\n"
-    "      <th>Size</th>\n"
-    "    </tr>\n"
-    "{{#file_list}}"
-    "    <tr class=\"{{file_list.zebra_class}}\">\n"
-    "      <td><img src=\"?icon={{file_list.icon}}\" "
-    "alt=\"{{file_list.icon_alt}}\"></td>\n"
-    "      <td><a "
-    "href=\"{{rel_path}}/{{{file_list.name}}}\">{{{file_list.name}}}</a></td>\n"
-    "      <td>{{file_list.type}}</td>\n"
-    "      <td align=\"right\"><tt>{{file_list.size}}{{file_list.unit}}</tt></td>\n"
-    "    </tr>\n"
-    "{{/file_list}}"
-    "{{^#file_list}}"
-    "    <tr>\n"
-    "      <td colspan=\"4\">Empty directory.</td>\n"
-    "    </tr>\n"
-    "{{/file_list}}"
-    "  </table>\n"
-    "</body>\n"
-    "</html>\n";
-
-static int directory_list_generator(struct coro *coro, void *data)
+static bool directory_list_next(void *data)
 {
     static const char *zebra_classes[] = {"odd", "even"};
     struct file_list *fl = data;
     struct dirent *entry;
-    int zebra_class = 0;
-    DIR *dir;
     int fd;
 
-    dir = opendir(fl->full_path);
-    if (!dir)
-        return 0;
+    if (!fl->file_list.dir)
+        return false;
 
-    fd = dirfd(dir);
+    fd = dirfd(fl->file_list.dir);
     if (fd < 0)
-        goto out;
+        return false;
 
-    while ((entry = readdir(dir))) {
+    while ((entry = readdir(fl->file_list.dir))) {
         struct stat st;
 
         if (entry->d_name[0] == '.')
@@ -337,15 +444,23 @@ static int directory_list_generator(struct coro *coro, void *data)
         }
 
         fl->file_list.name = entry->d_name;
-        fl->file_list.zebra_class = zebra_classes[zebra_class++ % 2];
+        fl->file_list.zebra_class =
+            zebra_classes[fl->file_list.n_entries++ % 2];
 
-        if (coro_yield(coro, 1))
-            break;
+        return true;
     }
 
-out:
-    closedir(dir);
-    return 0;
+    return false;
+}
+
+static void directory_list_fini(void *data)
+{
+    struct file_list *fl = data;
+
+    if (fl->file_list.dir) {
+        closedir(fl->file_list.dir);
+        fl->file_list.dir = NULL;
+    }
 }
 
 static ALWAYS_INLINE bool is_compression_worthy(const size_t compressed_sz,
@@ -368,7 +483,8 @@ static void realloc_if_needed(struct lwan_value *value, size_t needed_size)
 }
 
 static void deflate_value(const struct lwan_value *uncompressed,
-                          struct lwan_value *compressed)
+                          struct lwan_value *compressed,
+                          int level)
 {
     const unsigned long bound = compressBound(uncompressed->len);
 
@@ -377,9 +493,9 @@ static void deflate_value(const struct lwan_value *uncompressed,
     if (UNLIKELY(!(compressed->value = malloc(bound))))
         goto error_zero_out;
 
-    if (UNLIKELY(compress((Bytef *)compressed->value, &compressed->len,
-                          (Bytef *)uncompressed->value,
-                          uncompressed->len) != Z_OK))
+    if (UNLIKELY(compress2((Bytef *)compressed->value, &compressed->len,
+                           (Bytef *)uncompressed->value, uncompressed->len,
+                           level) != Z_OK))
         goto error_free_compressed;
 
     if (is_compression_worthy(compressed->len, uncompressed->len))
@@ -395,7 +511,8 @@ error_zero_out:
 #if defined(HAVE_BROTLI)
 static void brotli_value(const struct lwan_value *uncompressed,
                          struct lwan_value *brotli,
-                         const struct lwan_value *deflated)
+                         const struct lwan_value *deflated,
+                         int quality)
 {
     const unsigned long bound =
         BrotliEncoderMaxCompressedSize(uncompressed->len);
@@ -406,7 +523,7 @@ static void brotli_value(const struct lwan_value *uncompressed,
         goto error_zero_out;
 
     if (UNLIKELY(
-            BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW,
+            BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
                                   BROTLI_DEFAULT_MODE, uncompressed->len,
                                   (uint8_t *)uncompressed->value, &brotli->len,
                                   (uint8_t *)brotli->value) != BROTLI_TRUE))
@@ -425,6 +542,235 @@ error_zero_out:
 }
 #endif
 
+#if defined(HAVE_ZSTD)
+static void zstd_value(const struct lwan_value *uncompressed,
+                       struct lwan_value *zstd,
+                       int level)
+{
+    const size_t bound = ZSTD_compressBound(uncompressed->len);
+
+    if (UNLIKELY(!(zstd->value = malloc(bound))))
+        goto error_zero_out;
+
+    zstd->len = ZSTD_compress(zstd->value, bound, uncompressed->value,
+                              uncompressed->len, level);
+    if (UNLIKELY(ZSTD_isError(zstd->len)))
+        goto error_free_compressed;
+
+    if (is_compression_worthy(zstd->len, uncompressed->len))
+        return realloc_if_needed(zstd, bound);
+
+error_free_compressed:
+    free(zstd->value);
+    zstd->value = NULL;
+error_zero_out:
+    zstd->len = 0;
+}
+#endif
+
+struct compression_levels {
+    int deflate;
+#if defined(HAVE_BROTLI)
+    int brotli; /* Negative to skip */
+#endif
+#if defined(HAVE_ZSTD)
+    int zstd;
+#endif
+};
+
+static const struct compression_levels fast_compression = {
+    .deflate = Z_BEST_SPEED,
+#if defined(HAVE_BROTLI)
+    .brotli = -1,
+#endif
+#if defined(HAVE_ZSTD)
+    .zstd = 1,
+#endif
+};
+
+static const struct compression_levels default_compression = {
+    .deflate = Z_DEFAULT_COMPRESSION,
+#if defined(HAVE_BROTLI)
+    .brotli = BROTLI_DEFAULT_QUALITY,
+#endif
+#if defined(HAVE_ZSTD)
+    .zstd = ZSTD_CLEVEL_DEFAULT,
+#endif
+};
+
+static const struct compression_levels best_compression = {
+    .deflate = Z_BEST_COMPRESSION,
+#if defined(HAVE_BROTLI)
+    .brotli = BROTLI_MAX_QUALITY,
+#endif
+#if defined(HAVE_ZSTD)
+    .zstd = 19,
+#endif
+};
+
+static void compress_variants(const struct lwan_value *uncompressed,
+                              struct compressed_variants *cv,
+                              const struct compression_levels *levels)
+{
+    deflate_value(uncompressed, &cv->deflated, levels->deflate);
+#if defined(HAVE_BROTLI)
+    if (levels->brotli >= 0)
+        brotli_value(uncompressed, &cv->brotli, &cv->deflated, levels->brotli);
+    else
+        cv->brotli = (struct lwan_value){};
+#endif
+#if defined(HAVE_ZSTD)
+    zstd_value(uncompressed, &cv->zstd, levels->zstd);
+#endif
+}
+
+static void free_variants(struct compressed_variants *cv)
+{
+    free(cv->deflated.value);
+#if defined(HAVE_BROTLI)
+    free(cv->brotli.value);
+#endif
+#if defined(HAVE_ZSTD)
+    free(cv->zstd.value);
+#endif
+}
+
+static void compressed_data_init(struct compressed_data *cd,
+                                 const struct serve_files_priv *priv,
+                                 const struct lwan_value *uncompressed)
+{
+    cd->best = NULL;
+    cd->cache = priv->cache;
+    cd->pending = lwan_compress_queue_enabled();
+
+    /* Don't make the client wait for anything but the fastest compressors,
+     * and not even for those if the file is large: the identity is served
+     * until the background compression queue produces better variants. */
+    if (uncompressed->len > priv->background_compression_max_size)
+        cd->fast = (struct compressed_variants){};
+    else
+        compress_variants(uncompressed, &cd->fast, &fast_compression);
+}
+
+/* Files that are too large for the best compressors to be worth their
+ * time get the default levels instead, still in the background. */
+static const struct compression_levels *
+background_compression_levels(const struct serve_files_priv *priv, size_t len)
+{
+    if (len > priv->background_compression_max_size)
+        return &default_compression;
+
+    return &best_compression;
+}
+
+static bool has_compressed_variant(const struct compressed_variants *cv)
+{
+#if defined(HAVE_BROTLI)
+    if (cv->brotli.len)
+        return true;
+#endif
+#if defined(HAVE_ZSTD)
+    if (cv->zstd.len)
+        return true;
+#endif
+    return cv->deflated.len > 0;
+}
+
+static void compressed_data_free(struct compressed_data *cd)
+{
+    free_variants(&cd->fast);
+
+    if (cd->best) {
+        free_variants(cd->best);
+        free(cd->best);
+    }
+}
+
+static ALWAYS_INLINE const struct compressed_variants *
+compressed_data_get(struct compressed_data *cd)
+{
+    const struct compressed_variants *best =
+        __atomic_load_n(&cd->best, __ATOMIC_ACQUIRE);
+
+    return best ? best : &cd->fast;
+}
+
+struct compression_job {
+    struct file_cache_entry *fce;
+    struct compressed_data *cd;
+    struct lwan_value uncompressed;
+    int fd;
+};
+
+static void compression_job_run(void *data, bool cancelled)
+{
+    struct compression_job *job = data;
+    struct lwan_value uncompressed = job->uncompressed;
+
+    if (!uncompressed.value && job->fd >= 0 && !cancelled) {
+        /* Uncompressed contents aren't kept around for this entry: map
+         * them only while they're being compressed. */
+        void *value = mmap(NULL, uncompressed.len, PROT_READ, MAP_SHARED,
+                           job->fd, 0);
+        if (value != MAP_FAILED)
+            uncompressed.value = value;
+    }
+
+    if (!cancelled && uncompressed.value) {
+        struct compressed_variants *best = malloc(sizeof(*best));
+
+        if (LIKELY(best)) {
+            compress_variants(&uncompressed, best,
+                              background_compression_levels(job->fce->priv,
+                                                            uncompressed.len));
+            __atomic_store_n(&job->cd->best, best, __ATOMIC_RELEASE);
+        }
+    }
+
+    if (uncompressed.value != job->uncompressed.value)
+        munmap(uncompressed.value, uncompressed.len);
+
+    cache_entry_unref(job->cd->cache, (struct cache_entry *)job->fce);
+    free(job);
+}
+
+static void compress_in_background(struct file_cache_entry *fce,
+                                   struct compressed_data *cd,
+                                   const struct lwan_value *uncompressed,
+                                   int fd)
+{
+    struct compression_job *job;
+
+    if (LIKELY(!ATOMIC_READ(cd->pending)))
+        return;
+    if (!__sync_bool_compare_and_swap(&cd->pending, 1, 0))
+        return;
+
+    /* The job holds a reference so the entry outlives it.  Entries that
+     * can't be shared are about to go away anyway. */
+    if (!cache_entry_try_ref((struct cache_entry *)fce))
+        return;
+
+    job = malloc(sizeof(*job));
+    if (UNLIKELY(!job))
+        goto try_again_later;
+
+    *job = (struct compression_job){
+        .fce = fce,
+        .cd = cd,
+        .uncompressed = *uncompressed,
+        .fd = fd,
+    };
+    if (LIKELY(lwan_compress_queue_add(compression_job_run, job)))
+        return;
+
+    free(job);
+try_again_later:
+    /* The caller holds another reference, so this won't destroy it. */
+    cache_entry_unref(cd->cache, (struct cache_entry *)fce);
+    ATOMIC_INC(cd->pending);
+}
+
 static bool mmap_init(struct file_cache_entry *ce,
                       struct serve_files_priv *priv,
                       const char *full_path,
@@ -448,17 +794,27 @@ static bool mmap_init(struct file_cache_entry *ce,
         goto close_file;
     }
 
-    lwan_madvise_queue(md->uncompressed.value, (size_t)st->st_size);
+    md->region =
+        lwan_madvise_register(md->uncompressed.value, (size_t)st->st_size);
 
     md->uncompressed.len = (size_t)st->st_size;
-    deflate_value(&md->uncompressed, &md->deflated);
-#if defined(HAVE_BROTLI)
-    brotli_value(&md->uncompressed, &md->brotli, &md->deflated);
-#endif
+    compressed_data_init(&md->compressed, priv, &md->uncompressed);
 
     ce->mime_type =
         lwan_determine_mime_type_for_file_name(full_path + priv->root_path_len);
 
+    md->fd = -1;
+    if (priv->compressed_only && has_compressed_variant(&md->compressed.fast)) {
+        /* Most clients will take one of the compressed variants; leave
+         * the uncompressed contents to the page cache. */
+        lwan_madvise_unmap(md->region, md->uncompressed.value,
+                           md->uncompressed.len);
+        md->uncompressed.value = NULL;
+        md->region = NULL;
+        md->fd = file_fd;
+        return true;
+    }
+
     success = true;
 
 close_file:
@@ -467,6 +823,106 @@ close_file:
     return success;
 }
 
+/* Small files, and their prebuilt responses, are kept together in a single
+ * mapping backed by huge pages if possible, rather than scattered through
+ * the heap and small file mappings. */
+struct slab {
+    pthread_mutex_t lock;
+    char *base;
+    size_t size;
+    size_t used;
+    void *free_chunks[SLAB_CLASSES];
+};
+
+static size_t slab_class_size(int class)
+{
+    return (size_t)1 << (SLAB_MIN_CHUNK_SHIFT + class);
+}
+
+static int slab_class_for_size(size_t size)
+{
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        if (size <= slab_class_size(class))
+            return class;
+    }
+
+    return -1;
+}
+
+static struct slab *slab_create(size_t size)
+{
+    struct slab *slab;
+    void *base = MAP_FAILED;
+
+    size = (size + SLAB_HUGE_PAGE_SIZE - 1) & ~(size_t)(SLAB_HUGE_PAGE_SIZE - 1);
+
+#if defined(MAP_HUGETLB)
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (base == MAP_FAILED) {
+        /* No huge pages have been reserved: ask for transparent ones. */
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (UNLIKELY(base == MAP_FAILED))
+            return NULL;
+#if defined(MADV_HUGEPAGE)
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    slab = malloc(sizeof(*slab));
+    if (UNLIKELY(!slab)) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    *slab = (struct slab){.base = base, .size = size};
+    if (UNLIKELY(pthread_mutex_init(&slab->lock, NULL))) {
+        munmap(base, size);
+        free(slab);
+        return NULL;
+    }
+
+    return slab;
+}
+
+static void slab_destroy(struct slab *slab)
+{
+    if (!slab)
+        return;
+
+    pthread_mutex_destroy(&slab->lock);
+    munmap(slab->base, slab->size);
+    free(slab);
+}
+
+static char *slab_alloc(struct slab *slab, int class)
+{
+    const size_t size = slab_class_size(class);
+    char *chunk;
+
+    pthread_mutex_lock(&slab->lock);
+    chunk = slab->free_chunks[class];
+    if (chunk) {
+        slab->free_chunks[class] = *(void **)chunk;
+    } else if (slab->size - slab->used >= size) {
+        chunk = slab->base + slab->used;
+        slab->used += size;
+    }
+    pthread_mutex_unlock(&slab->lock);
+
+    return chunk;
+}
+
+static void slab_free_chunk(struct slab *slab, char *chunk, int class)
+{
+    pthread_mutex_lock(&slab->lock);
+    *(void **)chunk = slab->free_chunks[class];
+    slab->free_chunks[class] = chunk;
+    pthread_mutex_unlock(&slab->lock);
+}
+
 static bool is_world_readable(mode_t mode)
 {
     const mode_t world_readable = S_IRUSR | S_IRGRP | S_IROTH;
@@ -474,6 +930,15 @@ static bool is_world_readable(mode_t mode)
     return (mode & world_readable) == world_readable;
 }
 
+static bool same_file_state(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+           a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
 static void
 try_readahead(const struct serve_files_priv *priv, int fd, size_t size)
 {
@@ -485,20 +950,22 @@ try_readahead(const struct serve_files_priv *priv, int fd, size_t size)
 }
 
 static int try_open_compressed(const char *relpath,
+                               const char *extension,
                                const struct serve_files_priv *priv,
                                const struct stat *uncompressed,
                                size_t *compressed_sz)
 {
-    char gzpath[PATH_MAX];
+    char compressed_path[PATH_MAX];
     struct stat st;
     int ret, fd;
 
-    /* Try to serve a compressed file using sendfile() if $FILENAME.gz exists */
-    ret = snprintf(gzpath, PATH_MAX, "%s.gz", relpath + 1);
+    /* Try to serve a compressed file using sendfile() if $FILENAME.gz
+     * (or .zst) exists */
+    ret = snprintf(compressed_path, PATH_MAX, "%s%s", relpath + 1, extension);
     if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
         goto out;
 
-    fd = openat(priv->root_fd, gzpath, open_mode);
+    fd = openat(priv->root_fd, compressed_path, open_mode);
     if (UNLIKELY(fd < 0))
         goto out;
 
@@ -528,353 +995,2387 @@ out:
     return -ENOENT;
 }
 
-static bool sendfile_init(struct file_cache_entry *ce,
-                          struct serve_files_priv *priv,
-                          const char *full_path,
-                          struct stat *st)
-{
-    struct sendfile_cache_data *sd = &ce->sendfile_cache_data;
-    const char *relpath = full_path + priv->root_path_len;
+/* Compressed variants of files served with sendfile() are kept in a
+ * directory, so they're produced only once, survive restarts, and can be
+ * shared by processes serving the same files.  Artifacts are named after
+ * the (device, inode, size, mtime) of the file they were produced from,
+ * plus the algorithm and level used; empty artifacts mean that compressing
+ * the file with that algorithm isn't worth it. */
 
-    ce->mime_type = lwan_determine_mime_type_for_file_name(relpath);
+#define STORE_CHUNK_SIZE 32768
 
-    sd->uncompressed.fd = openat(priv->root_fd, relpath + 1, open_mode);
-    if (UNLIKELY(sd->uncompressed.fd < 0)) {
-        switch (errno) {
-        case ENFILE:
-        case EMFILE:
-        case EACCES:
-            /* These errors should produce responses other than 404, so
-             * store errno as the file descriptor.  */
-            sd->uncompressed.fd = sd->compressed.fd = -errno;
-            sd->compressed.size = sd->uncompressed.size = 0;
+struct compressed_store {
+    int dir_fd;
+    size_t max_size;
+    size_t size;
+    unsigned int tmp_counter;
+    pthread_mutex_t trim_lock;
+};
 
-            return true;
-        }
+struct stored_variant {
+    int fd;
+    size_t size;
+};
 
-        return false;
-    }
+struct stored_variants {
+    struct stored_variant gzip;
+#if defined(HAVE_BROTLI)
+    struct stored_variant brotli;
+#endif
+#if defined(HAVE_ZSTD)
+    struct stored_variant zstd;
+#endif
+};
 
-    /* If precompressed files can be served, try opening it */
-    if (LIKELY(priv->serve_precompressed_files)) {
-        size_t compressed_sz;
-        int fd = try_open_compressed(relpath, priv, st, &compressed_sz);
+struct store_algorithm {
+    const char *extension;
+    int level;
+    size_t offset;
+    bool (*compress)(int in_fd, int out_fd, int level, size_t size);
+};
 
-        sd->compressed.fd = fd;
-        sd->compressed.size = compressed_sz;
-    }
+struct store_file {
+    char *name;
+    struct timespec mtime;
+    off_t size;
+};
 
-    sd->uncompressed.size = (size_t)st->st_size;
-    try_readahead(priv, sd->uncompressed.fd, sd->uncompressed.size);
+DEFINE_ARRAY_TYPE(store_file_list, struct store_file)
+
+static bool write_all(int fd, const void *buffer, size_t len)
+{
+    const char *p = buffer;
+
+    while (len) {
+        ssize_t written = write(fd, p, len);
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        p += written;
+        len -= (size_t)written;
+    }
 
     return true;
 }
 
-static const char *get_rel_path(const char *full_path,
-                                struct serve_files_priv *priv)
+static ssize_t read_chunk(int fd, void *buffer, off_t offset)
 {
-    const char *root_path = full_path + priv->root_path_len;
+    while (true) {
+        ssize_t r = pread(fd, buffer, STORE_CHUNK_SIZE, offset);
 
-    if (priv->root_path_len == 1) {
-        /* If root path length is 1, it's actually "/".   Don't skip
-         * the first forward slash if serving from root directory. */
-        root_path--;
+        if (LIKELY(r >= 0) || errno != EINTR)
+            return r;
+    }
+}
+
+static bool gzip_file(int in_fd,
+                      int out_fd,
+                      int level,
+                      size_t size __attribute__((unused)))
+{
+    unsigned char in[STORE_CHUNK_SIZE], out[STORE_CHUNK_SIZE];
+    z_stream stream = {};
+    off_t offset = 0;
+    int flush;
+
+    /* 16 + MAX_WBITS produces a gzip wrapper rather than a zlib one. */
+    if (deflateInit2(&stream, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    do {
+        ssize_t r = read_chunk(in_fd, in, offset);
+
+        if (UNLIKELY(r < 0))
+            goto error;
+
+        offset += r;
+        flush = r ? Z_NO_FLUSH : Z_FINISH;
+        stream.next_in = in;
+        stream.avail_in = (uInt)r;
+
+        do {
+            stream.next_out = out;
+            stream.avail_out = sizeof(out);
+
+            if (UNLIKELY(deflate(&stream, flush) == Z_STREAM_ERROR))
+                goto error;
+            if (UNLIKELY(
+                    !write_all(out_fd, out, sizeof(out) - stream.avail_out)))
+                goto error;
+        } while (!stream.avail_out);
+    } while (flush != Z_FINISH);
+
+    deflateEnd(&stream);
+    return true;
+
+error:
+    deflateEnd(&stream);
+    return false;
+}
+
+#if defined(HAVE_BROTLI)
+static bool brotli_file(int in_fd, int out_fd, int level, size_t size)
+{
+    uint8_t in[STORE_CHUNK_SIZE], out[STORE_CHUNK_SIZE];
+    BrotliEncoderState *state;
+    BrotliEncoderOperation op;
+    off_t offset = 0;
+    bool success = false;
+
+    state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (UNLIKELY(!state))
+        return false;
+
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, (uint32_t)level);
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT,
+                              size > UINT32_MAX ? UINT32_MAX : (uint32_t)size);
+
+    do {
+        ssize_t r = read_chunk(in_fd, in, offset);
+        const uint8_t *next_in = in;
+        size_t avail_in;
+
+        if (UNLIKELY(r < 0))
+            goto out;
+
+        offset += r;
+        op = r ? BROTLI_OPERATION_PROCESS : BROTLI_OPERATION_FINISH;
+        avail_in = (size_t)r;
+
+        do {
+            uint8_t *next_out = out;
+            size_t avail_out = sizeof(out);
+
+            if (UNLIKELY(!BrotliEncoderCompressStream(state, op, &avail_in,
+                                                      &next_in, &avail_out,
+                                                      &next_out, NULL)))
+                goto out;
+            if (UNLIKELY(!write_all(out_fd, out, sizeof(out) - avail_out)))
+                goto out;
+        } while (avail_in || BrotliEncoderHasMoreOutput(state));
+    } while (op != BROTLI_OPERATION_FINISH);
+
+    success = BrotliEncoderIsFinished(state);
+
+out:
+    BrotliEncoderDestroyInstance(state);
+    return success;
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+static bool zstd_file(int in_fd,
+                      int out_fd,
+                      int level,
+                      size_t size __attribute__((unused)))
+{
+    char in[STORE_CHUNK_SIZE], out[STORE_CHUNK_SIZE];
+    ZSTD_EndDirective mode;
+    ZSTD_CCtx *cctx;
+    off_t offset = 0;
+    bool success = false;
+
+    cctx = ZSTD_createCCtx();
+    if (UNLIKELY(!cctx))
+        return false;
+
+    if (ZSTD_isError(
+            ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level)))
+        goto out;
+
+    do {
+        ssize_t r = read_chunk(in_fd, in, offset);
+        ZSTD_inBuffer input = {.src = in};
+        bool finished;
+
+        if (UNLIKELY(r < 0))
+            goto out;
+
+        offset += r;
+        mode = r ? ZSTD_e_continue : ZSTD_e_end;
+        input.size = (size_t)r;
+
+        do {
+            ZSTD_outBuffer output = {.dst = out, .size = sizeof(out)};
+            size_t remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+
+            if (UNLIKELY(ZSTD_isError(remaining)))
+                goto out;
+            if (UNLIKELY(!write_all(out_fd, out, output.pos)))
+                goto out;
+
+            finished = mode == ZSTD_e_end ? !remaining
+                                          : input.pos == input.size;
+        } while (!finished);
+    } while (mode != ZSTD_e_end);
+
+    success = true;
+
+out:
+    ZSTD_freeCCtx(cctx);
+    return success;
+}
+#endif
+
+/* In the order they're produced.  If gzip isn't worth it, the others
+ * aren't even tried. */
+static const struct store_algorithm store_algorithms[] = {
+    {
+        .extension = "gz",
+        .level = Z_BEST_COMPRESSION,
+        .offset = offsetof(struct stored_variants, gzip),
+        .compress = gzip_file,
+    },
+#if defined(HAVE_ZSTD)
+    {
+        .extension = "zst",
+        .level = 19,
+        .offset = offsetof(struct stored_variants, zstd),
+        .compress = zstd_file,
+    },
+#endif
+#if defined(HAVE_BROTLI)
+    {
+        .extension = "br",
+        .level = BROTLI_MAX_QUALITY,
+        .offset = offsetof(struct stored_variants, brotli),
+        .compress = brotli_file,
+    },
+#endif
+};
+
+static ALWAYS_INLINE struct stored_variant *
+stored_variant(struct stored_variants *sv, const struct store_algorithm *alg)
+{
+    return (struct stored_variant *)((char *)sv + alg->offset);
+}
+
+static bool store_artifact_name(const struct stat *st,
+                                const struct store_algorithm *alg,
+                                char name[static NAME_MAX + 1])
+{
+    int r = snprintf(name, NAME_MAX + 1,
+                     "%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 ".%s%d",
+                     (uint64_t)st->st_dev, (uint64_t)st->st_ino,
+                     (uint64_t)st->st_size,
+                     (uint64_t)st->st_mtim.tv_sec * UINT64_C(1000000000) +
+                         (uint64_t)st->st_mtim.tv_nsec,
+                     alg->extension, alg->level);
+
+    return r >= 0 && r <= NAME_MAX;
+}
+
+/* Returns a file descriptor for the artifact, -ENODATA if compressing
+ * isn't worth it, or -ENOENT if it hasn't been produced yet. */
+static int store_open_artifact(const struct compressed_store *store,
+                               const struct stat *st,
+                               const struct store_algorithm *alg,
+                               size_t *size)
+{
+    char name[NAME_MAX + 1];
+    struct stat artifact_st;
+    int fd;
+
+    if (UNLIKELY(!store_artifact_name(st, alg, name)))
+        return -ENODATA;
+
+    fd = openat(store->dir_fd, name, open_mode);
+    if (fd < 0)
+        return -ENOENT;
+
+    if (UNLIKELY(fstat(fd, &artifact_st) < 0)) {
+        close(fd);
+        return -ENOENT;
+    }
+
+    /* The modification time of artifacts is used to evict the least
+     * recently used ones when the store grows past its budget. */
+    (void)futimens(fd, NULL);
+
+    if (!artifact_st.st_size) {
+        close(fd);
+        return -ENODATA;
+    }
+
+    *size = (size_t)artifact_st.st_size;
+    return fd;
+}
+
+static void stored_variants_free(struct stored_variants *sv)
+{
+    if (!sv)
+        return;
+
+    for (size_t i = 0; i < N_ELEMENTS(store_algorithms); i++) {
+        const struct stored_variant *variant =
+            stored_variant(sv, &store_algorithms[i]);
+
+        if (variant->fd >= 0)
+            close(variant->fd);
+    }
+
+    free(sv);
+}
+
+/* Returns NULL unless every variant has either been produced or deemed
+ * not worth it. */
+static struct stored_variants *
+stored_variants_open(const struct compressed_store *store,
+                     const struct stat *st)
+{
+    struct stored_variants *sv = malloc(sizeof(*sv));
+
+    if (UNLIKELY(!sv))
+        return NULL;
+
+    for (size_t i = 0; i < N_ELEMENTS(store_algorithms); i++)
+        *stored_variant(sv, &store_algorithms[i]) =
+            (struct stored_variant){.fd = -1};
+
+    for (size_t i = 0; i < N_ELEMENTS(store_algorithms); i++) {
+        struct stored_variant *variant =
+            stored_variant(sv, &store_algorithms[i]);
+
+        variant->fd =
+            store_open_artifact(store, st, &store_algorithms[i], &variant->size);
+        if (variant->fd == -ENOENT) {
+            stored_variants_free(sv);
+            return NULL;
+        }
+    }
+
+    return sv;
+}
+
+static void store_add_artifact(struct compressed_store *store,
+                               int in_fd,
+                               const struct stat *st,
+                               const struct store_algorithm *alg,
+                               bool worth_trying)
+{
+    char name[NAME_MAX + 1], tmp_name[NAME_MAX + 1];
+    struct stat now;
+    off_t size = 0;
+    int out_fd;
+
+    if (UNLIKELY(!store_artifact_name(st, alg, name)))
+        return;
+
+    snprintf(tmp_name, sizeof(tmp_name), "tmp.%d.%u", (int)getpid(),
+             ATOMIC_INC(store->tmp_counter));
+    out_fd = openat(store->dir_fd, tmp_name,
+                    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (UNLIKELY(out_fd < 0)) {
+        lwan_status_perror("Could not create %s in the compressed store",
+                           tmp_name);
+        return;
+    }
+
+    if (worth_trying) {
+        if (!alg->compress(in_fd, out_fd, alg->level, (size_t)st->st_size))
+            goto remove;
+
+        /* Don't store anything under the old name if the file changed
+         * while it was being compressed. */
+        if (fstat(in_fd, &now) < 0 || !same_file_state(st, &now))
+            goto remove;
+
+        size = lseek(out_fd, 0, SEEK_CUR);
+        if (UNLIKELY(size < 0))
+            goto remove;
+        if (!is_compression_worthy((size_t)size, (size_t)st->st_size)) {
+            if (UNLIKELY(ftruncate(out_fd, 0) < 0))
+                goto remove;
+            size = 0;
+        }
+    }
+
+    /* Rename only when the contents are on disk, so that artifacts are
+     * either complete or absent after a crash. */
+    if (UNLIKELY(fdatasync(out_fd) < 0))
+        goto remove;
+    if (UNLIKELY(renameat(store->dir_fd, tmp_name, store->dir_fd, name) < 0))
+        goto remove;
+
+    close(out_fd);
+    ATOMIC_AAF(&store->size, (size_t)size);
+    return;
+
+remove:
+    close(out_fd);
+    unlinkat(store->dir_fd, tmp_name, 0);
+}
+
+static int store_file_cmp(const void *a, const void *b)
+{
+    const struct store_file *fa = a, *fb = b;
+
+    if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+        return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+    if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+        return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Lists artifacts in the store, returning their total size.  Temporary
+ * files older than an hour have been left behind by a crash and are
+ * removed. */
+static size_t store_scan(struct compressed_store *store,
+                         struct store_file_list *files)
+{
+    const time_t stale_tmp = time(NULL) - 3600;
+    struct dirent *entry;
+    size_t total = 0;
+    DIR *dir;
+    int fd;
+
+    fd = openat(store->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (UNLIKELY(fd < 0))
+        return 0;
+    dir = fdopendir(fd);
+    if (UNLIKELY(!dir)) {
+        close(fd);
+        return 0;
+    }
+
+    while ((entry = readdir(dir))) {
+        struct store_file *file;
+        struct stat st;
+
+        if (fstatat(store->dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) <
+                0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+
+        if (!strncmp(entry->d_name, "tmp.", 4)) {
+            if (st.st_mtime < stale_tmp)
+                unlinkat(store->dir_fd, entry->d_name, 0);
+            continue;
+        }
+
+        total += (size_t)st.st_size;
+
+        if (!files)
+            continue;
+        file = store_file_list_append(files);
+        if (UNLIKELY(!file))
+            continue;
+        file->name = strdup(entry->d_name);
+        file->mtime = st.st_mtim;
+        file->size = st.st_size;
+    }
+
+    closedir(dir);
+    return total;
+}
+
+static void store_trim(struct compressed_store *store)
+{
+    struct store_file_list files;
+    struct store_file *file;
+    size_t total, target;
+
+    if (LIKELY(ATOMIC_READ(store->size) <= store->max_size))
+        return;
+    if (pthread_mutex_trylock(&store->trim_lock))
+        return;
+
+    /* Other processes might be using the same store, so look at what's
+     * actually there rather than trusting the counter. */
+    store_file_list_init(&files);
+    total = store_scan(store, &files);
+    store_file_list_sort(&files, store_file_cmp);
+
+    /* Leave some room so that this doesn't run again right away. */
+    target = store->max_size - store->max_size / 10;
+    LWAN_ARRAY_FOREACH (&files, file) {
+        if (total > target && file->name &&
+            !unlinkat(store->dir_fd, file->name, 0))
+            total -= (size_t)file->size;
+        free(file->name);
+    }
+    store_file_list_reset(&files);
+
+    __atomic_store_n(&store->size, total, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&store->trim_lock);
+}
+
+static struct compressed_store *store_open(const char *path, size_t max_size)
+{
+    struct compressed_store *store;
+
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        lwan_status_perror("Could not create compressed store at %s", path);
+        return NULL;
+    }
+
+    store = malloc(sizeof(*store));
+    if (UNLIKELY(!store))
+        return NULL;
+
+    store->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd < 0) {
+        lwan_status_perror("Could not open compressed store at %s", path);
+        goto out_free;
+    }
+    if (pthread_mutex_init(&store->trim_lock, NULL))
+        goto out_close;
+
+    store->max_size = max_size;
+    store->tmp_counter = 0;
+    store->size = store_scan(store, NULL);
+
+    lwan_status_debug("Compressed store at %s holds %zu bytes", path,
+                      store->size);
+
+    return store;
+
+out_close:
+    close(store->dir_fd);
+out_free:
+    free(store);
+    return NULL;
+}
+
+/* The compression queue is only set up after the configuration file has
+ * been read, so whether it's enabled can't be known in store_open(). */
+static void store_check_queue(void *data)
+{
+    const struct serve_files_priv *priv = data;
+
+    if (!lwan_compress_queue_enabled()) {
+        lwan_status_warning("Background compression is disabled; the "
+                            "compressed store for %s won't be filled",
+                            priv->prefix);
+    }
+}
+
+static void store_close(struct compressed_store *store)
+{
+    if (!store)
+        return;
+
+    pthread_mutex_destroy(&store->trim_lock);
+    close(store->dir_fd);
+    free(store);
+}
+
+static void store_job_run(void *data, bool cancelled)
+{
+    struct file_cache_entry *fce = data;
+    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+    struct compressed_store *store = fce->priv->store;
+    struct stored_variants *sv;
+    bool worth_trying = true;
+    struct stat st;
+
+    if (cancelled || fstat(sd->uncompressed.fd, &st) < 0)
+        goto out;
+
+    for (size_t i = 0; i < N_ELEMENTS(store_algorithms); i++) {
+        const struct store_algorithm *alg = &store_algorithms[i];
+        size_t size;
+        int fd = store_open_artifact(store, &st, alg, &size);
+
+        if (fd >= 0) {
+            close(fd);
+            continue;
+        }
+        if (fd == -ENOENT) {
+            store_add_artifact(store, sd->uncompressed.fd, &st, alg,
+                               worth_trying);
+            fd = store_open_artifact(store, &st, alg, &size);
+            if (fd >= 0)
+                close(fd);
+        }
+        if (fd == -ENODATA && i == 0)
+            worth_trying = false;
+    }
+
+    sv = stored_variants_open(store, &st);
+    if (sv)
+        __atomic_store_n(&sd->stored, sv, __ATOMIC_RELEASE);
+
+    store_trim(store);
+
+out:
+    cache_entry_unref(fce->priv->cache, (struct cache_entry *)fce);
+}
+
+static void store_in_background(struct file_cache_entry *fce)
+{
+    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+
+    if (LIKELY(!ATOMIC_READ(sd->store_pending)))
+        return;
+    if (!__sync_bool_compare_and_swap(&sd->store_pending, 1, 0))
+        return;
+
+    if (!cache_entry_try_ref((struct cache_entry *)fce))
+        return;
+
+    if (LIKELY(lwan_compress_queue_add(store_job_run, fce)))
+        return;
+
+    cache_entry_unref(fce->priv->cache, (struct cache_entry *)fce);
+    ATOMIC_INC(sd->store_pending);
+}
+
+static const struct stored_variant *
+stored_variant_for_request(struct sendfile_cache_data *sd,
+                           const struct lwan_request *request,
+                           const struct lwan_key_value **compression_hdr)
+{
+    const struct stored_variants *sv =
+        __atomic_load_n(&sd->stored, __ATOMIC_ACQUIRE);
+
+    if (LIKELY(!sv))
+        return NULL;
+
+#if defined(HAVE_BROTLI)
+    if (sv->brotli.size && (request->flags & REQUEST_ACCEPT_BROTLI)) {
+        *compression_hdr = &br_compression_hdr;
+        return &sv->brotli;
+    }
+#endif
+#if defined(HAVE_ZSTD)
+    if (sv->zstd.size && (request->flags & REQUEST_ACCEPT_ZSTD)) {
+        *compression_hdr = &zstd_compression_hdr;
+        return &sv->zstd;
+    }
+#endif
+    if (sv->gzip.size && (request->flags & REQUEST_ACCEPT_GZIP)) {
+        *compression_hdr = &gzip_compression_hdr;
+        return &sv->gzip;
+    }
+
+    return NULL;
+}
+
+static bool sendfile_init(struct file_cache_entry *ce,
+                          struct serve_files_priv *priv,
+                          const char *full_path,
+                          struct stat *st)
+{
+    struct sendfile_cache_data *sd = &ce->sendfile_cache_data;
+    const char *relpath = full_path + priv->root_path_len;
+
+    ce->mime_type = lwan_determine_mime_type_for_file_name(relpath);
+
+    sd->uncompressed.fd = openat(priv->root_fd, relpath + 1, open_mode);
+    if (UNLIKELY(sd->uncompressed.fd < 0)) {
+        switch (errno) {
+        case ENFILE:
+        case EMFILE:
+        case EACCES:
+            /* These errors should produce responses other than 404, so
+             * store errno as the file descriptor.  */
+            sd->uncompressed.fd = sd->compressed.fd = sd->zstd.fd = -errno;
+            sd->compressed.size = sd->zstd.size = sd->uncompressed.size = 0;
+            sd->stored = NULL;
+            sd->store_pending = 0;
+
+            return true;
+        }
+
+        return false;
+    }
+
+    /* If precompressed files can be served, try opening them */
+    if (LIKELY(priv->serve_precompressed_files)) {
+        sd->compressed.fd = try_open_compressed(relpath, ".gz", priv, st,
+                                                &sd->compressed.size);
+        sd->zstd.fd =
+            try_open_compressed(relpath, ".zst", priv, st, &sd->zstd.size);
+    } else {
+        sd->compressed.fd = sd->zstd.fd = -ENOENT;
+        sd->compressed.size = sd->zstd.size = 0;
+    }
+
+    sd->stored = NULL;
+    sd->store_pending = 0;
+    if (priv->store) {
+        sd->stored = stored_variants_open(priv->store, st);
+        sd->store_pending = !sd->stored && lwan_compress_queue_enabled() &&
+                            (size_t)st->st_size <= priv->store->max_size;
+    }
+
+    sd->uncompressed.size = (size_t)st->st_size;
+    try_readahead(priv, sd->uncompressed.fd, sd->uncompressed.size);
+
+    return true;
+}
+
+static const char *get_rel_path(const char *full_path,
+                                const struct serve_files_priv *priv)
+{
+    const char *root_path = full_path + priv->root_path_len;
+
+    if (priv->root_path_len == 1) {
+        /* If root path length is 1, it's actually "/".   Don't skip
+         * the first forward slash if serving from root directory. */
+        root_path--;
     }
 
     if (*root_path)
         return root_path;
 
-    if (streq(priv->prefix, "/"))
-        return "";
+    if (streq(priv->prefix, "/"))
+        return "";
+
+    return priv->prefix;
+}
+
+static const char *dirlist_find_readme(struct lwan_strbuf *readme,
+                                       const struct serve_files_priv *priv,
+                                       const char *full_path)
+{
+    static const char *candidates[] = {"readme", "readme.txt", "read.me",
+                                       "README.TXT", "README"};
+    int fd = -1;
+
+    if (!priv->auto_index_readme)
+        return NULL;
+
+    for (size_t i = 0; i < N_ELEMENTS(candidates); i++) {
+        char buffer[PATH_MAX];
+        int r;
+
+        r = snprintf(buffer, PATH_MAX, "%s/%s", full_path, candidates[i]);
+        if (r < 0 || r >= PATH_MAX)
+            continue;
+
+        fd = open(buffer, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        while (true) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                goto error;
+            }
+            if (!n)
+                break;
+
+            if (!lwan_strbuf_append_str(readme, buffer, (size_t)n))
+                goto error;
+        }
+
+        close(fd);
+        return lwan_strbuf_get_buffer(readme);
+    }
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static bool dirlist_init(struct file_cache_entry *ce,
+                         struct serve_files_priv *priv,
+                         const char *full_path,
+                         struct stat *st __attribute__((unused)))
+{
+    struct dir_list_cache_data *dd = &ce->dir_list_cache_data;
+    struct lwan_strbuf readme;
+    bool ret = false;
+
+    if (priv->auto_index_stream_threshold) {
+        dd->full_path = strdup(full_path);
+        ce->mime_type = "text/html";
+        return dd->full_path != NULL;
+    }
+    dd->full_path = NULL;
+
+    if (!lwan_strbuf_init(&readme))
+        return false;
+    if (!lwan_strbuf_init(&dd->rendered))
+        goto out_free_readme;
+
+    struct file_list vars = {
+        .full_path = full_path,
+        .rel_path = get_rel_path(full_path, priv),
+        .readme = dirlist_find_readme(&readme, priv, full_path),
+    };
+
+    if (!lwan_tpl_apply_with_buffer(priv->directory_list_tpl, &dd->rendered,
+                                    &vars))
+        goto out_free_rendered;
+
+    ce->mime_type = "text/html";
+
+    struct lwan_value rendered = {
+        .value = lwan_strbuf_get_buffer(&dd->rendered),
+        .len = lwan_strbuf_get_length(&dd->rendered),
+    };
+    compressed_data_init(&dd->compressed, priv, &rendered);
+
+    ret = true;
+    goto out_free_readme;
+
+out_free_rendered:
+    lwan_strbuf_free(&dd->rendered);
+out_free_readme:
+    lwan_strbuf_free(&readme);
+    return ret;
+}
+
+static bool redir_init(struct file_cache_entry *ce,
+                       struct serve_files_priv *priv,
+                       const char *full_path,
+                       struct stat *st __attribute__((unused)))
+{
+    struct redir_cache_data *rd = &ce->redir_cache_data;
+
+    if (asprintf(&rd->redir_to, "%s/", full_path + priv->root_path_len) < 0)
+        return false;
+
+    ce->mime_type = "text/plain";
+    return true;
+}
+
+static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
+                                           const char *key,
+                                           char *full_path,
+                                           struct stat *st)
+{
+    char index_html_path_buf[PATH_MAX];
+    char *index_html_path = index_html_path_buf;
+
+    if (S_ISDIR(st->st_mode)) {
+        /* It is a directory. It might be the root directory (empty key), or
+         * something else.  In either case, tack priv->index_html to the
+         * path.  */
+        if (*key == '\0') {
+            index_html_path = (char *)priv->index_html;
+        } else {
+            /* Redirect /path to /path/. This is to help cases where there's
+             * something like <img src="../foo.png">, so that actually
+             * /path/../foo.png is served instead of /path../foo.png.  */
+            const char *key_end = rawmemchr(key, '\0');
+            if (*(key_end - 1) != '/')
+                return &redir_funcs;
+
+            int ret = snprintf(index_html_path, PATH_MAX, "%s%s", key,
+                               priv->index_html);
+            if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
+                return NULL;
+        }
+
+        /* See if it exists. */
+        if (fstatat(priv->root_fd, index_html_path, st, 0) < 0) {
+            if (UNLIKELY(errno != ENOENT))
+                return NULL;
+
+            if (LIKELY(priv->auto_index)) {
+                /* If it doesn't, we want to generate a directory list. */
+                return &dirlist_funcs;
+            }
+
+            /* Auto index is disabled. */
+            return NULL;
+        }
+
+        /* Only serve world-readable indexes. */
+        if (UNLIKELY(!is_world_readable(st->st_mode)))
+            return NULL;
+
+        /* If it does, we want its full path. */
+
+        /* FIXME: Use strlcpy() here instead of calling strlen()? */
+        if (UNLIKELY(priv->root_path_len + 1 /* slash */ +
+                         strlen(index_html_path) + 1 >=
+                     PATH_MAX))
+            return NULL;
+
+        full_path[priv->root_path_len] = '/';
+        strncpy(full_path + priv->root_path_len + 1, index_html_path,
+                PATH_MAX - priv->root_path_len - 1);
+    }
+
+    /* Only serve regular files. */
+    if (UNLIKELY(!S_ISREG(st->st_mode)))
+        return NULL;
+
+    /* It's not a directory: choose the fastest way to serve the file
+     * judging by its size. */
+    if (priv->slab && (size_t)st->st_size <= priv->slab_max_file_size)
+        return &slab_funcs;
+    if (st->st_size < MMAP_SIZE_THRESHOLD)
+        return &mmap_funcs;
+
+    return &sendfile_funcs;
+}
+
+static struct file_cache_entry *
+create_cache_entry_from_funcs(struct serve_files_priv *priv,
+                              const char *full_path,
+                              struct stat *st,
+                              const struct cache_funcs *funcs)
+{
+    struct file_cache_entry *fce;
+
+    fce = malloc(sizeof(*fce));
+    if (UNLIKELY(!fce))
+        return NULL;
+
+    fce->etag = NULL;
+    fce->watch = NULL;
+    if (LIKELY(funcs->init(fce, priv, full_path, st))) {
+        fce->funcs = funcs;
+        fce->priv = priv;
+        return fce;
+    }
+
+    free(fce);
+
+    /* The slab store might be full. */
+    if (funcs == &slab_funcs)
+        return create_cache_entry_from_funcs(priv, full_path, st, &mmap_funcs);
+
+    if (funcs != &mmap_funcs)
+        return NULL;
+
+    return create_cache_entry_from_funcs(priv, full_path, st, &sendfile_funcs);
+}
+
+/* Assets served straight from a pack produced by packgen: lookups are a
+ * probe into a hash table in memory that's already mapped, without any
+ * per-file system calls, file descriptors, or cache entries. */
+struct pack {
+    const char *base;
+    size_t size;
+    const struct lwan_pack_entry *entries;
+    const uint32_t *buckets;
+    uint32_t n_buckets;
+    struct stat st;
+    int refs;
+};
+
+struct packed_assets {
+    char *path;
+    struct pack *current;
+    struct stat rejected; /* Last pack that couldn't be loaded */
+    pthread_rwlock_t lock;
+};
+
+static bool pack_blob_is_valid(const struct pack *pack,
+                               const struct lwan_pack_blob *blob,
+                               bool is_string)
+{
+    if (blob->off > pack->size || blob->len > pack->size - blob->off)
+        return false;
+    if (!is_string)
+        return true;
+
+    return blob->len < pack->size - blob->off &&
+           pack->base[blob->off + blob->len] == '\0' &&
+           !memchr(pack->base + blob->off, '\0', blob->len);
+}
+
+static bool pack_entry_is_valid(const struct pack *pack,
+                                const struct lwan_pack_entry *entry)
+{
+    if (!pack_blob_is_valid(pack, &entry->path, true))
+        return false;
+    if (entry->hash != lwan_pack_hash(pack->base + entry->path.off))
+        return false;
+    if (entry->mime_type.len &&
+        !pack_blob_is_valid(pack, &entry->mime_type, true))
+        return false;
+    for (int i = 0; i < LWAN_PACK_N_VARIANTS; i++) {
+        if (!pack_blob_is_valid(pack, &entry->variants[i], false))
+            return false;
+    }
+
+    return strnlen(entry->last_modified, sizeof(entry->last_modified)) == 29 &&
+           strnlen(entry->etag, sizeof(entry->etag)) < sizeof(entry->etag);
+}
+
+static bool pack_is_valid(struct pack *pack)
+{
+    const struct lwan_pack_header *header = (const void *)pack->base;
+    uint64_t entries_size, buckets_size;
+
+    if (pack->size < sizeof(*header))
+        return false;
+    if (memcmp(header->magic, LWAN_PACK_MAGIC, sizeof(header->magic)) ||
+        header->version != LWAN_PACK_VERSION ||
+        header->entry_size != sizeof(struct lwan_pack_entry) ||
+        header->size != pack->size)
+        return false;
+
+    if (!header->n_buckets || (header->n_buckets & (header->n_buckets - 1)) ||
+        header->n_buckets <= header->n_entries)
+        return false;
+
+    entries_size = (uint64_t)header->n_entries * sizeof(*pack->entries);
+    buckets_size = (uint64_t)header->n_buckets * sizeof(*pack->buckets);
+    if (header->entries_off % _Alignof(struct lwan_pack_entry) ||
+        header->entries_off > pack->size ||
+        entries_size > pack->size - header->entries_off)
+        return false;
+    if (header->buckets_off % _Alignof(uint32_t) ||
+        header->buckets_off > pack->size ||
+        buckets_size > pack->size - header->buckets_off)
+        return false;
+
+    pack->entries = (const void *)(pack->base + header->entries_off);
+    pack->buckets = (const void *)(pack->base + header->buckets_off);
+    pack->n_buckets = header->n_buckets;
+
+    for (uint32_t i = 0; i < header->n_entries; i++) {
+        if (!pack_entry_is_valid(pack, &pack->entries[i]))
+            return false;
+    }
+    for (uint32_t i = 0; i < header->n_buckets; i++) {
+        if (pack->buckets[i] > header->n_entries)
+            return false;
+    }
+
+    return true;
+}
+
+static struct pack *pack_open(const char *path)
+{
+    struct pack *pack;
+    void *base;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lwan_status_perror("Could not open pack %s", path);
+        return NULL;
+    }
+
+    pack = malloc(sizeof(*pack));
+    if (UNLIKELY(!pack))
+        goto out_close;
+
+    if (fstat(fd, &pack->st) < 0 || !pack->st.st_size) {
+        lwan_status_error("Could not obtain size of pack %s", path);
+        goto out_free;
+    }
+
+    base = mmap(NULL, (size_t)pack->st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        lwan_status_perror("Could not map pack %s", path);
+        goto out_free;
+    }
+
+    pack->base = base;
+    pack->size = (size_t)pack->st.st_size;
+    pack->refs = 1;
+    if (!pack_is_valid(pack)) {
+        lwan_status_error("%s is not a valid pack", path);
+        goto out_unmap;
+    }
+
+    close(fd);
+    return pack;
+
+out_unmap:
+    munmap(base, pack->size);
+out_free:
+    free(pack);
+out_close:
+    close(fd);
+    return NULL;
+}
+
+static void pack_unref(struct pack *pack)
+{
+    if (ATOMIC_DEC(pack->refs))
+        return;
+
+    munmap((void *)pack->base, pack->size);
+    free(pack);
+}
+
+static void pack_unref_defer(void *data)
+{
+    pack_unref(data);
+}
+
+static bool same_pack_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Deploys replace the pack by renaming a new one over it: map it once it
+ * shows up, and let requests still using the old one finish with it.  Only
+ * called while the module is being initialized and from the job thread, so
+ * I/O threads never stat(), map, or validate a pack. */
+static bool packed_assets_reload(void *data)
+{
+    struct packed_assets *assets = data;
+    struct pack *old, *new;
+    struct stat st;
+
+    /* Returning true keeps the job thread waking up every second, so that
+     * a new pack is picked up as quickly as it'd be if I/O threads looked
+     * for it. */
+    old = assets->current;
+    if (stat(assets->path, &st) < 0 || (old && same_pack_file(&old->st, &st)))
+        return true;
+    if (same_pack_file(&assets->rejected, &st))
+        return true;
+
+    new = pack_open(assets->path);
+    if (!new) {
+        assets->rejected = st;
+        return true;
+    }
+
+    pthread_rwlock_wrlock(&assets->lock);
+    assets->current = new;
+    pthread_rwlock_unlock(&assets->lock);
+
+    lwan_status_debug("Loaded pack %s with %u entries", assets->path,
+                      ((const struct lwan_pack_header *)new->base)->n_entries);
+
+    if (old)
+        pack_unref(old);
+
+    return true;
+}
+
+static struct pack *packed_assets_get_and_ref(struct packed_assets *assets)
+{
+    struct pack *pack;
+
+    pthread_rwlock_rdlock(&assets->lock);
+    pack = assets->current;
+    if (LIKELY(pack))
+        ATOMIC_INC(pack->refs);
+    pthread_rwlock_unlock(&assets->lock);
+
+    return pack;
+}
+
+static struct packed_assets *packed_assets_open(const char *path)
+{
+    struct packed_assets *assets = malloc(sizeof(*assets));
+
+    if (UNLIKELY(!assets))
+        return NULL;
+
+    assets->path = strdup(path);
+    if (UNLIKELY(!assets->path))
+        goto out_free;
+    if (pthread_rwlock_init(&assets->lock, NULL))
+        goto out_free_path;
+
+    assets->current = NULL;
+    assets->rejected = (struct stat){};
+    packed_assets_reload(assets);
+    if (!assets->current) {
+        lwan_status_warning("Pack %s not loaded yet; will keep looking for it",
+                            path);
+    }
+
+    lwan_job_add(packed_assets_reload, assets);
+
+    return assets;
+
+out_free_path:
+    free(assets->path);
+out_free:
+    free(assets);
+    return NULL;
+}
+
+static void packed_assets_close(struct packed_assets *assets)
+{
+    if (!assets)
+        return;
+
+    lwan_job_del(packed_assets_reload, assets);
+
+    if (assets->current)
+        pack_unref(assets->current);
+    pthread_rwlock_destroy(&assets->lock);
+    free(assets->path);
+    free(assets);
+}
+
+static const struct lwan_pack_entry *pack_find(const struct pack *pack,
+                                               const char *path)
+{
+    const uint64_t hash = lwan_pack_hash(path);
+    const uint32_t mask = pack->n_buckets - 1;
+
+    for (uint32_t i = (uint32_t)hash & mask, n = 0; n < pack->n_buckets;
+         i = (i + 1) & mask, n++) {
+        const struct lwan_pack_entry *entry;
+        uint32_t index = pack->buckets[i];
+
+        if (!index)
+            break;
+
+        entry = &pack->entries[index - 1];
+        if (entry->hash == hash && streq(pack->base + entry->path.off, path))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Builds a cache key the same way it'd be obtained from a request URL:
+ * the handler prefix and any leading slashes are stripped from it. */
+static bool cache_key_for_path(const char *rel_path,
+                               const char *suffix,
+                               char key[static PATH_MAX])
+{
+    int r = snprintf(key, PATH_MAX, "%s%s", rel_path, suffix);
+
+    return r >= 0 && r < PATH_MAX;
+}
+
+struct watched_dir {
+    struct list_node dirs;
+    char *rel_path; /* Relative to the root; "" for the root itself */
+    int wd;         /* -1 once the directory isn't watched anymore */
+    unsigned int generation;
+    /* One for the watcher while the directory is watched, plus one for
+     * each cache entry pointing to it. */
+    unsigned int refs;
+};
+
+static void watched_dir_unref(struct watched_dir *dir)
+{
+    if (dir && !ATOMIC_DEC(dir->refs)) {
+        free(dir->rel_path);
+        free(dir);
+    }
+}
+
+#if defined(HAVE_INOTIFY)
+#define WATCH_MASK                                                             \
+    (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |          \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |            \
+     IN_ONLYDIR | IN_DONT_FOLLOW)
+
+struct watcher {
+    struct serve_files_priv *priv;
+
+    int inotify_fd;
+    int wakeup_fd[2];
+    pthread_t self;
+
+    /* Written only by the watcher thread, with the lock held; read by the
+     * I/O threads while creating cache entries. */
+    pthread_rwlock_t lock;
+    struct hash *by_wd;
+    struct hash *by_path;
+    struct list_head dirs;
+
+    bool warned_about_limit;
+};
+
+static void watcher_forget_dir(struct watcher *watcher, struct watched_dir *dir)
+{
+    /* Entries pointing to this directory won't be renewed anymore, and
+     * will be evicted after cache_period like any other. */
+    ATOMIC_INC(dir->generation);
+
+    if (dir->wd < 0)
+        return;
+
+    pthread_rwlock_wrlock(&watcher->lock);
+    hash_del(watcher->by_wd, (void *)(intptr_t)dir->wd);
+    hash_del(watcher->by_path, dir->rel_path);
+    dir->wd = -1;
+    pthread_rwlock_unlock(&watcher->lock);
+
+    list_del_from(&watcher->dirs, &dir->dirs);
+    watched_dir_unref(dir);
+}
+
+static void watcher_add_tree(struct watcher *watcher, const char *rel_path)
+{
+    struct serve_files_priv *priv = watcher->priv;
+    char full_path[PATH_MAX];
+    struct watched_dir *dir;
+    struct dirent *entry;
+    DIR *dir_stream;
+    int wd, fd, r;
+
+    r = snprintf(full_path, sizeof(full_path), "%s%s%s", priv->root_path,
+                 *rel_path ? "/" : "", rel_path);
+    if (UNLIKELY(r < 0 || r >= (int)sizeof(full_path)))
+        return;
+
+    wd = inotify_add_watch(watcher->inotify_fd, full_path, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC && !watcher->warned_about_limit) {
+            lwan_status_warning("inotify watch limit reached; files under %s "
+                                "(and possibly others) will be cached for "
+                                "cache_period only",
+                                full_path);
+            watcher->warned_about_limit = true;
+        }
+        return;
+    }
+    if (hash_find(watcher->by_wd, (void *)(intptr_t)wd))
+        return;
+
+    dir = malloc(sizeof(*dir));
+    if (UNLIKELY(!dir))
+        goto remove_watch;
+    dir->rel_path = strdup(rel_path);
+    if (UNLIKELY(!dir->rel_path)) {
+        free(dir);
+        goto remove_watch;
+    }
+    dir->wd = wd;
+    dir->generation = 0;
+    dir->refs = 1;
+    list_add_tail(&watcher->dirs, &dir->dirs);
+
+    pthread_rwlock_wrlock(&watcher->lock);
+    hash_add(watcher->by_wd, (void *)(intptr_t)wd, dir);
+    hash_add(watcher->by_path, dir->rel_path, dir);
+    pthread_rwlock_unlock(&watcher->lock);
+
+    fd = openat(priv->root_fd, *rel_path ? rel_path : ".",
+                open_mode | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0)
+        return;
+    dir_stream = fdopendir(fd);
+    if (UNLIKELY(!dir_stream)) {
+        close(fd);
+        return;
+    }
+
+    while ((entry = readdir(dir_stream))) {
+        char child[PATH_MAX];
+        struct stat st;
+
+        if (entry->d_name[0] == '.' &&
+            (!entry->d_name[1] ||
+             (entry->d_name[1] == '.' && !entry->d_name[2])))
+            continue;
+
+        if (fstatat(dirfd(dir_stream), entry->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISDIR(st.st_mode))
+            continue;
+
+        r = snprintf(child, sizeof(child), "%s%s%s", rel_path,
+                     *rel_path ? "/" : "", entry->d_name);
+        if (LIKELY(r >= 0 && r < (int)sizeof(child)))
+            watcher_add_tree(watcher, child);
+    }
+
+    closedir(dir_stream);
+    return;
+
+remove_watch:
+    inotify_rm_watch(watcher->inotify_fd, wd);
+}
+
+static void watcher_remove_tree(struct watcher *watcher, const char *rel_path)
+{
+    const size_t len = strlen(rel_path);
+    struct watched_dir *dir, *next;
+
+    list_for_each_safe (&watcher->dirs, dir, next, dirs) {
+        if (strncmp(dir->rel_path, rel_path, len))
+            continue;
+        if (dir->rel_path[len] != '\0' && dir->rel_path[len] != '/')
+            continue;
+
+        inotify_rm_watch(watcher->inotify_fd, dir->wd);
+        watcher_forget_dir(watcher, dir);
+    }
+}
+
+static void watcher_invalidate(struct watcher *watcher,
+                               const char *rel_path,
+                               const char *suffix)
+{
+    char key[PATH_MAX];
+
+    if (cache_key_for_path(rel_path, suffix, key))
+        cache_invalidate(watcher->priv->cache, key);
+}
+
+static void watcher_invalidate_tree(struct watcher *watcher,
+                                    const char *rel_path)
+{
+    char prefix[PATH_MAX];
+
+    if (cache_key_for_path(rel_path, "/", prefix))
+        cache_invalidate_prefix(watcher->priv->cache, prefix);
+}
+
+static void watcher_forget_missing(struct watcher *watcher,
+                                   const char *rel_path)
+{
+    char prefix[PATH_MAX];
+
+    if (!watcher->priv->missing)
+        return;
+
+    /* Anything under a directory that changed might exist now. */
+    if (cache_key_for_path(rel_path, *rel_path ? "/" : "", prefix))
+        cache_invalidate_prefix(watcher->priv->missing, prefix);
+}
+
+static void watcher_invalidate_path(struct watcher *watcher,
+                                    const char *rel_path)
+{
+    static const char *compressed_exts[] = {".gz", ".zst"};
+    const size_t len = strlen(rel_path);
+
+    /* The entry itself, or, for directories, its redirect and its listing
+     * (or index file). */
+    watcher_invalidate(watcher, rel_path, "");
+    if (*rel_path)
+        watcher_invalidate(watcher, rel_path, "/");
+
+    /* Changes to precompressed files affect the entry for the original. */
+    for (size_t i = 0; i < N_ELEMENTS(compressed_exts); i++) {
+        const size_t ext_len = strlen(compressed_exts[i]);
+        char original[PATH_MAX];
+
+        if (len <= ext_len || len >= sizeof(original) ||
+            !streq(rel_path + len - ext_len, compressed_exts[i]))
+            continue;
+
+        memcpy(original, rel_path, len - ext_len);
+        original[len - ext_len] = '\0';
+        watcher_invalidate(watcher, original, "");
+    }
+}
+
+static void watcher_handle_event(struct watcher *watcher,
+                                 const struct inotify_event *event)
+{
+    struct watched_dir *dir;
+
+    if (UNLIKELY(event->mask & IN_Q_OVERFLOW)) {
+        /* Events were lost: don't trust anything that's cached. */
+        lwan_status_warning("inotify queue overflow; evicting everything "
+                            "cached under %s",
+                            watcher->priv->root_path);
+        list_for_each (&watcher->dirs, dir, dirs)
+            ATOMIC_INC(dir->generation);
+        cache_invalidate_prefix(watcher->priv->cache, "");
+        if (watcher->priv->missing)
+            cache_invalidate_prefix(watcher->priv->missing, "");
+        return;
+    }
+
+    dir = hash_find(watcher->by_wd, (void *)(intptr_t)event->wd);
+    if (!dir)
+        return;
+
+    watcher_forget_missing(watcher, dir->rel_path);
+
+    /* Only events on the directory itself stop the entries under it from
+     * being renewed (watcher_forget_dir() bumps its generation); anything
+     * else only invalidates the entries it names. */
+    if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        watcher_invalidate_path(watcher, dir->rel_path);
+        watcher_forget_dir(watcher, dir);
+        return;
+    }
+
+    if (event->len) {
+        char child[PATH_MAX];
+        int r = snprintf(child, sizeof(child), "%s%s%s", dir->rel_path,
+                         *dir->rel_path ? "/" : "", event->name);
+
+        if (LIKELY(r >= 0 && r < (int)sizeof(child))) {
+            watcher_invalidate_path(watcher, child);
+
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    watcher_remove_tree(watcher, child);
+                    watcher_invalidate_tree(watcher, child);
+                }
+                else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    watcher_add_tree(watcher, child);
+            }
+        }
+    }
+
+    /* Directory listings change whenever their contents change. */
+    watcher_invalidate_path(watcher, dir->rel_path);
+}
+
+static void *watcher_thread(void *data)
+{
+    struct watcher *watcher = data;
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    lwan_set_thread_name("watcher");
+
+    while (true) {
+        struct pollfd fds[] = {
+            {.fd = watcher->inotify_fd, .events = POLLIN},
+            {.fd = watcher->wakeup_fd[0], .events = POLLIN},
+        };
+        ssize_t len;
+
+        if (poll(fds, N_ELEMENTS(fds), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            lwan_status_perror("poll");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        len = read(watcher->inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            continue;
+
+        for (char *p = buffer; p < buffer + len;) {
+            const struct inotify_event *event = (struct inotify_event *)p;
+
+            watcher_handle_event(watcher, event);
+            p += sizeof(*event) + event->len;
+        }
+    }
+
+    return NULL;
+}
+
+static bool renew_cache_entry(struct cache_entry *entry,
+                              void *context __attribute__((unused)))
+{
+    const struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+
+    return fce->watch &&
+           ATOMIC_READ(fce->watch->generation) == fce->watch_generation;
+}
+
+/* Finds the watched directory that holds full_path, and snapshots its
+ * generation before the cache entry is built. */
+static struct watched_dir *watcher_find_dir(struct watcher *watcher,
+                                            const char *full_path,
+                                            const struct stat *st,
+                                            unsigned int *generation)
+{
+    const char *rel_path = full_path + watcher->priv->root_path_len;
+    struct watched_dir *dir;
+    char dir_path[PATH_MAX];
+
+    rel_path += *rel_path == '/';
+
+    if (!S_ISDIR(st->st_mode)) {
+        const char *slash = strrchr(rel_path, '/');
+        size_t len = slash ? (size_t)(slash - rel_path) : 0;
+
+        memcpy(dir_path, rel_path, len);
+        dir_path[len] = '\0';
+        rel_path = dir_path;
+    }
+
+    pthread_rwlock_rdlock(&watcher->lock);
+    dir = hash_find(watcher->by_path, rel_path);
+    if (dir) {
+        *generation = ATOMIC_READ(dir->generation);
+        ATOMIC_INC(dir->refs);
+    }
+    pthread_rwlock_unlock(&watcher->lock);
+
+    return dir;
+}
+
+static struct watcher *watcher_start(struct serve_files_priv *priv)
+{
+    struct watcher *watcher = calloc(1, sizeof(*watcher));
+
+    if (!watcher)
+        return NULL;
+
+    watcher->priv = priv;
+    list_head_init(&watcher->dirs);
+
+    watcher->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->inotify_fd < 0) {
+        lwan_status_perror("inotify_init1");
+        goto out_free;
+    }
+    if (pipe2(watcher->wakeup_fd, O_CLOEXEC) < 0) {
+        lwan_status_perror("pipe2");
+        goto out_close_inotify;
+    }
+    if (pthread_rwlock_init(&watcher->lock, NULL))
+        goto out_close_pipe;
+
+    watcher->by_wd = hash_int_new(NULL, NULL);
+    watcher->by_path = hash_str_new(NULL, NULL);
+    if (!watcher->by_wd || !watcher->by_path)
+        goto out_free_hashes;
+
+    watcher_add_tree(watcher, "");
+    lwan_status_debug("Watching %d directories under %s",
+                      hash_get_count(watcher->by_wd), priv->root_path);
+
+    if (pthread_create(&watcher->self, NULL, watcher_thread, watcher)) {
+        lwan_status_perror("pthread_create");
+        goto out_free_dirs;
+    }
+
+    cache_set_renew_entry_cb(priv->cache, renew_cache_entry);
+    return watcher;
+
+out_free_dirs:
+    while (!list_empty(&watcher->dirs)) {
+        struct watched_dir *dir =
+            list_pop(&watcher->dirs, struct watched_dir, dirs);
+        watched_dir_unref(dir);
+    }
+out_free_hashes:
+    if (watcher->by_wd)
+        hash_free(watcher->by_wd);
+    if (watcher->by_path)
+        hash_free(watcher->by_path);
+    pthread_rwlock_destroy(&watcher->lock);
+out_close_pipe:
+    close(watcher->wakeup_fd[0]);
+    close(watcher->wakeup_fd[1]);
+out_close_inotify:
+    close(watcher->inotify_fd);
+out_free:
+    free(watcher);
+    return NULL;
+}
+
+/* Stops the watcher thread, so that it doesn't touch the cache anymore. */
+static void watcher_stop(struct watcher *watcher)
+{
+    if (!watcher)
+        return;
+
+    if (write(watcher->wakeup_fd[1], "", 1) == 1)
+        pthread_join(watcher->self, NULL);
+}
+
+/* Must be called after the cache has been destroyed, as entries point to
+ * the watched directories. */
+static void watcher_free(struct watcher *watcher)
+{
+    if (!watcher)
+        return;
+
+    while (!list_empty(&watcher->dirs)) {
+        struct watched_dir *dir =
+            list_pop(&watcher->dirs, struct watched_dir, dirs);
+        watched_dir_unref(dir);
+    }
+
+    hash_free(watcher->by_wd);
+    hash_free(watcher->by_path);
+    pthread_rwlock_destroy(&watcher->lock);
+    close(watcher->wakeup_fd[0]);
+    close(watcher->wakeup_fd[1]);
+    close(watcher->inotify_fd);
+    free(watcher);
+}
+#else
+static struct watched_dir *
+watcher_find_dir(struct watcher *watcher __attribute__((unused)),
+                 const char *full_path __attribute__((unused)),
+                 const struct stat *st __attribute__((unused)),
+                 unsigned int *generation __attribute__((unused)))
+{
+    return NULL;
+}
+
+static struct watcher *watcher_start(struct serve_files_priv *priv)
+{
+    lwan_status_warning("Watching %s for changes isn't supported on this "
+                        "platform", priv->root_path);
+    return NULL;
+}
 
-    return priv->prefix;
+static void watcher_stop(struct watcher *watcher __attribute__((unused))) {}
+static void watcher_free(struct watcher *watcher __attribute__((unused))) {}
+#endif /* HAVE_INOTIFY */
+
+static void destroy_cache_entry(struct cache_entry *entry,
+                                void *context __attribute__((unused)))
+{
+    struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+
+    fce->funcs->free(fce);
+    watched_dir_unref(fce->watch);
+    free(fce);
 }
 
-static const char *dirlist_find_readme(struct lwan_strbuf *readme,
-                                       struct serve_files_priv *priv,
-                                       const char *full_path)
+static struct cache_entry *create_missing_entry(
+    const char *key __attribute__((unused)),
+    void *context __attribute__((unused)))
 {
-    static const char *candidates[] = {"readme", "readme.txt", "read.me",
-                                       "README.TXT", "README"};
-    int fd = -1;
+    return malloc(sizeof(struct cache_entry));
+}
 
-    if (!priv->auto_index_readme)
+static void destroy_missing_entry(struct cache_entry *entry,
+                                  void *context __attribute__((unused)))
+{
+    free(entry);
+}
+
+static void remember_missing(struct serve_files_priv *priv, const char *key)
+{
+    struct cache_entry *entry;
+    int error;
+
+    if (!priv->missing)
+        return;
+
+    entry = cache_get_and_ref_entry(priv->missing, key, &error);
+    if (LIKELY(entry))
+        cache_entry_unref(priv->missing, entry);
+}
+
+static struct cache_entry *create_cache_entry(const char *key, void *context)
+{
+    struct serve_files_priv *priv = context;
+    struct file_cache_entry *fce;
+    struct stat st;
+    const struct cache_funcs *funcs;
+    struct watched_dir *watch = NULL;
+    unsigned int watch_generation = 0;
+    char full_path[PATH_MAX];
+    int tries = 0;
+
+    if (priv->missing && cache_contains(priv->missing, key))
         return NULL;
 
-    for (size_t i = 0; i < N_ELEMENTS(candidates); i++) {
-        char buffer[PATH_MAX];
-        int r;
+retry:
+    if (UNLIKELY(
+            !realpathat2(priv->root_fd, priv->root_path, key, full_path, &st))) {
+        if (errno == ENOENT || errno == ENOTDIR || errno == ELOOP)
+            remember_missing(priv, key);
+        return NULL;
+    }
 
-        r = snprintf(buffer, PATH_MAX, "%s/%s", full_path, candidates[i]);
-        if (r < 0 || r >= PATH_MAX)
-            continue;
+    if (UNLIKELY(!is_world_readable(st.st_mode))) {
+        remember_missing(priv, key);
+        return NULL;
+    }
 
-        fd = open(buffer, O_RDONLY | O_CLOEXEC);
-        if (fd < 0)
-            continue;
+    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len))) {
+        remember_missing(priv, key);
+        return NULL;
+    }
 
-        while (true) {
-            ssize_t n = read(fd, buffer, sizeof(buffer));
+    funcs = get_funcs(priv, key, full_path, &st);
+    if (UNLIKELY(!funcs))
+        return NULL;
 
-            if (n < 0) {
-                if (errno == EINTR)
-                    continue;
-                goto error;
-            }
-            if (!n)
-                break;
+    if (priv->watcher)
+        watch = watcher_find_dir(priv->watcher, full_path, &st,
+                                 &watch_generation);
 
-            if (!lwan_strbuf_append_str(readme, buffer, (size_t)n))
-                goto error;
+    fce = create_cache_entry_from_funcs(priv, full_path, &st, funcs);
+    if (UNLIKELY(!fce)) {
+        watched_dir_unref(watch);
+        return NULL;
+    }
+
+    if (watch) {
+        struct stat st_after;
+
+        /* If the file changed while the entry was being built, the
+         * invalidation might have happened before it was inserted in the
+         * cache: that's noticed by its state, or by the generation if its
+         * directory went away.  Try again; if it keeps changing, let it
+         * expire instead. */
+        if (ATOMIC_READ(watch->generation) != watch_generation ||
+            stat(full_path, &st_after) < 0 ||
+            !same_file_state(&st, &st_after)) {
+            watched_dir_unref(watch);
+            if (++tries < 3) {
+                destroy_cache_entry((struct cache_entry *)fce, NULL);
+                goto retry;
+            }
+            watch = NULL;
         }
+    }
 
-        close(fd);
-        return lwan_strbuf_get_buffer(readme);
+    fce->watch = watch;
+    fce->watch_generation = watch_generation;
+
+    if (UNLIKELY(lwan_format_rfc_time(st.st_mtime, fce->last_modified.string) <
+                 0)) {
+        destroy_cache_entry((struct cache_entry *)fce, NULL);
+        return NULL;
     }
+    fce->last_modified.integer = st.st_mtime;
 
-error:
-    if (fd >= 0)
-        close(fd);
-    return NULL;
+    return (struct cache_entry *)fce;
 }
 
-static bool dirlist_init(struct file_cache_entry *ce,
-                         struct serve_files_priv *priv,
-                         const char *full_path,
-                         struct stat *st __attribute__((unused)))
+static void mmap_free(struct file_cache_entry *fce)
 {
-    struct dir_list_cache_data *dd = &ce->dir_list_cache_data;
-    struct lwan_strbuf readme;
-    bool ret = false;
+    struct mmap_cache_data *md = &fce->mmap_cache_data;
 
-    if (!lwan_strbuf_init(&readme))
-        return false;
-    if (!lwan_strbuf_init(&dd->rendered))
-        goto out_free_readme;
+    if (md->uncompressed.value) {
+        lwan_madvise_unmap(md->region, md->uncompressed.value,
+                           md->uncompressed.len);
+    } else {
+        close(md->fd);
+    }
+    compressed_data_free(&md->compressed);
+}
 
-    struct file_list vars = {
-        .full_path = full_path,
-        .rel_path = get_rel_path(full_path, priv),
-        .readme = dirlist_find_readme(&readme, priv, full_path),
-    };
+static void slab_free(struct file_cache_entry *fce)
+{
+    struct slab_cache_data *sd = &fce->slab_cache_data;
 
-    if (!lwan_tpl_apply_with_buffer(priv->directory_list_tpl, &dd->rendered,
-                                    &vars))
-        goto out_free_rendered;
+    slab_free_chunk(fce->priv->slab, sd->fast.chunk, sd->fast.chunk_class);
 
-    ce->mime_type = "text/html";
+    if (sd->best) {
+        slab_free_chunk(fce->priv->slab, sd->best->chunk,
+                        sd->best->chunk_class);
+        free(sd->best);
+    }
+}
+
+static void sendfile_free(struct file_cache_entry *fce)
+{
+    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+
+    if (sd->compressed.fd >= 0)
+        close(sd->compressed.fd);
+    if (sd->zstd.fd >= 0)
+        close(sd->zstd.fd);
+    if (sd->uncompressed.fd >= 0)
+        close(sd->uncompressed.fd);
+
+    stored_variants_free(sd->stored);
+}
+
+static void dirlist_free(struct file_cache_entry *fce)
+{
+    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+
+    if (dd->full_path) {
+        free(dd->full_path);
+        return;
+    }
+
+    lwan_strbuf_free(&dd->rendered);
+    compressed_data_free(&dd->compressed);
+}
+
+static void redir_free(struct file_cache_entry *fce)
+{
+    struct redir_cache_data *rd = &fce->redir_cache_data;
+
+    free(rd->redir_to);
+}
+
+static size_t compressed_data_cost(const struct compressed_data *cd,
+                                   size_t uncompressed_len)
+{
+    const struct compressed_variants *cv = &cd->fast;
+    size_t cost = cv->deflated.len;
 
-    struct lwan_value rendered = {
-        .value = lwan_strbuf_get_buffer(&dd->rendered),
-        .len = lwan_strbuf_get_length(&dd->rendered),
-    };
-    deflate_value(&rendered, &dd->deflated);
 #if defined(HAVE_BROTLI)
-    brotli_value(&rendered, &dd->brotli, &dd->deflated);
+    cost += cv->brotli.len;
+#endif
+#if defined(HAVE_ZSTD)
+    cost += cv->zstd.len;
 #endif
 
-    ret = true;
-    goto out_free_readme;
+    /* Variants produced in the background are attached after the entry
+     * has been accounted for; assume they'll be about the same size, or
+     * as large as the uncompressed contents if nothing was compressed. */
+    if (!ATOMIC_READ(cd->pending))
+        return cost;
+    return cost ? cost * 2 : uncompressed_len;
+}
 
-out_free_rendered:
-    lwan_strbuf_free(&dd->rendered);
-out_free_readme:
-    lwan_strbuf_free(&readme);
-    return ret;
+static size_t mmap_cost(const struct file_cache_entry *fce)
+{
+    const struct mmap_cache_data *md = &fce->mmap_cache_data;
+
+    size_t cost = sizeof(*fce) + compressed_data_cost(&md->compressed,
+                                                      md->uncompressed.len);
+
+    return md->uncompressed.value ? cost + md->uncompressed.len : cost;
 }
 
-static bool redir_init(struct file_cache_entry *ce,
-                       struct serve_files_priv *priv,
-                       const char *full_path,
-                       struct stat *st __attribute__((unused)))
+static size_t slab_cost(const struct file_cache_entry *fce)
 {
-    struct redir_cache_data *rd = &ce->redir_cache_data;
+    const struct slab_cache_data *sd = &fce->slab_cache_data;
+    size_t cost = slab_class_size(sd->fast.chunk_class);
+
+    /* See compressed_data_cost(). */
+    return sizeof(*fce) + (ATOMIC_READ(sd->pending) ? cost * 2 : cost);
+}
+
+static size_t sendfile_cost(const struct file_cache_entry *fce)
+{
+    /* File contents live in the page cache; what's limited here is the
+     * number of open file descriptors, through the number of entries. */
+    return sizeof(*fce);
+}
+
+static size_t dirlist_cost(const struct file_cache_entry *fce)
+{
+    const struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+
+    if (dd->full_path)
+        return sizeof(*fce) + strlen(dd->full_path);
+
+    return sizeof(*fce) + lwan_strbuf_get_length(&dd->rendered) +
+           compressed_data_cost(&dd->compressed,
+                                lwan_strbuf_get_length(&dd->rendered));
+}
+
+static size_t redir_cost(const struct file_cache_entry *fce)
+{
+    return sizeof(*fce) + strlen(fce->redir_cache_data.redir_to);
+}
+
+static size_t file_cache_entry_cost(struct cache_entry *entry,
+                                    void *context __attribute__((unused)))
+{
+    const struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+
+    return fce->funcs->cost(fce);
+}
+
+DEFINE_ARRAY_TYPE(preload_list, char *)
+
+struct preload {
+    struct serve_files_priv *priv;
+    struct preload_list keys;
+
+    /* Copied from the settings, as preloading only starts once the server
+     * has been initialized. */
+    char *manifest;
+    size_t budget;
+    unsigned int n_threads;
+    bool wait;
+
+    pthread_t *threads;
+    unsigned int n_started;
+
+    size_t next_key;
+    size_t n_loaded;
+    size_t n_failed;
+    size_t n_skipped; /* Because of the memory budget */
+    size_t used;
+    unsigned int n_finished;
+    int cancelled;
+    bool budget_exhausted; /* While listing files */
+
+    /* Set once the files have been listed, and once they've been
+     * loaded. */
+    size_t n_queued;
+    bool done;
+
+    struct timespec started;
+};
+
+static bool preload_add_key(struct preload *preload, const char *rel_path)
+{
+    char key_buf[PATH_MAX];
+    char **key;
+
+    if (UNLIKELY(!cache_key_for_path(rel_path, "", key_buf)))
+        return true;
+
+    key = preload_list_append(&preload->keys);
+    if (UNLIKELY(!key))
+        return false;
+
+    *key = strdup(key_buf);
+    if (UNLIKELY(!*key)) {
+        preload->keys.base.elements--;
+        return false;
+    }
+
+    return true;
+}
+
+/* Only mmap()ed files count towards the memory budget; larger files are
+ * cached as open file descriptors.  This only weeds out files that can't
+ * possibly fit: the budget is enforced as entries are loaded, with their
+ * actual cost, compressed variants included.  Once a file doesn't fit,
+ * the remaining ones are only listed to be counted as skipped. */
+static bool preload_fits_budget(struct preload *preload,
+                                const struct stat *st,
+                                const char *path,
+                                size_t *budget)
+{
+    size_t size = (size_t)st->st_size;
+
+    if (preload->budget_exhausted)
+        return false;
+    if (st->st_size >= MMAP_SIZE_THRESHOLD)
+        return true;
+    if (size > *budget) {
+        lwan_status_warning("Preload memory budget exhausted at %s", path);
+        preload->budget_exhausted = true;
+        return false;
+    }
+
+    *budget -= size;
+    return true;
+}
+
+static bool preload_walk(struct preload *preload,
+                         int dir_fd,
+                         const char *rel_path,
+                         size_t *budget)
+{
+    DIR *dir;
+    struct dirent *entry;
+    bool keep_going = true;
+
+    dir = fdopendir(dir_fd);
+    if (UNLIKELY(!dir)) {
+        close(dir_fd);
+        return true;
+    }
+
+    while (keep_going && (entry = readdir(dir))) {
+        char path[PATH_MAX];
+        struct stat st;
+        int r;
+
+        if (entry->d_name[0] == '.' &&
+            (!entry->d_name[1] ||
+             (entry->d_name[1] == '.' && !entry->d_name[2])))
+            continue;
+
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (!is_world_readable(st.st_mode))
+            continue;
+
+        r = snprintf(path, sizeof(path), "%s%s%s", rel_path,
+                     *rel_path ? "/" : "", entry->d_name);
+        if (UNLIKELY(r < 0 || r >= (int)sizeof(path)))
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            int fd = openat(dirfd(dir), entry->d_name,
+                            open_mode | O_DIRECTORY | O_NOFOLLOW);
+
+            if (fd >= 0)
+                keep_going = preload_walk(preload, fd, path, budget);
+        } else if (S_ISREG(st.st_mode)) {
+            if (!preload_fits_budget(preload, &st, path, budget))
+                ATOMIC_INC(preload->n_skipped);
+            else
+                keep_going = preload_add_key(preload, path);
+        }
+    }
+
+    closedir(dir);
+    return keep_going;
+}
+
+static void preload_read_manifest(struct preload *preload,
+                                  const char *manifest,
+                                  size_t *budget)
+{
+    char line[PATH_MAX];
+    FILE *file;
+
+    file = fopen(manifest, "re");
+    if (!file) {
+        lwan_status_perror("Could not open preload manifest %s", manifest);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char *path = line;
+        struct stat st;
+
+        path[strcspn(path, "\r\n")] = '\0';
+        while (*path == '/')
+            path++;
+        if (!*path || *path == '#')
+            continue;
+
+        if (fstatat(preload->priv->root_fd, path, &st, 0) < 0 ||
+            !S_ISREG(st.st_mode)) {
+            lwan_status_warning("Not preloading %s: not a regular file", path);
+            continue;
+        }
+
+        if (!preload_fits_budget(preload, &st, path, budget)) {
+            ATOMIC_INC(preload->n_skipped);
+            continue;
+        }
+
+        if (!preload_add_key(preload, path))
+            break;
+    }
+
+    fclose(file);
+}
+
+static bool preload_key(struct serve_files_priv *priv,
+                        const char *key,
+                        size_t *cost)
+{
+    struct cache_entry *ce;
+    bool cached;
+    int error;
 
-    if (asprintf(&rd->redir_to, "%s/", full_path + priv->root_path_len) < 0)
+    ce = cache_get_and_ref_entry(priv->cache, key, &error);
+    if (!ce)
         return false;
 
-    ce->mime_type = "text/plain";
-    return true;
+    /* Entries that couldn't be added to the cache can't be referenced
+     * again. */
+    cached = cache_entry_try_ref(ce);
+    if (cached) {
+        *cost = file_cache_entry_cost(ce, NULL);
+        cache_entry_unref(priv->cache, ce);
+    }
+    cache_entry_unref(priv->cache, ce);
+
+    return cached;
 }
 
-static const struct cache_funcs *get_funcs(struct serve_files_priv *priv,
-                                           const char *key,
-                                           char *full_path,
-                                           struct stat *st)
+static void preload_finished(struct preload *preload, unsigned int n_threads)
 {
-    char index_html_path_buf[PATH_MAX];
-    char *index_html_path = index_html_path_buf;
+    const size_t n_keys = preload->keys.base.elements;
+    struct timespec now;
+    size_t next_key;
 
-    if (S_ISDIR(st->st_mode)) {
-        /* It is a directory. It might be the root directory (empty key), or
-         * something else.  In either case, tack priv->index_html to the
-         * path.  */
-        if (*key == '\0') {
-            index_html_path = (char *)priv->index_html;
-        } else {
-            /* Redirect /path to /path/. This is to help cases where there's
-             * something like <img src="../foo.png">, so that actually
-             * /path/../foo.png is served instead of /path../foo.png.  */
-            const char *key_end = rawmemchr(key, '\0');
-            if (*(key_end - 1) != '/')
-                return &redir_funcs;
+    if (ATOMIC_AAF(&preload->n_finished, n_threads) != preload->n_threads)
+        return;
 
-            int ret = snprintf(index_html_path, PATH_MAX, "%s%s", key,
-                               priv->index_html);
-            if (UNLIKELY(ret < 0 || ret >= PATH_MAX))
-                return NULL;
-        }
+    /* If every thread stopped because of the budget, the files nobody got
+     * to are skipped as well. */
+    next_key = ATOMIC_READ(preload->next_key);
+    if (!ATOMIC_READ(preload->cancelled) && next_key < n_keys)
+        ATOMIC_AAF(&preload->n_skipped, n_keys - next_key);
+    __atomic_store_n(&preload->done, true, __ATOMIC_RELEASE);
+
+    clock_gettime(monotonic_clock_id, &now);
+    lwan_status_info("Preloading %s: %zu of %zu files cached in %ldms%s",
+                     preload->priv->prefix, ATOMIC_READ(preload->n_loaded),
+                     preload->keys.base.elements,
+                     (long)((now.tv_sec - preload->started.tv_sec) * 1000 +
+                            (now.tv_nsec - preload->started.tv_nsec) / 1000000),
+                     ATOMIC_READ(preload->cancelled) ? " (cancelled)" : "");
+}
 
-        /* See if it exists. */
-        if (fstatat(priv->root_fd, index_html_path, st, 0) < 0) {
-            if (UNLIKELY(errno != ENOENT))
-                return NULL;
+static void *preload_thread(void *data)
+{
+    struct preload *preload = data;
+    const size_t n_keys = preload->keys.base.elements;
 
-            if (LIKELY(priv->auto_index)) {
-                /* If it doesn't, we want to generate a directory list. */
-                return &dirlist_funcs;
-            }
+    lwan_set_thread_name("preload");
 
-            /* Auto index is disabled. */
-            return NULL;
-        }
+    while (!ATOMIC_READ(preload->cancelled)) {
+        size_t index = ATOMIC_AAF(&preload->next_key, 1) - 1;
+        const char *key;
+        size_t n_loaded;
+        size_t cost;
 
-        /* Only serve world-readable indexes. */
-        if (UNLIKELY(!is_world_readable(st->st_mode)))
-            return NULL;
+        if (index >= n_keys)
+            break;
 
-        /* If it does, we want its full path. */
+        key = *preload_list_get_elem(&preload->keys, index);
+        if (!preload_key(preload->priv, key, &cost)) {
+            ATOMIC_INC(preload->n_failed);
+            continue;
+        }
 
-        /* FIXME: Use strlcpy() here instead of calling strlen()? */
-        if (UNLIKELY(priv->root_path_len + 1 /* slash */ +
-                         strlen(index_html_path) + 1 >=
-                     PATH_MAX))
-            return NULL;
+        if (ATOMIC_AAF(&preload->used, cost) > preload->budget) {
+            /* Don't keep what went over the budget; other threads might
+             * be loading files that still fit, so only this one stops. */
+            cache_invalidate(preload->priv->cache, key);
+            ATOMIC_AAF(&preload->used, -cost);
+            ATOMIC_INC(preload->n_skipped);
+            lwan_status_warning("Preload memory budget exhausted at %s", key);
+            break;
+        }
 
-        full_path[priv->root_path_len] = '/';
-        strncpy(full_path + priv->root_path_len + 1, index_html_path,
-                PATH_MAX - priv->root_path_len - 1);
+        n_loaded = ATOMIC_INC(preload->n_loaded);
+        if (!(n_loaded % 1000)) {
+            lwan_status_info("Preloading %s: %zu of %zu files cached",
+                             preload->priv->prefix, n_loaded, n_keys);
+        }
     }
 
-    /* Only serve regular files. */
-    if (UNLIKELY(!S_ISREG(st->st_mode)))
-        return NULL;
-
-    /* It's not a directory: choose the fastest way to serve the file
-     * judging by its size. */
-    if (st->st_size < 16384)
-        return &mmap_funcs;
+    preload_finished(preload, 1);
 
-    return &sendfile_funcs;
+    return NULL;
 }
 
-static struct file_cache_entry *
-create_cache_entry_from_funcs(struct serve_files_priv *priv,
-                              const char *full_path,
-                              struct stat *st,
-                              const struct cache_funcs *funcs)
+static void preload_join(struct preload *preload)
 {
-    struct file_cache_entry *fce;
+    for (unsigned int i = 0; i < preload->n_started; i++)
+        pthread_join(preload->threads[i], NULL);
+    preload->n_started = 0;
+}
 
-    fce = malloc(sizeof(*fce));
-    if (UNLIKELY(!fce))
-        return NULL;
+static void preload_free(struct preload *preload)
+{
+    char **key;
 
-    if (LIKELY(funcs->init(fce, priv, full_path, st))) {
-        fce->funcs = funcs;
-        return fce;
-    }
+    if (!preload)
+        return;
 
-    free(fce);
+    ATOMIC_INC(preload->cancelled);
+    preload_join(preload);
 
-    if (funcs != &mmap_funcs)
-        return NULL;
+    LWAN_ARRAY_FOREACH (&preload->keys, key)
+        free(*key);
+    preload_list_reset(&preload->keys);
 
-    return create_cache_entry_from_funcs(priv, full_path, st, &sendfile_funcs);
+    free(preload->manifest);
+    free(preload->threads);
+    free(preload);
 }
 
-static void destroy_cache_entry(struct cache_entry *entry,
-                                void *context __attribute__((unused)))
+static void preload_start(void *data)
 {
-    struct file_cache_entry *fce = (struct file_cache_entry *)entry;
+    struct preload *preload = data;
+    struct serve_files_priv *priv = preload->priv;
+    size_t budget = preload->budget;
+    unsigned int n_threads = preload->n_threads;
 
-    fce->funcs->free(fce);
-    free(fce);
-}
+    clock_gettime(monotonic_clock_id, &preload->started);
 
-static struct cache_entry *create_cache_entry(const char *key, void *context)
-{
-    struct serve_files_priv *priv = context;
-    struct file_cache_entry *fce;
-    struct stat st;
-    const struct cache_funcs *funcs;
-    char full_path[PATH_MAX];
+    if (preload->manifest) {
+        preload_read_manifest(preload, preload->manifest, &budget);
+    } else {
+        int fd = openat(priv->root_fd, ".", open_mode | O_DIRECTORY);
 
-    if (UNLIKELY(
-            !realpathat2(priv->root_fd, priv->root_path, key, full_path, &st)))
-        return NULL;
+        if (fd >= 0)
+            preload_walk(preload, fd, "", &budget);
+    }
 
-    if (UNLIKELY(!is_world_readable(st.st_mode)))
-        return NULL;
+    __atomic_store_n(&preload->n_queued, preload->keys.base.elements,
+                     __ATOMIC_RELEASE);
 
-    if (UNLIKELY(strncmp(full_path, priv->root_path, priv->root_path_len)))
-        return NULL;
+    if (!preload->keys.base.elements) {
+        lwan_status_info("Preloading %s: nothing to preload", priv->prefix);
+        __atomic_store_n(&preload->done, true, __ATOMIC_RELEASE);
+        return;
+    }
 
-    funcs = get_funcs(priv, key, full_path, &st);
-    if (UNLIKELY(!funcs))
-        return NULL;
+    if (!n_threads) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (unsigned int)n_cpus : 1;
+    }
+    if (n_threads > preload->keys.base.elements)
+        n_threads = (unsigned int)preload->keys.base.elements;
 
-    fce = create_cache_entry_from_funcs(priv, full_path, &st, funcs);
-    if (UNLIKELY(!fce))
-        return NULL;
+    preload->threads = calloc(n_threads, sizeof(*preload->threads));
+    if (!preload->threads) {
+        lwan_status_perror("Could not preload %s", priv->prefix);
+        __atomic_store_n(&preload->done, true, __ATOMIC_RELEASE);
+        return;
+    }
 
-    if (UNLIKELY(lwan_format_rfc_time(st.st_mtime, fce->last_modified.string) <
-                 0)) {
-        destroy_cache_entry((struct cache_entry *)fce, NULL);
-        return NULL;
+    lwan_status_info("Preloading %s: caching %zu files with %u threads",
+                     priv->prefix, preload->keys.base.elements, n_threads);
+
+    preload->n_threads = n_threads;
+    for (; preload->n_started < n_threads; preload->n_started++) {
+        if (pthread_create(&preload->threads[preload->n_started], NULL,
+                           preload_thread, preload)) {
+            lwan_status_perror("Could not create preload thread");
+            break;
+        }
     }
-    fce->last_modified.integer = st.st_mtime;
+    if (preload->n_started < n_threads)
+        preload_finished(preload, n_threads - preload->n_started);
 
-    return (struct cache_entry *)fce;
+    if (preload->wait)
+        preload_join(preload);
 }
 
-static void mmap_free(struct file_cache_entry *fce)
+static struct preload *
+preload_new(struct serve_files_priv *priv,
+            const struct lwan_serve_files_settings *settings)
 {
-    struct mmap_cache_data *md = &fce->mmap_cache_data;
+    struct preload *preload = calloc(1, sizeof(*preload));
 
-    munmap(md->uncompressed.value, md->uncompressed.len);
-    free(md->deflated.value);
-#if defined(HAVE_BROTLI)
-    free(md->brotli.value);
-#endif
-}
+    if (!preload)
+        return NULL;
 
-static void sendfile_free(struct file_cache_entry *fce)
-{
-    struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
+    preload->priv = priv;
+    preload_list_init(&preload->keys);
+    preload->budget = settings->preload_max_size;
+    preload->n_threads = settings->preload_threads;
+    preload->wait = settings->preload_wait;
 
-    if (sd->compressed.fd >= 0)
-        close(sd->compressed.fd);
-    if (sd->uncompressed.fd >= 0)
-        close(sd->uncompressed.fd);
+    if (settings->preload_manifest) {
+        preload->manifest = strdup(settings->preload_manifest);
+        if (!preload->manifest) {
+            free(preload);
+            return NULL;
+        }
+    }
+
+    /* Files are loaded with the readahead and compression threads up, so
+     * that they're cached the same way they would be by a request. */
+    lwan_after_init(preload_start, preload);
+
+    return preload;
 }
 
-static void dirlist_free(struct file_cache_entry *fce)
+bool lwan_serve_files_get_preload_status(
+    const void *instance, struct lwan_serve_files_preload_status *status)
 {
-    struct dir_list_cache_data *dd = &fce->dir_list_cache_data;
+    const struct serve_files_priv *priv = instance;
+    struct preload *preload = priv->preload;
 
-    lwan_strbuf_free(&dd->rendered);
-    free(dd->deflated.value);
-#if defined(HAVE_BROTLI)
-    free(dd->brotli.value);
-#endif
+    if (!preload)
+        return false;
+
+    /* Files are counted as skipped while they're listed, so the list has
+     * to be complete for these to add up. */
+    *status = (struct lwan_serve_files_preload_status){
+        .files = __atomic_load_n(&preload->n_queued, __ATOMIC_ACQUIRE),
+        .loaded = ATOMIC_READ(preload->n_loaded),
+        .failed = ATOMIC_READ(preload->n_failed),
+        .skipped = ATOMIC_READ(preload->n_skipped),
+        .bytes = ATOMIC_READ(preload->used),
+        .done = __atomic_load_n(&preload->done, __ATOMIC_ACQUIRE),
+    };
+
+    return true;
 }
 
-static void redir_free(struct file_cache_entry *fce)
+static void init_multipart_boundary(struct serve_files_priv *priv)
 {
-    struct redir_cache_data *rd = &fce->redir_cache_data;
+    uint64_t value = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)priv;
 
-    free(rd->redir_to);
+#if defined(HAVE_GETENTROPY)
+    /* If this fails, value isn't touched and the fallback is used. */
+    (void)getentropy(&value, sizeof(value));
+#endif
+
+    snprintf(priv->multipart_boundary, sizeof(priv->multipart_boundary),
+             "lwan%016" PRIx64, value);
+    snprintf(priv->multipart_mime_type, sizeof(priv->multipart_mime_type),
+             "multipart/byteranges; boundary=%s", priv->multipart_boundary);
 }
 
 static void *serve_files_create(const char *prefix, void *args)
@@ -908,19 +3409,40 @@ static void *serve_files_create(const char *prefix, void *args)
         goto out_malloc;
     }
 
-    priv->cache =
-        cache_create(create_cache_entry, destroy_cache_entry, priv, 5);
+    priv->cache = cache_create(create_cache_entry, destroy_cache_entry, priv,
+                               settings->cache_period);
     if (!priv->cache) {
         lwan_status_error("Couldn't create cache");
         goto out_cache_create;
     }
+    cache_set_entry_cost_cb(priv->cache, file_cache_entry_cost);
+    cache_set_time_to_refresh(priv->cache, settings->cache_refresh_period);
+    cache_set_limits(priv->cache, settings->cache_max_entries,
+                     settings->cache_max_size);
+    if (!cache_set_thread_cache(priv->cache, true))
+        lwan_status_warning("Couldn't enable thread cache");
+
+    priv->missing = NULL;
+    if (settings->negative_cache_period &&
+        settings->negative_cache_max_entries) {
+        priv->missing =
+            cache_create(create_missing_entry, destroy_missing_entry, priv,
+                         settings->negative_cache_period);
+        if (!priv->missing) {
+            lwan_status_error("Couldn't create negative cache");
+            goto out_missing_create;
+        }
+        cache_set_limits(priv->missing, settings->negative_cache_max_entries,
+                         0);
+    }
 
     if (settings->directory_list_template) {
         priv->directory_list_tpl = lwan_tpl_compile_file(
             settings->directory_list_template, file_list_desc);
     } else {
         priv->directory_list_tpl =
-            lwan_tpl_compile_string_full(directory_list_tpl_str, file_list_desc,
+            lwan_tpl_compile_string_full(directory_list_tpl_source,
+                                         file_list_desc,
                                          LWAN_TPL_FLAG_CONST_TEMPLATE);
     }
     if (!priv->directory_list_tpl) {
@@ -942,12 +3464,57 @@ static void *serve_files_create(const char *prefix, void *args)
     priv->serve_precompressed_files = settings->serve_precompressed_files;
     priv->auto_index = settings->auto_index;
     priv->auto_index_readme = settings->auto_index_readme;
+    priv->compressed_only = settings->compressed_only;
     priv->read_ahead = settings->read_ahead;
+    priv->background_compression_max_size =
+        settings->background_compression_max_size;
+    priv->max_ranges = settings->max_ranges;
+    priv->auto_index_stream_threshold = settings->auto_index_stream_threshold;
+    init_multipart_boundary(priv);
+
+    priv->store = NULL;
+    if (settings->compressed_store_path) {
+        priv->store = store_open(settings->compressed_store_path,
+                                 settings->compressed_store_max_size);
+        if (priv->store)
+            lwan_after_init(store_check_queue, priv);
+    }
+
+    priv->packed = settings->pack_path
+                       ? packed_assets_open(settings->pack_path)
+                       : NULL;
+
+    priv->slab = NULL;
+    priv->slab_max_file_size = 0;
+    if (settings->slab_max_file_size && settings->slab_size) {
+        priv->slab = slab_create(settings->slab_size);
+        if (priv->slab) {
+            /* Larger files are better served from the page cache. */
+            priv->slab_max_file_size = settings->slab_max_file_size;
+            if (priv->slab_max_file_size >= MMAP_SIZE_THRESHOLD)
+                priv->slab_max_file_size = MMAP_SIZE_THRESHOLD - 1;
+        } else {
+            lwan_status_perror("Couldn't create slab store for %s",
+                               canonical_root);
+        }
+    }
+
+    priv->watcher = settings->watch ? watcher_start(priv) : NULL;
+
+    priv->preload = NULL;
+    if (settings->preload || settings->preload_manifest) {
+        priv->preload = preload_new(priv, settings);
+        if (!priv->preload)
+            lwan_status_perror("Could not preload %s", prefix);
+    }
 
     return priv;
 
 out_tpl_prefix_copy:
 out_tpl_compile:
+    if (priv->missing)
+        cache_destroy(priv->missing);
+out_missing_create:
     cache_destroy(priv->cache);
 out_cache_create:
     free(priv);
@@ -973,6 +3540,45 @@ static void *serve_files_create_from_hash(const char *prefix,
             (size_t)parse_long("read_ahead", SERVE_FILES_READ_AHEAD_BYTES),
         .auto_index_readme =
             parse_bool(hash_find(hash, "auto_index_readme"), true),
+        .auto_index_stream_threshold = (size_t)parse_long(
+            hash_find(hash, "auto_index_stream_threshold"), 0),
+        .background_compression_max_size = (size_t)parse_long(
+            hash_find(hash, "background_compression_max_size"),
+            SERVE_FILES_BACKGROUND_COMPRESSION_MAX_SIZE),
+        .max_ranges = (size_t)parse_long(hash_find(hash, "max_ranges"),
+                                         SERVE_FILES_MAX_RANGES),
+        .cache_period = parse_time_period(hash_find(hash, "cache_period"),
+                                          SERVE_FILES_CACHE_PERIOD),
+        .cache_refresh_period =
+            parse_time_period(hash_find(hash, "cache_refresh_period"), 0),
+        .cache_max_entries =
+            (size_t)parse_long(hash_find(hash, "cache_max_entries"), 0),
+        .cache_max_size =
+            (size_t)parse_long(hash_find(hash, "cache_max_size"), 0),
+        .negative_cache_period =
+            parse_time_period(hash_find(hash, "negative_cache_period"),
+                              SERVE_FILES_NEGATIVE_CACHE_PERIOD),
+        .negative_cache_max_entries = (size_t)parse_long(
+            hash_find(hash, "negative_cache_max_entries"),
+            SERVE_FILES_NEGATIVE_CACHE_MAX_ENTRIES),
+        .preload = parse_bool(hash_find(hash, "preload"), false),
+        .preload_manifest = hash_find(hash, "preload_manifest"),
+        .preload_threads =
+            (unsigned int)parse_long(hash_find(hash, "preload_threads"), 0),
+        .preload_max_size = (size_t)parse_long(
+            hash_find(hash, "preload_max_size"), SERVE_FILES_PRELOAD_MAX_SIZE),
+        .preload_wait = parse_bool(hash_find(hash, "preload_wait"), false),
+        .watch = parse_bool(hash_find(hash, "watch"), false),
+        .compressed_store_path = hash_find(hash, "compressed_store_path"),
+        .compressed_store_max_size =
+            (size_t)parse_long(hash_find(hash, "compressed_store_max_size"),
+                               SERVE_FILES_COMPRESSED_STORE_MAX_SIZE),
+        .slab_max_file_size =
+            (size_t)parse_long(hash_find(hash, "slab_max_file_size"), 0),
+        .slab_size = (size_t)parse_long(hash_find(hash, "slab_size"),
+                                        SERVE_FILES_SLAB_SIZE),
+        .pack_path = hash_find(hash, "pack_path"),
+        .compressed_only = parse_bool(hash_find(hash, "compressed_only"), false),
     };
 
     return serve_files_create(prefix, &settings);
@@ -987,8 +3593,16 @@ static void serve_files_destroy(void *data)
         return;
     }
 
+    watcher_stop(priv->watcher);
+    preload_free(priv->preload);
     lwan_tpl_free(priv->directory_list_tpl);
     cache_destroy(priv->cache);
+    if (priv->missing)
+        cache_destroy(priv->missing);
+    slab_destroy(priv->slab);
+    packed_assets_close(priv->packed);
+    watcher_free(priv->watcher);
+    store_close(priv->store);
     close(priv->root_fd);
     free(priv->root_path);
     free(priv->prefix);
@@ -1013,7 +3627,7 @@ static size_t prepare_headers(struct lwan_request *request,
 {
     char content_length[INT_TO_STR_BUFFER_SIZE];
     size_t discard;
-    struct lwan_key_value additional_headers[4] = {
+    struct lwan_key_value additional_headers[5] = {
         {
             .key = "Last-Modified",
             .value = fce->last_modified.string,
@@ -1023,65 +3637,298 @@ static size_t prepare_headers(struct lwan_request *request,
             .value = uint_to_string(size, content_length, &discard),
         },
     };
+    struct lwan_key_value *hdr = &additional_headers[2];
 
+    if (fce->etag) {
+        *hdr++ = (struct lwan_key_value){
+            .key = "ETag",
+            .value = (char *)fce->etag,
+        };
+    }
     if (user_hdr)
-        additional_headers[2] = *user_hdr;
+        *hdr = *user_hdr;
 
     return lwan_prepare_response_header_full(request, return_status, header_buf,
                                              DEFAULT_HEADERS_SIZE,
                                              additional_headers);
 }
 
+static void sort_ranges(struct lwan_range *ranges, size_t n_ranges)
+{
+    /* Insertion sort: there are at most max_ranges items, and they're
+     * usually in order already. */
+    for (size_t i = 1; i < n_ranges; i++) {
+        struct lwan_range key = ranges[i];
+        size_t j = i;
+
+        for (; j > 0 && ranges[j - 1].from > key.from; j--)
+            ranges[j] = ranges[j - 1];
+        ranges[j] = key;
+    }
+}
+
+/* Resolves the ranges requested by the client against the file size,
+ * turning them into [from, to) intervals, sorted and coalesced. */
 static enum lwan_http_status
-compute_range(struct lwan_request *request, off_t *from, off_t *to, off_t size)
+compute_multiple_ranges(struct lwan_range *ranges, size_t *n_ranges, off_t size)
+{
+    size_t n_valid = 0;
+
+    for (size_t i = 0; i < *n_ranges; i++) {
+        struct lwan_range r = ranges[i];
+
+        if (r.from < 0) {
+            if (UNLIKELY(!r.to))
+                continue;
+            r.from = r.to < size ? size - r.to : 0;
+            r.to = size;
+        } else {
+            if (UNLIKELY(r.to >= 0 && r.to < r.from))
+                return HTTP_RANGE_UNSATISFIABLE;
+            if (r.from >= size)
+                continue;
+            r.to = (r.to < 0 || r.to >= size) ? size : r.to + 1;
+        }
+
+        ranges[n_valid++] = r;
+    }
+    if (UNLIKELY(!n_valid))
+        return HTTP_RANGE_UNSATISFIABLE;
+
+    sort_ranges(ranges, n_valid);
+
+    /* Coalesce overlapping and adjacent ranges. */
+    *n_ranges = 1;
+    for (size_t i = 1; i < n_valid; i++) {
+        struct lwan_range *last = &ranges[*n_ranges - 1];
+
+        if (ranges[i].from <= last->to) {
+            if (ranges[i].to > last->to)
+                last->to = ranges[i].to;
+        } else {
+            ranges[(*n_ranges)++] = ranges[i];
+        }
+    }
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+/* Resolves the Range header, if any, into the [from, to) interval to be
+ * sent.  If more than one range remains after coalescing, ranges and
+ * n_ranges are set instead, and the response should be built with
+ * serve_multiple_ranges(). */
+static enum lwan_http_status compute_range(struct lwan_request *request,
+                                           const struct serve_files_priv *priv,
+                                           off_t *from,
+                                           off_t *to,
+                                           off_t size,
+                                           struct lwan_range **ranges,
+                                           size_t *n_ranges)
 {
-    off_t f, t;
-    int r = lwan_request_get_range(request, &f, &t);
+    struct lwan_range single, *requested = &single;
+    enum lwan_http_status status;
+    int n = lwan_request_get_ranges(request, &single, 1);
+
+    *n_ranges = 0;
+
+    if (n == -E2BIG && priv->max_ranges > 1) {
+        requested = coro_malloc(request->conn->coro,
+                                priv->max_ranges * sizeof(*requested));
+        if (UNLIKELY(!requested))
+            return HTTP_INTERNAL_ERROR;
+
+        n = lwan_request_get_ranges(request, requested, priv->max_ranges);
+    }
 
-    /* No Range: header present */
-    if (LIKELY(r < 0 || (f < 0 && t < 0))) {
+    /* No Range: header present, a malformed one, or one with too many
+     * ranges: ignore it and send everything. */
+    if (LIKELY(n <= 0)) {
         *from = 0;
         *to = size;
 
         return HTTP_OK;
     }
 
-    /* To must be greater than From; it doesn't make any sense to be
-     * equal, either. */
-    if (UNLIKELY(f >= t && t >= 0))
-        return HTTP_RANGE_UNSATISFIABLE;
-
-    /* Range goes beyond the size of the file */
-    if (UNLIKELY(f >= size || t >= size))
-        return HTTP_RANGE_UNSATISFIABLE;
+    *n_ranges = (size_t)n;
+    status = compute_multiple_ranges(requested, n_ranges, size);
+    if (status != HTTP_PARTIAL_CONTENT)
+        return status;
 
-    /* t < 0: ranges from f to the file size */
-    if (t < 0) {
-        *to = size;
+    if (*n_ranges == 1) {
+        /* Also the case if all ranges were coalesced into a single one. */
+        *from = requested[0].from;
+        *to = requested[0].to;
+        *n_ranges = 0;
     } else {
-        if (UNLIKELY(__builtin_sub_overflow(t, f, to)))
-            return HTTP_RANGE_UNSATISFIABLE;
+        *ranges = requested;
+    }
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+struct content_range {
+    struct lwan_key_value hdr;
+    char value[sizeof("bytes -/") + 3 * 20];
+};
+
+/* Single-part 206 responses are never compressed, so the Content-Range
+ * header takes the place of Content-Encoding in prepare_headers(). */
+static const struct lwan_key_value *
+content_range_hdr(struct content_range *cr, off_t from, off_t to, off_t size)
+{
+    snprintf(cr->value, sizeof(cr->value), "bytes %jd-%jd/%jd",
+             (intmax_t)from, (intmax_t)to - 1, (intmax_t)size);
+    cr->hdr = (struct lwan_key_value){.key = "Content-Range",
+                                      .value = cr->value};
+
+    return &cr->hdr;
+}
+
+static enum lwan_http_status
+serve_multiple_ranges(struct lwan_request *request,
+                      struct file_cache_entry *fce,
+                      const struct lwan_range *ranges,
+                      size_t n_ranges,
+                      off_t size,
+                      const void *contents,
+                      int fd)
+{
+    const struct serve_files_priv *priv = fce->priv;
+    const size_t part_header_size = sizeof("\r\n--\r\nContent-Type: \r\n"
+                                           "Content-Range: bytes -/\r\n\r\n") +
+                                    sizeof(priv->multipart_boundary) +
+                                    strlen(fce->mime_type) + 3 * 20;
+    struct coro *coro = request->conn->coro;
+    char headers[DEFAULT_HEADERS_SIZE];
+    struct iovec *iov;
+    char *part_headers, *trailer;
+    size_t content_length, header_len, trailer_len;
+
+    iov = coro_malloc(coro, (2 * n_ranges + 2) * sizeof(*iov));
+    part_headers = coro_malloc(coro, n_ranges * part_header_size +
+                                         sizeof(priv->multipart_boundary) + 8);
+    if (UNLIKELY(!iov || !part_headers))
+        return HTTP_INTERNAL_ERROR;
+
+    content_length = 0;
+    for (size_t i = 0; i < n_ranges; i++) {
+        char *part_header = part_headers + i * part_header_size;
+        int len = snprintf(part_header, part_header_size,
+                           "\r\n--%s\r\n"
+                           "Content-Type: %s\r\n"
+                           "Content-Range: bytes %jd-%jd/%jd\r\n\r\n",
+                           priv->multipart_boundary, fce->mime_type,
+                           (intmax_t)ranges[i].from, (intmax_t)ranges[i].to - 1,
+                           (intmax_t)size);
+        if (UNLIKELY(len < 0 || (size_t)len >= part_header_size))
+            return HTTP_INTERNAL_ERROR;
+
+        iov[2 * i + 1] = (struct iovec){.iov_base = part_header,
+                                        .iov_len = (size_t)len};
+        iov[2 * i + 2] = (struct iovec){
+            .iov_base = (char *)contents + ranges[i].from,
+            .iov_len = (size_t)(ranges[i].to - ranges[i].from),
+        };
+        content_length += (size_t)len + iov[2 * i + 2].iov_len;
     }
 
-    *from = f;
+    trailer = part_headers + n_ranges * part_header_size;
+    trailer_len = (size_t)snprintf(trailer, sizeof(priv->multipart_boundary) + 8,
+                                   "\r\n--%s--\r\n", priv->multipart_boundary);
+    iov[2 * n_ranges + 1] =
+        (struct iovec){.iov_base = trailer, .iov_len = trailer_len};
+    content_length += trailer_len;
+
+    request->response.mime_type = priv->multipart_mime_type;
+    header_len = prepare_headers(request, HTTP_PARTIAL_CONTENT, fce,
+                                 content_length, NULL, headers);
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
+        lwan_send(request, headers, header_len, 0);
+    } else if (contents) {
+        iov[0] = (struct iovec){.iov_base = headers, .iov_len = header_len};
+        lwan_writev(request, iov, 2 * n_ranges + 2);
+    } else {
+        /* Part headers are interleaved with sendfile() calls, so that file
+         * contents are never copied to userland. */
+        lwan_send(request, headers, header_len, MSG_MORE);
+        for (size_t i = 0; i < n_ranges; i++) {
+            lwan_sendfile(request, fd, ranges[i].from, iov[2 * i + 2].iov_len,
+                          iov[2 * i + 1].iov_base, iov[2 * i + 1].iov_len);
+        }
+        lwan_send(request, trailer, trailer_len, 0);
+    }
 
     return HTTP_PARTIAL_CONTENT;
 }
 
+/* Serves a file, or what compute_range() asked for from it, with
+ * sendfile(). */
+static enum lwan_http_status
+serve_fd(struct lwan_request *request,
+         struct file_cache_entry *fce,
+         int fd,
+         const struct lwan_key_value *compression_hdr,
+         enum lwan_http_status status,
+         off_t from,
+         off_t to,
+         const struct lwan_range *ranges,
+         size_t n_ranges,
+         size_t size)
+{
+    char headers[DEFAULT_HEADERS_SIZE];
+    struct content_range cr;
+    size_t header_len;
+
+    if (n_ranges) {
+        return serve_multiple_ranges(request, fce, ranges, n_ranges,
+                                     (off_t)size, NULL, fd);
+    }
+
+    if (status == HTTP_PARTIAL_CONTENT)
+        compression_hdr = content_range_hdr(&cr, from, to, (off_t)size);
+    size = (size_t)(to - from);
+    header_len = prepare_headers(request, status, fce, size, compression_hdr,
+                                 headers);
+    if (UNLIKELY(!header_len))
+        return HTTP_INTERNAL_ERROR;
+
+    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD)
+        lwan_send(request, headers, header_len, 0);
+    else
+        lwan_sendfile(request, fd, from, size, headers, header_len);
+
+    return status;
+}
+
 static enum lwan_http_status sendfile_serve(struct lwan_request *request,
                                             void *data)
 {
     const struct lwan_key_value *compression_hdr;
     struct file_cache_entry *fce = data;
     struct sendfile_cache_data *sd = &fce->sendfile_cache_data;
-    char headers[DEFAULT_HEADERS_SIZE];
-    size_t header_len;
+    const struct stored_variant *stored;
     enum lwan_http_status return_status;
+    struct lwan_range *ranges = NULL;
+    size_t n_ranges = 0;
     off_t from, to;
     size_t size;
     int fd;
 
-    if (sd->compressed.size && (request->flags & REQUEST_ACCEPT_GZIP)) {
+    store_in_background(fce);
+
+    if (sd->zstd.size && (request->flags & REQUEST_ACCEPT_ZSTD)) {
+        from = 0;
+        to = (off_t)sd->zstd.size;
+
+        compression_hdr = &zstd_compression_hdr;
+        fd = sd->zstd.fd;
+        size = sd->zstd.size;
+
+        return_status = HTTP_OK;
+    } else if (sd->compressed.size && (request->flags & REQUEST_ACCEPT_GZIP)) {
         from = 0;
         to = (off_t)sd->compressed.size;
 
@@ -1089,16 +3936,27 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
         fd = sd->compressed.fd;
         size = sd->compressed.size;
 
+        return_status = HTTP_OK;
+    } else if ((stored = stored_variant_for_request(sd, request,
+                                                    &compression_hdr))) {
+        from = 0;
+        to = (off_t)stored->size;
+
+        fd = stored->fd;
+        size = stored->size;
+
         return_status = HTTP_OK;
     } else {
         return_status =
-            compute_range(request, &from, &to, (off_t)sd->uncompressed.size);
-        if (UNLIKELY(return_status == HTTP_RANGE_UNSATISFIABLE))
-            return HTTP_RANGE_UNSATISFIABLE;
+            compute_range(request, fce->priv, &from, &to,
+                          (off_t)sd->uncompressed.size, &ranges, &n_ranges);
+        if (UNLIKELY(return_status != HTTP_OK &&
+                     return_status != HTTP_PARTIAL_CONTENT))
+            return return_status;
 
         compression_hdr = NULL;
         fd = sd->uncompressed.fd;
-        size = (size_t)(to - from);
+        size = sd->uncompressed.size;
     }
     if (UNLIKELY(fd < 0)) {
         switch (-fd) {
@@ -1106,24 +3964,17 @@ static enum lwan_http_status sendfile_serve(struct lwan_request *request,
             return HTTP_FORBIDDEN;
         case EMFILE:
         case ENFILE:
+            /* Running out of file descriptors is transient: don't keep
+             * serving this error from the cache. */
+            cache_invalidate(fce->priv->cache, request->url.value);
             return HTTP_UNAVAILABLE;
         default:
             return HTTP_INTERNAL_ERROR;
         }
     }
 
-    header_len = prepare_headers(request, return_status, fce, size,
-                                 compression_hdr, headers);
-    if (UNLIKELY(!header_len))
-        return HTTP_INTERNAL_ERROR;
-
-    if (lwan_request_get_method(request) == REQUEST_METHOD_HEAD) {
-        lwan_send(request, headers, header_len, 0);
-    } else {
-        lwan_sendfile(request, fd, from, (size_t)to, headers, header_len);
-    }
-
-    return return_status;
+    return serve_fd(request, fce, fd, compression_hdr, return_status, from,
+                    to, ranges, n_ranges, size);
 }
 
 static enum lwan_http_status
@@ -1166,36 +4017,69 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
     const struct lwan_key_value *compressed;
     struct file_cache_entry *fce = data;
     struct mmap_cache_data *md = &fce->mmap_cache_data;
+    const struct compressed_variants *cv;
+    struct content_range cr;
     void *contents;
     size_t size;
     enum lwan_http_status status;
 
+    compress_in_background(fce, &md->compressed, &md->uncompressed, md->fd);
+    cv = compressed_data_get(&md->compressed);
+
 #if defined(HAVE_BROTLI)
-    if (md->brotli.len && (request->flags & REQUEST_ACCEPT_BROTLI)) {
-        contents = md->brotli.value;
-        size = md->brotli.len;
+    if (cv->brotli.len && (request->flags & REQUEST_ACCEPT_BROTLI)) {
+        contents = cv->brotli.value;
+        size = cv->brotli.len;
         compressed = &br_compression_hdr;
 
         status = HTTP_OK;
     } else
 #endif
-    if (md->deflated.len && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
-        contents = md->deflated.value;
-        size = md->deflated.len;
+#if defined(HAVE_ZSTD)
+    if (cv->zstd.len && (request->flags & REQUEST_ACCEPT_ZSTD)) {
+        contents = cv->zstd.value;
+        size = cv->zstd.len;
+        compressed = &zstd_compression_hdr;
+
+        status = HTTP_OK;
+    } else
+#endif
+    if (cv->deflated.len && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
+        contents = cv->deflated.value;
+        size = cv->deflated.len;
         compressed = &deflate_compression_hdr;
 
         status = HTTP_OK;
     } else {
+        struct lwan_range *ranges;
+        size_t n_ranges;
         off_t from, to;
 
-        status =
-            compute_range(request, &from, &to, (off_t)md->uncompressed.len);
+        status = compute_range(request, fce->priv, &from, &to,
+                               (off_t)md->uncompressed.len, &ranges,
+                               &n_ranges);
+        if (!md->uncompressed.value &&
+            (status == HTTP_OK || status == HTTP_PARTIAL_CONTENT)) {
+            return serve_fd(request, fce, md->fd, NULL, status, from, to,
+                            ranges, n_ranges, md->uncompressed.len);
+        }
+
         switch (status) {
         case HTTP_PARTIAL_CONTENT:
+            if (n_ranges) {
+                return serve_multiple_ranges(request, fce, ranges, n_ranges,
+                                             (off_t)md->uncompressed.len,
+                                             md->uncompressed.value, -1);
+            }
+            /* fallthrough */
         case HTTP_OK:
+            lwan_madvise_touch(md->region);
             contents = (char *)md->uncompressed.value + from;
             size = (size_t)(to - from);
-            compressed = NULL;
+            compressed = status == HTTP_PARTIAL_CONTENT
+                             ? content_range_hdr(&cr, from, to,
+                                                 (off_t)md->uncompressed.len)
+                             : NULL;
             break;
 
         default:
@@ -1206,6 +4090,626 @@ static enum lwan_http_status mmap_serve(struct lwan_request *request,
     return serve_buffer(request, fce, compressed, contents, size, status);
 }
 
+static size_t slab_prepare_headers(struct file_cache_entry *ce,
+                                   size_t size,
+                                   const struct lwan_key_value *compressed,
+                                   char headers[static DEFAULT_HEADERS_SIZE])
+{
+    /* Dates are placeholders, overwritten whenever the response is sent. */
+    struct lwan_thread thread = {};
+    struct lwan_connection conn = {.flags = CONN_IS_KEEP_ALIVE,
+                                   .thread = &thread};
+    struct lwan_request request = {
+        .flags = RESPONSE_STREAM,
+        .conn = &conn,
+        .response = {.mime_type = ce->mime_type},
+    };
+
+    memset(thread.date.date, ' ', 29);
+    memset(thread.date.expires, ' ', 29);
+
+    return prepare_headers(&request, HTTP_OK, ce, size, compressed, headers);
+}
+
+static bool slab_response_init(struct slab_response *response,
+                               const char *headers,
+                               size_t header_len,
+                               const struct lwan_value *body,
+                               char *blob)
+{
+    const char *date = memmem(headers, header_len, "\r\nDate: ", 8);
+    const char *expires = memmem(headers, header_len, "\r\nExpires: ", 11);
+
+    if (UNLIKELY(!date || !expires || expires < date))
+        return false;
+
+    memcpy(blob, headers, header_len);
+    memcpy(blob + header_len, body->value, body->len);
+
+    *response = (struct slab_response){
+        .blob = blob,
+        .len = header_len + body->len,
+        .body_off = header_len,
+        .date_off = (size_t)(date - headers) + 8,
+        .expires_off = (size_t)(expires - headers) + 11,
+    };
+
+    return true;
+}
+
+/* Builds responses for the uncompressed contents compressed with the given
+ * levels, plus one for the identity if asked to, in a single slab chunk. */
+static bool slab_responses_init(struct file_cache_entry *ce,
+                                struct slab *slab,
+                                struct slab_responses *responses,
+                                const struct lwan_value *uncompressed,
+                                const struct compression_levels *levels,
+                                bool with_identity)
+{
+    struct {
+        struct slab_response *response;
+        const struct lwan_value *body;
+        const struct lwan_key_value *hdr;
+        char headers[DEFAULT_HEADERS_SIZE];
+        size_t header_len;
+    } variants[4];
+    struct compressed_variants cv = {};
+    size_t n_variants = 0;
+    size_t total = 0;
+    bool success = false;
+
+    if (levels)
+        compress_variants(uncompressed, &cv, levels);
+
+    memset(responses, 0, sizeof(*responses));
+
+#define ADD_VARIANT(response_, body_, hdr_)                                    \
+    do {                                                                       \
+        if ((body_)->len) {                                                    \
+            variants[n_variants].response = (response_);                       \
+            variants[n_variants].body = (body_);                               \
+            variants[n_variants].hdr = (hdr_);                                 \
+            n_variants++;                                                      \
+        }                                                                      \
+    } while (0)
+
+    if (with_identity)
+        ADD_VARIANT(&responses->identity, uncompressed, NULL);
+    ADD_VARIANT(&responses->deflated, &cv.deflated, &deflate_compression_hdr);
+#if defined(HAVE_BROTLI)
+    ADD_VARIANT(&responses->brotli, &cv.brotli, &br_compression_hdr);
+#endif
+#if defined(HAVE_ZSTD)
+    ADD_VARIANT(&responses->zstd, &cv.zstd, &zstd_compression_hdr);
+#endif
+
+#undef ADD_VARIANT
+
+    if (!n_variants) {
+        /* Nothing was worth compressing. */
+        if (!with_identity)
+            goto free_variants;
+
+        /* Empty files still need a response. */
+        variants[0].response = &responses->identity;
+        variants[0].body = uncompressed;
+        variants[0].hdr = NULL;
+        n_variants = 1;
+    }
+
+    for (size_t i = 0; i < n_variants; i++) {
+        variants[i].header_len =
+            slab_prepare_headers(ce, variants[i].body->len, variants[i].hdr,
+                                 variants[i].headers);
+        if (UNLIKELY(!variants[i].header_len))
+            goto free_variants;
+
+        total += variants[i].header_len + variants[i].body->len;
+    }
+
+    responses->chunk_class = slab_class_for_size(total);
+    if (responses->chunk_class < 0)
+        goto free_variants;
+
+    responses->chunk = slab_alloc(slab, responses->chunk_class);
+    if (!responses->chunk)
+        goto free_variants;
+
+    total = 0;
+    for (size_t i = 0; i < n_variants; i++) {
+        if (UNLIKELY(!slab_response_init(variants[i].response,
+                                         variants[i].headers,
+                                         variants[i].header_len,
+                                         variants[i].body,
+                                         responses->chunk + total))) {
+            slab_free_chunk(slab, responses->chunk, responses->chunk_class);
+            goto free_variants;
+        }
+
+        total += variants[i].response->len;
+    }
+
+    success = true;
+
+free_variants:
+    free_variants(&cv);
+
+    return success;
+}
+
+static bool slab_init(struct file_cache_entry *ce,
+                      struct serve_files_priv *priv,
+                      const char *full_path,
+                      struct stat *st)
+{
+    struct slab_cache_data *sd = &ce->slab_cache_data;
+    const char *path = full_path + priv->root_path_len;
+    struct lwan_value uncompressed = {.len = (size_t)st->st_size};
+    bool success = false;
+    ssize_t r;
+    int file_fd;
+
+    path += *path == '/';
+
+    file_fd = openat(priv->root_fd, path, open_mode);
+    if (UNLIKELY(file_fd < 0))
+        return false;
+
+    uncompressed.value = malloc(uncompressed.len + 1);
+    if (UNLIKELY(!uncompressed.value))
+        goto close_file;
+
+    for (size_t off = 0; off < uncompressed.len; off += (size_t)r) {
+        r = pread(file_fd, uncompressed.value + off, uncompressed.len - off,
+                  (off_t)off);
+        if (r < 0 && errno == EINTR) {
+            r = 0;
+            continue;
+        }
+        if (UNLIKELY(r <= 0))
+            goto free_uncompressed;
+    }
+
+    /* Headers are built once, here, so what's usually filled in after the
+     * entry has been created must be known already. */
+    ce->mime_type =
+        lwan_determine_mime_type_for_file_name(full_path + priv->root_path_len);
+    if (UNLIKELY(lwan_format_rfc_time(st->st_mtime, ce->last_modified.string) <
+                 0))
+        goto free_uncompressed;
+
+    /* As with compressed_data_init(), only the fastest compressors run
+     * while the client waits; see slab_compress_in_background(). */
+    success = slab_responses_init(
+        ce, priv->slab, &sd->fast, &uncompressed,
+        uncompressed.len > priv->background_compression_max_size
+            ? NULL
+            : &fast_compression,
+        true);
+    sd->best = NULL;
+    sd->pending = lwan_compress_queue_enabled();
+
+free_uncompressed:
+    free(uncompressed.value);
+close_file:
+    close(file_fd);
+
+    return success;
+}
+
+static void slab_compression_job_run(void *data, bool cancelled)
+{
+    struct file_cache_entry *fce = data;
+    struct slab_cache_data *sd = &fce->slab_cache_data;
+
+    if (!cancelled) {
+        /* The body of the identity response is the uncompressed file. */
+        const struct slab_response *identity = &sd->fast.identity;
+        const struct lwan_value uncompressed = {
+            .value = (char *)identity->blob + identity->body_off,
+            .len = identity->len - identity->body_off,
+        };
+        struct slab_responses *best = malloc(sizeof(*best));
+
+        if (LIKELY(best) &&
+            slab_responses_init(fce, fce->priv->slab, best, &uncompressed,
+                                background_compression_levels(
+                                    fce->priv, uncompressed.len),
+                                false)) {
+            __atomic_store_n(&sd->best, best, __ATOMIC_RELEASE);
+        } else {
+            free(best);
+        }
+    }
+
+    cache_entry_unref(fce->priv->cache, (struct cache_entry *)fce);
+}
+
+static void slab_compress_in_background(struct file_cache_entry *fce)
+{
+    struct slab_cache_data *sd = &fce->slab_cache_data;
+
+    if (LIKELY(!ATOMIC_READ(sd->pending)))
+        return;
+    if (!__sync_bool_compare_and_swap(&sd->pending, 1, 0))
+        return;
+
+    /* See compress_in_background(). */
+    if (!cache_entry_try_ref((struct cache_entry *)fce))
+        return;
+
+    if (LIKELY(lwan_compress_queue_add(slab_compression_job_run, fce)))
+        return;
+
+    cache_entry_unref(fce->priv->cache, (struct cache_entry *)fce);
+    ATOMIC_INC(sd->pending);
+}
+
+static bool slab_can_send_prebuilt(const struct lwan_request *request,
+                                   const struct file_cache_entry *fce)
+{
+    /* Anything that would change the headers requires building them again. */
+    if (lwan_request_get_method(request) != REQUEST_METHOD_GET)
+        return false;
+    if (request->flags & (REQUEST_IS_HTTP_1_0 | REQUEST_ALLOW_CORS |
+                          RESPONSE_CHUNKED_ENCODING |
+                          RESPONSE_NO_CONTENT_LENGTH))
+        return false;
+    if (request->response.compression.settings)
+        return false;
+    if (request->response.mime_type != fce->mime_type)
+        return false;
+
+    return (request->conn->flags & (CONN_IS_KEEP_ALIVE | CONN_IS_UPGRADE)) ==
+           CONN_IS_KEEP_ALIVE;
+}
+
+static void slab_send_prebuilt(struct lwan_request *request,
+                               const struct slab_response *response)
+{
+    const struct lwan_thread *thread = request->conn->thread;
+
+    if (response->len <= DEFAULT_BUFFER_SIZE) {
+        char buffer[DEFAULT_BUFFER_SIZE];
+
+        memcpy(buffer, response->blob, response->len);
+        memcpy(buffer + response->date_off, thread->date.date, 29);
+        memcpy(buffer + response->expires_off, thread->date.expires, 29);
+
+        lwan_send(request, buffer, response->len, 0);
+    } else {
+        struct iovec vec[] = {
+            {
+                .iov_base = (void *)response->blob,
+                .iov_len = response->date_off,
+            },
+            {
+                .iov_base = (void *)thread->date.date,
+                .iov_len = 29,
+            },
+            {
+                .iov_base = (void *)(response->blob + response->date_off + 29),
+                .iov_len = response->expires_off - response->date_off - 29,
+            },
+            {
+                .iov_base = (void *)thread->date.expires,
+                .iov_len = 29,
+            },
+            {
+                .iov_base =
+                    (void *)(response->blob + response->expires_off + 29),
+                .iov_len = response->len - response->expires_off - 29,
+            },
+        };
+
+        lwan_writev(request, vec, N_ELEMENTS(vec));
+    }
+}
+
+static enum lwan_http_status slab_serve(struct lwan_request *request,
+                                        void *data)
+{
+    const struct lwan_key_value *compressed;
+    struct file_cache_entry *fce = data;
+    struct slab_cache_data *sd = &fce->slab_cache_data;
+    const struct slab_responses *responses;
+    const struct slab_response *response;
+    size_t body_len;
+
+    slab_compress_in_background(fce);
+    responses = __atomic_load_n(&sd->best, __ATOMIC_ACQUIRE);
+    if (!responses)
+        responses = &sd->fast;
+
+#if defined(HAVE_BROTLI)
+    if (responses->brotli.len && (request->flags & REQUEST_ACCEPT_BROTLI)) {
+        response = &responses->brotli;
+        compressed = &br_compression_hdr;
+    } else
+#endif
+#if defined(HAVE_ZSTD)
+    if (responses->zstd.len && (request->flags & REQUEST_ACCEPT_ZSTD)) {
+        response = &responses->zstd;
+        compressed = &zstd_compression_hdr;
+    } else
+#endif
+    if (responses->deflated.len && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
+        response = &responses->deflated;
+        compressed = &deflate_compression_hdr;
+    } else {
+        const struct slab_response *identity = &sd->fast.identity;
+        const char *body = identity->blob + identity->body_off;
+        struct lwan_range *ranges;
+        struct content_range cr;
+        size_t n_ranges;
+        off_t from, to;
+        enum lwan_http_status status;
+
+        body_len = identity->len - identity->body_off;
+        status = compute_range(request, fce->priv, &from, &to,
+                               (off_t)body_len, &ranges, &n_ranges);
+        switch (status) {
+        case HTTP_OK:
+            response = identity;
+            compressed = NULL;
+            break;
+
+        case HTTP_PARTIAL_CONTENT:
+            if (n_ranges) {
+                return serve_multiple_ranges(request, fce, ranges, n_ranges,
+                                             (off_t)body_len, body, -1);
+            }
+            return serve_buffer(
+                request, fce,
+                content_range_hdr(&cr, from, to, (off_t)body_len),
+                body + from, (size_t)(to - from), status);
+
+        default:
+            return status;
+        }
+    }
+
+    if (LIKELY(slab_can_send_prebuilt(request, fce))) {
+        slab_send_prebuilt(request, response);
+        return HTTP_OK;
+    }
+
+    body_len = response->len - response->body_off;
+    return serve_buffer(request, fce, compressed,
+                        response->blob + response->body_off, body_len, HTTP_OK);
+}
+
+struct pack_response {
+    /* Only what serve_buffer() and friends look at is filled in. */
+    struct file_cache_entry fce;
+    const struct pack *pack;
+    const struct lwan_pack_entry *entry;
+};
+
+static enum lwan_http_status pack_serve(struct lwan_request *request,
+                                        void *data)
+{
+    struct pack_response *pr = data;
+    const struct lwan_pack_entry *entry = pr->entry;
+    const struct lwan_key_value *compressed;
+    const struct lwan_pack_blob *blob;
+
+#if defined(HAVE_BROTLI)
+    if (entry->variants[LWAN_PACK_BROTLI].len &&
+        (request->flags & REQUEST_ACCEPT_BROTLI)) {
+        blob = &entry->variants[LWAN_PACK_BROTLI];
+        compressed = &br_compression_hdr;
+    } else
+#endif
+#if defined(HAVE_ZSTD)
+    if (entry->variants[LWAN_PACK_ZSTD].len &&
+        (request->flags & REQUEST_ACCEPT_ZSTD)) {
+        blob = &entry->variants[LWAN_PACK_ZSTD];
+        compressed = &zstd_compression_hdr;
+    } else
+#endif
+    if (entry->variants[LWAN_PACK_DEFLATE].len &&
+        (request->flags & REQUEST_ACCEPT_DEFLATE)) {
+        blob = &entry->variants[LWAN_PACK_DEFLATE];
+        compressed = &deflate_compression_hdr;
+    } else {
+        const char *contents;
+        struct lwan_range *ranges;
+        struct content_range cr;
+        size_t n_ranges;
+        off_t from, to;
+        enum lwan_http_status status;
+
+        blob = &entry->variants[LWAN_PACK_IDENTITY];
+        contents = pr->pack->base + blob->off;
+
+        status = compute_range(request, pr->fce.priv, &from, &to,
+                               (off_t)blob->len, &ranges, &n_ranges);
+        switch (status) {
+        case HTTP_OK:
+            compressed = NULL;
+            break;
+
+        case HTTP_PARTIAL_CONTENT:
+            if (n_ranges) {
+                return serve_multiple_ranges(request, &pr->fce, ranges,
+                                             n_ranges, (off_t)blob->len,
+                                             contents, -1);
+            }
+            return serve_buffer(
+                request, &pr->fce,
+                content_range_hdr(&cr, from, to, (off_t)blob->len),
+                contents + from, (size_t)(to - from), status);
+
+        default:
+            return status;
+        }
+    }
+
+    return serve_buffer(request, &pr->fce, compressed,
+                        pr->pack->base + blob->off, blob->len, HTTP_OK);
+}
+
+static const struct lwan_pack_entry *
+pack_find_for_url(const struct pack *pack,
+                  const struct serve_files_priv *priv,
+                  const char *url)
+{
+    const struct lwan_pack_entry *entry;
+    char index_path[PATH_MAX];
+    size_t url_len;
+    int r;
+
+    while (*url == '/')
+        url++;
+
+    entry = pack_find(pack, url);
+    if (entry)
+        return entry;
+
+    url_len = strlen(url);
+    if (url_len && url[url_len - 1] != '/')
+        return NULL;
+
+    r = snprintf(index_path, sizeof(index_path), "%s%s", url,
+                 priv->index_html);
+    if (UNLIKELY(r < 0 || r >= (int)sizeof(index_path)))
+        return NULL;
+
+    return pack_find(pack, index_path);
+}
+
+static bool client_has_same_etag(struct lwan_request *request,
+                                 const char *etag)
+{
+    const char *if_none_match;
+
+    if (!*etag)
+        return false;
+
+    if_none_match = lwan_request_get_header(request, "If-None-Match");
+    return if_none_match && streq(if_none_match, etag);
+}
+
+/* Returns false if the request should be handled by looking for files in
+ * the root directory instead. */
+static bool pack_handle_request(struct lwan_request *request,
+                                struct lwan_response *response,
+                                struct serve_files_priv *priv,
+                                enum lwan_http_status *status)
+{
+    const struct lwan_pack_entry *entry;
+    struct pack_response *pr;
+    struct pack *pack;
+
+    pack = packed_assets_get_and_ref(priv->packed);
+    if (!pack)
+        return false;
+    coro_defer(request->conn->coro, pack_unref_defer, pack);
+
+    entry = pack_find_for_url(pack, priv, request->url.value);
+    if (!entry)
+        return false;
+
+    response->stream.callback = NULL;
+
+    if (client_has_same_etag(request, entry->etag) ||
+        client_has_fresh_content(request, (time_t)entry->mtime)) {
+        *status = HTTP_NOT_MODIFIED;
+        return true;
+    }
+
+    pr = coro_malloc(request->conn->coro, sizeof(*pr));
+    if (UNLIKELY(!pr)) {
+        *status = HTTP_INTERNAL_ERROR;
+        return true;
+    }
+
+    pr->pack = pack;
+    pr->entry = entry;
+    pr->fce.priv = priv;
+    pr->fce.etag = entry->etag;
+    pr->fce.last_modified.integer = (time_t)entry->mtime;
+    memcpy(pr->fce.last_modified.string, entry->last_modified,
+           sizeof(pr->fce.last_modified.string));
+    pr->fce.mime_type =
+        entry->mime_type.len
+            ? pack->base + entry->mime_type.off
+            : lwan_determine_mime_type_for_file_name(pack->base +
+                                                     entry->path.off);
+
+    response->mime_type = pr->fce.mime_type;
+    response->stream.callback = pack_serve;
+    response->stream.data = pr;
+
+    request->flags |= RESPONSE_STREAM;
+
+    *status = HTTP_OK;
+    return true;
+}
+
+struct dirlist_stream {
+    struct file_list vars;
+    struct lwan_strbuf readme;
+};
+
+static void dirlist_stream_free(void *data)
+{
+    struct dirlist_stream *ds = data;
+
+    directory_list_fini(&ds->vars);
+    lwan_strbuf_free(&ds->readme);
+}
+
+static enum lwan_http_status
+dirlist_serve_streamed(struct lwan_request *request,
+                       struct file_cache_entry *fce)
+{
+    const struct serve_files_priv *priv = fce->priv;
+    const char *full_path = fce->dir_list_cache_data.full_path;
+    struct coro *coro = request->conn->coro;
+    size_t generation = coro_deferred_get_generation(coro);
+    enum lwan_http_status status = HTTP_OK;
+    struct dirlist_stream ds;
+
+    if (!lwan_strbuf_init(&ds.readme))
+        return HTTP_INTERNAL_ERROR;
+
+    ds.vars = (struct file_list){
+        .full_path = full_path,
+        .rel_path = get_rel_path(full_path, priv),
+        .readme = dirlist_find_readme(&ds.readme, priv, full_path),
+    };
+
+    /* Sending a chunk might yield and never resume if the connection is
+     * dropped, so the directory is closed when the coroutine is freed. */
+    coro_defer(coro, dirlist_stream_free, &ds);
+
+    /* Headers for chunked responses come from the response struct, where
+     * they share space with the stream callback that got us here. */
+    request->response.headers = NULL;
+
+    if (!lwan_tpl_apply_chunked(priv->directory_list_tpl, request, &ds.vars,
+                                priv->auto_index_stream_threshold)) {
+        status = HTTP_INTERNAL_ERROR;
+    } else if (request->flags & RESPONSE_CHUNKED_ENCODING) {
+        /* Streamed responses aren't ended by lwan_response(). */
+        lwan_response_send_chunk(request);
+    } else {
+        struct lwan_strbuf *buf = request->response.buffer;
+        const char *contents = lwan_strbuf_get_buffer(buf);
+
+        if (UNLIKELY(!contents))
+            status = HTTP_INTERNAL_ERROR;
+        else
+            status = serve_buffer(request, fce, NULL, contents,
+                                  lwan_strbuf_get_length(buf), HTTP_OK);
+    }
+
+    coro_deferred_run(coro, generation);
+    return status;
+}
+
 static enum lwan_http_status dirlist_serve(struct lwan_request *request,
                                            void *data)
 {
@@ -1217,18 +4721,37 @@ static enum lwan_http_status dirlist_serve(struct lwan_request *request,
     size_t size;
 
     icon = lwan_request_get_query_param(request, "icon");
+    if (!icon && dd->full_path)
+        return dirlist_serve_streamed(request, fce);
+
     if (!icon) {
+        const struct lwan_value rendered = {
+            .value = lwan_strbuf_get_buffer(&dd->rendered),
+            .len = lwan_strbuf_get_length(&dd->rendered),
+        };
+        const struct compressed_variants *cv;
+
+        compress_in_background(fce, &dd->compressed, &rendered, -1);
+        cv = compressed_data_get(&dd->compressed);
+
 #if defined(HAVE_BROTLI)
-        if (dd->brotli.len && (request->flags & REQUEST_ACCEPT_BROTLI)) {
+        if (cv->brotli.len && (request->flags & REQUEST_ACCEPT_BROTLI)) {
             compressed = &br_compression_hdr;
-            contents = dd->brotli.value;
-            size = dd->brotli.len;
+            contents = cv->brotli.value;
+            size = cv->brotli.len;
+        } else
+#endif
+#if defined(HAVE_ZSTD)
+        if (cv->zstd.len && (request->flags & REQUEST_ACCEPT_ZSTD)) {
+            compressed = &zstd_compression_hdr;
+            contents = cv->zstd.value;
+            size = cv->zstd.len;
         } else
 #endif
-        if (dd->deflated.len && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
+        if (cv->deflated.len && (request->flags & REQUEST_ACCEPT_DEFLATE)) {
             compressed = &deflate_compression_hdr;
-            contents = dd->deflated.value;
-            size = dd->deflated.len;
+            contents = cv->deflated.value;
+            size = cv->deflated.len;
         } else {
             contents = lwan_strbuf_get_buffer(&dd->rendered);
             size = lwan_strbuf_get_length(&dd->rendered);
@@ -1274,6 +4797,10 @@ serve_files_handle_request(struct lwan_request *request,
     struct file_cache_entry *fce;
     struct cache_entry *ce;
 
+    if (priv->packed &&
+        pack_handle_request(request, response, priv, &return_status))
+        return return_status;
+
     ce = cache_coro_get_and_ref_entry(priv->cache, request->conn->coro,
                                       request->url.value);
     if (UNLIKELY(!ce)) {
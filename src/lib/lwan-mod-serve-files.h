@@ -26,23 +26,79 @@ extern "C" {
 #include "lwan.h"
 
 #define SERVE_FILES_READ_AHEAD_BYTES (128 * 1024)
+#define SERVE_FILES_BACKGROUND_COMPRESSION_MAX_SIZE (1024 * 1024)
+#define SERVE_FILES_MAX_RANGES 16
+#define SERVE_FILES_CACHE_PERIOD 5
+#define SERVE_FILES_NEGATIVE_CACHE_PERIOD 0
+#define SERVE_FILES_NEGATIVE_CACHE_MAX_ENTRIES 4096
+#define SERVE_FILES_PRELOAD_MAX_SIZE (64 * 1024 * 1024)
+#define SERVE_FILES_COMPRESSED_STORE_MAX_SIZE (256 * 1024 * 1024)
+#define SERVE_FILES_SLAB_SIZE (16 * 1024 * 1024)
 
 struct lwan_serve_files_settings {
   const char *root_path;
   const char *index_html;
   const char *directory_list_template;
+  const char *preload_manifest;
+  const char *compressed_store_path;
+  const char *pack_path;
   size_t read_ahead;
+  size_t background_compression_max_size;
+  size_t max_ranges;
+  size_t preload_max_size;
+  size_t compressed_store_max_size;
+  size_t cache_max_entries;
+  size_t cache_max_size;
+  size_t negative_cache_max_entries;
+  size_t slab_max_file_size;
+  size_t slab_size;
+  size_t auto_index_stream_threshold;
+  unsigned int cache_period;
+  unsigned int cache_refresh_period;
+  unsigned int negative_cache_period;
+  unsigned int preload_threads;
   bool serve_precompressed_files;
   bool auto_index;
   bool auto_index_readme;
+  bool preload;
+  bool preload_wait;
+  bool watch;
+  bool compressed_only;
+};
+
+/* Progress of preloading: how many files were listed to be loaded, and
+ * of those, how many were cached, couldn't be, or were skipped because of
+ * the memory budget (along with files that were never listed because of
+ * it); and how much memory the ones that were cached use. */
+struct lwan_serve_files_preload_status {
+  size_t files;
+  size_t loaded;
+  size_t failed;
+  size_t skipped;
+  size_t bytes;
+  bool done;
 };
 
 LWAN_MODULE_FORWARD_DECL(serve_files);
 
+/* Takes the data of a serve_files handler; returns false if it doesn't
+ * preload files. */
+bool lwan_serve_files_get_preload_status(
+    const void *instance, struct lwan_serve_files_preload_status *status);
+
 #define SERVE_FILES_SETTINGS(root_path_, index_html_, serve_precompressed_files_) \
   .module = LWAN_MODULE_REF(serve_files), \
   .args = ((struct lwan_serve_files_settings[]) {{ \
     .read_ahead = SERVE_FILES_READ_AHEAD_BYTES, \
+    .background_compression_max_size = \
+        SERVE_FILES_BACKGROUND_COMPRESSION_MAX_SIZE, \
+    .max_ranges = SERVE_FILES_MAX_RANGES, \
+    .cache_period = SERVE_FILES_CACHE_PERIOD, \
+    .negative_cache_period = SERVE_FILES_NEGATIVE_CACHE_PERIOD, \
+    .negative_cache_max_entries = SERVE_FILES_NEGATIVE_CACHE_MAX_ENTRIES, \
+    .preload_max_size = SERVE_FILES_PRELOAD_MAX_SIZE, \
+    .compressed_store_max_size = SERVE_FILES_COMPRESSED_STORE_MAX_SIZE, \
+    .slab_size = SERVE_FILES_SLAB_SIZE, \
     .root_path = root_path_, \
     .index_html = index_html_, \
     .serve_precompressed_files = serve_precompressed_files_, \
@@ -0,0 +1,92 @@
+/*
+ * lwan - simple web server
+ * Copyright (c) 2020 Leandro A. F. Pereira <leandro@hardinfo.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#pragma once
+
+/* Format of the asset packs produced by packgen and served by serve_files.
+ *
+ * A pack is a header, followed by file contents and strings, followed by
+ * the entries and an open-addressing hash table indexing them by path.
+ * Everything is in the byte order of the machine that produced the pack;
+ * serve_files validates the whole pack once, when it's mapped, so that
+ * lookups don't have to. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define LWAN_PACK_MAGIC "LWANPACK"
+#define LWAN_PACK_VERSION 1
+
+enum lwan_pack_variant {
+    LWAN_PACK_IDENTITY,
+    LWAN_PACK_DEFLATE,
+    LWAN_PACK_BROTLI,
+    LWAN_PACK_ZSTD,
+    LWAN_PACK_N_VARIANTS,
+};
+
+/* Strings (paths and MIME types) are NUL-terminated; len doesn't include
+ * the terminator.  Compressed variants not worth keeping have len 0. */
+struct lwan_pack_blob {
+    uint64_t off;
+    uint64_t len;
+};
+
+struct lwan_pack_entry {
+    uint64_t hash;
+    int64_t mtime;
+    struct lwan_pack_blob path;
+    struct lwan_pack_blob mime_type;
+    struct lwan_pack_blob variants[LWAN_PACK_N_VARIANTS];
+    char last_modified[32];
+    char etag[24];
+};
+
+struct lwan_pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_entries;
+    /* Power of two, larger than n_entries.  Each bucket holds the index
+     * of an entry plus one, or 0 if it's empty. */
+    uint32_t n_buckets;
+    uint32_t entry_size;
+    uint64_t entries_off;
+    uint64_t buckets_off;
+    uint64_t size;
+};
+
+/* FNV-1a; paths are relative to the packed directory, without a leading
+ * slash, just like serve_files cache keys. */
+static inline uint64_t lwan_pack_hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static inline uint64_t lwan_pack_hash(const char *path)
+{
+    return lwan_pack_hash_bytes(path, strlen(path));
+}
@@ -23,6 +23,7 @@
 #include <limits.h>
 
 #include "lwan.h"
+#include "list.h"
 
 struct lwan_fd_watch *lwan_watch_fd(struct lwan *l,
                                     int fd,
@@ -36,6 +37,17 @@ void lwan_set_thread_name(const char *name);
 void lwan_response_init(struct lwan *l);
 void lwan_response_shutdown(struct lwan *l);
 
+void lwan_response_compress(struct lwan_request *request);
+void lwan_response_compress_stream_begin(struct lwan_request *request);
+bool lwan_response_compress_stream(struct lwan_request *request,
+                                   const struct iovec *iov,
+                                   size_t n_iov,
+                                   bool finish,
+                                   struct lwan_value *out);
+bool lwan_response_compress_chunk(struct lwan_request *request, bool finish);
+void lwan_response_compress_stream_end(struct lwan_request *request);
+void lwan_compressor_pool_free(struct lwan_thread *t);
+
 void lwan_socket_init(struct lwan *l);
 void lwan_socket_shutdown(struct lwan *l);
 
@@ -44,6 +56,26 @@ void lwan_thread_shutdown(struct lwan *l);
 void lwan_thread_add_client(struct lwan_thread *t, int fd);
 void lwan_thread_nudge(struct lwan_thread *t);
 
+/* Lets a connection wait for something done by another thread without
+ * being resumed by I/O events in the meantime.  Once done, the waiter is
+ * handed back to the worker thread that created it, which resumes the
+ * connection if it's still waiting.  Both sides hold a reference, but
+ * only the worker thread touches it. */
+struct lwan_waiter {
+    struct lwan_waiter *next;
+    struct list_node node; /* For whoever is going to wake it up */
+    struct lwan_thread *thread;
+    struct lwan_connection *conn;
+    int refs;
+    bool waiting;
+};
+
+void lwan_waiter_init(struct lwan_waiter *waiter, struct lwan_connection *conn);
+struct lwan_waiter *lwan_waiter_new(struct coro *coro);
+void lwan_waiter_wait(struct lwan_waiter *waiter, struct coro *coro);
+void lwan_waiter_wake(struct lwan_waiter *waiter);
+void lwan_waiter_unref(struct lwan_waiter *waiter);
+
 void lwan_status_init(struct lwan *l);
 void lwan_status_shutdown(struct lwan *l);
 
@@ -52,13 +84,64 @@ void lwan_job_thread_shutdown(void);
 void lwan_job_add(bool (*cb)(void *data), void *data);
 void lwan_job_del(bool (*cb)(void *data), void *data);
 
+/* Modules are created while the configuration file is read, before the
+ * helper threads (readahead, background compression) are started.  Work
+ * that needs them is deferred with this until lwan_init() is done; after
+ * that, cb is called right away. */
+void lwan_after_init(void (*cb)(void *data), void *data);
+
 void lwan_tables_init(void);
 void lwan_tables_shutdown(void);
 
-void lwan_readahead_init(void);
+void lwan_readahead_init(size_t lock_budget);
 void lwan_readahead_shutdown(void);
 void lwan_readahead_queue(int fd, off_t off, size_t size);
-void lwan_madvise_queue(void *addr, size_t size);
+
+/* Mappings registered here are prefetched, and the most used ones are kept
+ * locked in memory within the budget given to lwan_readahead_init().
+ * Registered mappings must be unmapped with lwan_madvise_unmap(). */
+struct lwan_readahead_region;
+struct lwan_readahead_region *lwan_madvise_register(void *addr, size_t size);
+void lwan_madvise_touch(struct lwan_readahead_region *region);
+void lwan_madvise_unmap(struct lwan_readahead_region *region,
+                        void *addr,
+                        size_t size);
+
+/* Pages in part of a file from an I/O thread, so that sendfile() doesn't
+ * block a worker thread. */
+struct lwan_page_in {
+    struct lwan_waiter waiter; /* Must be the first member */
+    off_t off;
+    size_t size;
+    int fd;
+};
+
+void lwan_readahead_page_in_shutdown(void);
+bool lwan_readahead_page_in(struct lwan_page_in *page_in, int fd);
+
+/* A file range mapped once, so that whether parts of it are in the page
+ * cache can be asked repeatedly with a single mincore() call each.  When
+ * it can't be mapped, everything is assumed to be resident. */
+struct lwan_mapped_range {
+    void *addr;
+    size_t len;
+    off_t off;
+};
+
+bool lwan_readahead_map_range(struct lwan_mapped_range *range,
+                              int fd,
+                              off_t off,
+                              size_t size);
+void lwan_readahead_unmap_range(struct lwan_mapped_range *range);
+bool lwan_readahead_range_is_resident(const struct lwan_mapped_range *range,
+                                      off_t off,
+                                      size_t size);
+
+void lwan_compress_queue_init(unsigned int n_threads, unsigned int cpu_budget);
+void lwan_compress_queue_shutdown(void);
+bool lwan_compress_queue_enabled(void);
+bool lwan_compress_queue_add(void (*cb)(void *data, bool cancelled),
+                             void *data);
 
 char *lwan_process_request(struct lwan *l, struct lwan_request *request,
                            struct lwan_value *buffer, char *next_request);
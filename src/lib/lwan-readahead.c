@@ -24,7 +24,10 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <ioprio.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include "lwan-private.h"
 
@@ -40,6 +43,27 @@ enum readahead_cmd {
     SHUTDOWN,
 };
 
+enum region_op {
+    REGION_WILLNEED = 1 << 0,
+    REGION_LOCK = 1 << 1,
+    REGION_UNLOCK = 1 << 2,
+};
+
+struct lwan_readahead_region {
+    struct list_node regions;
+    struct list_node ops;
+    void *addr;
+    size_t length;
+    unsigned int hits;  /* Since the last rebalance; updated atomically */
+    unsigned int score; /* Decaying sum of hits; readahead thread only */
+    enum region_op op;
+    bool fresh;     /* Not looked at by the readahead thread yet */
+    bool pending;   /* In the list of operations to perform */
+    bool busy;      /* Used by the readahead thread without the lock held */
+    bool dead;      /* Unregistered while pending or busy */
+    bool locked;
+};
+
 struct lwan_readahead_cmd {
     enum readahead_cmd cmd;
     union {
@@ -48,10 +72,6 @@ struct lwan_readahead_cmd {
             off_t off;
             int fd;
         } readahead;
-        struct {
-            void *addr;
-            size_t length;
-        } madvise;
     };
 } __attribute__((packed));
 
@@ -59,6 +79,40 @@ static int readahead_pipe_fd[2] = {-1, -1};
 static pthread_t readahead_self;
 static long page_size = PAGE_SIZE;
 
+/* Memory mapped by the file cache is prefetched, and the most frequently
+ * used mappings are kept locked in memory, within a budget. */
+static struct {
+    pthread_mutex_t lock;
+    struct list_head regions;
+    size_t n_regions;
+    size_t budget;
+    size_t locked;
+    unsigned long long prefetched_pages;
+    unsigned long long resident_hints;
+    unsigned long long dropped_hints;
+} madvise_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    /* Handlers register regions before lwan_readahead_init() is called. */
+    .regions = {.n = {&madvise_state.regions.n, &madvise_state.regions.n}},
+};
+
+#define PAGE_IN_THREADS 2
+#define PAGE_IN_MAX_QUEUED 256
+#define PAGE_IN_BUFFER_SIZE (64 * 1024)
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    size_t queued;
+    pthread_t threads[PAGE_IN_THREADS];
+    int n_threads;
+    bool running;
+} page_in = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
 #ifdef _SC_PAGESIZE
 __attribute__((constructor)) static void get_page_size(void)
 {
@@ -74,6 +128,7 @@ void lwan_readahead_shutdown(void)
     struct lwan_readahead_cmd cmd = {
         .cmd = SHUTDOWN,
     };
+    struct lwan_readahead_stats stats;
 
     if (readahead_pipe_fd[0] == readahead_pipe_fd[1] &&
         readahead_pipe_fd[0] == -1)
@@ -84,11 +139,34 @@ void lwan_readahead_shutdown(void)
     write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
     pthread_join(readahead_self, NULL);
 
+    lwan_get_readahead_stats(&stats);
+    lwan_status_debug("Readahead: %llu pages prefetched, %llu hints for "
+                      "resident pages, %llu hints dropped; %zu of %zu bytes "
+                      "locked",
+                      stats.prefetched_pages, stats.resident_hints,
+                      stats.dropped_hints, stats.locked, stats.lock_budget);
+
     close(readahead_pipe_fd[0]);
     close(readahead_pipe_fd[1]);
     readahead_pipe_fd[0] = readahead_pipe_fd[1] = -1;
 }
 
+void lwan_get_readahead_stats(struct lwan_readahead_stats *stats)
+{
+    /* Counters are only written by the readahead thread, except for the
+     * dropped hints; the lock keeps the locked size and the budget in
+     * sync. */
+    pthread_mutex_lock(&madvise_state.lock);
+    *stats = (struct lwan_readahead_stats){
+        .prefetched_pages = ATOMIC_READ(madvise_state.prefetched_pages),
+        .resident_hints = ATOMIC_READ(madvise_state.resident_hints),
+        .dropped_hints = ATOMIC_READ(madvise_state.dropped_hints),
+        .locked = madvise_state.locked,
+        .lock_budget = madvise_state.budget,
+    };
+    pthread_mutex_unlock(&madvise_state.lock);
+}
+
 void lwan_readahead_queue(int fd, off_t off, size_t size)
 {
     if (size < (size_t)page_size)
@@ -100,25 +178,455 @@ void lwan_readahead_queue(int fd, off_t off, size_t size)
     };
 
     /* Readahead is just a hint.  Failing to write is not an error. */
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
+    if (UNLIKELY(write(readahead_pipe_fd[1], &cmd, sizeof(cmd)) < 0))
+        ATOMIC_INC(madvise_state.dropped_hints);
+}
+
+bool lwan_readahead_map_range(struct lwan_mapped_range *range,
+                              int fd,
+                              off_t off,
+                              size_t size)
+{
+    const off_t aligned_off = off & ~((off_t)page_size - 1);
+    size_t len = size + (size_t)(off - aligned_off);
+
+    /* Nothing is faulted in by mapping the file; this is just so that
+     * mincore() can be used. */
+    range->addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, aligned_off);
+    if (UNLIKELY(range->addr == MAP_FAILED)) {
+        range->addr = NULL;
+        return false;
+    }
+
+    range->off = aligned_off;
+    range->len = len;
+    return true;
+}
+
+void lwan_readahead_unmap_range(struct lwan_mapped_range *range)
+{
+    if (range->addr) {
+        munmap(range->addr, range->len);
+        range->addr = NULL;
+    }
+}
+
+bool lwan_readahead_range_is_resident(const struct lwan_mapped_range *range,
+                                      off_t off,
+                                      size_t size)
+{
+    const off_t aligned_off = off & ~((off_t)page_size - 1);
+    unsigned char vec[256];
+    size_t len = size + (size_t)(off - aligned_off);
+    size_t pages;
+
+    /* Without a mapping, there's no way to tell. */
+    if (UNLIKELY(!range->addr || aligned_off < range->off ||
+                 aligned_off >= range->off + (off_t)range->len))
+        return true;
+
+    if (len > range->len - (size_t)(aligned_off - range->off))
+        len = range->len - (size_t)(aligned_off - range->off);
+    /* Only the beginning of very large ranges is checked. */
+    if (len > sizeof(vec) * (size_t)page_size)
+        len = sizeof(vec) * (size_t)page_size;
+    pages = (len + (size_t)page_size - 1) / (size_t)page_size;
+
+    if (UNLIKELY(mincore((char *)range->addr + (aligned_off - range->off),
+                         len, vec)))
+        return true;
+
+    for (size_t i = 0; i < pages; i++) {
+        if (!(vec[i] & 1))
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_resident(int fd, off_t off, size_t size)
+{
+    struct lwan_mapped_range range;
+    bool resident;
+
+    if (UNLIKELY(!lwan_readahead_map_range(&range, fd, off, size)))
+        return true;
+
+    resident = lwan_readahead_range_is_resident(&range, off, size);
+    lwan_readahead_unmap_range(&range);
+
+    return resident;
+}
+
+bool lwan_readahead_page_in(struct lwan_page_in *pi, int fd)
+{
+    bool queued = false;
+
+    /* The file might be closed while it's being paged in. */
+    pi->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (UNLIKELY(pi->fd < 0))
+        return false;
+
+    pthread_mutex_lock(&page_in.lock);
+    if (LIKELY(page_in.running && page_in.queued < PAGE_IN_MAX_QUEUED)) {
+        list_add_tail(&page_in.queue, &pi->waiter.node);
+        page_in.queued++;
+        pthread_cond_signal(&page_in.cond);
+        queued = true;
+    }
+    pthread_mutex_unlock(&page_in.lock);
+
+    if (UNLIKELY(!queued))
+        close(pi->fd);
+
+    return queued;
 }
 
-void lwan_madvise_queue(void *addr, size_t length)
+static void page_in_range(struct lwan_page_in *pi, char *buffer)
 {
+    const off_t end = pi->off + (off_t)pi->size;
+
+    /* Start reading everything at once, then wait for it. */
+    readahead(pi->fd, pi->off, pi->size);
+
+    for (off_t off = pi->off; off < end;) {
+        size_t len = (size_t)(end - off);
+        ssize_t r;
+
+        if (len > PAGE_IN_BUFFER_SIZE)
+            len = PAGE_IN_BUFFER_SIZE;
+
+        r = pread(pi->fd, buffer, len, off);
+        if (UNLIKELY(r <= 0)) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        off += r;
+    }
+}
+
+static void *page_in_loop(void *data __attribute__((unused)))
+{
+    char *buffer = malloc(PAGE_IN_BUFFER_SIZE);
+
+    if (UNLIKELY(!buffer))
+        lwan_status_critical("Could not allocate page-in buffer");
+
+    lwan_set_thread_name("pagein");
+
+    pthread_mutex_lock(&page_in.lock);
+    while (true) {
+        struct lwan_page_in *pi;
+
+        while (page_in.running && list_empty(&page_in.queue))
+            pthread_cond_wait(&page_in.cond, &page_in.lock);
+
+        /* Whatever was queued is still paged in before shutting down, as
+         * connections are waiting on it. */
+        pi = list_pop(&page_in.queue, struct lwan_page_in, waiter.node);
+        if (!pi)
+            break;
+        page_in.queued--;
+        pthread_mutex_unlock(&page_in.lock);
+
+        page_in_range(pi, buffer);
+        close(pi->fd);
+        lwan_waiter_wake(&pi->waiter);
+
+        pthread_mutex_lock(&page_in.lock);
+    }
+    pthread_mutex_unlock(&page_in.lock);
+
+    free(buffer);
+    return NULL;
+}
+
+void lwan_readahead_page_in_shutdown(void)
+{
+    pthread_mutex_lock(&page_in.lock);
+    page_in.running = false;
+    pthread_cond_broadcast(&page_in.cond);
+    pthread_mutex_unlock(&page_in.lock);
+
+    for (int i = 0; i < page_in.n_threads; i++)
+        pthread_join(page_in.threads[i], NULL);
+    page_in.n_threads = 0;
+}
+
+static size_t non_resident_pages(void *addr, size_t length)
+{
+    const size_t pages = (length + (size_t)page_size - 1) / (size_t)page_size;
+    unsigned char vec[256];
+    size_t missing = 0;
+
+    for (size_t page = 0; page < pages; page += sizeof(vec)) {
+        size_t n = pages - page;
+
+        if (n > sizeof(vec))
+            n = sizeof(vec);
+
+        if (UNLIKELY(mincore((char *)addr + page * (size_t)page_size,
+                             n * (size_t)page_size, vec) < 0))
+            return pages - page + missing;
+
+        for (size_t i = 0; i < n; i++)
+            missing += !(vec[i] & 1);
+    }
+
+    return missing;
+}
+
+static size_t page_round(size_t length)
+{
+    return (length + (size_t)page_size - 1) & ~((size_t)page_size - 1);
+}
+
+struct lwan_readahead_region *lwan_madvise_register(void *addr, size_t length)
+{
+    struct lwan_readahead_region *region;
+
     if (length < (size_t)page_size)
-        return;
+        return NULL;
 
-    struct lwan_readahead_cmd cmd = {
-        .madvise = {.addr = addr, .length = length},
-        .cmd = MADVISE,
+    region = malloc(sizeof(*region));
+    if (UNLIKELY(!region))
+        return NULL;
+
+    *region = (struct lwan_readahead_region){
+        .addr = addr,
+        .length = length,
+        .fresh = true,
     };
 
-    /* Madvise is just a hint.  Failing to write is not an error. */
-    write(readahead_pipe_fd[1], &cmd, sizeof(cmd));
+    pthread_mutex_lock(&madvise_state.lock);
+    list_add_tail(&madvise_state.regions, &region->regions);
+    madvise_state.n_regions++;
+    pthread_mutex_unlock(&madvise_state.lock);
+
+    struct lwan_readahead_cmd cmd = {.cmd = MADVISE};
+
+    /* The region is looked at in the next periodic pass if the readahead
+     * thread can't be woken up right now. */
+    if (UNLIKELY(write(readahead_pipe_fd[1], &cmd, sizeof(cmd)) < 0))
+        ATOMIC_INC(madvise_state.dropped_hints);
+
+    return region;
+}
+
+void lwan_madvise_touch(struct lwan_readahead_region *region)
+{
+    if (region)
+        __atomic_fetch_add(&region->hits, 1, __ATOMIC_RELAXED);
+}
+
+void lwan_madvise_unmap(struct lwan_readahead_region *region,
+                        void *addr,
+                        size_t length)
+{
+    bool busy = false;
+
+    if (region) {
+        pthread_mutex_lock(&madvise_state.lock);
+
+        /* Unmapping also unlocks the pages. */
+        if (region->locked)
+            madvise_state.locked -= page_round(region->length);
+
+        list_del_from(&madvise_state.regions, &region->regions);
+        madvise_state.n_regions--;
+
+        /* Don't wait for the readahead thread to be done with the region
+         * (it might be faulting it in): it unmaps it once it's done. */
+        busy = region->busy;
+        if (region->pending || busy)
+            region->dead = true;
+        else
+            free(region);
+
+        pthread_mutex_unlock(&madvise_state.lock);
+    }
+
+    if (!busy)
+        munmap(addr, length);
+}
+
+/* Called with the lock held once the readahead thread is done with a
+ * region it used without holding it. */
+static void region_release(struct lwan_readahead_region *region)
+{
+    region->busy = false;
+
+    if (region->dead) {
+        munmap(region->addr, region->length);
+        if (!region->pending)
+            free(region);
+    }
+}
+
+static int compare_region_score(const void *a, const void *b)
+{
+    const struct lwan_readahead_region *ra =
+        *(const struct lwan_readahead_region **)a;
+    const struct lwan_readahead_region *rb =
+        *(const struct lwan_readahead_region **)b;
+
+    return (ra->score < rb->score) - (ra->score > rb->score);
+}
+
+static void queue_region_op(struct list_head *ops,
+                            struct lwan_readahead_region *region,
+                            enum region_op op)
+{
+    if (!region->pending) {
+        region->pending = true;
+        region->op = 0;
+        list_add_tail(ops, &region->ops);
+    }
+    region->op |= op;
+}
+
+static void choose_locked_regions(struct list_head *ops)
+{
+    static struct lwan_readahead_region **sorted;
+    static size_t sorted_len;
+    struct lwan_readahead_region *region;
+    size_t budget_left;
+    size_t n = 0;
+
+    if (madvise_state.n_regions > sorted_len) {
+        struct lwan_readahead_region **new_sorted = realloc(
+            sorted, madvise_state.n_regions * 2 * sizeof(*sorted));
+
+        if (UNLIKELY(!new_sorted))
+            return;
+        sorted = new_sorted;
+        sorted_len = madvise_state.n_regions * 2;
+    }
+
+    /* Regions that cooled down completely aren't worth locking, so only
+     * the ones that were used recently (or need to be unlocked) are
+     * sorted. */
+    list_for_each (&madvise_state.regions, region, regions) {
+        region->score = region->score / 2 +
+                        __atomic_exchange_n(&region->hits, 0, __ATOMIC_RELAXED);
+        if (region->score || region->locked) {
+            region->busy = true;
+            sorted[n++] = region;
+        }
+    }
+
+    /* Regions might be unregistered while they're sorted; they're freed
+     * once they're released. */
+    pthread_mutex_unlock(&madvise_state.lock);
+    qsort(sorted, n, sizeof(*sorted), compare_region_score);
+    pthread_mutex_lock(&madvise_state.lock);
+
+    /* The most used regions are kept locked for as long as they fit in
+     * the budget; the ones that have cooled down are unlocked to make room
+     * for them. */
+    budget_left = madvise_state.budget;
+    for (size_t i = 0; i < n; i++) {
+        const size_t length = page_round(sorted[i]->length);
+        const bool dead = sorted[i]->dead;
+
+        region_release(sorted[i]);
+        if (dead)
+            continue;
+
+        if (sorted[i]->score && length <= budget_left) {
+            budget_left -= length;
+            if (!sorted[i]->locked)
+                queue_region_op(ops, sorted[i], REGION_LOCK);
+        } else if (sorted[i]->locked) {
+            queue_region_op(ops, sorted[i], REGION_UNLOCK);
+        }
+    }
+}
+
+static void madvise_pass(bool rebalance)
+{
+    struct lwan_readahead_region *region;
+    struct list_head ops;
+
+    list_head_init(&ops);
+
+    pthread_mutex_lock(&madvise_state.lock);
+
+    list_for_each (&madvise_state.regions, region, regions) {
+        if (region->fresh) {
+            region->fresh = false;
+            queue_region_op(&ops, region, REGION_WILLNEED);
+        }
+    }
+    if (rebalance && madvise_state.budget)
+        choose_locked_regions(&ops);
+
+    /* Unlock cold regions first, so locking hot ones stays within the
+     * budget. */
+    list_for_each (&ops, region, ops) {
+        if (region->op & REGION_UNLOCK) {
+            munlock(region->addr, region->length);
+            madvise_state.locked -= page_round(region->length);
+            region->locked = false;
+        }
+    }
+
+    while ((region = list_pop(&ops, struct lwan_readahead_region, ops))) {
+        size_t missing;
+        bool locked = false;
+
+        region->pending = false;
+        if (region->dead) {
+            free(region);
+            continue;
+        }
+        if (!(region->op & (REGION_WILLNEED | REGION_LOCK)))
+            continue;
+
+        /* Faulting pages in might take a while; let other threads register
+         * and unregister regions in the meantime. */
+        region->busy = true;
+        pthread_mutex_unlock(&madvise_state.lock);
+
+        missing = non_resident_pages(region->addr, region->length);
+        if (missing && (region->op & REGION_WILLNEED))
+            madvise(region->addr, region->length, MADV_WILLNEED);
+        if (region->op & REGION_LOCK)
+            locked = !mlock(region->addr, region->length);
+
+        pthread_mutex_lock(&madvise_state.lock);
+
+        if (missing)
+            madvise_state.prefetched_pages += missing;
+        else
+            madvise_state.resident_hints++;
+
+        if (region->dead) {
+            region_release(region);
+            continue;
+        }
+        region->busy = false;
+
+        if (locked) {
+            region->locked = true;
+            madvise_state.locked += page_round(region->length);
+        } else if (region->op & REGION_LOCK) {
+            /* Most likely RLIMIT_MEMLOCK; stop trying to lock more. */
+            lwan_status_warning("Could not lock %zu bytes in memory; "
+                                "limiting locked memory to %zu bytes",
+                                region->length, madvise_state.locked);
+            madvise_state.budget = madvise_state.locked;
+        }
+    }
+
+    pthread_mutex_unlock(&madvise_state.lock);
 }
 
 static void *lwan_readahead_loop(void *data __attribute__((unused)))
 {
+    struct timespec last_rebalance = {};
+
     /* Idle priority for the calling thread.   Magic value of `7` obtained from
      * sample program in linux/Documentation/block/ioprio.txt.  This is a no-op
      * on anything but Linux.  */
@@ -127,10 +635,25 @@ static void *lwan_readahead_loop(void *data __attribute__((unused)))
     lwan_set_thread_name("readahead");
 
     while (true) {
+        struct pollfd pfd = {.fd = readahead_pipe_fd[0], .events = POLLIN};
         struct lwan_readahead_cmd cmd[16];
-        ssize_t n_bytes = read(readahead_pipe_fd[0], cmd, sizeof(cmd));
+        bool madvised = false;
+        struct timespec now;
+        ssize_t n_bytes;
         ssize_t cmds;
 
+        /* Which regions are locked is revisited every second. */
+        clock_gettime(monotonic_clock_id, &now);
+        if (now.tv_sec != last_rebalance.tv_sec) {
+            madvise_pass(true);
+            last_rebalance = now;
+        }
+
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+
+        n_bytes = read(readahead_pipe_fd[0], cmd, sizeof(cmd));
+
         if (UNLIKELY(n_bytes < 0)) {
             if (errno == EAGAIN || errno == EINTR)
                 continue;
@@ -149,26 +672,35 @@ static void *lwan_readahead_loop(void *data __attribute__((unused)))
         for (ssize_t i = 0; i < cmds; i++) {
             switch (cmd[i].cmd) {
             case READAHEAD:
+                if (is_resident(cmd[i].readahead.fd, cmd[i].readahead.off,
+                                cmd[i].readahead.size)) {
+                    madvise_state.resident_hints++;
+                    break;
+                }
                 readahead(cmd[i].readahead.fd, cmd[i].readahead.off,
                           cmd[i].readahead.size);
+                madvise_state.prefetched_pages +=
+                    page_round(cmd[i].readahead.size) / (size_t)page_size;
                 break;
             case MADVISE:
-                madvise(cmd[i].madvise.addr, cmd[i].madvise.length,
-                        MADV_WILLNEED);
-                mlock(cmd[i].madvise.addr, cmd[i].madvise.length);
+                madvised = true;
                 break;
             case SHUTDOWN:
                 goto out;
             }
         }
+
+        if (madvised)
+            madvise_pass(false);
     }
 
 out:
     return NULL;
 }
 
-void lwan_readahead_init(void)
+void lwan_readahead_init(size_t lock_budget)
 {
+    struct rlimit rlim;
     int flags;
 
     if (readahead_pipe_fd[0] != readahead_pipe_fd[1])
@@ -176,6 +708,15 @@ void lwan_readahead_init(void)
 
     lwan_status_debug("Initializing low priority readahead thread");
 
+    if (!getrlimit(RLIMIT_MEMLOCK, &rlim) && rlim.rlim_cur != RLIM_INFINITY &&
+        rlim.rlim_cur < lock_budget) {
+        lwan_status_debug("Limiting locked memory to %zu bytes, per "
+                          "RLIMIT_MEMLOCK",
+                          (size_t)rlim.rlim_cur);
+        lock_budget = (size_t)rlim.rlim_cur;
+    }
+    madvise_state.budget = lock_budget;
+
     if (pipe2(readahead_pipe_fd, O_CLOEXEC | PIPE_DIRECT_FLAG) < 0)
         lwan_status_critical_perror("pipe2");
 
@@ -189,6 +730,14 @@ void lwan_readahead_init(void)
     if (pthread_create(&readahead_self, NULL, lwan_readahead_loop, NULL))
         lwan_status_critical_perror("pthread_create");
 
+    list_head_init(&page_in.queue);
+    page_in.running = true;
+    for (int i = 0; i < PAGE_IN_THREADS; i++) {
+        if (pthread_create(&page_in.threads[i], NULL, page_in_loop, NULL))
+            lwan_status_critical_perror("pthread_create");
+        page_in.n_threads++;
+    }
+
 #ifdef SCHED_IDLE
     struct sched_param sched_param = {.sched_priority = 0};
     if (pthread_setschedparam(readahead_self, SCHED_IDLE, &sched_param) < 0)
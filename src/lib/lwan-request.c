@@ -71,6 +71,8 @@ struct lwan_request_parser_helper {
 
     struct lwan_value connection;	/* Connection: */
 
+    struct lwan_trie_match route;	/* Matched URL map and path params */
+
     struct lwan_key_value_array cookies, query_params, post_params;
 
     struct { /* If-Modified-Since: */
@@ -698,6 +700,10 @@ parse_accept_encoding(struct lwan_request *request)
         case STR4_INT(' ','g','z','i'):
             request->flags |= REQUEST_ACCEPT_GZIP;
             break;
+        case STR4_INT('z','s','t','d'):
+        case STR4_INT(' ','z','s','t'):
+            request->flags |= REQUEST_ACCEPT_ZSTD;
+            break;
 #if defined(HAVE_BROTLI)
         default:
             while (lwan_char_isspace(*p))
@@ -1315,8 +1321,8 @@ lwan_request_websocket_upgrade(struct lwan_request *request)
 static enum lwan_http_status prepare_for_response(struct lwan_url_map *url_map,
                                                   struct lwan_request *request)
 {
-    request->url.value += url_map->prefix_len;
-    request->url.len -= url_map->prefix_len;
+    request->url.value += request->helper->route.len;
+    request->url.len -= request->helper->route.len;
 
     if (UNLIKELY(url_map->flags & HANDLER_MUST_AUTHORIZE &&
                  !lwan_http_authorize(request, url_map->authorization.realm,
@@ -1331,6 +1337,11 @@ static enum lwan_http_status prepare_for_response(struct lwan_url_map *url_map,
     if (url_map->flags & HANDLER_PARSE_ACCEPT_ENCODING)
         parse_accept_encoding(request);
 
+    /* URL maps might be looked up again after a rewrite. */
+    request->response.compression.settings =
+        (url_map->flags & HANDLER_COMPRESS_RESPONSE) ? &url_map->compression
+                                                     : NULL;
+
     if (lwan_request_get_method(request) == REQUEST_METHOD_POST) {
         enum lwan_http_status status;
 
@@ -1351,6 +1362,26 @@ static enum lwan_http_status prepare_for_response(struct lwan_url_map *url_map,
     return HTTP_OK;
 }
 
+static struct lwan_url_map *lookup_url_map(struct lwan *l,
+                                           struct lwan_request *request)
+{
+    struct lwan_trie_match *route = &request->helper->route;
+    enum lwan_request_flags method = lwan_request_get_method(request);
+    struct lwan_url_map *url_map;
+
+    url_map = lwan_trie_lookup(&l->url_map_trie, request->url.value,
+                               (unsigned int)method, route);
+
+    /* Handlers restricted to GET requests also take HEAD requests. */
+    if (UNLIKELY(!url_map && route->other_methods &&
+                 method == REQUEST_METHOD_HEAD)) {
+        url_map = lwan_trie_lookup(&l->url_map_trie, request->url.value,
+                                   (unsigned int)REQUEST_METHOD_GET, route);
+    }
+
+    return url_map;
+}
+
 static bool handle_rewrite(struct lwan_request *request)
 {
     struct lwan_request_parser_helper *helper = request->helper;
@@ -1407,9 +1438,11 @@ char *lwan_process_request(struct lwan *l,
     }
 
 lookup_again:
-    url_map = lwan_trie_lookup_prefix(&l->url_map_trie, request->url.value);
+    url_map = lookup_url_map(l, request);
     if (UNLIKELY(!url_map)) {
-        lwan_default_response(request, HTTP_NOT_FOUND);
+        lwan_default_response(request, helper.route.other_methods
+                                           ? HTTP_NOT_ALLOWED
+                                           : HTTP_NOT_FOUND);
         goto out;
     }
 
@@ -1469,6 +1502,22 @@ const char *lwan_request_get_cookie(struct lwan_request *request,
     return value_lookup(lwan_request_get_cookies(request), key);
 }
 
+const char *lwan_request_get_path_param(struct lwan_request *request,
+                                        const char *name,
+                                        size_t *len)
+{
+    const struct lwan_trie_match *route = &request->helper->route;
+
+    for (unsigned int i = 0; i < route->n_params; i++) {
+        if (streq(route->params[i].name, name)) {
+            *len = route->params[i].len;
+            return route->params[i].value;
+        }
+    }
+
+    return NULL;
+}
+
 const char *lwan_request_get_header(struct lwan_request *request,
                                     const char *header)
 {
@@ -1580,6 +1629,83 @@ lwan_request_get_range(struct lwan_request *request, off_t *from, off_t *to)
     return -ENOENT;
 }
 
+static const char *parse_range_offset(const char *p, const char *end,
+                                      off_t *value)
+{
+    uint64_t parsed = 0;
+    const char *start = p;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (UNLIKELY(parsed > ((uint64_t)OFF_MAX - 9) / 10))
+            return NULL;
+        parsed = parsed * 10 + (uint64_t)(*p - '0');
+    }
+
+    if (UNLIKELY(p == start))
+        return NULL;
+
+    *value = (off_t)parsed;
+    return p;
+}
+
+int lwan_request_get_ranges(struct lwan_request *request,
+                            struct lwan_range *ranges,
+                            size_t max_ranges)
+{
+    const struct lwan_value *raw = &request->helper->range.raw;
+    const char *p, *end;
+    size_t n_ranges = 0;
+
+    if (!raw->len)
+        return -ENOENT;
+
+    if (UNLIKELY(raw->len <= (sizeof("bytes=") - 1)))
+        return -EINVAL;
+    if (UNLIKELY(strncmp(raw->value, "bytes=", sizeof("bytes=") - 1)))
+        return -EINVAL;
+
+    p = raw->value + sizeof("bytes=") - 1;
+    end = raw->value + raw->len;
+
+    while (p < end) {
+        struct lwan_range range;
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+
+        if (p < end && *p == '-') {
+            range.from = -1;
+            p = parse_range_offset(p + 1, end, &range.to);
+        } else {
+            p = parse_range_offset(p, end, &range.from);
+            if (UNLIKELY(!p || p == end || *p != '-'))
+                return -EINVAL;
+
+            p++;
+            if (p < end && *p >= '0' && *p <= '9')
+                p = parse_range_offset(p, end, &range.to);
+            else
+                range.to = -1;
+        }
+        if (UNLIKELY(!p))
+            return -EINVAL;
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end) {
+            if (UNLIKELY(*p != ','))
+                return -EINVAL;
+            p++;
+        }
+
+        if (UNLIKELY(n_ranges == max_ranges))
+            return -E2BIG;
+        ranges[n_ranges++] = range;
+    }
+
+    return (int)n_ranges;
+}
+
 ALWAYS_INLINE int
 lwan_request_get_if_modified_since(struct lwan_request *request, time_t *value)
 {
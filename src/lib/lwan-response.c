@@ -136,6 +136,54 @@ static inline bool has_response_body(enum lwan_request_flags method,
     return (method & 1 << 0) || status != HTTP_NOT_MODIFIED;
 }
 
+static void writev_response_buffer(struct lwan_request *request,
+                                   const struct iovec *head,
+                                   size_t n_head,
+                                   const struct iovec *tail,
+                                   size_t n_tail)
+{
+    struct lwan_strbuf *buffer = request->response.buffer;
+    struct iovec inline_vec[LWAN_ARRAY_INCREMENT];
+    struct iovec *vec = inline_vec;
+    const struct iovec *segments;
+    size_t n_segments = lwan_strbuf_get_segments(buffer, &segments);
+    size_t n_vec = n_head + n_tail + (n_segments ? n_segments : 1);
+
+    if (n_vec > N_ELEMENTS(inline_vec)) {
+        vec = coro_malloc(request->conn->coro, n_vec * sizeof(*vec));
+        if (UNLIKELY(!vec)) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+    }
+
+    /* lwan_writev() modifies the vector it's given, so segments must be
+     * copied even if there's no head or tail. */
+    memcpy(vec, head, n_head * sizeof(*vec));
+    if (n_segments) {
+        memcpy(vec + n_head, segments, n_segments * sizeof(*vec));
+    } else {
+        n_segments = 1;
+        vec[n_head] = (struct iovec){
+            .iov_base = lwan_strbuf_get_buffer(buffer),
+            .iov_len = lwan_strbuf_get_length(buffer),
+        };
+    }
+    memcpy(vec + n_head + n_segments, tail, n_tail * sizeof(*vec));
+
+    lwan_writev(request, vec, n_vec);
+}
+
+static void finish_compressed_event_stream(struct lwan_request *request)
+{
+    struct lwan_value out;
+
+    if (LIKELY(lwan_response_compress_stream(request, NULL, 0, true, &out)))
+        lwan_send(request, out.value, out.len, 0);
+
+    lwan_response_compress_stream_end(request);
+}
+
 void lwan_response(struct lwan_request *request, enum lwan_http_status status)
 {
     const struct lwan_response *response = &request->response;
@@ -150,7 +198,13 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
     }
 
     if (UNLIKELY(request->flags & RESPONSE_SENT_HEADERS)) {
-        lwan_status_debug("Headers already sent, ignoring call");
+        if (request->response.compression.stream) {
+            /* Event streams don't have a terminating event, so flush
+             * whatever is left in the compressor here. */
+            finish_compressed_event_stream(request);
+        } else {
+            lwan_status_debug("Headers already sent, ignoring call");
+        }
         return;
     }
 
@@ -178,6 +232,9 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
+    if (response->compression.settings)
+        lwan_response_compress(request);
+
     size_t header_len =
         lwan_prepare_response_header(request, status, headers, sizeof(headers));
     if (UNLIKELY(!header_len)) {
@@ -190,21 +247,24 @@ void lwan_response(struct lwan_request *request, enum lwan_http_status status)
         return;
     }
 
-    char *resp_buf = lwan_strbuf_get_buffer(response->buffer);
     const size_t resp_len = lwan_strbuf_get_length(response->buffer);
-    if (sizeof(headers) - header_len > resp_len) {
+    const struct iovec *segments;
+    if (sizeof(headers) - header_len > resp_len &&
+        !lwan_strbuf_get_segments(response->buffer, &segments)) {
         /* writev() has to allocate, copy, and validate the response vector,
          * so use send() for responses small enough to fit the headers
-         * buffer.  On Linux, this is ~10% faster.  */
-        memcpy(headers + header_len, resp_buf, resp_len);
+         * buffer.  On Linux, this is ~10% faster.  (Small buffers can
+         * still be segmented if they reference static data; those aren't
+         * flattened here, as that could fail.) */
+        memcpy(headers + header_len, lwan_strbuf_get_buffer(response->buffer),
+               resp_len);
         lwan_send(request, headers, header_len + resp_len, 0);
     } else {
-        struct iovec response_vec[] = {
-            {.iov_base = headers, .iov_len = header_len},
-            {.iov_base = resp_buf, .iov_len = resp_len},
-        };
+        /* Segmented buffers are sent as they are, without having to
+         * concatenate them first. */
+        const struct iovec head = {.iov_base = headers, .iov_len = header_len};
 
-        lwan_writev(request, response_vec, N_ELEMENTS(response_vec));
+        writev_response_buffer(request, &head, 1, NULL, 0);
     }
 }
 
@@ -342,6 +402,14 @@ size_t lwan_prepare_response_header_full(
         }
     }
 
+    if (request->response.compression.settings) {
+        if (request->response.compression.encoding) {
+            APPEND_CONSTANT("\r\nContent-Encoding: ");
+            APPEND_STRING(request->response.compression.encoding);
+        }
+        APPEND_CONSTANT("\r\nVary: Accept-Encoding");
+    }
+
     if (LIKELY(!date_overridden)) {
         APPEND_CONSTANT("\r\nDate: ");
         APPEND_STRING_LEN(request->conn->thread->date.date, 29);
@@ -392,6 +460,8 @@ bool lwan_response_set_chunked(struct lwan_request *request,
         return false;
 
     request->flags |= RESPONSE_CHUNKED_ENCODING;
+    if (request->response.compression.settings)
+        lwan_response_compress_stream_begin(request);
     buffer_len = lwan_prepare_response_header(request, status, buffer,
                                               DEFAULT_BUFFER_SIZE);
     if (UNLIKELY(!buffer_len))
@@ -403,41 +473,108 @@ bool lwan_response_set_chunked(struct lwan_request *request,
     return true;
 }
 
+static void send_chunk(struct lwan_request *request, size_t buffer_len)
+{
+    char chunk_size[3 * sizeof(size_t) + 2];
+    int converted_len =
+        snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", buffer_len);
+    if (UNLIKELY(converted_len < 0 ||
+                 (size_t)converted_len >= sizeof(chunk_size))) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+    size_t chunk_size_len = (size_t)converted_len;
+
+    const struct iovec head = {.iov_base = chunk_size,
+                               .iov_len = chunk_size_len};
+    const struct iovec tail = {.iov_base = "\r\n", .iov_len = 2};
+
+    writev_response_buffer(request, &head, 1, &tail, 1);
+}
+
 void lwan_response_send_chunk(struct lwan_request *request)
 {
+    static const char last_chunk[] = "0\r\n\r\n";
+
     if (!(request->flags & RESPONSE_SENT_HEADERS)) {
         if (UNLIKELY(!lwan_response_set_chunked(request, HTTP_OK)))
             return;
     }
 
     size_t buffer_len = lwan_strbuf_get_length(request->response.buffer);
+
+    if (request->response.compression.stream) {
+        /* An empty chunk ends the response, so it's also the cue to
+         * finish the compressed stream. */
+        const bool finish = !buffer_len;
+
+        if (UNLIKELY(!lwan_response_compress_chunk(request, finish))) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        if (finish) {
+            send_chunk(request, lwan_strbuf_get_length(request->response.buffer));
+            lwan_response_compress_stream_end(request);
+            lwan_strbuf_reset(request->response.buffer);
+            lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
+            return;
+        }
+
+        buffer_len = lwan_strbuf_get_length(request->response.buffer);
+    }
+
     if (UNLIKELY(!buffer_len)) {
-        static const char last_chunk[] = "0\r\n\r\n";
         lwan_send(request, last_chunk, sizeof(last_chunk) - 1, 0);
         return;
     }
 
-    char chunk_size[3 * sizeof(size_t) + 2];
-    int converted_len =
-        snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", buffer_len);
-    if (UNLIKELY(converted_len < 0 ||
-                 (size_t)converted_len >= sizeof(chunk_size))) {
-        coro_yield(request->conn->coro, CONN_CORO_ABORT);
-        __builtin_unreachable();
-    }
-    size_t chunk_size_len = (size_t)converted_len;
+    send_chunk(request, buffer_len);
+
+    lwan_strbuf_reset(request->response.buffer);
+    coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+}
+
+static bool send_tpl_chunk(struct lwan_strbuf *buf, void *data)
+{
+    /* An empty chunk would end the response. */
+    if (lwan_strbuf_get_length(buf))
+        lwan_response_send_chunk(data);
+    return true;
+}
 
-    struct iovec chunk_vec[] = {
-        {.iov_base = chunk_size, .iov_len = chunk_size_len},
-        {.iov_base = lwan_strbuf_get_buffer(request->response.buffer),
-         .iov_len = buffer_len},
-        {.iov_base = "\r\n", .iov_len = 2},
+bool lwan_tpl_apply_chunked(struct lwan_tpl *tpl,
+                            struct lwan_request *request,
+                            void *variables,
+                            size_t threshold)
+{
+    const struct lwan_tpl_flush flush = {
+        .threshold = threshold,
+        .callback = send_tpl_chunk,
+        .data = request,
     };
+    const bool stream =
+        lwan_request_get_method(request) != REQUEST_METHOD_HEAD &&
+        (!(request->flags & RESPONSE_SENT_HEADERS) ||
+         (request->flags & RESPONSE_CHUNKED_ENCODING));
+
+    if (!lwan_tpl_apply_with_flush(tpl, request->response.buffer, variables,
+                                   stream ? &flush : NULL,
+                                   request->conn->coro)) {
+        if (request->flags & RESPONSE_CHUNKED_ENCODING) {
+            /* Part of the document has been sent already, so there's no
+             * way to report the error other than dropping the connection. */
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+        return false;
+    }
 
-    lwan_writev(request, chunk_vec, N_ELEMENTS(chunk_vec));
+    if ((request->flags & RESPONSE_CHUNKED_ENCODING) &&
+        lwan_strbuf_get_length(request->response.buffer))
+        lwan_response_send_chunk(request);
 
-    lwan_strbuf_reset(request->response.buffer);
-    coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
+    return true;
 }
 
 bool lwan_response_set_event_stream(struct lwan_request *request,
@@ -451,6 +588,8 @@ bool lwan_response_set_event_stream(struct lwan_request *request,
 
     request->response.mime_type = "text/event-stream";
     request->flags |= RESPONSE_NO_CONTENT_LENGTH;
+    if (request->response.compression.settings)
+        lwan_response_compress_stream_begin(request);
     buffer_len = lwan_prepare_response_header(request, status, buffer,
                                               DEFAULT_BUFFER_SIZE);
     if (UNLIKELY(!buffer_len))
@@ -489,12 +628,19 @@ void lwan_response_send_event(struct lwan_request *request, const char *event)
 
     size_t buffer_len = lwan_strbuf_get_length(request->response.buffer);
     if (buffer_len) {
+        char *buffer = lwan_strbuf_get_buffer(request->response.buffer);
+
+        if (UNLIKELY(!buffer)) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
         vec[last++] = (struct iovec){
             .iov_base = "data: ",
             .iov_len = sizeof("data: ") - 1,
         };
         vec[last++] = (struct iovec){
-            .iov_base = lwan_strbuf_get_buffer(request->response.buffer),
+            .iov_base = buffer,
             .iov_len = buffer_len,
         };
     }
@@ -504,7 +650,19 @@ void lwan_response_send_event(struct lwan_request *request, const char *event)
         .iov_len = 4,
     };
 
-    lwan_writev(request, vec, last);
+    if (request->response.compression.stream) {
+        struct lwan_value out;
+
+        if (UNLIKELY(!lwan_response_compress_stream(request, vec, last, false,
+                                                    &out))) {
+            coro_yield(request->conn->coro, CONN_CORO_ABORT);
+            __builtin_unreachable();
+        }
+
+        lwan_send(request, out.value, out.len, 0);
+    } else {
+        lwan_writev(request, vec, last);
+    }
 
     lwan_strbuf_reset(request->response.buffer);
     coro_yield(request->conn->coro, CONN_CORO_WANT_WRITE);
@@ -566,6 +724,11 @@ void lwan_response_websocket_write(struct lwan_request *request)
     if (!(request->conn->flags & CONN_IS_WEBSOCKET))
         return;
 
+    if (UNLIKELY(!msg)) {
+        coro_yield(request->conn->coro, CONN_CORO_ABORT);
+        __builtin_unreachable();
+    }
+
     write_websocket_frame(request, header, msg, len);
     lwan_strbuf_reset(request->response.buffer);
 }
@@ -28,6 +28,35 @@
 
 static const unsigned int STATIC = 1 << 0;
 static const unsigned int DYNAMICALLY_ALLOCATED = 1 << 1;
+static const unsigned int SEGMENTABLE = 1 << 2;
+
+/* Segmentable buffers start out contiguous, and are only split once they
+ * either grow past this size or a large enough static reference is appended
+ * to them.  Smaller references are just copied: an iovec entry isn't free
+ * either. */
+#define SEGMENT_THRESHOLD (4 * DEFAULT_BUFFER_SIZE)
+#define SEGMENT_MIN_REFERENCE 256
+#define SEGMENT_MIN_CHUNK DEFAULT_BUFFER_SIZE
+/* Keeps the number of iovecs well below IOV_MAX, so that lwan_response()
+ * can send headers and body with a single writev(). */
+#define SEGMENT_MAX 256
+
+/* This doesn't use lwan_array, as this file is also linked into tools
+ * that don't have coroutines. */
+struct lwan_strbuf_segments {
+    /* What's going to be sent, in order. */
+    struct iovec *segments;
+    size_t n_segments;
+
+    /* Owned allocations; segments might point to these. */
+    char **chunks;
+    size_t n_chunks;
+
+    /* Free space in the last owned chunk. */
+    char *tail;
+    size_t tail_avail;
+    size_t last_chunk_size;
+};
 
 static inline size_t align_size(size_t unaligned_size)
 {
@@ -44,6 +73,227 @@ static ALWAYS_INLINE size_t max(size_t one, size_t another)
     return (one > another) ? one : another;
 }
 
+static void free_segments(struct lwan_strbuf *s)
+{
+    struct lwan_strbuf_segments *segs = s->segments;
+
+    for (size_t i = 0; i < segs->n_chunks; i++)
+        free(segs->chunks[i]);
+
+    free(segs->chunks);
+    free(segs->segments);
+    free(segs);
+
+    s->segments = NULL;
+}
+
+static void reset_segments(struct lwan_strbuf *s)
+{
+    struct lwan_strbuf_segments *segs = s->segments;
+    char *first_chunk = NULL;
+
+    /* Keep the first chunk as the contiguous buffer, so that reusing the
+     * buffer (as is done with the response buffer, once per request)
+     * doesn't have to start allocating from scratch. */
+    if (segs->n_chunks) {
+        first_chunk = segs->chunks[0];
+        segs->chunks[0] = NULL;
+    }
+
+    free_segments(s);
+
+    if (first_chunk) {
+        first_chunk[0] = '\0';
+        s->value.buffer = first_chunk;
+        s->flags &= ~STATIC;
+    } else {
+        s->value.static_buffer = "";
+        s->flags |= STATIC;
+    }
+    s->used = 0;
+}
+
+static bool grow_array(void **array, size_t n_elems, size_t elem_size)
+{
+    /* Grows the array whenever n_elems is a power of 2 (or zero). */
+    if (n_elems & (n_elems - 1))
+        return true;
+
+    void *new_array = reallocarray(*array, n_elems ? n_elems * 2 : 8,
+                                   elem_size);
+    if (UNLIKELY(!new_array))
+        return false;
+
+    *array = new_array;
+    return true;
+}
+
+static bool append_segment(struct lwan_strbuf_segments *segs,
+                           const char *str,
+                           size_t sz)
+{
+    if (UNLIKELY(!grow_array((void **)&segs->segments, segs->n_segments,
+                             sizeof(*segs->segments))))
+        return false;
+
+    segs->segments[segs->n_segments++] =
+        (struct iovec){.iov_base = (void *)str, .iov_len = sz};
+    return true;
+}
+
+static bool append_owned_chunk(struct lwan_strbuf_segments *segs, char *chunk)
+{
+    if (UNLIKELY(!grow_array((void **)&segs->chunks, segs->n_chunks,
+                             sizeof(*segs->chunks))))
+        return false;
+
+    segs->chunks[segs->n_chunks++] = chunk;
+    return true;
+}
+
+static bool append_chunk(struct lwan_strbuf_segments *segs, size_t needed)
+{
+    const size_t size =
+        max(max(segs->last_chunk_size * 2, SEGMENT_MIN_CHUNK), needed);
+    char *buffer = malloc(size);
+
+    if (UNLIKELY(!buffer))
+        return false;
+
+    if (UNLIKELY(!append_owned_chunk(segs, buffer))) {
+        free(buffer);
+        return false;
+    }
+
+    segs->tail = buffer;
+    segs->tail_avail = size;
+    segs->last_chunk_size = size;
+
+    return true;
+}
+
+static bool segments_append_copy(struct lwan_strbuf *s,
+                                 const char *str,
+                                 size_t sz)
+{
+    struct lwan_strbuf_segments *segs = s->segments;
+    struct iovec *last =
+        segs->n_segments ? &segs->segments[segs->n_segments - 1] : NULL;
+
+    while (sz) {
+        if (!segs->tail_avail) {
+            if (UNLIKELY(!append_chunk(segs, sz)))
+                return false;
+            last = NULL;
+        }
+
+        size_t to_copy = sz < segs->tail_avail ? sz : segs->tail_avail;
+
+        if (last && (char *)last->iov_base + last->iov_len == segs->tail) {
+            /* Extend the last segment if it ends where the free space in
+             * the tail chunk begins; this is the common case. */
+            last->iov_len += to_copy;
+        } else {
+            if (UNLIKELY(!append_segment(segs, segs->tail, to_copy)))
+                return false;
+            last = &segs->segments[segs->n_segments - 1];
+        }
+
+        memcpy(segs->tail, str, to_copy);
+        segs->tail += to_copy;
+        segs->tail_avail -= to_copy;
+        s->used += to_copy;
+
+        str += to_copy;
+        sz -= to_copy;
+    }
+
+    return true;
+}
+
+static bool convert_to_segments(struct lwan_strbuf *s)
+{
+    struct lwan_strbuf_segments *segs = calloc(1, sizeof(*segs));
+
+    if (UNLIKELY(!segs))
+        return false;
+
+    if (s->used) {
+        if (UNLIKELY(!append_segment(segs, s->value.static_buffer, s->used)))
+            goto error;
+
+        if (!(s->flags & STATIC)) {
+            /* The contiguous buffer is now the first owned chunk.  Its
+             * remaining capacity isn't known here, so don't use it. */
+            if (UNLIKELY(!append_owned_chunk(segs, s->value.buffer)))
+                goto error;
+
+            segs->last_chunk_size = s->used;
+        }
+    } else if (!(s->flags & STATIC)) {
+        free(s->value.buffer);
+    }
+
+    s->value.static_buffer = "";
+    s->flags |= STATIC;
+    s->segments = segs;
+
+    return true;
+
+error:
+    free(segs->segments);
+    free(segs->chunks);
+    free(segs);
+    return false;
+}
+
+static ALWAYS_INLINE bool should_segment(const struct lwan_strbuf *s,
+                                         size_t size)
+{
+    return (s->flags & SEGMENTABLE) && size > SEGMENT_THRESHOLD;
+}
+
+char *lwan_strbuf_flatten(struct lwan_strbuf *s)
+{
+    const struct iovec *iov;
+    char *buffer, *p;
+    size_t aligned_size;
+
+    if (!s->segments)
+        return s->value.buffer;
+
+    aligned_size = align_size(s->used + 1);
+    if (UNLIKELY(!aligned_size))
+        return NULL;
+
+    buffer = malloc(aligned_size);
+    if (UNLIKELY(!buffer))
+        return NULL;
+
+    p = buffer;
+    for (size_t i = 0; i < s->segments->n_segments; i++) {
+        iov = &s->segments->segments[i];
+        p = mempcpy(p, iov->iov_base, iov->iov_len);
+    }
+    *p = '\0';
+
+    free_segments(s);
+    s->flags &= ~STATIC;
+    s->value.buffer = buffer;
+
+    return buffer;
+}
+
+size_t lwan_strbuf_get_segments(const struct lwan_strbuf *s,
+                                const struct iovec **segments)
+{
+    if (!s->segments)
+        return 0;
+
+    *segments = s->segments->segments;
+    return s->segments->n_segments;
+}
+
 static bool grow_buffer_if_needed(struct lwan_strbuf *s, size_t size)
 {
     if (s->flags & STATIC) {
@@ -106,6 +356,15 @@ ALWAYS_INLINE bool lwan_strbuf_init(struct lwan_strbuf *s)
     return lwan_strbuf_init_with_size(s, 0);
 }
 
+bool lwan_strbuf_init_segmented(struct lwan_strbuf *s)
+{
+    if (UNLIKELY(!lwan_strbuf_init_with_size(s, 0)))
+        return false;
+
+    s->flags |= SEGMENTABLE;
+    return true;
+}
+
 struct lwan_strbuf *lwan_strbuf_new_with_size(size_t size)
 {
     struct lwan_strbuf *s = malloc(sizeof(*s));
@@ -147,6 +406,8 @@ void lwan_strbuf_free(struct lwan_strbuf *s)
 {
     if (UNLIKELY(!s))
         return;
+    if (s->segments)
+        free_segments(s);
     if (!(s->flags & STATIC))
         free(s->value.buffer);
     if (s->flags & DYNAMICALLY_ALLOCATED)
@@ -155,6 +416,9 @@ void lwan_strbuf_free(struct lwan_strbuf *s)
 
 bool lwan_strbuf_append_char(struct lwan_strbuf *s, const char c)
 {
+    if (s->segments)
+        return segments_append_copy(s, &c, 1);
+
     if (UNLIKELY(!grow_buffer_if_needed(s, s->used + 2)))
         return false;
 
@@ -166,6 +430,16 @@ bool lwan_strbuf_append_char(struct lwan_strbuf *s, const char c)
 
 bool lwan_strbuf_append_str(struct lwan_strbuf *s1, const char *s2, size_t sz)
 {
+    if (s1->segments)
+        return segments_append_copy(s1, s2, sz);
+
+    if (UNLIKELY(should_segment(s1, s1->used + sz))) {
+        /* Instead of reallocating and copying what has been appended so
+         * far, start using a list of chunks. */
+        if (LIKELY(convert_to_segments(s1)))
+            return segments_append_copy(s1, s2, sz);
+    }
+
     if (UNLIKELY(!grow_buffer_if_needed(s1, s1->used + sz + 2)))
         return false;
 
@@ -176,8 +450,36 @@ bool lwan_strbuf_append_str(struct lwan_strbuf *s1, const char *s2, size_t sz)
     return true;
 }
 
+bool lwan_strbuf_append_static(struct lwan_strbuf *s1,
+                               const char *s2,
+                               size_t sz)
+{
+    if (!(s1->flags & SEGMENTABLE) || sz < SEGMENT_MIN_REFERENCE)
+        return lwan_strbuf_append_str(s1, s2, sz);
+
+    if (!s1->segments) {
+        if (!s1->used)
+            return lwan_strbuf_set_static(s1, s2, sz);
+
+        if (UNLIKELY(!convert_to_segments(s1)))
+            return lwan_strbuf_append_str(s1, s2, sz);
+    }
+
+    if (s1->segments->n_segments >= SEGMENT_MAX)
+        return segments_append_copy(s1, s2, sz);
+
+    if (UNLIKELY(!append_segment(s1->segments, s2, sz)))
+        return false;
+
+    s1->used += sz;
+    return true;
+}
+
 bool lwan_strbuf_set_static(struct lwan_strbuf *s1, const char *s2, size_t sz)
 {
+    if (s1->segments)
+        reset_segments(s1);
+
     if (!(s1->flags & STATIC))
         free(s1->value.buffer);
 
@@ -190,6 +492,9 @@ bool lwan_strbuf_set_static(struct lwan_strbuf *s1, const char *s2, size_t sz)
 
 bool lwan_strbuf_set(struct lwan_strbuf *s1, const char *s2, size_t sz)
 {
+    if (s1->segments)
+        reset_segments(s1);
+
     if (UNLIKELY(!grow_buffer_if_needed(s1, sz + 1)))
         return false;
 
@@ -244,6 +549,11 @@ bool lwan_strbuf_append_printf(struct lwan_strbuf *s, const char *fmt, ...)
 
 bool lwan_strbuf_grow_to(struct lwan_strbuf *s, size_t new_size)
 {
+    /* Callers of this function will write directly to the buffer, so it
+     * has to be contiguous. */
+    if (UNLIKELY(s->segments && !lwan_strbuf_flatten(s)))
+        return false;
+
     return grow_buffer_if_needed(s, new_size + 1);
 }
 
@@ -259,6 +569,11 @@ bool lwan_strbuf_grow_by(struct lwan_strbuf *s, size_t offset)
 
 void lwan_strbuf_reset(struct lwan_strbuf *s)
 {
+    if (s->segments) {
+        reset_segments(s);
+        return;
+    }
+
     if (s->flags & STATIC) {
         s->value.static_buffer = "";
     } else {
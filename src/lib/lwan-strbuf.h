@@ -23,6 +23,9 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/uio.h>
+
+struct lwan_strbuf_segments;
 
 struct lwan_strbuf {
     union {
@@ -31,10 +34,15 @@ struct lwan_strbuf {
     } value;
     size_t used;
     unsigned int flags;
+
+    /* Only set while the buffer is split in more than one segment; see
+     * lwan_strbuf_init_segmented(). */
+    struct lwan_strbuf_segments *segments;
 };
 
 bool lwan_strbuf_init_with_size(struct lwan_strbuf *buf, size_t size);
 bool lwan_strbuf_init(struct lwan_strbuf *buf);
+bool lwan_strbuf_init_segmented(struct lwan_strbuf *buf);
 struct lwan_strbuf *lwan_strbuf_new_static(const char *str, size_t size);
 struct lwan_strbuf *lwan_strbuf_new_with_size(size_t size);
 struct lwan_strbuf *lwan_strbuf_new(void);
@@ -58,6 +66,13 @@ static inline bool lwan_strbuf_set_staticz(struct lwan_strbuf *s1,
     return lwan_strbuf_set_static(s1, s2, strlen(s2));
 }
 
+/* Appends a reference to memory that must remain valid and unmodified until
+ * the buffer is reset, set, or freed.  Only buffers initialized with
+ * lwan_strbuf_init_segmented() store the reference; others copy it.  */
+bool lwan_strbuf_append_static(struct lwan_strbuf *s1,
+                               const char *s2,
+                               size_t sz);
+
 bool lwan_strbuf_set(struct lwan_strbuf *s1, const char *s2, size_t sz);
 static inline bool lwan_strbuf_setz(struct lwan_strbuf *s1, const char *s2)
 {
@@ -74,5 +89,20 @@ bool lwan_strbuf_printf(struct lwan_strbuf *s1, const char *fmt, ...)
 bool lwan_strbuf_grow_to(struct lwan_strbuf *s, size_t new_size);
 bool lwan_strbuf_grow_by(struct lwan_strbuf *s, size_t offset);
 
+/* Segmented buffers are copied into a contiguous one by
+ * lwan_strbuf_get_buffer(), which returns NULL if that fails; buffers that
+ * weren't initialized with lwan_strbuf_init_segmented() never are. */
+char *lwan_strbuf_flatten(struct lwan_strbuf *s);
+size_t lwan_strbuf_get_segments(const struct lwan_strbuf *s,
+                                const struct iovec **segments);
+
+static inline char *lwan_strbuf_get_buffer_internal(struct lwan_strbuf *s)
+{
+    if (__builtin_expect(!!s->segments, 0))
+        return lwan_strbuf_flatten(s);
+    return s->value.buffer;
+}
+
 #define lwan_strbuf_get_length(s) (((struct lwan_strbuf *)(s))->used)
-#define lwan_strbuf_get_buffer(s) (((struct lwan_strbuf *)(s))->value.buffer)
+#define lwan_strbuf_get_buffer(s)                                              \
+    lwan_strbuf_get_buffer_internal((struct lwan_strbuf *)(s))
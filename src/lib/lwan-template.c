@@ -46,6 +46,7 @@
 #include "list.h"
 #include "ringbuffer.h"
 #include "lwan-array.h"
+#include "lwan-cache.h"
 #include "lwan-strbuf.h"
 #include "lwan-template.h"
 
@@ -66,6 +67,8 @@ enum action {
     ACTION_IF_VARIABLE_NOT_EMPTY,
     ACTION_END_IF_VARIABLE_NOT_EMPTY,
     ACTION_APPLY_TPL,
+    ACTION_START_FRAGMENT,
+    ACTION_END_FRAGMENT,
     ACTION_LAST
 };
 
@@ -79,7 +82,7 @@ enum flags {
 #define FOR_EACH_LEXEME(X)                                                     \
     X(ERROR) X(EOF) X(IDENTIFIER) X(LEFT_META) X(HASH) X(RIGHT_META) X(TEXT)   \
     X(SLASH) X(QUESTION_MARK) X(HAT) X(GREATER_THAN) X(OPEN_CURLY_BRACE)       \
-    X(CLOSE_CURLY_BRACE)
+    X(CLOSE_CURLY_BRACE) X(PERCENT)
 
 #define GENERATE_ENUM(id) LEXEME_##id,
 #define GENERATE_ARRAY_ITEM(id) [LEXEME_##id] = #id,
@@ -107,6 +110,11 @@ DEFINE_ARRAY_TYPE(chunk_array, struct chunk)
 struct lwan_tpl {
     struct chunk_array chunks;
     size_t minimum_size;
+    const struct lwan_tpl_compiled *compiled;
+    /* Only kept for partials, so that compiled code inlining them can be
+     * checked against what was read from disk. */
+    char *source;
+    size_t source_len;
 };
 
 struct symtab {
@@ -140,6 +148,7 @@ struct parser {
     struct list_head stack;
     struct chunk_array chunks;
     enum lwan_tpl_flag template_flags;
+    struct fragment *fragment; /* Being declared */
 };
 
 struct stacked_lexeme {
@@ -152,6 +161,22 @@ struct chunk_descriptor {
     struct lwan_var_descriptor *descriptor;
 };
 
+/* {{%cache ttl [key...]}}...{{/%cache}}: the rendered block is kept in a
+ * cache, keyed by the block id and the values of the key variables; if
+ * none are given, all the variables used in the block are keys. */
+struct fragment {
+    struct fragment_cache *cache;
+    struct lwan_tpl *tpl;
+    const struct chunk *end;
+    time_t time_to_live;
+    unsigned long id;
+    size_t n_keys;
+    struct lwan_var_descriptor *keys[];
+};
+
+static bool fragment_cache_create(struct fragment *fragment);
+static void fragment_free(struct fragment *fragment);
+
 static const char left_meta[] = "{{";
 static const char right_meta[] = "}}";
 static_assert(sizeof(left_meta) == sizeof(right_meta),
@@ -172,6 +197,8 @@ static void *parser_negate(struct parser *parser, struct lexeme *lexeme);
 static void *parser_identifier(struct parser *parser, struct lexeme *lexeme);
 static void *parser_slash(struct parser *parser, struct lexeme *lexeme);
 static void *parser_text(struct parser *parser, struct lexeme *lexeme);
+static void *parser_end_fragment(struct parser *parser,
+                                 struct lexeme *lexeme);
 
 static void error_vlexeme(struct lexeme *lexeme, const char *msg, va_list ap)
     __attribute__((format(printf, 2, 0)));
@@ -436,6 +463,9 @@ static void *lex_inside_action(struct lexer *lexer)
         case '/':
             emit(lexer, LEXEME_SLASH);
             break;
+        case '%':
+            emit(lexer, LEXEME_PERCENT);
+            break;
         default:
             if (isspace(r)) {
                 ignore(lexer);
@@ -657,6 +687,9 @@ static void *parser_end_var_not_empty(struct parser *parser,
 
 static void *parser_slash(struct parser *parser, struct lexeme *lexeme)
 {
+    if (lexeme->type == LEXEME_PERCENT)
+        return parser_end_fragment;
+
     if (lexeme->type == LEXEME_IDENTIFIER) {
         struct lexeme *next = NULL;
 
@@ -686,6 +719,12 @@ static void *parser_iter(struct parser *parser, struct lexeme *lexeme)
                                 (int)lexeme->value.len, lexeme->value.value);
         }
 
+        if (!symbol->generator &&
+            !(symbol->cursor_init && symbol->cursor_next)) {
+            return error_lexeme(lexeme, "Variable `%.*s' can't be iterated",
+                                (int)lexeme->value.len, lexeme->value.value);
+        }
+
         int r = symtab_push(parser, symbol->list_desc);
         if (r < 0) {
             if (r == -ENODEV) {
@@ -775,6 +814,11 @@ static void *parser_identifier(struct parser *parser, struct lexeme *lexeme)
     return unexpected_lexeme_or_lex_error(lexeme, next);
 }
 
+static struct lwan_tpl *
+compile_file(const char *filename,
+             const struct lwan_var_descriptor *descriptor,
+             bool keep_source);
+
 static void *parser_partial(struct parser *parser, struct lexeme *lexeme)
 {
     struct lwan_tpl *tpl;
@@ -783,7 +827,7 @@ static void *parser_partial(struct parser *parser, struct lexeme *lexeme)
     if (lexeme->type != LEXEME_IDENTIFIER)
         return unexpected_lexeme(lexeme);
 
-    tpl = lwan_tpl_compile_file(filename, parser->descriptor);
+    tpl = compile_file(filename, parser->descriptor, true);
     if (tpl) {
         emit_chunk(parser, ACTION_APPLY_TPL, 0, tpl);
         return parser_right_meta;
@@ -792,6 +836,115 @@ static void *parser_partial(struct parser *parser, struct lexeme *lexeme)
     return error_lexeme(lexeme, "Could not compile template ``%s''", filename);
 }
 
+static bool lexeme_is(const struct lexeme *lexeme, const char *str)
+{
+    size_t len = strlen(str);
+
+    return lexeme->type == LEXEME_IDENTIFIER && lexeme->value.len == len &&
+           !memcmp(lexeme->value.value, str, len);
+}
+
+static void *parser_fragment_keys(struct parser *parser, struct lexeme *lexeme)
+{
+    struct fragment *fragment = parser->fragment;
+
+    if (lexeme->type == LEXEME_RIGHT_META) {
+        emit_chunk(parser, ACTION_START_FRAGMENT, 0, fragment);
+        parser->fragment = NULL;
+        return parser_text;
+    }
+
+    if (lexeme->type != LEXEME_IDENTIFIER)
+        return unexpected_lexeme(lexeme);
+
+    struct lwan_var_descriptor *symbol = symtab_lookup_lexeme(parser, lexeme);
+    if (!symbol) {
+        return error_lexeme(lexeme, "Unknown variable: %.*s",
+                            (int)lexeme->value.len, lexeme->value.value);
+    }
+    if (!symbol->append_to_strbuf) {
+        return error_lexeme(lexeme, "Variable `%.*s' can't be a cache key",
+                            (int)lexeme->value.len, lexeme->value.value);
+    }
+
+    fragment = realloc(fragment, sizeof(*fragment) + (fragment->n_keys + 1) *
+                                                         sizeof(symbol));
+    if (!fragment)
+        lwan_status_critical_perror("realloc");
+
+    fragment->keys[fragment->n_keys++] = symbol;
+    parser->fragment = fragment;
+
+    return parser_fragment_keys;
+}
+
+static void *parser_fragment_ttl(struct parser *parser, struct lexeme *lexeme)
+{
+    unsigned int time_to_live;
+
+    if (lexeme->type != LEXEME_IDENTIFIER)
+        return unexpected_lexeme(lexeme);
+
+    time_to_live = parse_time_period(
+        strndupa(lexeme->value.value, lexeme->value.len), 0);
+    if (!time_to_live) {
+        return error_lexeme(lexeme, "Invalid time to live: %.*s",
+                            (int)lexeme->value.len, lexeme->value.value);
+    }
+
+    parser->fragment = calloc(1, sizeof(*parser->fragment));
+    if (!parser->fragment)
+        lwan_status_critical_perror("calloc");
+
+    parser->fragment->tpl = parser->tpl;
+    parser->fragment->time_to_live = (time_t)time_to_live;
+
+    return parser_fragment_keys;
+}
+
+static void *parser_fragment(struct parser *parser, struct lexeme *lexeme)
+{
+    if (!lexeme_is(lexeme, "cache"))
+        return unexpected_lexeme(lexeme);
+
+    if (parser->fragment)
+        return error_lexeme(lexeme, "Unterminated cache declaration");
+
+    /* Distinguish it from sequences when looking for the closing tag. */
+    struct lexeme stacked = *lexeme;
+    stacked.type = LEXEME_PERCENT;
+    parser_push_lexeme(parser, &stacked);
+
+    return parser_fragment_ttl;
+}
+
+static void *parser_end_fragment(struct parser *parser, struct lexeme *lexeme)
+{
+    struct chunk *iter;
+    int depth = 0;
+
+    if (!lexeme_is(lexeme, "cache"))
+        return unexpected_lexeme(lexeme);
+
+    struct lexeme stacked = *lexeme;
+    stacked.type = LEXEME_PERCENT;
+    if (!parser_stack_top_matches(parser, &stacked, LEXEME_PERCENT))
+        return NULL;
+
+    LWAN_ARRAY_FOREACH_REVERSE(&parser->chunks, iter) {
+        if (iter->action == ACTION_END_FRAGMENT) {
+            depth++;
+        } else if (iter->action == ACTION_START_FRAGMENT && !depth--) {
+            size_t index = chunk_array_get_elem_index(&parser->chunks, iter);
+
+            emit_chunk(parser, ACTION_END_FRAGMENT, 0, (void *)index);
+            return parser_right_meta;
+        }
+    }
+
+    return error_lexeme(lexeme, "Could not find {{%%cache}}");
+}
+
 static void *parser_meta(struct parser *parser, struct lexeme *lexeme)
 {
     switch (lexeme->type) {
@@ -819,6 +972,9 @@ static void *parser_meta(struct parser *parser, struct lexeme *lexeme)
 
     case LEXEME_SLASH:
         return parser_slash;
+
+    case LEXEME_PERCENT:
+        return parser_fragment;
     }
 }
 
@@ -951,8 +1107,12 @@ static void free_chunk(struct chunk *chunk)
     case ACTION_VARIABLE_STR_ESCAPE:
     case ACTION_END_IF_VARIABLE_NOT_EMPTY:
     case ACTION_END_ITER:
+    case ACTION_END_FRAGMENT:
         /* do nothing */
         break;
+    case ACTION_START_FRAGMENT:
+        fragment_free(chunk->data);
+        break;
     case ACTION_IF_VARIABLE_NOT_EMPTY:
     case ACTION_START_ITER:
         free(chunk->data);
@@ -980,14 +1140,96 @@ void lwan_tpl_free(struct lwan_tpl *tpl)
         chunk_array_reset(&tpl->chunks);
     }
 
+    free(tpl->source);
     free(tpl);
 }
 
+static bool fragment_add_key(struct fragment **fragment,
+                             struct lwan_var_descriptor *descriptor)
+{
+    struct fragment *f = *fragment;
+
+    for (size_t i = 0; i < f->n_keys; i++) {
+        if (f->keys[i] == descriptor)
+            return true;
+    }
+
+    f = realloc(f, sizeof(*f) + (f->n_keys + 1) * sizeof(descriptor));
+    if (!f)
+        return false;
+
+    f->keys[f->n_keys++] = descriptor;
+    *fragment = f;
+    return true;
+}
+
+static bool fragment_init(struct parser *parser, struct chunk *chunk)
+{
+    struct fragment *fragment = chunk->data;
+    struct chunk *end = chunk;
+    bool implicit_keys = !fragment->n_keys;
+
+    /* Inner chunks haven't been post-processed yet, so variables still
+     * point to their descriptors. */
+    for (int depth = 0;; end++) {
+        switch (end->action) {
+        case ACTION_START_FRAGMENT:
+            depth++;
+            continue;
+        case ACTION_END_FRAGMENT:
+            if (--depth)
+                continue;
+            break;
+        case ACTION_VARIABLE:
+        case ACTION_IF_VARIABLE_NOT_EMPTY:
+            if (implicit_keys && !fragment_add_key(&fragment, end->data))
+                lwan_status_critical_perror("realloc");
+            continue;
+        case ACTION_START_ITER:
+        case ACTION_APPLY_TPL:
+            if (implicit_keys) {
+                lwan_status_error("Cached blocks with sequences or partials "
+                                  "must list their keys");
+                return false;
+            }
+            continue;
+        case ACTION_LAST:
+            lwan_status_error(
+                "Internal error: Could not find the end of cached block");
+            return false;
+        default:
+            continue;
+        }
+        break;
+    }
+
+    chunk->data = fragment;
+    fragment->end = end;
+    if (!fragment_cache_create(fragment)) {
+        lwan_status_error("Could not create cache for block");
+        return false;
+    }
+
+    return true;
+}
+
 static bool post_process_template(struct parser *parser)
 {
     struct chunk *prev_chunk;
     struct chunk *chunk;
 
+    /* Cached blocks are set up in a pass of their own: they need to see
+     * the chunks inside them before those are post-processed, and the
+     * loop below skips the chunk right after a block opener. */
+    LWAN_ARRAY_FOREACH(&parser->chunks, chunk) {
+        if (chunk->action == ACTION_START_FRAGMENT) {
+            if (!fragment_init(parser, chunk))
+                return false;
+        } else if (chunk->action == ACTION_LAST) {
+            break;
+        }
+    }
+
     LWAN_ARRAY_FOREACH(&parser->chunks, chunk) {
         if (chunk->action == ACTION_IF_VARIABLE_NOT_EMPTY) {
             for (prev_chunk = chunk;; chunk++) {
@@ -1136,6 +1378,10 @@ static bool parser_shutdown(struct parser *parser, struct lexeme *lexeme)
         lwan_status_error("Parser error: unmatched quote");
         success = false;
     }
+    if (parser->fragment) {
+        free(parser->fragment);
+        success = false;
+    }
 
     return success && post_process_template(parser);
 }
@@ -1196,6 +1442,7 @@ static void dump_program(const struct lwan_tpl *tpl)
             break;
         case ACTION_END_ITER:
         case ACTION_END_IF_VARIABLE_NOT_EMPTY:
+        case ACTION_END_FRAGMENT:
             break;
         }
 
@@ -1252,6 +1499,18 @@ static void dump_program(const struct lwan_tpl *tpl)
         case ACTION_APPLY_TPL:
             printf("%s", instr("APPLY_TEMPLATE", instr_buf));
             break;
+        case ACTION_START_FRAGMENT: {
+            const struct fragment *fragment = iter->data;
+
+            printf("%s [%zu keys, %llds]", instr("START_FRAGMENT", instr_buf),
+                   fragment->n_keys, (long long)fragment->time_to_live);
+            indent++;
+            break;
+        }
+        case ACTION_END_FRAGMENT:
+            printf("%s", instr("END_FRAGMENT", instr_buf));
+            indent--;
+            break;
         case ACTION_LAST:
             printf("%s", instr("LAST", instr_buf));
         }
@@ -1268,6 +1527,88 @@ static void dump_program(const struct lwan_tpl *tpl)
 }
 #endif
 
+/* Placeholder so that __start_lwan_tpl_compiled and __stop_lwan_tpl_compiled
+ * get defined even if no compiled template is linked in. */
+LWAN_TPL_REGISTER_COMPILED(placeholder, NULL, NULL, 0, 0, NULL, 0, 0, NULL);
+
+static uint64_t template_hash(const char *string, size_t len)
+{
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+/* Partials are read when the template is compiled, so the ones inlined in
+ * the generated code might not be what's on disk anymore.  They're
+ * compared in the order tplgen recorded them: the order they appear in,
+ * with the partials of each partial right after it. */
+static bool partials_match(const struct lwan_tpl *tpl,
+                           const struct lwan_tpl_compiled_partial **partial,
+                           const struct lwan_tpl_compiled_partial *end)
+{
+    const struct chunk *chunk;
+
+    LWAN_ARRAY_FOREACH (&tpl->chunks, chunk) {
+        const struct lwan_tpl *inner = chunk->data;
+
+        if (chunk->action != ACTION_APPLY_TPL)
+            continue;
+
+        if (*partial == end || (*partial)->length != inner->source_len ||
+            (*partial)->hash != template_hash(inner->source, inner->source_len) ||
+            memcmp((*partial)->source, inner->source, inner->source_len))
+            return false;
+
+        (*partial)++;
+        if (!partials_match(inner, partial, end))
+            return false;
+    }
+
+    return true;
+}
+
+__attribute__((no_sanitize_address))
+static const struct lwan_tpl_compiled *
+find_compiled(const struct lwan_tpl *tpl,
+              const char *string,
+              const struct lwan_var_descriptor *descriptor)
+{
+    extern const struct lwan_tpl_compiled SECTION_START(lwan_tpl_compiled);
+    extern const struct lwan_tpl_compiled SECTION_END(lwan_tpl_compiled);
+    const struct lwan_tpl_compiled *compiled;
+    size_t len = 0;
+    uint64_t hash = 0;
+
+    for (compiled = __start_lwan_tpl_compiled;
+         compiled < __stop_lwan_tpl_compiled; compiled++) {
+        if (compiled->descriptor != descriptor)
+            continue;
+
+        if (!len) {
+            len = strlen(string);
+            hash = template_hash(string, len);
+        }
+        if (compiled->length == len && compiled->hash == hash &&
+            !memcmp(compiled->source, string, len)) {
+            const struct lwan_tpl_compiled_partial *partial =
+                compiled->partials;
+            const struct lwan_tpl_compiled_partial *end =
+                partial + compiled->n_partials;
+
+            if (partials_match(tpl, &partial, end) && partial == end)
+                return compiled;
+        }
+    }
+
+    return NULL;
+}
+
 struct lwan_tpl *
 lwan_tpl_compile_string_full(const char *string,
                              const struct lwan_var_descriptor *descriptor,
@@ -1282,6 +1623,12 @@ lwan_tpl_compile_string_full(const char *string,
             dump_program(tpl);
 #endif
 
+            tpl->compiled = find_compiled(tpl, string, descriptor);
+            if (tpl->compiled) {
+                lwan_status_debug("Using compiled version of template");
+                tpl->minimum_size = tpl->compiled->minimum_size;
+            }
+
             return tpl;
         }
     }
@@ -1297,9 +1644,10 @@ lwan_tpl_compile_string(const char *string,
     return lwan_tpl_compile_string_full(string, descriptor, 0);
 }
 
-struct lwan_tpl *
-lwan_tpl_compile_file(const char *filename,
-                      const struct lwan_var_descriptor *descriptor)
+static struct lwan_tpl *
+compile_file(const char *filename,
+             const struct lwan_var_descriptor *descriptor,
+             bool keep_source)
 {
     int fd;
     struct stat st;
@@ -1318,6 +1666,14 @@ lwan_tpl_compile_file(const char *filename,
         goto close_file;
 
     tpl = lwan_tpl_compile_string(mapped, descriptor);
+    if (tpl && keep_source) {
+        tpl->source_len = strnlen(mapped, (size_t)st.st_size);
+        tpl->source = strndup(mapped, tpl->source_len);
+        if (UNLIKELY(!tpl->source)) {
+            lwan_tpl_free(tpl);
+            tpl = NULL;
+        }
+    }
 
     if (munmap(mapped, (size_t)st.st_size) < 0)
         lwan_status_perror("munmap");
@@ -1328,10 +1684,312 @@ end:
     return tpl;
 }
 
+struct lwan_tpl *
+lwan_tpl_compile_file(const char *filename,
+                      const struct lwan_var_descriptor *descriptor)
+{
+    return compile_file(filename, descriptor, false);
+}
+
+struct sequence {
+    const struct lwan_var_descriptor *descriptor;
+    void *variables;
+    struct coro_switcher switcher;
+    struct coro *coro;
+};
+
+static bool sequence_init(struct sequence *seq,
+                          const struct lwan_var_descriptor *descriptor,
+                          void *variables)
+{
+    seq->descriptor = descriptor;
+    seq->variables = variables;
+
+    if (descriptor->cursor_init) {
+        seq->coro = NULL;
+        return descriptor->cursor_init(variables);
+    }
+
+    seq->coro = coro_new(&seq->switcher, descriptor->generator, variables);
+    return seq->coro != NULL;
+}
+
+static inline bool sequence_next(struct sequence *seq)
+{
+    if (seq->coro)
+        return coro_resume_value(seq->coro, 0);
+
+    return seq->descriptor->cursor_next(seq->variables);
+}
+
+static void sequence_fini(struct sequence *seq, bool finished)
+{
+    if (seq->coro) {
+        /* Let the generator know it should stop. */
+        if (!finished)
+            coro_resume_value(seq->coro, 1);
+
+        coro_free(seq->coro);
+    } else if (seq->descriptor->cursor_fini) {
+        seq->descriptor->cursor_fini(seq->variables);
+    }
+}
+
 static const struct chunk *apply(struct lwan_tpl *tpl,
                                  const struct chunk *chunks,
                                  struct lwan_strbuf *buf,
                                  void *variables,
+                                 const struct lwan_tpl_flush *flush,
+                                 struct coro *coro,
+                                 const void *data);
+
+#if !defined(LWAN_TPL_GENERATOR)
+/* Blocks with the same time to live share a cache, no matter the template
+ * they're in: each cache has its own thread-local storage and timer
+ * bookkeeping, which would otherwise be multiplied by every block. */
+struct fragment_cache {
+    struct list_node node;
+    struct cache *cache;
+    time_t time_to_live;
+    int refs;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct list_head list;
+    unsigned long last_id;
+} fragment_caches = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+struct fragment_entry {
+    struct cache_entry base;
+    struct lwan_strbuf rendered;
+};
+
+/* Passed as the creation context of each lookup, so that a missing entry
+ * can be rendered by whoever looks it up.  (Fragment caches never refresh
+ * their entries, so this is all create_entry gets.) */
+struct fragment_render {
+    const struct chunk *chunk;
+    void *variables;
+    struct coro *coro;
+};
+
+static struct cache_entry *fragment_create(const char *key
+                                           __attribute__((unused)),
+                                           void *context)
+{
+    const struct fragment_render *render = context;
+    const struct fragment *fragment = render->chunk->data;
+    struct fragment_entry *entry = malloc(sizeof(*entry));
+
+    if (UNLIKELY(!entry))
+        return NULL;
+
+    if (UNLIKELY(!lwan_strbuf_init(&entry->rendered)))
+        goto error;
+
+    /* Nested blocks are looked up with the same coroutine; the output
+     * can't be flushed, as it's going into the cache. */
+    if (UNLIKELY(!apply(fragment->tpl, render->chunk + 1, &entry->rendered,
+                        render->variables, NULL, render->coro,
+                        fragment->end))) {
+        lwan_strbuf_free(&entry->rendered);
+        goto error;
+    }
+
+    return (struct cache_entry *)entry;
+
+error:
+    free(entry);
+    return NULL;
+}
+
+static void fragment_destroy(struct cache_entry *entry,
+                             void *context __attribute__((unused)))
+{
+    struct fragment_entry *fe = (struct fragment_entry *)entry;
+
+    lwan_strbuf_free(&fe->rendered);
+    free(fe);
+}
+
+static size_t fragment_cost(struct cache_entry *entry,
+                            void *context __attribute__((unused)))
+{
+    struct fragment_entry *fe = (struct fragment_entry *)entry;
+
+    return sizeof(*fe) + lwan_strbuf_get_length(&fe->rendered);
+}
+
+static bool fragment_cache_create(struct fragment *fragment)
+{
+    struct fragment_cache *fc;
+
+    pthread_mutex_lock(&fragment_caches.lock);
+
+    if (!fragment_caches.list.n.next)
+        list_head_init(&fragment_caches.list);
+
+    /* Ids are never reused, so entries left behind by a block that has
+     * been freed can't be mistaken for another block's. */
+    fragment->id = ++fragment_caches.last_id;
+
+    list_for_each (&fragment_caches.list, fc, node) {
+        if (fc->time_to_live == fragment->time_to_live) {
+            fc->refs++;
+            goto out;
+        }
+    }
+
+    fc = malloc(sizeof(*fc));
+    if (!fc)
+        goto out;
+
+    fc->cache = cache_create(fragment_create, fragment_destroy, NULL,
+                             fragment->time_to_live);
+    if (!fc->cache) {
+        free(fc);
+        fc = NULL;
+        goto out;
+    }
+    cache_set_entry_cost_cb(fc->cache, fragment_cost);
+    if (!cache_set_thread_cache(fc->cache, true))
+        lwan_status_warning("Could not enable thread cache for cached blocks");
+
+    fc->time_to_live = fragment->time_to_live;
+    fc->refs = 1;
+    list_add_tail(&fragment_caches.list, &fc->node);
+
+out:
+    pthread_mutex_unlock(&fragment_caches.lock);
+
+    fragment->cache = fc;
+    return fc != NULL;
+}
+
+static void fragment_free(struct fragment *fragment)
+{
+    struct fragment_cache *fc = fragment->cache;
+
+    if (fc) {
+        char prefix[3 * sizeof(fragment->id) + 2];
+
+        pthread_mutex_lock(&fragment_caches.lock);
+        if (--fc->refs) {
+            /* Other blocks still use the cache; drop only what this one
+             * rendered. */
+            snprintf(prefix, sizeof(prefix), "%lu\x1d", fragment->id);
+            cache_invalidate_prefix(fc->cache, prefix);
+        } else {
+            list_del(&fc->node);
+            cache_destroy(fc->cache);
+            free(fc);
+        }
+        pthread_mutex_unlock(&fragment_caches.lock);
+    }
+
+    free(fragment);
+}
+
+static bool fragment_key(const struct fragment *fragment,
+                         struct lwan_strbuf *key,
+                         void *variables)
+{
+    if (UNLIKELY(!lwan_strbuf_printf(key, "%lu\x1d", fragment->id)))
+        return false;
+
+    for (size_t i = 0; i < fragment->n_keys; i++) {
+        const struct lwan_var_descriptor *descriptor = fragment->keys[i];
+        size_t len = lwan_strbuf_get_length(key);
+
+        descriptor->append_to_strbuf(key, (char *)variables +
+                                              descriptor->offset);
+
+        /* Values can have any character but NUL, so each one is followed
+         * by its length to keep keys unambiguous. */
+        if (UNLIKELY(!lwan_strbuf_append_printf(
+                key, "\x1f%zu\x1e", lwan_strbuf_get_length(key) - len)))
+            return false;
+    }
+
+    return true;
+}
+
+static bool fragment_append(const struct chunk *chunk,
+                            struct lwan_strbuf *buf,
+                            void *variables,
+                            struct coro *coro)
+{
+    const struct fragment *fragment = chunk->data;
+    struct fragment_render render = {chunk, variables, coro};
+    struct cache_entry *entry;
+    struct lwan_strbuf key;
+    bool ret = false;
+    int error;
+
+    if (UNLIKELY(!lwan_strbuf_init(&key)))
+        return false;
+    if (UNLIKELY(!fragment_key(fragment, &key, variables)))
+        goto out;
+
+    /* From a request handler, a miss that's already being rendered by
+     * another request parks the coroutine until it's done; outside of
+     * one, there's nothing to yield to, and the thread waits. */
+    if (coro) {
+        entry = cache_coro_get_and_ref_entry_with_ctx(
+            fragment->cache->cache, coro, lwan_strbuf_get_buffer(&key), &render);
+    } else {
+        entry = cache_get_and_ref_entry_with_ctx(
+            fragment->cache->cache, lwan_strbuf_get_buffer(&key), &error, &render);
+    }
+
+    if (LIKELY(entry)) {
+        struct fragment_entry *fe = (struct fragment_entry *)entry;
+
+        ret = lwan_strbuf_append_str(buf, lwan_strbuf_get_buffer(&fe->rendered),
+                                     lwan_strbuf_get_length(&fe->rendered));
+        /* Entries obtained with a coroutine are released with it. */
+        if (!coro)
+            cache_entry_unref(fragment->cache->cache, entry);
+    } else {
+        /* The lookup fails with EDEADLK if the block is being rendered by
+         * a coroutine parked on this thread, which can't finish while this
+         * one waits for it; render it without the cache instead.  (If
+         * rendering itself failed, it'll fail again here.) */
+        ret = apply(fragment->tpl, chunk + 1, buf, variables, NULL, coro,
+                    fragment->end) != NULL;
+    }
+
+out:
+    lwan_strbuf_free(&key);
+    return ret;
+}
+#else
+/* tplgen doesn't link with the cache, and refuses to generate code for
+ * cached blocks anyway. */
+static bool fragment_cache_create(struct fragment *fragment
+                                  __attribute__((unused)))
+{
+    return true;
+}
+
+static void fragment_free(struct fragment *fragment) { free(fragment); }
+
+static bool fragment_append(const struct chunk *chunk __attribute__((unused)),
+                            struct lwan_strbuf *buf __attribute__((unused)),
+                            void *variables __attribute__((unused)),
+                            struct coro *coro __attribute__((unused)))
+{
+    return false;
+}
+#endif
+
+static const struct chunk *apply(struct lwan_tpl *tpl,
+                                 const struct chunk *chunks,
+                                 struct lwan_strbuf *buf,
+                                 void *variables,
+                                 const struct lwan_tpl_flush *flush,
+                                 struct coro *coro,
                                  const void *data)
 {
     static const void *const dispatch_table[] = {
@@ -1345,10 +2003,10 @@ static const struct chunk *apply(struct lwan_tpl *tpl,
         [ACTION_APPLY_TPL] = &&action_apply_tpl,
         [ACTION_START_ITER] = &&action_start_iter,
         [ACTION_END_ITER] = &&action_end_iter,
+        [ACTION_START_FRAGMENT] = &&action_start_fragment,
+        [ACTION_END_FRAGMENT] = &&action_end_fragment,
         [ACTION_LAST] = &&finalize,
     };
-    struct coro_switcher switcher;
-    struct coro *coro = NULL;
     const struct chunk *chunk = chunks;
 
     if (UNLIKELY(!chunk))
@@ -1384,8 +2042,10 @@ static const struct chunk *apply(struct lwan_tpl *tpl,
     DISPATCH_ACTION_FAST();
 
 action_append:
-    lwan_strbuf_append_str(buf, lwan_strbuf_get_buffer(chunk->data),
-                           lwan_strbuf_get_length(chunk->data));
+    /* Template text outlives any response rendered from it, so segmented
+     * buffers can just reference it. */
+    lwan_strbuf_append_static(buf, lwan_strbuf_get_buffer(chunk->data),
+                              lwan_strbuf_get_length(chunk->data));
     DISPATCH_NEXT_ACTION_FAST();
 
 action_append_small: {
@@ -1422,7 +2082,7 @@ action_if_variable_not_empty: {
             chunk = cd->chunk;
             DISPATCH_NEXT_ACTION_FAST();
         } else {
-            chunk = apply(tpl, chunk + 1, buf, variables, cd->chunk);
+            chunk = apply(tpl, chunk + 1, buf, variables, flush, coro, cd->chunk);
             DISPATCH_NEXT_ACTION_CHECK();
         }
     }
@@ -1436,7 +2096,8 @@ action_apply_tpl: {
         struct lwan_tpl *inner_tpl = chunk->data;
 
         if (LIKELY(lwan_strbuf_grow_by(buf, inner_tpl->minimum_size))) {
-            if (!apply(inner_tpl, inner_tpl->chunks.base.base, buf, variables, NULL)) {
+            if (!apply(inner_tpl, inner_tpl->chunks.base.base, buf, variables,
+                       flush, coro, NULL)) {
                 lwan_status_warning("Could not apply subtemplate");
                 return NULL;
             }
@@ -1449,58 +2110,68 @@ action_apply_tpl: {
         DISPATCH_NEXT_ACTION_FAST();
     }
 
-action_start_iter:
-    if (UNLIKELY(coro != NULL)) {
-        lwan_status_warning("Coroutine is not NULL when starting iteration");
-        return NULL;
-    }
+action_start_iter: {
+        struct chunk_descriptor *cd = chunk->data;
+        struct sequence seq;
+        bool has_item;
 
-    struct chunk_descriptor *cd = chunk->data;
-    coro = coro_new(&switcher, cd->descriptor->generator, variables);
+        if (UNLIKELY(!sequence_init(&seq, cd->descriptor, variables))) {
+            lwan_status_warning("Could not start iteration");
+            return NULL;
+        }
 
-    bool resumed = coro_resume_value(coro, 0);
-    bool negate = (chunk->flags & FLAGS_NEGATE) == FLAGS_NEGATE;
-    if (negate)
-        resumed = !resumed;
-    if (!resumed) {
-        chunk = cd->chunk;
+        has_item = sequence_next(&seq);
+        if (chunk->flags & FLAGS_NEGATE) {
+            sequence_fini(&seq, !has_item);
 
-        if (negate)
-            coro_resume_value(coro, 1);
+            if (!has_item &&
+                !apply(tpl, chunk + 1, buf, variables, flush, coro, chunk))
+                return NULL;
+        } else {
+            while (has_item) {
+                if (UNLIKELY(!apply(tpl, chunk + 1, buf, variables, flush,
+                                    coro, chunk))) {
+                    sequence_fini(&seq, false);
+                    return NULL;
+                }
+                if (UNLIKELY(!lwan_tpl_maybe_flush(buf, flush))) {
+                    sequence_fini(&seq, false);
+                    return NULL;
+                }
 
-        coro_free(coro);
-        coro = NULL;
+                has_item = sequence_next(&seq);
+            }
 
-        if (negate)
-            DISPATCH_ACTION_FAST();
+            sequence_fini(&seq, true);
+        }
 
-        DISPATCH_NEXT_ACTION_FAST();
+        chunk = cd->chunk;
+        DISPATCH_ACTION_FAST();
     }
 
-    chunk = apply(tpl, chunk + 1, buf, variables, chunk);
-    DISPATCH_ACTION_CHECK();
-
 action_end_iter:
-    if (data == chunk->data)
+    if (LIKELY(data == chunk->data))
         goto finalize;
 
-    if (UNLIKELY(!coro)) {
-        if (!chunk->flags) {
-            lwan_status_warning("Coroutine is NULL when finishing iteration");
+    lwan_status_warning("Unexpected end of iteration");
+    return NULL;
+
+action_start_fragment: {
+        const struct fragment *fragment = chunk->data;
+
+        if (UNLIKELY(!fragment_append(chunk, buf, variables, coro))) {
+            lwan_status_warning("Could not render cached block");
             return NULL;
         }
-        DISPATCH_NEXT_ACTION_FAST();
-    }
 
-    if (!coro_resume_value(coro, 0)) {
-        coro_free(coro);
-        coro = NULL;
+        chunk = fragment->end;
         DISPATCH_NEXT_ACTION_FAST();
     }
 
-    chunk = apply(tpl, ((struct chunk *)chunk->data) + 1, buf, variables,
-                  chunk->data);
-    DISPATCH_ACTION_CHECK();
+action_end_fragment:
+    if (LIKELY(data == chunk))
+        goto finalize;
+    DISPATCH_NEXT_ACTION_FAST();
 
 finalize:
     return chunk;
@@ -1513,21 +2184,41 @@ finalize:
 #undef RETURN_IF_NO_CHUNK
 }
 
-bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
-                                struct lwan_strbuf *buf,
-                                void *variables)
+bool lwan_tpl_apply_with_flush(struct lwan_tpl *tpl,
+                               struct lwan_strbuf *buf,
+                               void *variables,
+                               const struct lwan_tpl_flush *flush,
+                               struct coro *coro)
 {
     lwan_strbuf_reset(buf);
 
     if (UNLIKELY(!lwan_strbuf_grow_to(buf, tpl->minimum_size)))
         return false;
 
-    if (!apply(tpl, tpl->chunks.base.base, buf, variables, NULL))
+    if (tpl->compiled)
+        return tpl->compiled->render(buf, variables, flush);
+
+    if (!apply(tpl, tpl->chunks.base.base, buf, variables, flush, coro, NULL))
         return false;
 
     return true;
 }
 
+bool lwan_tpl_apply_with_coro(struct lwan_tpl *tpl,
+                              struct lwan_strbuf *buf,
+                              void *variables,
+                              struct coro *coro)
+{
+    return lwan_tpl_apply_with_flush(tpl, buf, variables, NULL, coro);
+}
+
+bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
+                                struct lwan_strbuf *buf,
+                                void *variables)
+{
+    return lwan_tpl_apply_with_flush(tpl, buf, variables, NULL, NULL);
+}
+
 struct lwan_strbuf *lwan_tpl_apply(struct lwan_tpl *tpl, void *variables)
 {
     struct lwan_strbuf *buf = lwan_strbuf_new_with_size(tpl->minimum_size);
@@ -1542,6 +2233,408 @@ struct lwan_strbuf *lwan_tpl_apply(struct lwan_tpl *tpl, void *variables)
     return NULL;
 }
 
+#if defined(LWAN_TPL_GENERATOR)
+
+#include <inttypes.h>
+
+struct c_emitter {
+    FILE *out;
+    FILE *partials;
+    size_t n_partials;
+    const struct lwan_tpl_c_names *names;
+    struct lwan_strbuf literal;
+    size_t minimum_size;
+    int depth;
+    int iter_depth;
+    const struct lwan_tpl_c_names *iters[16];
+    bool uses_vars;
+    bool uses_variables;
+    bool uses_flush;
+};
+
+static void c_indent(struct c_emitter *e)
+{
+    for (int i = 0; i <= e->depth; i++)
+        fputs("    ", e->out);
+}
+
+static void c_line(struct c_emitter *e, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void c_line(struct c_emitter *e, const char *fmt, ...)
+{
+    va_list ap;
+
+    c_indent(e);
+
+    va_start(ap, fmt);
+    vfprintf(e->out, fmt, ap);
+    va_end(ap);
+
+    fputc('\n', e->out);
+}
+
+static void c_string(FILE *out, const char *str, size_t len, int depth)
+{
+    fputc('"', out);
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+
+        switch (c) {
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '\t':
+            fputs("\\t", out);
+            break;
+        case '\r':
+            fputs("\\r", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            if (i + 1 < len) {
+                fputs("\"\n", out);
+                for (int j = 0; j <= depth; j++)
+                    fputs("    ", out);
+                fputc('"', out);
+            }
+            break;
+        default:
+            if (c < 0x20 || c >= 0x7f)
+                fprintf(out, "\\%03o", c);
+            else
+                fputc(c, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+/* Adjacent literals, even across partials and variables that turned out
+ * to be constant, are appended with a single call. */
+static void c_flush_literal(struct c_emitter *e)
+{
+    size_t len = lwan_strbuf_get_length(&e->literal);
+
+    if (!len)
+        return;
+
+    c_line(e, "%s(buf,", len <= sizeof(void *) ? "lwan_strbuf_append_str"
+                                                : "lwan_strbuf_append_static");
+    e->depth++;
+    c_indent(e);
+    c_string(e->out, lwan_strbuf_get_buffer(&e->literal), len, e->depth);
+    fprintf(e->out, ",\n");
+    c_line(e, "%zu);", len);
+    e->depth--;
+
+    lwan_strbuf_reset(&e->literal);
+}
+
+/* Ends the sequences being iterated, from the innermost one at level, so
+ * that the generated function can bail out. */
+static void c_emit_iter_cleanup(struct c_emitter *e, int level)
+{
+    for (int i = level; i >= 0; i--) {
+        const struct lwan_tpl_c_names *names = e->iters[i];
+
+        if (!names->cursor_init) {
+            c_line(e, "coro_resume_value(coro%d, 1);", i);
+            c_line(e, "coro_free(coro%d);", i);
+        } else if (names->cursor_fini) {
+            c_line(e, "%s(variables);", names->cursor_fini);
+        }
+    }
+}
+
+/* Partials are inlined, so their text is recorded for partials_match() to
+ * compare against what's read at runtime. */
+static void c_record_partial(struct c_emitter *e, const struct lwan_tpl *inner)
+{
+    fputs("    {\n        .source = ", e->partials);
+    c_string(e->partials, inner->source, inner->source_len, 2);
+    fprintf(e->partials,
+            ",\n"
+            "        .hash = 0x%016" PRIx64 "ull,\n"
+            "        .length = %zu,\n"
+            "    },\n",
+            template_hash(inner->source, inner->source_len), inner->source_len);
+    e->n_partials++;
+}
+
+static void c_emit_variable(struct c_emitter *e, const char *func, size_t index)
+{
+    c_flush_literal(e);
+    c_line(e, "%s(buf, &vars->%s);", func, e->names[index].field);
+    e->uses_vars = true;
+}
+
+static bool c_emit_chunks(struct c_emitter *e,
+                          const struct chunk *chunk,
+                          const struct chunk *end)
+{
+    for (; chunk != end; chunk++) {
+        switch (chunk->action) {
+        case ACTION_LAST:
+            return true;
+
+        case ACTION_APPEND:
+            lwan_strbuf_append_str(&e->literal,
+                                   lwan_strbuf_get_buffer(chunk->data),
+                                   lwan_strbuf_get_length(chunk->data));
+            break;
+
+        case ACTION_APPEND_SMALL: {
+            uintptr_t val = (uintptr_t)chunk->data;
+
+            lwan_strbuf_append_str(&e->literal, (char *)&val,
+                                   strnlen((char *)&val, sizeof(val)));
+            break;
+        }
+
+        case ACTION_VARIABLE: {
+            const struct lwan_var_descriptor *descriptor = chunk->data;
+            size_t index = (size_t)descriptor->offset;
+
+            c_emit_variable(e, e->names[index].append_to_strbuf, index);
+            break;
+        }
+
+        case ACTION_VARIABLE_STR:
+            c_emit_variable(e, "lwan_append_str_to_strbuf",
+                            (uintptr_t)chunk->data);
+            break;
+
+        case ACTION_VARIABLE_STR_ESCAPE:
+            c_emit_variable(e, "lwan_append_str_escaped_to_strbuf",
+                            (uintptr_t)chunk->data);
+            break;
+
+        case ACTION_IF_VARIABLE_NOT_EMPTY: {
+            const struct chunk_descriptor *cd = chunk->data;
+            const struct lwan_tpl_c_names *names =
+                &e->names[cd->descriptor->offset];
+
+            c_flush_literal(e);
+            c_line(e, "if (%s%s(&vars->%s)) {",
+                   (chunk->flags & FLAGS_NEGATE) ? "" : "!",
+                   names->get_is_empty, names->field);
+            e->uses_vars = true;
+
+            e->depth++;
+            if (!c_emit_chunks(e, chunk + 1, cd->chunk))
+                return false;
+            c_flush_literal(e);
+            e->depth--;
+
+            c_line(e, "}");
+
+            chunk = cd->chunk;
+            break;
+        }
+
+        case ACTION_START_ITER: {
+            const struct chunk_descriptor *cd = chunk->data;
+            const struct lwan_tpl_c_names *names =
+                &e->names[cd->descriptor->offset];
+            bool negate = chunk->flags & FLAGS_NEGATE;
+            int level = e->iter_depth;
+
+            if (level == (int)N_ELEMENTS(e->iters)) {
+                lwan_status_error("Sequences nested too deeply");
+                return false;
+            }
+            e->iters[e->iter_depth++] = names;
+
+            c_flush_literal(e);
+            c_line(e, "{");
+            e->depth++;
+            if (names->cursor_init) {
+                c_line(e, "if (UNLIKELY(!%s(variables))) {", names->cursor_init);
+            } else {
+                c_line(e, "struct coro_switcher switcher%d;", level);
+                c_line(e,
+                       "struct coro *coro%d = coro_new(&switcher%d, %s, "
+                       "variables);",
+                       level, level, names->generator);
+                fputc('\n', e->out);
+                c_line(e, "if (UNLIKELY(!coro%d)) {", level);
+            }
+            e->depth++;
+            c_emit_iter_cleanup(e, level - 1);
+            c_line(e, "return false;");
+            e->depth--;
+            c_line(e, "}");
+            fputc('\n', e->out);
+
+            if (names->cursor_init) {
+                c_line(e, negate ? "if (!%s(variables)) {"
+                                 : "while (%s(variables)) {",
+                       names->cursor_next);
+            } else {
+                c_line(e, negate ? "if (!coro_resume_value(coro%d, 0)) {"
+                                 : "while (coro_resume_value(coro%d, 0)) {",
+                       level);
+            }
+            e->uses_variables = true;
+
+            /* cd->chunk points right after the END_ITER chunk. */
+            e->depth++;
+            if (!c_emit_chunks(e, chunk + 1, cd->chunk - 1))
+                return false;
+            c_flush_literal(e);
+            if (!negate) {
+                fputc('\n', e->out);
+                c_line(e, "if (UNLIKELY(!lwan_tpl_maybe_flush(buf, flush))) {");
+                e->depth++;
+                c_emit_iter_cleanup(e, level);
+                c_line(e, "return false;");
+                e->depth--;
+                c_line(e, "}");
+                e->uses_flush = true;
+            }
+            e->depth--;
+
+            if (negate && !names->cursor_init) {
+                c_line(e, "} else {");
+                c_line(e, "    coro_resume_value(coro%d, 1);", level);
+            }
+            c_line(e, "}");
+            if (names->cursor_init) {
+                if (names->cursor_fini)
+                    c_line(e, "%s(variables);", names->cursor_fini);
+            } else {
+                c_line(e, "coro_free(coro%d);", level);
+            }
+            e->depth--;
+            c_line(e, "}");
+
+            e->iter_depth--;
+            chunk = cd->chunk - 1;
+            break;
+        }
+
+        case ACTION_APPLY_TPL: {
+            const struct lwan_tpl *inner = chunk->data;
+
+            c_record_partial(e, inner);
+            e->minimum_size += inner->minimum_size;
+            if (!c_emit_chunks(e, inner->chunks.base.base, NULL))
+                return false;
+            break;
+        }
+
+        case ACTION_START_FRAGMENT:
+            lwan_status_error("Cached blocks can't be compiled to C");
+            return false;
+
+        case ACTION_END_ITER:
+        case ACTION_END_IF_VARIABLE_NOT_EMPTY:
+        case ACTION_END_FRAGMENT:
+            lwan_status_error("Unexpected end of block while generating code");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool lwan_tpl_generate_c(FILE *out,
+                         const char *string,
+                         const struct lwan_var_descriptor *descriptor,
+                         const struct lwan_tpl_c_options *options)
+{
+    struct lwan_tpl *tpl;
+    struct c_emitter e = {.names = options->names};
+    char *body = NULL, *partials = NULL;
+    size_t body_len, partials_len;
+    bool ret = false;
+
+    tpl = lwan_tpl_compile_string(string, descriptor);
+    if (!tpl)
+        return false;
+
+    if (!lwan_strbuf_init(&e.literal))
+        goto out_free_tpl;
+
+    e.out = open_memstream(&body, &body_len);
+    if (!e.out)
+        goto out_free_literal;
+    e.partials = open_memstream(&partials, &partials_len);
+    if (!e.partials) {
+        fclose(e.out);
+        goto out_free_body;
+    }
+
+    e.minimum_size = tpl->minimum_size;
+    ret = c_emit_chunks(&e, tpl->chunks.base.base, NULL);
+    if (ret)
+        c_flush_literal(&e);
+
+    fclose(e.out);
+    fclose(e.partials);
+    if (!ret)
+        goto out_free_body;
+
+    fprintf(out, "/* Generated by tplgen from %s; do not edit. */\n\n",
+            options->template_name);
+
+    fprintf(out, "static const char %s_source[] =\n", options->prefix);
+    fputs("    ", out);
+    c_string(out, string, strlen(string), 0);
+    fputs(";\n\n", out);
+
+    fprintf(out, "static bool %s_render(struct lwan_strbuf *buf,\n", options->prefix);
+    fprintf(out, "    void *variables%s,\n",
+            (e.uses_vars || e.uses_variables) ? "" : " __attribute__((unused))");
+    fprintf(out, "    const struct lwan_tpl_flush *flush%s)\n{\n",
+            e.uses_flush ? "" : " __attribute__((unused))");
+    if (e.uses_vars)
+        fputs("    TPL_STRUCT *vars = variables;\n\n", out);
+    fwrite(body, 1, body_len, out);
+    fputs("\n    return true;\n}\n\n", out);
+
+    if (e.n_partials) {
+        fprintf(out,
+                "static const struct lwan_tpl_compiled_partial "
+                "%s_partials[] = {\n",
+                options->prefix);
+        fwrite(partials, 1, partials_len, out);
+        fputs("};\n\n", out);
+    }
+
+    fprintf(out,
+            "LWAN_TPL_REGISTER_COMPILED(%s, %s, %s_source,\n"
+            "                           0x%016" PRIx64 "ull, %zu,\n",
+            options->prefix, options->descriptor_name, options->prefix,
+            template_hash(string, strlen(string)), strlen(string));
+    if (e.n_partials) {
+        fprintf(out, "                           %s_partials, %zu,\n",
+                options->prefix, e.n_partials);
+    } else {
+        fputs("                           NULL, 0,\n", out);
+    }
+    fprintf(out, "                           %zu, %s_render);\n",
+            e.minimum_size, options->prefix);
+
+    ret = !ferror(out);
+
+out_free_body:
+    free(partials);
+    free(body);
+out_free_literal:
+    lwan_strbuf_free(&e.literal);
+out_free_tpl:
+    lwan_tpl_free(tpl);
+    return ret;
+}
+
+#endif /* LWAN_TPL_GENERATOR */
+
 #ifdef TEMPLATE_TEST
 
 struct test_struct {
@@ -22,6 +22,7 @@
 #include "lwan-coro.h"
 #include "lwan-strbuf.h"
 #include <stddef.h>
+#include <stdint.h>
 
 enum lwan_tpl_flag { LWAN_TPL_FLAG_CONST_TEMPLATE = 1 << 0 };
 
@@ -34,6 +35,14 @@ struct lwan_var_descriptor {
 
     coro_function_t generator;
     const struct lwan_var_descriptor *list_desc;
+
+    /* Alternative to a generator: init() prepares the iteration, returning
+     * false on failure; next() fills in the fields of the following item,
+     * returning false past the last one; fini(), if set, is called when
+     * the iteration ends (even if early) and init() had succeeded. */
+    bool (*cursor_init)(void *variables);
+    bool (*cursor_next)(void *variables);
+    void (*cursor_fini)(void *variables);
 };
 
 #define TPL_VAR_SIMPLE(var_, append_to_lwan_strbuf_, get_is_empty_)            \
@@ -49,6 +58,15 @@ struct lwan_var_descriptor {
         .generator = generator_, .list_desc = seqitem_desc_                    \
     }
 
+/* Like TPL_VAR_SEQUENCE, but iterated without a coroutine; any state the
+ * cursor needs can live in the variables struct, next to the item. */
+#define TPL_VAR_SEQUENCE_CURSOR(var_, init_, next_, fini_, seqitem_desc_)     \
+    {                                                                          \
+        .name = #var_, .offset = offsetof(TPL_STRUCT, var_),                   \
+        .list_desc = seqitem_desc_, .cursor_init = init_,                      \
+        .cursor_next = next_, .cursor_fini = fini_                             \
+    }
+
 #define TPL_VAR_INT(var_)                                                      \
     TPL_VAR_SIMPLE(var_, lwan_append_int_to_strbuf, lwan_tpl_int_is_empty)
 
@@ -64,9 +82,76 @@ struct lwan_var_descriptor {
 
 #define TPL_VAR_SENTINEL                                                       \
     {                                                                          \
-        NULL, 0, NULL, NULL, NULL, NULL                                        \
+        NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL                      \
     }
 
+/*
+ * Templates compiled to C by tplgen register themselves with this.  When a
+ * template with the same descriptor and text is compiled at runtime,
+ * lwan_tpl_apply_with_buffer() calls the generated function instead of
+ * interpreting the template.  The hash only narrows down the candidates;
+ * the text itself is compared before one is used.  Partials are inlined in
+ * the generated code, so the text of each one, in the order they appear,
+ * must match as well.  (Entries are explicitly aligned so that the
+ * compiler won't pad them, as they're iterated as an array.)
+ */
+struct lwan_tpl_flush;
+
+struct lwan_tpl_compiled_partial {
+    const char *source;
+    uint64_t hash;
+    size_t length;
+};
+
+struct lwan_tpl_compiled {
+    const struct lwan_var_descriptor *descriptor;
+    const char *source;
+    uint64_t hash;
+    size_t length;
+    const struct lwan_tpl_compiled_partial *partials;
+    size_t n_partials;
+    size_t minimum_size;
+    bool (*render)(struct lwan_strbuf *buf,
+                   void *variables,
+                   const struct lwan_tpl_flush *flush);
+};
+
+#define LWAN_TPL_REGISTER_COMPILED(name_, descriptor_, source_, hash_,         \
+                                   length_, partials_, n_partials_,            \
+                                   minimum_size_, render_)                     \
+    static const struct lwan_tpl_compiled                                      \
+        __attribute__((used, section(LWAN_SECTION_NAME(lwan_tpl_compiled)),    \
+                       aligned(__alignof__(struct lwan_tpl_compiled))))        \
+            lwan_tpl_compiled_##name_ = {.descriptor = descriptor_,            \
+                                         .source = source_,                    \
+                                         .hash = hash_,                        \
+                                         .length = length_,                    \
+                                         .partials = partials_,                \
+                                         .n_partials = n_partials_,            \
+                                         .minimum_size = minimum_size_,        \
+                                         .render = render_}
+
+/*
+ * Lets output be consumed while a template is still being rendered: after
+ * each item of a sequence, if the buffer holds at least threshold bytes,
+ * callback() is called to take them, and should leave the buffer empty.
+ * Returning false from it stops rendering.
+ */
+struct lwan_tpl_flush {
+    size_t threshold;
+    bool (*callback)(struct lwan_strbuf *buf, void *data);
+    void *data;
+};
+
+static inline bool lwan_tpl_maybe_flush(struct lwan_strbuf *buf,
+                                        const struct lwan_tpl_flush *flush)
+{
+    if (!flush || lwan_strbuf_get_length(buf) < flush->threshold)
+        return true;
+
+    return flush->callback(buf, flush->data);
+}
+
 /*
  * These functions are not meant to be used directly. We do need a pointer to
  * them, though, that's why they're exported. Eventually this will move to
@@ -94,4 +179,56 @@ struct lwan_strbuf *lwan_tpl_apply(struct lwan_tpl *tpl, void *variables);
 bool lwan_tpl_apply_with_buffer(struct lwan_tpl *tpl,
                                 struct lwan_strbuf *buf,
                                 void *variables);
+/* From request handlers, pass the request coroutine (request->conn->coro):
+ * cached blocks ({{%cache}}) that are being rendered by another request
+ * then park it instead of blocking the whole thread. */
+bool lwan_tpl_apply_with_coro(struct lwan_tpl *tpl,
+                              struct lwan_strbuf *buf,
+                              void *variables,
+                              struct coro *coro);
+bool lwan_tpl_apply_with_flush(struct lwan_tpl *tpl,
+                               struct lwan_strbuf *buf,
+                               void *variables,
+                               const struct lwan_tpl_flush *flush,
+                               struct coro *coro);
+
+/* Renders into the response buffer, sending it as chunks (see
+ * lwan_response_send_chunk()) once it grows past threshold bytes; the MIME
+ * type must have been set already.  If anything was sent, so was the rest
+ * of the document, and the response only has to be ended; otherwise, the
+ * buffer holds the whole document.  Sequences are left unfinished if the
+ * connection is dropped while sending, so cursors holding resources should
+ * also release them with coro_defer(). */
+struct lwan_request;
+bool lwan_tpl_apply_chunked(struct lwan_tpl *tpl,
+                            struct lwan_request *request,
+                            void *variables,
+                            size_t threshold);
 void lwan_tpl_free(struct lwan_tpl *tpl);
+
+#if defined(LWAN_TPL_GENERATOR)
+/* Used by tplgen.  The offset of each descriptor passed to
+ * lwan_tpl_generate_c() is an index into the names array, which holds the C
+ * expressions used to access and format that variable. */
+struct lwan_tpl_c_names {
+    const char *field;
+    const char *append_to_strbuf;
+    const char *get_is_empty;
+    const char *generator;
+    const char *cursor_init;
+    const char *cursor_next;
+    const char *cursor_fini;
+};
+
+struct lwan_tpl_c_options {
+    const char *template_name;
+    const char *descriptor_name;
+    const char *prefix;
+    const struct lwan_tpl_c_names *names;
+};
+
+bool lwan_tpl_generate_c(FILE *out,
+                         const char *string,
+                         const struct lwan_var_descriptor *descriptor,
+                         const struct lwan_tpl_c_options *options);
+#endif
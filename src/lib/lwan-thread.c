@@ -36,6 +36,7 @@
 #endif
 
 #include "lwan-private.h"
+#include "lwan-cache.h"
 #include "lwan-dq.h"
 #include "list.h"
 
@@ -113,7 +114,7 @@ __attribute__((noreturn)) static int process_request_coro(struct coro *coro,
     char *next_request = NULL;
     struct lwan_proxy proxy;
 
-    if (UNLIKELY(!lwan_strbuf_init(&strbuf)))
+    if (UNLIKELY(!lwan_strbuf_init_segmented(&strbuf)))
         goto out;
     coro_defer(coro, lwan_strbuf_free_defer, &strbuf);
 
@@ -235,12 +236,20 @@ static void update_epoll_flags(int fd,
         lwan_status_perror("epoll_ctl");
 }
 
+/* So that code only given a coroutine can make its connection wait. */
+static __thread struct lwan_connection *current_conn;
+
 static ALWAYS_INLINE void
 resume_coro(struct death_queue *dq, struct lwan_connection *conn, int epoll_fd)
 {
+    enum lwan_connection_coro_yield yield_result;
+
     assert(conn->coro);
 
-    enum lwan_connection_coro_yield yield_result = coro_resume(conn->coro);
+    current_conn = conn;
+    yield_result = coro_resume(conn->coro);
+    current_conn = NULL;
+
     if (yield_result == CONN_CORO_ABORT) {
         death_queue_kill(dq, conn);
         return;
@@ -315,6 +324,96 @@ static void accept_nudge(int pipe_fd,
     timeouts_add(t->wheel, &dq->timeout, 1000);
 }
 
+void lwan_waiter_init(struct lwan_waiter *waiter, struct lwan_connection *conn)
+{
+    *waiter = (struct lwan_waiter){
+        .thread = conn->thread,
+        .conn = conn,
+        .refs = 2,
+        .waiting = true,
+    };
+}
+
+struct lwan_waiter *lwan_waiter_new(struct coro *coro)
+{
+    struct lwan_waiter *waiter;
+
+    /* Only coroutines of connections can be woken up. */
+    if (UNLIKELY(!current_conn || current_conn->coro != coro))
+        return NULL;
+
+    waiter = malloc(sizeof(*waiter));
+    if (LIKELY(waiter))
+        lwan_waiter_init(waiter, current_conn);
+
+    return waiter;
+}
+
+void lwan_waiter_unref(struct lwan_waiter *waiter)
+{
+    /* Only the worker thread that created it touches the refcount. */
+    if (--waiter->refs)
+        return;
+
+    free(waiter);
+}
+
+static void waiter_release_defer(void *data)
+{
+    struct lwan_waiter *waiter = data;
+
+    waiter->waiting = false;
+    lwan_waiter_unref(waiter);
+}
+
+void lwan_waiter_wait(struct lwan_waiter *waiter, struct coro *coro)
+{
+    /* The connection might be closed while it's waiting. */
+    size_t generation = coro_deferred_get_generation(coro);
+
+    coro_defer(coro, waiter_release_defer, waiter);
+
+    while (waiter->waiting)
+        coro_yield(coro, CONN_CORO_SUSPEND_TIMER);
+
+    coro_deferred_run(coro, generation);
+}
+
+void lwan_waiter_wake(struct lwan_waiter *waiter)
+{
+    struct lwan_thread *t = waiter->thread;
+    struct lwan_waiter *head = __atomic_load_n(&t->woken, __ATOMIC_RELAXED);
+
+    do {
+        waiter->next = head;
+    } while (!__atomic_compare_exchange_n(&t->woken, &head, waiter, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    lwan_thread_nudge(t);
+}
+
+static void resume_woken(struct lwan_thread *t, int epoll_fd)
+{
+    struct lwan_waiter *waiter =
+        __atomic_exchange_n(&t->woken, NULL, __ATOMIC_ACQUIRE);
+
+    while (waiter) {
+        struct lwan_waiter *next = waiter->next;
+
+        /* Connections that were closed in the meantime stopped waiting. */
+        if (waiter->waiting) {
+            struct lwan_connection *conn = waiter->conn;
+
+            waiter->waiting = false;
+            update_epoll_flags(lwan_connection_get_fd(t->lwan, conn), conn,
+                               epoll_fd, CONN_CORO_RESUME_TIMER);
+        }
+        lwan_waiter_unref(waiter);
+
+        waiter = next;
+    }
+}
+
 static bool process_pending_timers(struct death_queue *dq,
                                    struct lwan_thread *t,
                                    int epoll_fd)
@@ -339,8 +438,10 @@ static bool process_pending_timers(struct death_queue *dq,
 
     if (processed_dq_timeout) {
         /* dq timeout expires every 1000ms if there are connections, so
-         * update the date cache at this point as well.  */
+         * update the date cache at this point as well, and let go of
+         * cache entries that were evicted in the meantime.  */
         update_date_cache(t);
+        cache_thread_sweep();
 
         if (!death_queue_empty(dq)) {
             timeouts_add(t->wheel, &dq->timeout, 1000);
@@ -381,6 +482,9 @@ turn_timer_wheel(struct death_queue *dq, struct lwan_thread *t, int epoll_fd)
     return (int)wheel_timeout;
 
 infinite_timeout:
+    /* Nothing will be looked up until there are connections again, and
+     * cached entries would be kept alive until then. */
+    cache_thread_release();
     return -1;
 }
 
@@ -425,6 +529,7 @@ static void *thread_io_loop(void *data)
             if (UNLIKELY(!event->data.ptr)) {
                 accept_nudge(read_pipe_fd, t, lwan->conns, &dq, &switcher,
                              epoll_fd);
+                resume_woken(t, epoll_fd);
                 continue;
             }
 
@@ -443,11 +548,28 @@ static void *thread_io_loop(void *data)
     pthread_barrier_wait(&lwan->thread.barrier);
 
     death_queue_kill_all(&dq);
+    cache_thread_release();
+    resume_woken(t, epoll_fd);
     free(events);
 
     return NULL;
 }
 
+void lwan_get_sendfile_stats(const struct lwan *l,
+                             struct lwan_sendfile_stats *stats)
+{
+    *stats = (struct lwan_sendfile_stats){};
+
+    /* Each thread only updates its own counters. */
+    for (unsigned int i = 0; i < l->thread.count; i++) {
+        const struct lwan_thread *t = &l->thread.threads[i];
+
+        stats->resident += ATOMIC_READ(t->sendfile.resident);
+        stats->offloaded += ATOMIC_READ(t->sendfile.offloaded);
+        stats->blocked += ATOMIC_READ(t->sendfile.blocked);
+    }
+}
+
 static void create_thread(struct lwan *l, struct lwan_thread *thread)
 {
     int ignore;
@@ -713,6 +835,7 @@ void lwan_thread_shutdown(struct lwan *l)
         pthread_join(l->thread.threads[i].self, NULL);
         spsc_queue_free(&t->pending_fds);
         timeouts_close(t->wheel);
+        lwan_compressor_pool_free(t);
     }
 
     free(l->thread.threads);
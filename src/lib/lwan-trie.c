@@ -23,167 +23,565 @@
 
 #include "lwan-private.h"
 
+enum node_type {
+    NODE_STATIC,
+    NODE_PARAM,
+    NODE_WILDCARD,
+};
+
+/* Nodes used while building the tree.  Static children are kept sorted
+ * by the first character of their labels, which never repeats between
+ * siblings. */
 struct lwan_trie_node {
-    struct lwan_trie_node *next[8];
-    struct lwan_trie_leaf *leaf;
-    int ref_count;
+    char *label;
+    size_t label_len;
+    enum node_type type;
+
+    struct lwan_trie_node **children;
+    size_t n_children;
+    struct lwan_trie_node *param;
+    struct lwan_trie_node *wildcard;
+
+    void *prefix[LWAN_TRIE_METHOD_SLOTS];
+    void *exact[LWAN_TRIE_METHOD_SLOTS];
 };
 
-struct lwan_trie_leaf {
-    char *key;
-    void *data;
-    struct lwan_trie_leaf *next;
+/* Nodes used for lookups.  They're laid out breadth-first, so that siblings
+ * are contiguous, and two of them fit in a cache line. */
+struct packed_node {
+    uint32_t label; /* Offset in strings; labels are NUL-terminated */
+    uint16_t label_len;
+    uint8_t type;
+    char first;
+    uint32_t children; /* Index of the first static child */
+    uint16_t n_children;
+    uint32_t param, wildcard; /* Index of the child, or 0 if none */
+    uint32_t prefix, exact;   /* Index in routes plus one, or 0 if none */
 };
 
+struct lwan_trie_packed {
+    struct packed_node *nodes;
+    void *(*routes)[LWAN_TRIE_METHOD_SLOTS];
+    char *strings;
+};
+
+static_assert(sizeof(struct packed_node) == 32,
+              "Two packed trie nodes fit in a cache line");
+
 bool lwan_trie_init(struct lwan_trie *trie, void (*free_node)(void *data))
 {
     if (!trie)
         return false;
     trie->root = NULL;
+    trie->packed = NULL;
     trie->free_node = free_node;
     return true;
 }
 
-static ALWAYS_INLINE struct lwan_trie_leaf *
-find_leaf_with_key(struct lwan_trie_node *node, const char *key, size_t len)
+static struct lwan_trie_node *
+node_new(enum node_type type, const char *label, size_t label_len)
 {
-    struct lwan_trie_leaf *leaf = node->leaf;
+    struct lwan_trie_node *node = calloc(1, sizeof(*node));
 
-    if (!leaf)
-        return NULL;
+    if (!node)
+        lwan_status_critical_perror("calloc");
+
+    node->label = strndup(label, label_len);
+    if (!node->label)
+        lwan_status_critical_perror("strndup");
+
+    node->label_len = label_len;
+    node->type = type;
+
+    return node;
+}
+
+static size_t common_prefix_len(const char *a, size_t a_len,
+                                const char *b, size_t b_len)
+{
+    size_t len = 0;
 
-    if (!leaf->next) /* No collisions -- no need to strncmp() */
-        return leaf;
+    while (len < a_len && len < b_len && a[len] == b[len])
+        len++;
 
-    for (; leaf; leaf = leaf->next) {
-        if (!strncmp(leaf->key, key, len - 1))
-            return leaf;
+    return len;
+}
+
+static struct lwan_trie_node **
+find_static_child(struct lwan_trie_node *node, char first)
+{
+    for (size_t i = 0; i < node->n_children; i++) {
+        if (node->children[i]->label[0] == first)
+            return &node->children[i];
     }
 
     return NULL;
 }
 
-#define GET_NODE()                                                             \
-    do {                                                                       \
-        if (!(node = *knode)) {                                                \
-            *knode = node = lwan_aligned_alloc(sizeof(*node), 64);             \
-            if (!node)                                                         \
-                goto oom;                                                      \
-            memset(node, 0, sizeof(*node));                                    \
-        }                                                                      \
-        ++node->ref_count;                                                     \
-    } while (0)
+static void add_static_child(struct lwan_trie_node *node,
+                             struct lwan_trie_node *child)
+{
+    struct lwan_trie_node **children;
+    size_t i;
+
+    children = realloc(node->children,
+                       (node->n_children + 1) * sizeof(*node->children));
+    if (!children)
+        lwan_status_critical_perror("realloc");
+
+    for (i = node->n_children; i > 0; i--) {
+        if ((unsigned char)children[i - 1]->label[0] <
+            (unsigned char)child->label[0])
+            break;
+        children[i] = children[i - 1];
+    }
+    children[i] = child;
+
+    node->children = children;
+    node->n_children++;
+}
 
-void lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
+static struct lwan_trie_node *
+insert_static(struct lwan_trie_node *node, const char *key, size_t len)
 {
-    if (UNLIKELY(!trie || !key || !data))
-        return;
+    while (len) {
+        struct lwan_trie_node **childp = find_static_child(node, *key);
 
-    struct lwan_trie_node **knode, *node;
-    const char *orig_key = key;
+        if (!childp) {
+            struct lwan_trie_node *child = node_new(NODE_STATIC, key, len);
 
-    /* Traverse the trie, allocating nodes if necessary */
-    for (knode = &trie->root; *key; knode = &node->next[(int)(*key++ & 7)])
-        GET_NODE();
+            add_static_child(node, child);
+            return child;
+        }
+
+        struct lwan_trie_node *child = *childp;
+        size_t common =
+            common_prefix_len(child->label, child->label_len, key, len);
 
-    /* Get the leaf node (allocate it if necessary) */
-    GET_NODE();
+        if (common < child->label_len) {
+            /* Split the edge: the child keeps the part of its label that
+             * differs, and hangs below a node with the common part. */
+            struct lwan_trie_node *split =
+                node_new(NODE_STATIC, child->label, common);
 
-    struct lwan_trie_leaf *leaf =
-        find_leaf_with_key(node, orig_key, (size_t)(key - orig_key));
-    bool had_key = leaf;
-    if (!leaf) {
-        leaf = lwan_aligned_alloc(sizeof(*leaf), 64);
-        if (!leaf)
-            lwan_status_critical_perror("malloc");
-    } else if (trie->free_node) {
-        trie->free_node(leaf->data);
+            memmove(child->label, child->label + common,
+                    child->label_len - common + 1);
+            child->label_len -= common;
+
+            *childp = split;
+            add_static_child(split, child);
+            child = split;
+        }
+
+        node = child;
+        key += common;
+        len -= common;
     }
 
-    leaf->data = data;
-    if (!had_key) {
-        leaf->key = strdup(orig_key);
-        leaf->next = node->leaf;
-        node->leaf = leaf;
+    return node;
+}
+
+static bool is_param_start(const char *pattern, const char *key)
+{
+    return (*key == ':' || *key == '*') && key > pattern && key[-1] == '/';
+}
+
+static struct lwan_trie_node *insert_param(struct lwan_trie_node *node,
+                                           const char *pattern,
+                                           enum node_type type,
+                                           const char *name,
+                                           size_t name_len)
+{
+    struct lwan_trie_node **childp =
+        type == NODE_PARAM ? &node->param : &node->wildcard;
+
+    if (!*childp) {
+        *childp = node_new(type, name, name_len);
+    } else if ((*childp)->label_len != name_len ||
+               memcmp((*childp)->label, name, name_len)) {
+        lwan_status_error("Parameter \"%.*s\" in \"%s\" conflicts with "
+                          "parameter \"%s\" of another route",
+                          (int)name_len, name, pattern, (*childp)->label);
+        return NULL;
     }
-    return;
 
-oom:
-    lwan_status_critical_perror("calloc");
+    return *childp;
 }
 
-#undef GET_NODE
+static struct lwan_trie_node *insert(struct lwan_trie_node *node,
+                                     const char *pattern,
+                                     size_t len)
+{
+    const char *key = pattern;
+    const char *end = pattern + len;
+    unsigned int n_params = 0;
+
+    while (key < end) {
+        if (is_param_start(pattern, key)) {
+            enum node_type type = *key == ':' ? NODE_PARAM : NODE_WILDCARD;
+            const char *name = key + 1;
+            size_t name_len = strcspn(name, "/");
+
+            if (name + name_len > end)
+                name_len = (size_t)(end - name);
+
+            if (type == NODE_WILDCARD && name + name_len != end) {
+                lwan_status_error("Wildcard must be the last segment of \"%s\"",
+                                  pattern);
+                return NULL;
+            }
+            if (++n_params > LWAN_TRIE_MAX_PARAMS) {
+                lwan_status_error("Too many parameters in \"%s\"", pattern);
+                return NULL;
+            }
+
+            node = insert_param(node, pattern, type, name, name_len);
+            if (!node)
+                return NULL;
+
+            key = name + name_len;
+            continue;
+        }
+
+        const char *run = key;
+        do {
+            key++;
+        } while (key < end && !is_param_start(pattern, key));
 
-static ALWAYS_INLINE struct lwan_trie_node *
-lookup_node(struct lwan_trie_node *root, const char *key, size_t *prefix_len)
+        node = insert_static(node, run, (size_t)(key - run));
+    }
+
+    return node;
+}
+
+static void count_nodes(const struct lwan_trie_node *node,
+                        size_t *n_nodes,
+                        size_t *n_routes,
+                        size_t *strings_len)
 {
-    struct lwan_trie_node *node, *previous_node = NULL;
-    const char *orig_key = key;
+    (*n_nodes)++;
+    *strings_len += node->label_len + 1;
 
-    for (node = root; node && *key; node = node->next[(int)(*key++ & 7)]) {
-        if (node->leaf)
-            previous_node = node;
+    for (size_t i = 0; i < LWAN_TRIE_METHOD_SLOTS; i++) {
+        if (node->prefix[i]) {
+            (*n_routes)++;
+            break;
+        }
+    }
+    for (size_t i = 0; i < LWAN_TRIE_METHOD_SLOTS; i++) {
+        if (node->exact[i]) {
+            (*n_routes)++;
+            break;
+        }
     }
 
-    *prefix_len = (size_t)(key - orig_key);
+    for (size_t i = 0; i < node->n_children; i++)
+        count_nodes(node->children[i], n_nodes, n_routes, strings_len);
+    if (node->param)
+        count_nodes(node->param, n_nodes, n_routes, strings_len);
+    if (node->wildcard)
+        count_nodes(node->wildcard, n_nodes, n_routes, strings_len);
+}
+
+struct pack_state {
+    struct lwan_trie_packed *packed;
+    const struct lwan_trie_node **queue;
+    size_t n_nodes, n_routes, strings_len;
+};
 
-    if (node && node->leaf)
-        return node;
+static uint32_t pack_routes(struct pack_state *state,
+                            void *const slots[LWAN_TRIE_METHOD_SLOTS])
+{
+    for (size_t i = 0; i < LWAN_TRIE_METHOD_SLOTS; i++) {
+        if (slots[i]) {
+            memcpy(state->packed->routes[state->n_routes], slots,
+                   sizeof(state->packed->routes[0]));
+            return (uint32_t)++state->n_routes;
+        }
+    }
 
-    return previous_node;
+    return 0;
 }
 
-ALWAYS_INLINE void *lwan_trie_lookup_prefix(struct lwan_trie *trie,
-                                            const char *key)
+static uint32_t enqueue(struct pack_state *state,
+                        const struct lwan_trie_node *node)
 {
-    assert(trie);
-    assert(key);
+    struct packed_node *packed = &state->packed->nodes[state->n_nodes];
+
+    *packed = (struct packed_node){
+        .label = (uint32_t)state->strings_len,
+        .label_len = (uint16_t)node->label_len,
+        .type = (uint8_t)node->type,
+        .first = node->label[0],
+        .prefix = pack_routes(state, node->prefix),
+        .exact = pack_routes(state, node->exact),
+    };
+
+    memcpy(state->packed->strings + state->strings_len, node->label,
+           node->label_len + 1);
+    state->strings_len += node->label_len + 1;
+
+    state->queue[state->n_nodes] = node;
+    return (uint32_t)state->n_nodes++;
+}
 
-    size_t prefix_len;
-    struct lwan_trie_node *node = lookup_node(trie->root, key, &prefix_len);
+void lwan_trie_pack(struct lwan_trie *trie)
+{
+    size_t n_nodes = 0, n_routes = 0, strings_len = 0;
 
-    if (node) {
-        struct lwan_trie_leaf *leaf = find_leaf_with_key(node, key, prefix_len);
+    if (!trie->root)
+        return;
 
-        if (leaf)
-            return leaf->data;
+    count_nodes(trie->root, &n_nodes, &n_routes, &strings_len);
+
+    if (n_nodes > UINT32_MAX / 2 || strings_len > UINT32_MAX)
+        lwan_status_critical("Too many routes");
+
+    size_t nodes_size = n_nodes * sizeof(struct packed_node);
+    size_t routes_size = n_routes * sizeof(void *[LWAN_TRIE_METHOD_SLOTS]);
+    struct lwan_trie_packed *packed = lwan_aligned_alloc(
+        64 + nodes_size + routes_size + strings_len, 64);
+    if (!packed)
+        lwan_status_critical_perror("lwan_aligned_alloc");
+
+    packed->nodes = (struct packed_node *)((char *)packed + 64);
+    packed->routes = (void *)((char *)packed->nodes + nodes_size);
+    packed->strings = (char *)packed->routes + routes_size;
+
+    struct pack_state state = {
+        .packed = packed,
+        .queue = calloc(n_nodes, sizeof(*state.queue)),
+    };
+    if (!state.queue)
+        lwan_status_critical_perror("calloc");
+
+    enqueue(&state, trie->root);
+    for (size_t head = 0; head < state.n_nodes; head++) {
+        const struct lwan_trie_node *node = state.queue[head];
+        struct packed_node *p = &packed->nodes[head];
+
+        if (node->n_children) {
+            p->children = (uint32_t)state.n_nodes;
+            p->n_children = (uint16_t)node->n_children;
+            for (size_t i = 0; i < node->n_children; i++)
+                enqueue(&state, node->children[i]);
+        }
+        if (node->param)
+            p->param = enqueue(&state, node->param);
+        if (node->wildcard)
+            p->wildcard = enqueue(&state, node->wildcard);
     }
 
-    return NULL;
+    assert(state.n_nodes == n_nodes);
+    assert(state.n_routes == n_routes);
+
+    free(state.queue);
+    free(trie->packed);
+    trie->packed = packed;
 }
 
-static void lwan_trie_node_destroy(struct lwan_trie *trie,
-                                   struct lwan_trie_node *node)
+bool lwan_trie_add_for_method(struct lwan_trie *trie,
+                              const char *key,
+                              unsigned int method,
+                              void *data)
 {
+    if (UNLIKELY(!trie || !key || !data || method >= LWAN_TRIE_METHOD_SLOTS))
+        return false;
+
+    size_t len = strlen(key);
+    bool exact = len && key[len - 1] == '$';
+
+    if (exact)
+        len--;
+    if (UNLIKELY(len > UINT16_MAX)) {
+        lwan_status_error("Route \"%s\" is too long", key);
+        return false;
+    }
+
+    if (!trie->root)
+        trie->root = node_new(NODE_STATIC, "", 0);
+
+    struct lwan_trie_node *node = insert(trie->root, key, len);
     if (!node)
+        return false;
+
+    void **slot = exact ? &node->exact[method] : &node->prefix[method];
+    if (*slot && trie->free_node)
+        trie->free_node(*slot);
+    *slot = data;
+
+    /* Lookups won't see this route until the trie is packed again. */
+    free(trie->packed);
+    trie->packed = NULL;
+
+    return true;
+}
+
+bool lwan_trie_add(struct lwan_trie *trie, const char *key, void *data)
+{
+    return lwan_trie_add_for_method(trie, key, LWAN_TRIE_ANY_METHOD, data);
+}
+
+struct lookup {
+    const struct lwan_trie_packed *packed;
+    const char *key;
+    unsigned int method;
+    void *best;
+    size_t other_methods_len;
+    struct lwan_trie_match *match;
+    unsigned int n_params;
+    struct lwan_trie_param params[LWAN_TRIE_MAX_PARAMS];
+};
+
+static void consider(struct lookup *l, uint32_t route, const char *key)
+{
+    void *const *slots = l->packed->routes[route - 1];
+    void *data = slots[l->method] ? slots[l->method] : slots[LWAN_TRIE_ANY_METHOD];
+    size_t len = (size_t)(key - l->key);
+
+    if (!data) {
+        l->match->other_methods = true;
+        if (len > l->other_methods_len)
+            l->other_methods_len = len;
         return;
+    }
 
-    int32_t nodes_destroyed = node->ref_count;
+    if (l->best && len <= l->match->len)
+        return;
 
-    for (struct lwan_trie_leaf *leaf = node->leaf; leaf;) {
-        struct lwan_trie_leaf *tmp = leaf->next;
+    l->best = data;
+    l->match->len = len;
+    l->match->n_params = l->n_params;
+    memcpy(l->match->params, l->params, l->n_params * sizeof(l->params[0]));
+}
+
+static void lookup_node(struct lookup *l,
+                        const struct packed_node *node,
+                        const char *key)
+{
+    const struct packed_node *nodes = l->packed->nodes;
+
+    if (node->exact && !*key)
+        consider(l, node->exact, key);
+    if (node->prefix)
+        consider(l, node->prefix, key);
 
-        if (trie->free_node)
-            trie->free_node(leaf->data);
+    if (!*key)
+        goto wildcard;
 
-        free(leaf->key);
-        free(leaf);
-        leaf = tmp;
+    for (uint32_t i = 0; i < node->n_children; i++) {
+        const struct packed_node *child = &nodes[node->children + i];
+
+        if (child->first == *key) {
+            if (!strncmp(key, l->packed->strings + child->label,
+                         child->label_len))
+                lookup_node(l, child, key + child->label_len);
+            break;
+        }
     }
 
-    for (int32_t i = 0; nodes_destroyed > 0 && i < 8; i++) {
-        if (node->next[i]) {
-            lwan_trie_node_destroy(trie, node->next[i]);
-            --nodes_destroyed;
+    if (node->param) {
+        size_t len = strcspn(key, "/");
+
+        if (len) {
+            const struct packed_node *child = &nodes[node->param];
+
+            assert(l->n_params < LWAN_TRIE_MAX_PARAMS);
+            l->params[l->n_params++] = (struct lwan_trie_param){
+                .name = l->packed->strings + child->label,
+                .value = key,
+                .len = len,
+            };
+            lookup_node(l, child, key + len);
+            l->n_params--;
         }
     }
 
+wildcard:
+    if (node->wildcard) {
+        const struct packed_node *child = &nodes[node->wildcard];
+        size_t len = strlen(key);
+
+        assert(l->n_params < LWAN_TRIE_MAX_PARAMS);
+        l->params[l->n_params++] = (struct lwan_trie_param){
+            .name = l->packed->strings + child->label,
+            .value = key,
+            .len = len,
+        };
+        lookup_node(l, child, key + len);
+        l->n_params--;
+    }
+}
+
+void *lwan_trie_lookup(const struct lwan_trie *trie,
+                       const char *key,
+                       unsigned int method,
+                       struct lwan_trie_match *match)
+{
+    assert(trie);
+    assert(key);
+    assert(method < LWAN_TRIE_METHOD_SLOTS);
+
+    match->len = 0;
+    match->n_params = 0;
+    match->other_methods = false;
+
+    if (UNLIKELY(!trie->packed))
+        return NULL;
+
+    struct lookup l = {
+        .packed = trie->packed,
+        .key = key,
+        .method = method,
+        .match = match,
+    };
+    lookup_node(&l, &trie->packed->nodes[0], key);
+
+    /* A longer match for other methods hides shorter matches for this
+     * one: "/users/:id" for GET shouldn't fall back to "/" on a DELETE. */
+    if (match->other_methods) {
+        if (l.best && l.other_methods_len <= match->len)
+            match->other_methods = false;
+        else
+            return NULL;
+    }
+
+    return l.best;
+}
+
+static void lwan_trie_node_destroy(struct lwan_trie *trie,
+                                   struct lwan_trie_node *node)
+{
+    if (!node)
+        return;
+
+    for (size_t i = 0; i < LWAN_TRIE_METHOD_SLOTS; i++) {
+        if (trie->free_node) {
+            if (node->prefix[i])
+                trie->free_node(node->prefix[i]);
+            if (node->exact[i])
+                trie->free_node(node->exact[i]);
+        }
+    }
+
+    for (size_t i = 0; i < node->n_children; i++)
+        lwan_trie_node_destroy(trie, node->children[i]);
+    lwan_trie_node_destroy(trie, node->param);
+    lwan_trie_node_destroy(trie, node->wildcard);
+
+    free(node->children);
+    free(node->label);
     free(node);
 }
 
 void lwan_trie_destroy(struct lwan_trie *trie)
 {
-    if (!trie || !trie->root)
+    if (!trie)
         return;
+
     lwan_trie_node_destroy(trie, trie->root);
+    free(trie->packed);
+
+    trie->root = NULL;
+    trie->packed = NULL;
 }
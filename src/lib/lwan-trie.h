@@ -17,22 +17,67 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
  * USA.
  */
-
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Radix tree mapping URL patterns to per-method data.  Patterns are
+ * prefixes, with a few additions:
+ *
+ *   - A segment starting with ':' (e.g. "/users/:id") captures a
+ *     non-empty segment, up to the next '/';
+ *   - A segment starting with '*' (e.g. "*path") captures the rest of the
+ *     URL, which might be empty, and must be the last segment;
+ *   - A pattern ending with '$' (e.g. "/about$") only matches the whole
+ *     URL, rather than a prefix of it.
+ *
+ * Lookups return the data for the longest match; static segments are
+ * preferred over parameters, which are preferred over wildcards. */
+
+#define LWAN_TRIE_MAX_PARAMS 8
+#define LWAN_TRIE_METHOD_SLOTS 8
+#define LWAN_TRIE_ANY_METHOD 0
+
 struct lwan_trie_node;
+struct lwan_trie_packed;
 
 struct lwan_trie {
+    /* Built while routes are added; lookups only touch the packed copy,
+     * which is generated, in a single allocation, by lwan_trie_pack()
+     * once all routes are in. */
     struct lwan_trie_node *root;
+    struct lwan_trie_packed *packed;
     void (*free_node)(void *data);
 };
 
+/* Captured values point to the looked up key and aren't NUL-terminated;
+ * names point to the trie itself. */
+struct lwan_trie_param {
+    const char *name;
+    const char *value;
+    size_t len;
+};
+
+struct lwan_trie_match {
+    size_t len; /* Length of the key consumed by the match */
+    unsigned int n_params;
+    bool other_methods; /* Something matched, but not for this method */
+    struct lwan_trie_param params[LWAN_TRIE_MAX_PARAMS];
+};
+
 bool lwan_trie_init(struct lwan_trie *trie, void (*free_node)(void *data));
 void lwan_trie_destroy(struct lwan_trie *trie);
 
-void lwan_trie_add(struct lwan_trie *trie, const char *key, void *data);
+bool lwan_trie_add(struct lwan_trie *trie, const char *key, void *data);
+bool lwan_trie_add_for_method(struct lwan_trie *trie,
+                              const char *key,
+                              unsigned int method,
+                              void *data);
+void lwan_trie_pack(struct lwan_trie *trie);
 
-void *lwan_trie_lookup_prefix(struct lwan_trie *trie, const char *key);
+void *lwan_trie_lookup(const struct lwan_trie *trie,
+                       const char *key,
+                       unsigned int method,
+                       struct lwan_trie_match *match);
@@ -46,6 +46,16 @@
 /* See detect_fastest_monotonic_clock() */
 clockid_t monotonic_clock_id = CLOCK_MONOTONIC;
 
+struct init_hook {
+    void (*cb)(void *data);
+    void *data;
+};
+
+DEFINE_ARRAY_TYPE(init_hook_array, struct init_hook)
+
+static struct init_hook_array init_hooks;
+static bool initialized;
+
 static const struct lwan_config default_config = {
     .listener = "localhost:8080",
     .keep_alive_timeout = 15,
@@ -55,6 +65,9 @@ static const struct lwan_config default_config = {
     .allow_cors = false,
     .expires = 1 * ONE_WEEK,
     .n_threads = 0,
+    .compression_threads = 1,
+    .compression_cpu_budget = 50,
+    .readahead_lock_budget = 64 * 1024 * 1024,
     .max_post_data_size = 10 * DEFAULT_BUFFER_SIZE,
     .allow_post_temp_file = false,
 };
@@ -98,10 +111,8 @@ static const struct lwan_module *find_module(const char *name)
     return NULL;
 }
 
-static void destroy_urlmap(void *data)
+static void destroy_urlmap_contents(struct lwan_url_map *url_map)
 {
-    struct lwan_url_map *url_map = data;
-
     if (url_map->module) {
         const struct lwan_module *module = url_map->module;
 
@@ -113,6 +124,14 @@ static void destroy_urlmap(void *data)
 
     free(url_map->authorization.realm);
     free(url_map->authorization.password_file);
+    free(url_map->compression.mime_types);
+}
+
+static void destroy_urlmap(void *data)
+{
+    struct lwan_url_map *url_map = data;
+
+    destroy_urlmap_contents(url_map);
     free((char *)url_map->prefix);
     free(url_map);
 }
@@ -132,11 +151,30 @@ static struct lwan_url_map *add_url_map(struct lwan_trie *t, const char *prefix,
         lwan_status_critical_perror("Could not copy URL prefix");
 
     copy->prefix_len = strlen(copy->prefix);
-    lwan_trie_add(t, copy->prefix, copy);
+    if (!lwan_trie_add_for_method(t, copy->prefix, copy->method, copy)) {
+        free((char *)copy->prefix);
+        free(copy);
+        return NULL;
+    }
 
     return copy;
 }
 
+static bool parse_method(const char *value, enum lwan_request_flags *method)
+{
+#define METHOD_NAME(upper, lower, mask, constant)                              \
+    if (!strcasecmp(value, #upper)) {                                          \
+        *method = REQUEST_METHOD_##upper;                                      \
+        return true;                                                           \
+    }
+
+    FOR_EACH_REQUEST_METHOD(METHOD_NAME)
+
+#undef METHOD_NAME
+
+    return false;
+}
+
 static void parse_listener_prefix_authorization(struct config *c,
                                                 const struct config_line *l,
                                                 struct lwan_url_map *url_map)
@@ -182,6 +220,86 @@ error:
     free(url_map->authorization.password_file);
 }
 
+static char *dup_without_spaces(const char *value)
+{
+    char *copy = malloc(strlen(value) + 1);
+    char *p = copy;
+
+    if (!copy)
+        return NULL;
+
+    for (; *value; value++) {
+        if (!lwan_char_isspace(*value))
+            *p++ = *value;
+    }
+    *p = '\0';
+
+    return copy;
+}
+
+static void parse_listener_prefix_compress(struct config *c,
+                                           const struct config_line *l,
+                                           struct lwan_url_map *url_map)
+{
+    struct lwan_compression_settings *settings = &url_map->compression;
+
+    free(settings->mime_types);
+    *settings = (struct lwan_compression_settings){
+        .min_size = 256,
+        .level = 6,
+    };
+
+    while ((l = config_read_line(c))) {
+        switch (l->type) {
+        case CONFIG_LINE_TYPE_LINE:
+            if (streq(l->key, "mime_types")) {
+                free(settings->mime_types);
+                settings->mime_types = dup_without_spaces(l->value);
+            } else if (streq(l->key, "min_size")) {
+                long min_size = parse_long(l->value, 256);
+
+                if (min_size < 0) {
+                    config_error(c, "Minimum size can't be negative");
+                    goto error;
+                }
+                settings->min_size = (size_t)min_size;
+            } else if (streq(l->key, "level")) {
+                settings->level = parse_int(l->value, 6);
+
+                if (settings->level < 1 || settings->level > 9) {
+                    config_error(c, "Compression level must be between 1 and 9");
+                    goto error;
+                }
+            } else {
+                config_error(c, "Unknown compression option: %s", l->key);
+                goto error;
+            }
+            break;
+
+        case CONFIG_LINE_TYPE_SECTION:
+            config_error(c, "Unexpected section: %s", l->key);
+            goto error;
+
+        case CONFIG_LINE_TYPE_SECTION_END:
+            if (!settings->mime_types) {
+                settings->mime_types = strdup(
+                    "text/*,application/json,application/javascript,"
+                    "application/xml,image/svg+xml");
+            }
+
+            url_map->flags |=
+                HANDLER_COMPRESS_RESPONSE | HANDLER_PARSE_ACCEPT_ENCODING;
+            return;
+        }
+    }
+
+    config_error(c, "Could not find end of compress section");
+
+error:
+    free(settings->mime_types);
+    settings->mime_types = NULL;
+}
+
 static void parse_listener_prefix(struct config *c,
                                   const struct config_line *l,
                                   struct lwan *lwan,
@@ -208,6 +326,8 @@ static void parse_listener_prefix(struct config *c,
         case CONFIG_LINE_TYPE_SECTION:
             if (streq(l->key, "authorization")) {
                 parse_listener_prefix_authorization(c, l, &url_map);
+            } else if (streq(l->key, "compress")) {
+                parse_listener_prefix_compress(c, l, &url_map);
             } else if (!config_skip_section(c, l)) {
                 config_error(c, "Could not skip section");
                 goto out;
@@ -225,6 +345,12 @@ static void parse_listener_prefix(struct config *c,
 add_map:
     assert((handler && !module) || (!handler && module));
 
+    const char *method = hash_find(hash, "method");
+    if (method && !parse_method(method, &url_map.method)) {
+        config_error(c, "Unknown HTTP method: %s", method);
+        goto out;
+    }
+
     if (handler) {
         url_map.handler = handler;
         url_map.flags |= HANDLER_PARSE_MASK | HANDLER_DATA_IS_HASH_TABLE;
@@ -258,7 +384,11 @@ add_map:
         goto out;
     }
 
-    add_url_map(&lwan->url_map_trie, prefix, &url_map);
+    if (!add_url_map(&lwan->url_map_trie, prefix, &url_map)) {
+        config_error(c, "Invalid route: %s", prefix);
+        destroy_urlmap_contents(&url_map);
+        goto out;
+    }
 
 out:
     hash_free(hash);
@@ -274,6 +404,9 @@ void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
     for (; map->prefix; map++) {
         struct lwan_url_map *copy = add_url_map(&l->url_map_trie, NULL, map);
 
+        if (UNLIKELY(!copy))
+            lwan_status_critical("Invalid route: %s", map->prefix);
+
         if (copy->module && copy->module->create) {
             copy->data = copy->module->create (map->prefix, copy->args);
             copy->flags = copy->module->flags;
@@ -282,6 +415,8 @@ void lwan_set_url_map(struct lwan *l, const struct lwan_url_map *map)
             copy->flags = HANDLER_PARSE_MASK;
         }
     }
+
+    lwan_trie_pack(&l->url_map_trie);
 }
 
 static void parse_listener(struct config *c,
@@ -393,6 +528,27 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
                     config_error(conf, "Invalid number of threads: %ld",
                                  n_threads);
                 lwan->config.n_threads = (unsigned short int)n_threads;
+            } else if (streq(line->key, "compression_threads")) {
+                long n_threads = parse_long(line->value,
+                                            default_config.compression_threads);
+                if (n_threads < 0 || n_threads > 64)
+                    config_error(conf,
+                                 "Invalid number of compression threads: %ld",
+                                 n_threads);
+                lwan->config.compression_threads = (unsigned short)n_threads;
+            } else if (streq(line->key, "compression_cpu_budget")) {
+                long budget = parse_long(line->value,
+                                         default_config.compression_cpu_budget);
+                if (budget <= 0 || budget > 100)
+                    config_error(conf, "CPU budget must be between 1 and 100");
+                lwan->config.compression_cpu_budget = (unsigned short)budget;
+            } else if (streq(line->key, "readahead_lock_budget")) {
+                long budget = parse_long(
+                    line->value, (long)default_config.readahead_lock_budget);
+                if (budget < 0)
+                    config_error(conf, "Negative readahead lock budget");
+                else
+                    lwan->config.readahead_lock_budget = (size_t)budget;
             } else if (streq(line->key, "max_post_data_size")) {
                 long max_post_data_size = parse_long(
                     line->value, (long)default_config.max_post_data_size);
@@ -435,6 +591,8 @@ static bool setup_from_config(struct lwan *lwan, const char *path)
 
     config_close(conf);
 
+    lwan_trie_pack(&lwan->url_map_trie);
+
     return true;
 }
 
@@ -520,6 +678,33 @@ static char *dup_or_null(const char *s)
     return s ? strdup(s) : NULL;
 }
 
+void lwan_after_init(void (*cb)(void *data), void *data)
+{
+    struct init_hook *hook;
+
+    if (initialized) {
+        cb(data);
+        return;
+    }
+
+    hook = init_hook_array_append(&init_hooks);
+    if (!hook)
+        lwan_status_critical_perror("Could not defer initialization");
+
+    *hook = (struct init_hook){.cb = cb, .data = data};
+}
+
+static void run_init_hooks(void)
+{
+    struct init_hook *hook;
+
+    initialized = true;
+
+    LWAN_ARRAY_FOREACH (&init_hooks, hook)
+        hook->cb(hook->data);
+    init_hook_array_reset(&init_hooks);
+}
+
 static void lwan_fd_watch_init(struct lwan *l)
 {
     l->epfd = epoll_create1(EPOLL_CLOEXEC);
@@ -537,6 +722,7 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
     /* Load defaults */
     memset(l, 0, sizeof(*l));
     memcpy(&l->config, config, sizeof(*config));
+    initialized = false;
     l->config.listener = dup_or_null(l->config.listener);
     l->config.config_file_path = dup_or_null(l->config.config_file_path);
 
@@ -586,11 +772,15 @@ void lwan_init_with_config(struct lwan *l, const struct lwan_config *config)
 
     signal(SIGPIPE, SIG_IGN);
 
-    lwan_readahead_init();
+    lwan_readahead_init(l->config.readahead_lock_budget);
+    lwan_compress_queue_init(l->config.compression_threads,
+                             l->config.compression_cpu_budget);
     lwan_thread_init(l);
     lwan_socket_init(l);
     lwan_http_authorize_init();
     lwan_fd_watch_init(l);
+
+    run_init_hooks();
 }
 
 void lwan_shutdown(struct lwan *l)
@@ -602,8 +792,14 @@ void lwan_shutdown(struct lwan *l)
     free(l->config.config_file_path);
 
     lwan_job_thread_shutdown();
+    /* Page-ins are handed back to worker threads once done. */
+    lwan_readahead_page_in_shutdown();
     lwan_thread_shutdown(l);
 
+    /* Pending jobs might hold references to cache entries owned by
+     * handlers, so stop the queue before they're destroyed. */
+    lwan_compress_queue_shutdown();
+
     lwan_status_debug("Shutting down URL handlers");
     lwan_trie_destroy(&l->url_map_trie);
 
@@ -200,6 +200,7 @@ enum lwan_handler_flags {
     HANDLER_CAN_REWRITE_URL = 1 << 2,
     HANDLER_DATA_IS_HASH_TABLE = 1 << 3,
     HANDLER_PARSE_ACCEPT_ENCODING = 1 << 4,
+    HANDLER_COMPRESS_RESPONSE = 1 << 5,
 
     HANDLER_PARSE_MASK = HANDLER_HAS_POST_DATA,
 };
@@ -242,6 +243,8 @@ enum lwan_request_flags {
     REQUEST_PARSED_POST_DATA = 1 << 18,
     REQUEST_PARSED_COOKIES = 1 << 19,
     REQUEST_PARSED_ACCEPT_ENCODING = 1 << 20,
+
+    REQUEST_ACCEPT_ZSTD = 1 << 21,
 };
 
 #undef SELECT_MASK
@@ -293,10 +296,24 @@ struct lwan_key_value {
 
 struct lwan_request;
 
+struct lwan_compression_settings {
+    char *mime_types; /* Comma-separated; subtypes can be wildcards */
+    size_t min_size;
+    int level;
+};
+
+struct lwan_compressor;
+
 struct lwan_response {
     struct lwan_strbuf *buffer;
     const char *mime_type;
 
+    struct {
+        const struct lwan_compression_settings *settings;
+        const char *encoding;
+        struct lwan_compressor **stream;
+    } compression;
+
     union {
         struct {
             const struct lwan_key_value *headers;
@@ -315,6 +332,12 @@ struct lwan_value {
     size_t len;
 };
 
+struct lwan_range {
+    /* Inclusive, as in the Range header.  If from is negative, to is the
+     * length of a suffix; if to is negative, the range goes to the end. */
+    off_t from, to;
+};
+
 struct lwan_connection {
     /* This structure is exactly 32-bytes on x86-64. If it is changed,
      * make sure the scheduler (lwan-thread.c) is updated as well. */
@@ -390,6 +413,7 @@ struct lwan_url_map {
     const char *prefix;
     size_t prefix_len;
     enum lwan_handler_flags flags;
+    enum lwan_request_flags method; /* 0 handles every method */
 
     const struct lwan_module *module;
     void *args;
@@ -398,6 +422,30 @@ struct lwan_url_map {
         char *realm;
         char *password_file;
     } authorization;
+
+    struct lwan_compression_settings compression;
+};
+
+struct lwan_waiter;
+
+/* How the windows of files sent with sendfile() were found: already in the
+ * page cache, paged in by an I/O thread, or left for sendfile() to read,
+ * blocking the worker thread. */
+struct lwan_sendfile_stats {
+    unsigned long long resident;
+    unsigned long long offloaded;
+    unsigned long long blocked;
+};
+
+/* What the readahead thread did with the hints it was given: pages it
+ * prefetched, hints for pages that were resident already, and hints it
+ * never got; and how much of the mapped files is kept locked in memory. */
+struct lwan_readahead_stats {
+    unsigned long long prefetched_pages;
+    unsigned long long resident_hints;
+    unsigned long long dropped_hints;
+    size_t locked;
+    size_t lock_budget;
 };
 
 struct lwan_thread {
@@ -407,10 +455,13 @@ struct lwan_thread {
         char expires[30];
     } date;
     struct spsc_queue pending_fds;
+    struct lwan_waiter *woken;
+    struct lwan_sendfile_stats sendfile;
     struct timeouts *wheel;
     int epoll_fd;
     int pipe_fd[2];
     pthread_t self;
+    struct lwan_compressor *compressors;
 };
 
 struct lwan_straitjacket {
@@ -427,6 +478,9 @@ struct lwan_config {
     unsigned short keep_alive_timeout;
     unsigned int expires;
     unsigned short n_threads;
+    unsigned short compression_threads;
+    unsigned short compression_cpu_budget;
+    size_t readahead_lock_budget;
     bool quiet;
     bool reuse_port;
     bool proxy_protocol;
@@ -482,6 +536,10 @@ const char *lwan_request_get_cookie(struct lwan_request *request,
 const char *lwan_request_get_header(struct lwan_request *request,
                                     const char *header)
     __attribute__((warn_unused_result));
+const char *lwan_request_get_path_param(struct lwan_request *request,
+                                        const char *name,
+                                        size_t *len)
+    __attribute__((warn_unused_result));
 
 void lwan_request_sleep(struct lwan_request *request, uint64_t ms);
 
@@ -513,6 +571,10 @@ void lwan_straitjacket_enforce(const struct lwan_straitjacket *sj);
 
 const struct lwan_config *lwan_get_default_config(void);
 
+void lwan_get_sendfile_stats(const struct lwan *l,
+                             struct lwan_sendfile_stats *stats);
+void lwan_get_readahead_stats(struct lwan_readahead_stats *stats);
+
 int lwan_connection_get_fd(const struct lwan *lwan,
                            const struct lwan_connection *conn)
     __attribute__((pure)) __attribute__((warn_unused_result));
@@ -534,6 +596,9 @@ lwan_request_get_method(const struct lwan_request *request)
 int lwan_request_get_range(struct lwan_request *request,
                            off_t *from,
                            off_t *to);
+int lwan_request_get_ranges(struct lwan_request *request,
+                            struct lwan_range *ranges,
+                            size_t max_ranges);
 int lwan_request_get_if_modified_since(struct lwan_request *request,
                                        time_t *value);
 const struct lwan_value *
@@ -30,17 +30,23 @@
 static const char hello_world[] = "Hello, World!";
 static const char random_number_query[] = "SELECT randomNumber FROM World WHERE id=?";
 
+struct fortune {
+    int id;
+    char *message;
+};
+
+DEFINE_ARRAY_TYPE_INLINEFIRST(fortune_array, struct fortune)
+
 struct Fortune {
-    struct {
-        coro_function_t generator;
+    struct fortune_array fortunes;
+    size_t next_fortune;
 
+    struct {
         int id;
         char *message;
     } item;
 };
 
-DEFINE_ARRAY_TYPE_INLINEFIRST(fortune_array, struct Fortune)
-
 static const char fortunes_template_str[] = "<!DOCTYPE html>" \
 "<html>" \
 "<head><title>Fortunes</title></head>" \
@@ -54,7 +60,9 @@ static const char fortunes_template_str[] = "<!DOCTYPE html>" \
 "</body>" \
 "</html>";
 
-static int fortune_list_generator(struct coro *coro, void *data);
+static bool fortune_list_init(void *data);
+static bool fortune_list_next(void *data);
+static void fortune_list_fini(void *data);
 
 #undef TPL_STRUCT
 #define TPL_STRUCT struct Fortune
@@ -65,7 +73,8 @@ static const struct lwan_var_descriptor fortune_item_desc[] = {
 };
 
 static const struct lwan_var_descriptor fortune_desc[] = {
-    TPL_VAR_SEQUENCE(item, fortune_list_generator, fortune_item_desc),
+    TPL_VAR_SEQUENCE_CURSOR(item, fortune_list_init, fortune_list_next,
+                            fortune_list_fini, fortune_item_desc),
     TPL_VAR_SENTINEL,
 };
 
@@ -199,56 +208,57 @@ LWAN_HANDLER(plaintext)
 
 static int fortune_compare(const void *a, const void *b)
 {
-    const struct Fortune *fortune_a = (const struct Fortune *)a;
-    const struct Fortune *fortune_b = (const struct Fortune *)b;
-    size_t a_len = strlen(fortune_a->item.message);
-    size_t b_len = strlen(fortune_b->item.message);
+    const struct fortune *fortune_a = (const struct fortune *)a;
+    const struct fortune *fortune_b = (const struct fortune *)b;
+    size_t a_len = strlen(fortune_a->message);
+    size_t b_len = strlen(fortune_b->message);
 
     if (!a_len || !b_len)
         return a_len > b_len;
 
     size_t min_len = a_len < b_len ? a_len : b_len;
-    int cmp = memcmp(fortune_a->item.message, fortune_b->item.message, min_len);
+    int cmp = memcmp(fortune_a->message, fortune_b->message, min_len);
     if (cmp == 0)
         return a_len > b_len;
 
     return cmp > 0;
 }
 
-static bool append_fortune(struct coro *coro, struct fortune_array *fortunes,
+static bool append_fortune(struct fortune_array *fortunes,
                            int id, const char *message)
 {
-    struct Fortune *fortune;
+    struct fortune *fortune;
     char *message_copy;
 
-    message_copy = coro_strdup(coro, message);
+    message_copy = strdup(message);
     if (UNLIKELY(!message_copy))
         return false;
 
     fortune = fortune_array_append(fortunes);
-    if (UNLIKELY(!fortune))
+    if (UNLIKELY(!fortune)) {
+        free(message_copy);
         return false;
+    }
 
-    fortune->item.id = id;
-    fortune->item.message = message_copy;
+    fortune->id = id;
+    fortune->message = message_copy;
 
     return true;
 }
 
-static int fortune_list_generator(struct coro *coro, void *data)
+static bool fortune_list_init(void *data)
 {
     static const char fortune_query[] = "SELECT * FROM Fortune";
     char fortune_buffer[256];
     struct Fortune *fortune = data;
-    struct fortune_array fortunes;
     struct db_stmt *stmt;
-    size_t i;
 
     stmt = db_prepare_stmt(database, fortune_query, sizeof(fortune_query) - 1);
     if (UNLIKELY(!stmt))
-        return 0;
+        return false;
 
-    fortune_array_init(&fortunes);
+    fortune_array_init(&fortune->fortunes);
+    fortune->next_fortune = 0;
 
     struct db_row results[] = {
         { .kind = 'i' },
@@ -256,27 +266,50 @@ static int fortune_list_generator(struct coro *coro, void *data)
         { .kind = '\0' }
     };
     while (db_stmt_step(stmt, results)) {
-        if (!append_fortune(coro, &fortunes, results[0].u.i, results[1].u.s))
+        if (!append_fortune(&fortune->fortunes, results[0].u.i, results[1].u.s))
             goto out;
     }
 
-    if (!append_fortune(coro, &fortunes, 0,
+    if (!append_fortune(&fortune->fortunes, 0,
                             "Additional fortune added at request time."))
         goto out;
 
-    fortune_array_sort(&fortunes, fortune_compare);
+    db_stmt_finalize(stmt);
 
-    for (i = 0; i < fortunes.base.elements; i++) {
-        struct Fortune *f = &((struct Fortune *)fortunes.base.base)[i];
-        fortune->item.id = f->item.id;
-        fortune->item.message = f->item.message;
-        coro_yield(coro, 1);
-    }
+    fortune_array_sort(&fortune->fortunes, fortune_compare);
+    return true;
 
 out:
-    fortune_array_reset(&fortunes);
     db_stmt_finalize(stmt);
-    return 0;
+    fortune_list_fini(data);
+    return false;
+}
+
+static bool fortune_list_next(void *data)
+{
+    struct Fortune *fortune = data;
+    const struct fortune *f;
+
+    if (fortune->next_fortune == fortune->fortunes.base.elements)
+        return false;
+
+    f = &((const struct fortune *)
+              fortune->fortunes.base.base)[fortune->next_fortune++];
+    fortune->item.id = f->id;
+    fortune->item.message = f->message;
+
+    return true;
+}
+
+static void fortune_list_fini(void *data)
+{
+    struct Fortune *fortune = data;
+    struct fortune *f;
+
+    LWAN_ARRAY_FOREACH (&fortune->fortunes, f)
+        free(f->message);
+
+    fortune_array_reset(&fortune->fortunes);
 }
 
 LWAN_HANDLER(fortunes)
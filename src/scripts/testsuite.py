@@ -7,10 +7,12 @@ import os
 import random
 import re
 import requests
+import shutil
 import signal
 import socket
 import subprocess
 import sys
+import threading
 import time
 import unittest
 import string
@@ -66,6 +68,12 @@ class LwanTest(unittest.TestCase):
   def assertResponsePlain(self, request, status_code=200):
     self.assertHttpResponseValid(request, status_code, 'text/plain')
 
+  def build_features(self):
+    r = requests.get('http://127.0.0.1:8080/build-features')
+    self.assertResponsePlain(r)
+    return {k: bool(int(v)) for k, v in
+            (line.split('=') for line in r.text.split())}
+
 
 class TestPost(LwanTest):
   def test_will_it_blend(self):
@@ -149,9 +157,10 @@ class TestFileServing(LwanTest):
     self.assertHttpResponseValid(r, 206, 'application/octet-stream')
 
     self.assertTrue('content-length' in r.headers)
-    self.assertEqual(r.headers['content-length'], '50')
+    self.assertEqual(r.headers['content-length'], '51')
+    self.assertEqual(r.headers['content-range'], 'bytes 0-50/32768')
 
-    self.assertEqual(r.text, '\0' * 50)
+    self.assertEqual(r.text, '\0' * 51)
 
   def test_range_half_inverted(self):
     r = requests.get('http://127.0.0.1:8080/zero',
@@ -164,13 +173,25 @@ class TestFileServing(LwanTest):
     r = requests.get('http://127.0.0.1:8080/zero',
           headers={'Range': 'bytes=50-50'})
 
-    self.assertHttpResponseValid(r, 416, 'text/html')
+    self.assertHttpResponseValid(r, 206, 'application/octet-stream')
+    self.assertEqual(r.headers['content-length'], '1')
+    self.assertEqual(r.headers['content-range'], 'bytes 50-50/32768')
 
 
   def test_range_too_big(self):
     r = requests.get('http://127.0.0.1:8080/zero',
           headers={'Range': 'bytes=0-40000'})
 
+    # The last position is clamped to the end of the file.
+    self.assertHttpResponseValid(r, 206, 'application/octet-stream')
+    self.assertEqual(r.headers['content-length'], '32768')
+    self.assertEqual(r.headers['content-range'], 'bytes 0-32767/32768')
+
+
+  def test_range_past_the_end(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=40000-40010'})
+
     self.assertHttpResponseValid(r, 416, 'text/html')
 
 
@@ -182,6 +203,7 @@ class TestFileServing(LwanTest):
 
     self.assertTrue('content-length' in r.headers)
     self.assertEqual(r.headers['content-length'], '100')
+    self.assertEqual(r.headers['content-range'], 'bytes 32668-32767/32768')
 
     self.assertEqual(r.text, '\0' * 100)
 
@@ -193,9 +215,84 @@ class TestFileServing(LwanTest):
 
     self.assertTrue('content-length' in r.headers)
     self.assertEqual(r.headers['content-length'], '32718')
+    self.assertEqual(r.headers['content-range'], 'bytes 50-32767/32768')
 
     self.assertEqual(r.text, '\0' * 32718)
 
+  def test_range_middle(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=100-150'})
+
+    self.assertHttpResponseValid(r, 206, 'application/octet-stream')
+
+    self.assertTrue('content-length' in r.headers)
+    self.assertEqual(r.headers['content-length'], '51')
+    self.assertEqual(r.headers['content-range'], 'bytes 100-150/32768')
+
+    self.assertEqual(r.text, '\0' * 51)
+
+
+  def assertMultipartRanges(self, r, content_type, expected_ranges, body):
+    self.assertEqual(r.status_code, 206)
+    self.assertTrue(r.headers['content-type'].startswith('multipart/byteranges; boundary='))
+    boundary = r.headers['content-type'].split('boundary=')[1]
+
+    parts = r.content.split(b'\r\n--' + boundary.encode())
+    self.assertEqual(parts[0], b'')
+    self.assertEqual(parts[-1], b'--\r\n')
+    self.assertEqual(len(parts) - 2, len(expected_ranges))
+
+    for part, (first, last) in zip(parts[1:-1], expected_ranges):
+      headers, contents = part.split(b'\r\n\r\n', 1)
+      self.assertTrue(b'Content-Type: ' + content_type.encode() in headers)
+      self.assertTrue(b'Content-Range: bytes %d-%d/%d' % (first, last, len(body)) in headers)
+      self.assertEqual(contents, body[first:last + 1])
+
+
+  def test_multiple_ranges_small_file(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Range': 'bytes=0-3,10-12,2-5,-4',
+                   'Accept-Encoding': 'foobar'})
+
+    # Overlapping ranges are coalesced and sorted.
+    self.assertMultipartRanges(r, 'text/html', ((0, 5), (10, 12), (96, 99)),
+                               b'X' * 100)
+
+
+  def test_multiple_ranges_larger_file(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=0-9, 20000-20009, 32760-'})
+
+    self.assertMultipartRanges(r, 'application/octet-stream',
+                               ((0, 9), (20000, 20009), (32760, 32767)),
+                               b'\0' * 32768)
+
+
+  def test_multiple_ranges_coalesced_into_one(self):
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Range': 'bytes=10-19,15-29,30-39',
+                   'Accept-Encoding': 'foobar'})
+
+    self.assertHttpResponseValid(r, 206, 'text/html')
+    self.assertEqual(r.headers['content-range'], 'bytes 10-39/100')
+    self.assertEqual(r.text, 'X' * 30)
+
+
+  def test_multiple_ranges_unsatisfiable(self):
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=40000-40010,50000-'})
+
+    self.assertHttpResponseValid(r, 416, 'text/html')
+
+
+  def test_too_many_ranges_yields_full_file(self):
+    ranges = ','.join('%d-%d' % (i, i) for i in range(0, 100, 2))
+    r = requests.get('http://127.0.0.1:8080/zero',
+          headers={'Range': 'bytes=' + ranges})
+
+    self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+    self.assertEqual(r.headers['content-length'], '32768')
+
 
   def test_slash_slash_slash_does_not_matter_404(self):
     r = requests.get('http://127.0.0.1:8080//////////etc/passwd')
@@ -270,6 +367,139 @@ class TestFileServing(LwanTest):
       self.assertEqual(r.text, 'X' * 100)
 
 
+  def test_zstd_is_negotiated(self):
+    if not self.build_features()['zstd']:
+      self.skipTest('lwan was built without Zstandard support')
+    try:
+      import zstandard
+    except ImportError:
+      self.skipTest('zstandard module is not available')
+
+    r = requests.get('http://127.0.0.1:8080/100.html',
+          headers={'Accept-Encoding': 'zstd, deflate'}, stream=True)
+
+    self.assertResponseHtml(r)
+    self.assertEqual(r.headers['content-encoding'], 'zstd')
+    self.assertLess(int(r.headers['content-length']), 100)
+
+    body = r.raw.read()
+    self.assertEqual(len(body), int(r.headers['content-length']))
+    self.assertEqual(zstandard.ZstdDecompressor().decompressobj().decompress(body),
+                     b'X' * 100)
+
+
+  def test_background_compression(self):
+    # Misses are served with whatever could be compressed quickly; the
+    # brotli variant is attached by the background compression queue.
+    for _ in range(50):
+      r = requests.get('http://127.0.0.1:8080/icons/',
+            headers={'Accept-Encoding': 'br'})
+
+      self.assertResponseHtml(r)
+
+      if r.headers.get('content-encoding') == 'br':
+        break
+
+      self.assertFalse('content-encoding' in r.headers)
+      self.assertTrue('back.gif' in r.text)
+      time.sleep(0.1)
+    else:
+      self.skipTest('Brotli support not built in')
+
+
+  def test_watched_file_changes(self):
+    path = os.path.join('wwwroot', 'watched.txt')
+
+    def get():
+      return requests.get('http://127.0.0.1:8080/watched/watched.txt',
+            headers={'Accept-Encoding': 'foobar'})
+
+    try:
+      with open(path, 'w') as f:
+        f.write('before')
+
+      r = get()
+      self.assertHttpResponseValid(r, 200, 'text/plain')
+      self.assertEqual(r.text, 'before')
+
+      with open(path, 'w') as f:
+        f.write('after the change')
+
+      # Invalidation happens asynchronously, but way before the entry
+      # would expire on its own.
+      for _ in range(20):
+        r = get()
+        if r.text != 'before':
+          break
+        time.sleep(0.05)
+      self.assertEqual(r.text, 'after the change')
+
+      os.unlink(path)
+      for _ in range(20):
+        r = get()
+        if r.status_code == 404:
+          break
+        time.sleep(0.05)
+      self.assertEqual(r.status_code, 404)
+    finally:
+      if os.path.exists(path):
+        os.unlink(path)
+
+
+  def test_watched_missing_file_appears(self):
+    path = os.path.join('wwwroot', 'appeared.txt')
+    url = 'http://127.0.0.1:8080/watched/appeared.txt'
+
+    try:
+      self.assertResponse404(requests.get(url))
+
+      with open(path, 'w') as f:
+        f.write('here now')
+
+      # The negative entry would outlive the test; it's dropped because
+      # the directory changed.
+      for _ in range(20):
+        r = requests.get(url)
+        if r.status_code == 200:
+          break
+        time.sleep(0.05)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.text, 'here now')
+    finally:
+      if os.path.exists(path):
+        os.unlink(path)
+
+
+  def test_compressed_store(self):
+    def get():
+      return requests.get('http://127.0.0.1:8080/compressed-store/zero',
+            headers={'Accept-Encoding': 'gzip'})
+
+    # Files served with sendfile() are compressed in the background...
+    for _ in range(50):
+      r = get()
+      self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+      self.assertEqual(r.content, b'\0' * 32768)
+      if r.headers.get('content-encoding') == 'gzip':
+        break
+      time.sleep(0.1)
+    else:
+      self.fail('File was never compressed')
+
+    self.assertTrue(any(f.endswith('.gz9')
+                        for f in os.listdir('compressed-store')))
+
+    # ...and, as the result is kept on disk, it's available right away
+    # after a restart.
+    self.tearDown()
+    self.setUp()
+
+    r = get()
+    self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+    self.assertEqual(r.headers['content-encoding'], 'gzip')
+    self.assertEqual(r.content, b'\0' * 32768)
+
+
   def test_get_larger_file(self):
     r = requests.get('http://127.0.0.1:8080/zero',
           headers={'Accept-Encoding': 'foobar'})
@@ -282,6 +512,78 @@ class TestFileServing(LwanTest):
     self.assertEqual(r.text, '\0' * 32768)
 
 
+  def test_get_file_not_in_page_cache(self):
+    path = os.path.join('wwwroot', 'cold.bin')
+    data = os.urandom(3 * 512 * 1024)
+
+    try:
+      with open(path, 'wb') as f:
+        f.write(data)
+        f.flush()
+        os.fsync(f.fileno())
+        # Drop it from the page cache so it has to be read from disk
+        # while it's being sent.
+        os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+
+      before = self.sendfile_stats()
+      r = requests.get('http://127.0.0.1:8080/cold.bin',
+            headers={'Accept-Encoding': 'foobar'})
+      after = self.sendfile_stats()
+
+      self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+      self.assertEqual(r.headers['content-length'], str(len(data)))
+      self.assertEqual(r.content, data)
+
+      # A 128KiB window, then 512KiB ones: each is checked once, however
+      # many writes it takes to send it.
+      checked = sum(after[k] - before[k] for k in after)
+      self.assertEqual(checked, 4)
+    finally:
+      os.unlink(path)
+
+  def sendfile_stats(self):
+    r = requests.get('http://127.0.0.1:8080/sendfile-stats')
+    self.assertResponsePlain(r)
+    return {k: int(v) for k, v in
+            (line.split('=') for line in r.text.split())}
+
+  def readahead_stats(self):
+    r = requests.get('http://127.0.0.1:8080/readahead-stats')
+    self.assertResponsePlain(r)
+    return {k: int(v) for k, v in
+            (line.split('=') for line in r.text.split())}
+
+  def test_readahead_stats(self):
+    path = os.path.join('wwwroot', 'readahead.bin')
+    data = os.urandom(256 * 1024)
+
+    try:
+      with open(path, 'wb') as f:
+        f.write(data)
+
+      before = self.readahead_stats()
+      r = requests.get('http://127.0.0.1:8080/readahead.bin',
+            headers={'Accept-Encoding': 'foobar'})
+      self.assertHttpResponseValid(r, 200, 'application/octet-stream')
+      self.assertEqual(r.content, data)
+
+      # Opening the file queues a readahead hint, which is either acted
+      # upon or found to be unnecessary by the readahead thread.
+      for _ in range(20):
+        after = self.readahead_stats()
+        if after['prefetched_pages'] > before['prefetched_pages'] or \
+           after['resident_hints'] > before['resident_hints']:
+          break
+        time.sleep(0.1)
+      else:
+        self.fail('Readahead hint was never handled')
+
+      self.assertEqual(after['dropped_hints'], before['dropped_hints'])
+      self.assertLessEqual(after['locked'], after['lock_budget'])
+    finally:
+      os.unlink(path)
+
+
   def test_directory_listing(self):
     r = requests.get('http://127.0.0.1:8080/icons',
           headers={'Accept-Encoding': 'foobar'})
@@ -309,6 +611,41 @@ class TestFileServing(LwanTest):
     self.assertTrue('</html>' in r.text)
 
 
+  def test_streamed_directory_listing(self):
+    r = requests.get('http://127.0.0.1:8080/streamed-index/icons/',
+          headers={'Accept-Encoding': 'foobar'})
+
+    self.assertResponseHtml(r)
+    self.assertEqual(r.headers.get('transfer-encoding'), 'chunked')
+    self.assertFalse('content-length' in r.headers)
+
+    cached = requests.get('http://127.0.0.1:8080/icons/',
+          headers={'Accept-Encoding': 'foobar'})
+    self.assertEqual(r.text, cached.text)
+
+    r = requests.head('http://127.0.0.1:8080/streamed-index/icons/')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, '')
+
+
+  def test_streamed_directory_listing_below_threshold(self):
+    path = os.path.join('wwwroot', 'streamed_empty_dir')
+
+    os.mkdir(path)
+    try:
+      r = requests.get('http://127.0.0.1:8080/streamed-index/streamed_empty_dir/',
+            headers={'Accept-Encoding': 'foobar'})
+
+      # Nothing is flushed before the first item, so empty lists are sent
+      # in one go.
+      self.assertResponseHtml(r)
+      self.assertFalse('transfer-encoding' in r.headers)
+      self.assertEqual(r.headers['content-length'], str(len(r.content)))
+      self.assertTrue('</html>' in r.text)
+    finally:
+      os.rmdir(path)
+
+
   def test_has_lwan_server_header(self):
     r = requests.get('http://127.0.0.1:8080/100.html')
     self.assertTrue('server' in r.headers)
@@ -489,6 +826,53 @@ class TestChunkedEncoding(LwanTest):
       ''.join('*This is chunk %d*\n' % i for i in range(11)) +
       'Last chunk\n')
 
+class TestResponseCompression(LwanTest):
+  def test_small_response_is_not_compressed(self):
+    r = requests.get('http://127.0.0.1:8080/hello-compressed',
+          headers={'Accept-Encoding': 'gzip'})
+
+    self.assertResponsePlain(r)
+    self.assertFalse('content-encoding' in r.headers)
+    self.assertEqual(r.headers['vary'], 'Accept-Encoding')
+    self.assertEqual(r.text, 'Hello, world!')
+
+
+  def test_compressed_response(self):
+    name = 'a-name-long-enough-to-be-compressed' * 4
+
+    for encoding in ('gzip', 'deflate'):
+      r = requests.get('http://127.0.0.1:8080/hello-compressed?name=%s' % name,
+            headers={'Accept-Encoding': encoding})
+
+      self.assertResponsePlain(r)
+      self.assertEqual(r.headers['content-encoding'], encoding)
+      self.assertEqual(r.headers['vary'], 'Accept-Encoding')
+      self.assertEqual(r.text, 'Hello, %s!' % name)
+
+
+  def test_not_compressed_without_accept_encoding(self):
+    name = 'a-name-long-enough-to-be-compressed' * 4
+    r = requests.get('http://127.0.0.1:8080/hello-compressed?name=%s' % name,
+          headers={'Accept-Encoding': 'identity'})
+
+    self.assertResponsePlain(r)
+    self.assertFalse('content-encoding' in r.headers)
+    self.assertEqual(int(r.headers['content-length']), len(r.text))
+    self.assertEqual(r.text, 'Hello, %s!' % name)
+
+
+  def test_chunked_encoding(self):
+    r = requests.get('http://127.0.0.1:8080/chunked-compressed',
+          headers={'Accept-Encoding': 'gzip'})
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['transfer-encoding'], 'chunked')
+    self.assertEqual(r.headers['content-encoding'], 'gzip')
+    self.assertEqual(r.text,
+      'Testing chunked encoding! First chunk\n' +
+      ''.join('*This is chunk %d*\n' % i for i in range(11)) +
+      'Last chunk\n')
+
 class TestLua(LwanTest):
   def test_brew_coffee(self):
     r = requests.get('http://127.0.0.1:8080/lua/brew_coffee')
@@ -696,6 +1080,48 @@ class TestCache(LwanTest):
       timeout -= 0.1
 
 
+  def test_preloaded_files_are_cached(self):
+    # Preloading is done before the first request is served, and what
+    # was preloaded doesn't expire in the meantime.
+    self.assertTrue(self.is_mmapped('/icons/back.gif'))
+
+    r = requests.get('http://127.0.0.1:8080/preloaded/back.gif')
+    self.assertHttpResponseValid(r, 200, 'image/gif')
+    self.assertEqual(self.count_mmaps('/icons/back.gif'), 1)
+
+
+  def preload_status(self, prefix):
+    r = requests.get('http://127.0.0.1:8080/preload-status',
+          params={'prefix': prefix})
+    self.assertResponsePlain(r)
+    return {k: int(v) for k, v in
+            (line.split('=') for line in r.text.split())}
+
+
+  def test_preload_status(self):
+    icons = len(os.listdir(os.path.join('wwwroot', 'icons')))
+
+    status = self.preload_status('/preloaded')
+    self.assertEqual(status['done'], 1)
+    self.assertEqual(status['files'], icons)
+    self.assertEqual(status['loaded'], icons)
+    self.assertEqual(status['skipped'], 0)
+    self.assertGreater(status['bytes'], 0)
+
+    # Files that didn't fit are skipped, whether that was found out while
+    # listing or while loading them, and the rest are accounted for.
+    status = self.preload_status('/preloaded-budget')
+    self.assertEqual(status['done'], 1)
+    self.assertGreater(status['skipped'], 0)
+    self.assertEqual(status['loaded'] + status['failed'] + status['skipped'],
+                     icons)
+    self.assertLessEqual(status['bytes'], 300)
+
+    r = requests.get('http://127.0.0.1:8080/preload-status',
+          params={'prefix': '/100.html'})
+    self.assertEqual(r.status_code, 404)
+
+
   def test_cache_munmaps_conn_close(self):
     r = requests.get('http://127.0.0.1:8080/100.html')
 
@@ -713,6 +1139,261 @@ class TestCache(LwanTest):
       self.assertFalse(self.is_mmapped('/100.html'))
 
 
+  def test_cache_evicts_entries_over_limit(self):
+    names = ['bounded-%d.txt' % i for i in range(4)]
+    paths = [os.path.join('wwwroot', name) for name in names]
+
+    def get(name):
+      r = requests.get('http://127.0.0.1:8080/bounded/' + name)
+      self.assertHttpResponseValid(r, 200, 'text/plain')
+
+    try:
+      for path in paths:
+        with open(path, 'w') as f:
+          f.write(path)
+
+      # The first file is used twice, so when the others are requested
+      # once each, they're the ones evicted to keep at most 2 entries.
+      get(names[0])
+      get(names[0])
+      for name in names[1:]:
+        get(name)
+
+      # Worker threads let go of evicted entries they still hold in their
+      # thread caches within a second or so.
+      self.wait_munmap('/' + names[1], timeout=3.0)
+      self.wait_munmap('/' + names[2], timeout=3.0)
+
+      self.assertTrue(self.is_mmapped('/' + names[0]))
+      self.assertFalse(self.is_mmapped('/' + names[1]))
+      self.assertFalse(self.is_mmapped('/' + names[2]))
+      self.assertTrue(self.is_mmapped('/' + names[3]))
+    finally:
+      for path in paths:
+        if os.path.exists(path):
+          os.unlink(path)
+
+
+  def test_cache_coalesces_concurrent_misses(self):
+    path = os.path.join('wwwroot', 'coalesced.txt')
+    contents = 'coalesced ' * 400
+    results = []
+
+    def get():
+      r = requests.get('http://127.0.0.1:8080/coalesced.txt')
+      results.append((r.status_code, r.text))
+
+    try:
+      with open(path, 'w') as f:
+        f.write(contents)
+
+      threads = [threading.Thread(target=get) for _ in range(16)]
+      for thread in threads:
+        thread.start()
+      for thread in threads:
+        thread.join()
+
+      self.assertEqual(results, [(200, contents)] * len(threads))
+      self.assertEqual(self.count_mmaps('/coalesced.txt'), 1)
+    finally:
+      os.unlink(path)
+
+
+  def locked_memory(self):
+    with open('/proc/%d/status' % self.lwan.pid) as status:
+      for line in status:
+        if line.startswith('VmLck:'):
+          return int(line.split()[1])
+    return 0
+
+
+  def test_cache_locks_frequently_used_files(self):
+    path = os.path.join('wwwroot', 'hot.txt')
+
+    try:
+      with open(path, 'w') as f:
+        f.write('hot' * 4096)
+
+      for _ in range(5):
+        r = requests.get('http://127.0.0.1:8080/hot.txt',
+              headers={'Accept-Encoding': 'foobar'})
+        self.assertEqual(r.text, 'hot' * 4096)
+
+      # Which files are locked is decided once a second.
+      for _ in range(30):
+        if self.locked_memory() > 0:
+          break
+        time.sleep(0.1)
+      self.assertGreater(self.locked_memory(), 0)
+    finally:
+      os.unlink(path)
+
+
+  def test_cache_remembers_missing_files(self):
+    path = os.path.join('wwwroot', 'missing.txt')
+    url = 'http://127.0.0.1:8080/negative/missing.txt'
+
+    try:
+      self.assertEqual(requests.get(url).status_code, 404)
+
+      # Without a watcher, the file isn't looked up again until the
+      # negative entry expires.
+      with open(path, 'w') as f:
+        f.write('found')
+      self.assertEqual(requests.get(url).status_code, 404)
+
+      time.sleep(2)
+      for _ in range(30):
+        r = requests.get(url)
+        if r.status_code == 200:
+          break
+        time.sleep(0.1)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.text, 'found')
+    finally:
+      os.unlink(path)
+
+
+  def test_cache_forgets_missing_files_by_default(self):
+    path = os.path.join('wwwroot', 'not-yet.txt')
+    url = 'http://127.0.0.1:8080/not-yet.txt'
+
+    try:
+      self.assertEqual(requests.get(url).status_code, 404)
+
+      with open(path, 'w') as f:
+        f.write('found')
+      r = requests.get(url)
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.text, 'found')
+    finally:
+      os.unlink(path)
+
+
+  def test_cache_keeps_only_compressed_variants(self):
+    url = 'http://127.0.0.1:8080/compressed-only/index.html'
+    with open(os.path.join('wwwroot', 'index.html'), 'rb') as f:
+      contents = f.read()
+    # Other handlers might have mapped this file already.
+    mmaps = self.count_mmaps('/index.html')
+
+    r = requests.get(url, headers={'Accept-Encoding': 'deflate'})
+    self.assertResponseHtml(r)
+    self.assertEqual(r.headers['content-encoding'], 'deflate')
+    self.assertEqual(r.content, contents)
+
+    # The file is only mapped while it's being compressed in the background.
+    for _ in range(30):
+      if self.count_mmaps('/index.html') == mmaps:
+        break
+      time.sleep(0.1)
+    self.assertEqual(self.count_mmaps('/index.html'), mmaps)
+
+    r = requests.get(url, headers={'Accept-Encoding': 'foobar'})
+    self.assertResponseHtml(r)
+    self.assertFalse('content-encoding' in r.headers)
+    self.assertEqual(r.content, contents)
+
+    r = requests.get(url, headers={'Accept-Encoding': 'foobar',
+                                   'Range': 'bytes=10-'})
+    self.assertEqual(r.status_code, 206)
+    self.assertEqual(r.content, contents[10:])
+
+    r = requests.head(url, headers={'Accept-Encoding': 'foobar'})
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.headers['content-length'], str(len(contents)))
+
+    self.assertEqual(self.count_mmaps('/index.html'), mmaps)
+
+
+  def test_cache_serves_small_files_from_slab(self):
+    with open(os.path.join('wwwroot', 'index.html'), 'rb') as f:
+      contents = f.read()
+
+    with requests.Session() as s:
+      for _ in range(2):
+        r = s.get('http://127.0.0.1:8080/slab/index.html',
+              headers={'Accept-Encoding': 'foobar'})
+        self.assertResponseHtml(r)
+        self.assertEqual(r.content, contents)
+        self.assertTrue('last-modified' in r.headers)
+        self.assertEqual(r.headers['connection'], 'keep-alive')
+        self.assertEqual(r.headers['content-length'], str(len(contents)))
+        # Prebuilt responses have their dates filled in when sent.
+        self.assertEqual(len(r.headers['date']), 29)
+        self.assertTrue(r.headers['date'].endswith(' GMT'))
+        self.assertEqual(len(r.headers['expires']), 29)
+
+      r = s.get('http://127.0.0.1:8080/slab/index.html',
+            headers={'Accept-Encoding': 'deflate'})
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.headers['content-encoding'], 'deflate')
+      self.assertEqual(r.content, contents)
+
+      r = s.head('http://127.0.0.1:8080/slab/index.html',
+            headers={'Accept-Encoding': 'foobar'})
+      self.assertEqual(r.status_code, 200)
+      self.assertEqual(r.headers['content-length'], str(len(contents)))
+
+      r = s.get('http://127.0.0.1:8080/slab/index.html',
+            headers={'Range': 'bytes=10-', 'Accept-Encoding': 'foobar'})
+      self.assertEqual(r.status_code, 206)
+      self.assertEqual(r.content, contents[10:])
+
+
+  def test_slab_background_compression(self):
+    # As with other entries, the brotli response is only built by the
+    # background compression queue, and misses are served without it.
+    with open(os.path.join('wwwroot', 'index.html'), 'rb') as f:
+      contents = f.read()
+
+    for _ in range(50):
+      r = requests.get('http://127.0.0.1:8080/slab/index.html',
+            headers={'Accept-Encoding': 'br'})
+
+      self.assertResponseHtml(r)
+
+      if r.headers.get('content-encoding') == 'br':
+        break
+
+      self.assertFalse('content-encoding' in r.headers)
+      self.assertEqual(r.content, contents)
+      time.sleep(0.1)
+    else:
+      self.skipTest('Brotli support not built in')
+
+
+  def test_cache_refreshes_stale_entries_in_background(self):
+    path = os.path.join('wwwroot', 'refreshed.txt')
+    url = 'http://127.0.0.1:8080/refresh/refreshed.txt'
+
+    def replace(contents):
+      with open(path + '.tmp', 'w') as f:
+        f.write(contents)
+      os.rename(path + '.tmp', path)
+
+    try:
+      replace('old')
+      self.assertEqual(requests.get(url).text, 'old')
+
+      # The cached entry is served until it's refreshed, which only
+      # happens once it's older than the refresh period, well before
+      # the cache period is over.
+      replace('new')
+      self.assertEqual(requests.get(url).text, 'old')
+
+      time.sleep(1.5)
+      for _ in range(50):
+        r = requests.get(url)
+        if r.text == 'new':
+          break
+        self.assertEqual(r.text, 'old')
+        time.sleep(0.1)
+      self.assertEqual(r.text, 'new')
+    finally:
+      os.unlink(path)
+
+
   def test_cache_does_not_mmap_large_files(self):
     r = requests.get('http://127.0.0.1:8080/zero')
     self.assertFalse(self.is_mmapped('/zero'))
@@ -741,6 +1422,109 @@ class TestCache(LwanTest):
     requests.get('http://127.0.0.1:8080/100.html')
     self.assertEqual(self.count_mmaps('/100.html'), 1)
 
+class TestPack(LwanTest):
+  packgen = os.path.join(os.path.dirname(LWAN_PATH), '..', 'tools', 'packgen')
+  mime_types = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                            '..', 'bin', 'tools', 'mime.types')
+
+  @classmethod
+  def setUpClass(cls):
+    if not os.path.exists(cls.packgen):
+      raise unittest.SkipTest('packgen not found')
+
+  def write_files(self, files):
+    for path, contents in files.items():
+      path = os.path.join('packroot', path)
+      os.makedirs(os.path.dirname(path), exist_ok=True)
+      with open(path, 'w') as f:
+        f.write(contents)
+
+  def pack(self):
+    subprocess.check_call([self.packgen, '-m', self.mime_types, 'packroot',
+                           'assets.pack'], stdout=subprocess.DEVNULL)
+
+  def setUp(self):
+    self.files = {
+      'index.html': '<html><body>packed</body></html>',
+      'app.js': 'function hello() { return "hello"; }\n' * 64,
+      'sub/data.txt': 'data',
+    }
+    self.write_files(self.files)
+    self.pack()
+
+    super().setUp()
+
+  def tearDown(self):
+    super().tearDown()
+
+    shutil.rmtree('packroot')
+    os.unlink('assets.pack')
+
+  def test_pack_serves_files(self):
+    r = requests.get('http://127.0.0.1:8080/pack/app.js',
+          headers={'Accept-Encoding': 'foobar'})
+
+    self.assertHttpResponseValid(r, 200, 'application/javascript')
+    self.assertEqual(r.text, self.files['app.js'])
+    self.assertTrue('last-modified' in r.headers)
+    self.assertTrue(r.headers['etag'].startswith('"'))
+
+    r = requests.get('http://127.0.0.1:8080/pack/sub/data.txt')
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'data')
+
+    r = requests.get('http://127.0.0.1:8080/pack/')
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, self.files['index.html'])
+
+  def test_pack_serves_compressed_variants(self):
+    r = requests.get('http://127.0.0.1:8080/pack/app.js',
+          headers={'Accept-Encoding': 'deflate'})
+
+    self.assertEqual(r.status_code, 200)
+    self.assertEqual(r.headers['content-encoding'], 'deflate')
+    self.assertEqual(r.text, self.files['app.js'])
+
+  def test_pack_not_modified(self):
+    r = requests.get('http://127.0.0.1:8080/pack/app.js')
+    self.assertEqual(r.status_code, 200)
+
+    r = requests.get('http://127.0.0.1:8080/pack/app.js',
+          headers={'If-None-Match': r.headers['etag']})
+    self.assertEqual(r.status_code, 304)
+
+  def test_pack_range(self):
+    r = requests.get('http://127.0.0.1:8080/pack/app.js',
+          headers={'Range': 'bytes=10-', 'Accept-Encoding': 'foobar'})
+
+    self.assertEqual(r.status_code, 206)
+    self.assertEqual(r.headers['content-range'],
+                     'bytes 10-%d/%d' % (len(self.files['app.js']) - 1,
+                                         len(self.files['app.js'])))
+    self.assertEqual(r.text, self.files['app.js'][10:])
+
+  def test_pack_falls_back_to_path(self):
+    r = requests.get('http://127.0.0.1:8080/pack/100.html')
+
+    self.assertResponseHtml(r)
+    self.assertEqual(r.text, 'X' * 100)
+
+  def test_pack_is_reloaded_when_replaced(self):
+    r = requests.get('http://127.0.0.1:8080/pack/sub/data.txt')
+    self.assertEqual(r.text, 'data')
+
+    self.write_files({'sub/data.txt': 'new data'})
+    self.pack()
+
+    # The job thread looks for a new pack once a second.
+    for _ in range(30):
+      r = requests.get('http://127.0.0.1:8080/pack/sub/data.txt')
+      if r.text == 'new data':
+        break
+      time.sleep(0.1)
+    self.assertEqual(r.text, 'new data')
+
+
 class TestProxyProtocolRequests(SocketTest):
   def test_proxy_version1(self):
     proxy = "PROXY TCP4 192.168.242.221 192.168.242.242 56324 31337\r\n"
@@ -806,6 +1590,214 @@ class TestArtificialResponse(LwanTest):
     self.assertEqual(r.status_code, 418)
 
 
+class TestRouting(LwanTest):
+  def test_path_param(self):
+    r = requests.get('http://127.0.0.1:8080/users/42/orders')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'id=42\nurl=orders\n')
+
+  def test_wildcard(self):
+    r = requests.get('http://127.0.0.1:8080/users/7/files/a/b.txt')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'id=7\nrest=a/b.txt\nurl=\n')
+
+    r = requests.get('http://127.0.0.1:8080/users/7/files/')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'id=7\nrest=\nurl=\n')
+
+  def test_empty_path_param_does_not_match(self):
+    r = requests.get('http://127.0.0.1:8080/users/')
+
+    self.assertResponse404(r)
+
+  def test_exact_match(self):
+    r = requests.get('http://127.0.0.1:8080/users/me')
+
+    self.assertEqual(r.status_code, 418)
+
+    r = requests.get('http://127.0.0.1:8080/users/me/orders')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'id=me\nurl=orders\n')
+
+  def test_per_method_handlers(self):
+    r = requests.get('http://127.0.0.1:8080/by-method')
+
+    self.assertResponsePlain(r)
+    self.assertEqual(r.text, 'Hello, world!')
+
+    r = requests.head('http://127.0.0.1:8080/by-method')
+
+    self.assertEqual(r.status_code, 200)
+
+    r = requests.delete('http://127.0.0.1:8080/by-method')
+
+    self.assertEqual(r.status_code, 418)
+
+    r = requests.options('http://127.0.0.1:8080/by-method')
+
+    self.assertEqual(r.status_code, 405)
+
+
+class TestTemplateFragmentCache(LwanTest):
+  def get(self, name):
+    r = requests.get('http://127.0.0.1:8080/fragment-cache', params={'name': name})
+    self.assertResponsePlain(r)
+    return r.text.split('\n')
+
+  def test_cached_block_keyed_by_variables(self):
+    first = self.get('alice')
+    self.assertEqual(first[1], 'hello, alice')
+    self.assertEqual(first[0], 'name=alice rendered=%s' % first[3][len('requests='):])
+
+    # Same key: the block isn't rendered again, even though a variable
+    # that isn't part of the key changed.
+    second = self.get('alice')
+    self.assertNotEqual(second[3], first[3])
+    self.assertEqual(second[:3], first[:3])
+
+    third = self.get('bob')
+    self.assertEqual(third[1], 'hello, bob')
+    self.assertEqual(third[0], 'name=bob rendered=%s' % third[3][len('requests='):])
+
+    self.assertEqual(self.get('alice')[:3], first[:3])
+
+  def test_cached_block_inside_conditional(self):
+    # The block is the first thing inside {{name?}}.
+    first = self.get('carol')
+    self.assertEqual(first[2], 'welcome, carol (%s)' % first[3][len('requests='):])
+    self.assertEqual(self.get('carol')[2], first[2])
+
+    self.assertEqual(self.get('')[2], '')
+
+  def test_cached_block_keys_are_unambiguous(self):
+    # Keys are made of the values followed by their lengths, so values
+    # that look like the separator can't collide with others.
+    a = self.get('a\x1f1\x1e')
+    b = self.get('a')
+    self.assertEqual(b[0], 'name=a rendered=%s' % b[3][len('requests='):])
+    self.assertNotEqual(a[0], b[0])
+
+
+class TestSegmentedResponse(LwanTest):
+  def expected(self, n):
+    pieces = []
+    for i in range(n):
+      if i % 10 == 9:
+        pieces.append('S' * 512)
+      else:
+        pieces.append(chr(ord('a') + i % 26) * (i * 37 % 1000 + 1))
+    return ''.join(pieces)
+
+  def get(self, n, **params):
+    params['n'] = n
+    r = requests.get('http://127.0.0.1:8080/strbuf-segments', params=params)
+    self.assertResponsePlain(r)
+    self.assertEqual(r.headers['content-length'], str(len(r.content)))
+    return r
+
+  def test_small_response_is_contiguous(self):
+    r = self.get(5)
+    self.assertEqual(r.headers['x-segments'], '0')
+    self.assertEqual(r.text, self.expected(5))
+
+  def test_appends_crossing_segments(self):
+    r = self.get(300)
+    self.assertGreater(int(r.headers['x-segments']), 1)
+    self.assertEqual(r.text, self.expected(300))
+
+  def test_flattened_segments(self):
+    r = self.get(300, flatten=1)
+    self.assertGreater(int(r.headers['x-segments']), 1)
+    self.assertEqual(r.text, self.expected(300))
+
+  def test_reset_segments(self):
+    # Resetting keeps a chunk around, which is then grown again.
+    for params in ({'reset': 1}, {'reset': 1, 'flatten': 1}):
+      r = self.get(300, **params)
+      self.assertGreater(int(r.headers['x-segments']), 1)
+      self.assertEqual(r.text, self.expected(300))
+
+  def test_segments_on_keep_alive_connection(self):
+    # The response buffer is reset between requests on a connection.
+    with requests.Session() as s:
+      for n in (300, 5, 300, 40):
+        r = s.get('http://127.0.0.1:8080/strbuf-segments', params={'n': n})
+        self.assertResponsePlain(r)
+        self.assertEqual(r.text, self.expected(n))
+
+
+class TestTemplateCursor(LwanTest):
+  def render(self, tpl, items, **params):
+    params.update(tpl=tpl, items=items)
+    r = requests.get('http://127.0.0.1:8080/cursor-sequence', params=params)
+    self.assertResponsePlain(r)
+    result = dict(line.split('=', 1) for line in r.text.splitlines())
+    output = result.pop('output')
+    return output, {k: int(v) for k, v in result.items()}
+
+  def test_iterates_until_exhausted(self):
+    output, counts = self.render('all', 3)
+    self.assertEqual(output, '[1][2][3]')
+    self.assertEqual(counts['rendered'], 1)
+    self.assertEqual(counts['inits'], 1)
+    self.assertEqual(counts['nexts'], 4)
+    self.assertEqual(counts['finis'], 1)
+
+  def test_empty_sequence(self):
+    output, counts = self.render('all', 0)
+    self.assertEqual(output, '')
+    self.assertEqual(counts['nexts'], 1)
+    self.assertEqual(counts['finis'], 1)
+
+  def test_negated_stops_after_first_item(self):
+    output, counts = self.render('negated', 3)
+    self.assertEqual(output, '')
+    self.assertEqual(counts['nexts'], 1)
+    self.assertEqual(counts['finis'], 1)
+
+    output, counts = self.render('negated', 0)
+    self.assertEqual(output, 'empty')
+    self.assertEqual(counts['finis'], 1)
+
+  def test_failing_body_calls_fini(self):
+    output, counts = self.render('nested', 3)
+    self.assertEqual(counts['rendered'], 0)
+    self.assertEqual(counts['nexts'], 1)
+    self.assertEqual(counts['finis'], 1)
+    self.assertEqual(counts['nested_inits'], 1)
+    # A cursor that couldn't be started isn't finished.
+    self.assertEqual(counts['nested_finis'], 0)
+
+  def test_failing_init_does_not_call_fini(self):
+    output, counts = self.render('all', 3, fail_init=1)
+    self.assertEqual(counts['rendered'], 0)
+    self.assertEqual(counts['inits'], 1)
+    self.assertEqual(counts['nexts'], 0)
+    self.assertEqual(counts['finis'], 0)
+
+
+class TestHashTable(LwanTest):
+  # Enough keys to go through a few resizes in each direction; every
+  # check after an insertion or a removal runs while entries are still
+  # being moved between the old and the new table.
+  def check_migration(self, **params):
+    params['keys'] = 2000
+    r = requests.get('http://127.0.0.1:8080/hash-migration', params=params)
+    self.assertEqual(r.status_code, 200, r.text)
+    checks = int(r.text.split('checks=')[1])
+    self.assertGreater(checks, 2 * params['keys'])
+
+  def test_int_keys_while_migrating(self):
+    self.check_migration()
+
+  def test_str_keys_while_migrating(self):
+    self.check_migration(str=1)
+
+
 class TestSleep(LwanTest):
   def test_sleep(self):
     now = time.time()